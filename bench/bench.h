@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Equivalence checks and benchmarks, built with -DLSPTEST_BENCHMARKS=ON. A section compares a fast
+ * path against a simpler reference on random inputs and times both, or checks the behaviour of a
+ * server part on cases made for it. The checks fail the run, the timings are only printed.
+ */
+struct bench_options {
+    // Fewer random cases and smaller inputs, for ctest
+    bool quick = false;
+    // .scad files given on the command line, measured besides the generated ones
+    std::vector<std::string> files;
+};
+
+// Counts the failed checks of the running section
+struct bench_result {
+    int failures = 0;
+
+    bool check(bool ok, const std::string &what) {
+        if (!ok) {
+            if (failures < 10) std::cerr << "  MISMATCH: " << what << "\n";
+            failures++;
+        }
+        return ok;
+    }
+};
+
+// xorshift64*, the same sequence on every platform
+class bench_random {
+public:
+    explicit bench_random(uint64_t seed) : state(seed | 1) {}
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    // [0, n)
+    uint32_t below(uint32_t n) { return static_cast<uint32_t>(next() % n); }
+    bool chance(uint32_t percent) { return below(100) < percent; }
+
+private:
+    uint64_t state;
+};
+
+// Seconds per call of f, repeated until at least min_seconds passed
+template <typename F>
+double time_per_call(F &&f, double min_seconds = 0.2) {
+    using clock = std::chrono::steady_clock;
+    size_t calls = 0;
+    const clock::time_point begin = clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        calls++;
+        elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+    } while (elapsed < min_seconds);
+    return elapsed / calls;
+}
+
+// Keeps the optimizer from dropping a result
+template <typename T>
+inline void keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// About bytes of OpenSCAD source. generated is what CAD exporters write (polyhedra with long
+// number lists), otherwise modules and functions as people write them, using all of the grammar.
+std::string generate_scad(size_t bytes, uint64_t seed, bool generated);
+// The generated corpora and the files of the command line, by name
+std::vector<std::pair<std::string, std::string>> scad_corpora(const bench_options &options);
+
+struct text_edit_span;
+// Up to two pieces of OpenSCAD that change the structure around an edit: brackets, separators,
+// operators, statements, ranges, unterminated strings and comments
+std::string random_insert(bench_random &random);
+// Replaces a random range of text with random_insert, returns the span
+text_edit_span random_edit(std::string &text, bench_random &random);
+// Short documents of random pieces, dense in the constructs edits break up
+std::string random_document(bench_random &random);
+
+int uri_bench(const bench_options &options);
+int parser_bench(const bench_options &options);
+int lexer_bench(const bench_options &options);
+int position_bench(const bench_options &options);
+int request_task_bench(const bench_options &options);
+int evaluator_bench(const bench_options &options);
+int geometry_bench(const bench_options &options);
+int symbol_index_bench(const bench_options &options);
+int index_cache_bench(const bench_options &options);
+int xref_index_bench(const bench_options &options);
+int workspace_bench(const bench_options &options);
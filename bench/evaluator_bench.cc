@@ -0,0 +1,158 @@
+#include "bench.h"
+#include "evaluator.h"
+#include "render.h"
+#include "render_cache.h"
+#include "scad_parser.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+evaluation_result evaluate(const std::string &text, const evaluation_options &options = evaluation_options()) {
+    std::vector<scad_source> sources(1);
+    sources[0].path = "/bench/model.scad";
+    sources[0].text = text;
+    sources[0].tree = parse_scad(sources[0].text, 0);
+    return evaluate_scad(sources, options);
+}
+
+std::string joined(const std::vector<std::string> &messages) {
+    std::string text;
+    for (const std::string &message : messages) text += "\n    " + message;
+    return text;
+}
+
+bool has_message(const evaluation_result &result, const std::string &start) {
+    return std::any_of(result.messages.begin(), result.messages.end(),
+                       [&](const std::string &message) { return message.compare(0, start.size(), start) == 0; });
+}
+
+// Both counted depth first
+size_t count_nodes(const csg_node &node, csg_node::kind type) {
+    size_t count = node.type == type;
+    for (const csg_node_ptr &child : node.children) count += count_nodes(*child, type);
+    return count;
+}
+
+} // namespace
+
+int evaluator_bench(const bench_options &options) {
+    bench_result result;
+
+    struct echo_case {
+        const char *source;
+        const char *echo;
+    };
+    // The ECHO line each script prints, as OpenSCAD prints it
+    const echo_case echoes[] = {
+        {"echo(1 + 2 * 3);", "ECHO: 7"},
+        // The last assignment wins but takes the place of the first
+        {"a = 1; echo(a); a = 2;", "ECHO: 2"},
+        {"function twice(x) = 2 * x; echo(twice(21));", "ECHO: 42"},
+        {"echo([for (i = [1:3]) i * i]);", "ECHO: [1, 4, 9]"},
+        {"module m(x) { echo(x); } m(x = \"s\");", "ECHO: \"s\""},
+        {"echo(len([1, [2, 3]]), [1, 2][5]);", "ECHO: 2, undef"},
+    };
+    for (const echo_case &c : echoes) {
+        const evaluation_result evaluated = evaluate(c.source);
+        result.check(!evaluated.failed && evaluated.messages.size() == 1 && evaluated.messages[0] == c.echo,
+                     std::string(c.source) + " printed" + joined(evaluated.messages) + "\n  instead of " + c.echo);
+    }
+
+    // The tree of a model
+    const evaluation_result model = evaluate("difference() { cube(10); translate([5, 5, 5]) sphere(r = 3, $fn = 8); }"
+                                             "for (i = [0:2]) translate([20 * i, 0, 0]) cylinder(h = 2, r = 1);");
+    result.check(!model.failed && model.root, "the model did not evaluate:" + joined(model.messages));
+    if (model.root) {
+        result.check(count_nodes(*model.root, csg_node::kind::difference) == 1, "not one difference in the tree");
+        result.check(count_nodes(*model.root, csg_node::kind::cylinder) == 3, "not three cylinders in the tree");
+        result.check(count_nodes(*model.root, csg_node::kind::sphere) == 1, "not one sphere in the tree");
+    }
+
+    // Errors stop the evaluation without a tree
+    const char *errors[] = {
+        "function f(x) = f(x + 1); echo(f(0));",
+        "assert(false, \"stop\");",
+        "v = [for (i = [0:1e9]) i];",
+        "cube(1; ",
+    };
+    for (const char *source : errors) {
+        const evaluation_result evaluated = evaluate(source);
+        result.check(evaluated.failed && !evaluated.root && has_message(evaluated, "ERROR: "),
+                     std::string(source) + " did not fail:" + joined(evaluated.messages));
+    }
+
+    // Operations the renderer can not do fail the render instead of making other geometry
+    const char *unsupported[] = {
+        "hull() { cube(1); translate([5, 0, 0]) cube(1); }",
+        "minkowski() { cube(1); sphere(1); }",
+        "translate([1, 0, 0]) text(\"a\");",
+        "linear_extrude(1) offset(1) square(1);",
+        "linear_extrude(1) resize([2, 2]) square(1);",
+        "import(\"part.stl\");",
+    };
+    for (const char *source : unsupported) {
+        const evaluation_result evaluated = evaluate(source);
+        result.check(evaluated.failed && !evaluated.root && has_message(evaluated, "ERROR: ") &&
+                         evaluated.messages.back().find("not supported") != std::string::npos,
+                     std::string(source) + " was not rejected:" + joined(evaluated.messages));
+    }
+
+    // Nor is a failed render kept, the next one tries again
+    render_job job;
+    job.sources.resize(1);
+    job.sources[0].path = "/bench/hull.scad";
+    job.sources[0].text = unsupported[0];
+    job.sources[0].tree = parse_scad(job.sources[0].text, 0);
+    job.key = 1;
+    render_cache renders;
+    renders.configure(std::string(), render_cache::DEFAULT_MEMORY_LIMIT, 0);
+    renders.store(job.key, std::make_shared<render_output>(run_render(job)));
+    result.check(!renders.find(job.key) && renders.stats().stores == 0, "the render cache kept a failed render");
+
+    // A result as the render workers pass it, the mesh in front of the rest
+    job.sources[0].text = "difference() { cube(4); translate([1, 1, 1]) cube(2); }";
+    job.sources[0].tree = parse_scad(job.sources[0].text, 0);
+    const render_output rendered = run_render(job);
+    const mesh &geometry = rendered.geometry;
+    const std::string bytes = std::string(geometry.position_bytes()) + std::string(geometry.index_bytes());
+    const std::string rest = rendered.serialize(false);
+    render_output read;
+    result.check(!rendered.failed && geometry.triangle_count() > 0 && render_output::deserialize(rest, bytes, read) &&
+                     read.geometry.positions == geometry.positions && read.geometry.indices == geometry.indices &&
+                     read.geometry.parts == geometry.parts && read.parts.size() == rendered.parts.size() &&
+                     read.files == rendered.files,
+                 "the output did not come back from the mesh and the rest");
+    result.check(!render_output::deserialize(rest, bytes.substr(4), read) &&
+                     !render_output::deserialize(rendered.serialize(), bytes, read),
+                 "a mesh of another size was taken");
+
+    // Left out past the limit with a warning, the first instances are kept
+    evaluation_options limited;
+    limited.max_instances = 10;
+    const evaluation_result capped = evaluate("for (i = [0:99]) translate([i, 0, 0]) cube(1);", limited);
+    result.check(!capped.failed && capped.root && has_message(capped, "WARNING: More than 10"),
+                 "max_instances did not cap the model:" + joined(capped.messages));
+    if (capped.root) {
+        const size_t cubes = count_nodes(*capped.root, csg_node::kind::cube);
+        result.check(cubes > 0 && cubes <= 10, "max_instances kept " + std::to_string(cubes) + " cubes");
+    }
+
+    // The preview resolution caps $fn, scripts still see the value they set
+    evaluation_options coarse;
+    coarse.coarsest = {8, 2, 30};
+    const evaluation_result capped_fn = evaluate("$fn = 100; echo($fn); sphere(5);", coarse);
+    result.check(capped_fn.root && capped_fn.root->type == csg_node::kind::sphere && capped_fn.root->fragments == 8 &&
+                     capped_fn.messages.size() == 1 && capped_fn.messages[0] == "ECHO: 100",
+                 "the coarsest resolution was not applied:" + joined(capped_fn.messages));
+
+    // A loop with many instances, timed without the geometry
+    const size_t count = options.quick ? 1000 : 20000;
+    const std::string loop = "module part(i) { translate([i, 0, 0]) rotate([0, 0, i]) cube([1, 2, 3]); }\n"
+                             "for (i = [0:" + std::to_string(count - 1) + "]) part(i);\n";
+    const double seconds = time_per_call([&] { keep(evaluate(loop)); });
+    std::printf("  %zu scripts checked, evaluating %zu module instances %8.2f ms\n",
+                std::size(echoes) + std::size(errors) + std::size(unsupported) + 3, count, seconds * 1e3);
+    return result.failures;
+}
@@ -0,0 +1,170 @@
+#include "bench.h"
+#include "csg_tree.h"
+#include "evaluator.h"
+#include "geometry.h"
+#include "scad_parser.h"
+#include "task_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+
+// Divergence theorem over the triangles, exact for closed meshes whatever their vertices are shared
+double volume(const mesh &m) {
+    double sum = 0;
+    for (size_t i = 0; i + 2 < m.indices.size(); i += 3) {
+        vec3 corners[3];
+        for (int k = 0; k < 3; k++) {
+            const float *p = &m.positions[3 * m.indices[i + k]];
+            corners[k] = {p[0], p[1], p[2]};
+        }
+        sum += corners[0].dot(corners[1].cross(corners[2]));
+    }
+    return sum / 6;
+}
+
+double volume(const solid &s) {
+    return volume(triangulate(s));
+}
+
+bool near(double value, double expected, double tolerance) {
+    return std::fabs(value - expected) <= tolerance * std::max(1.0, std::fabs(expected));
+}
+
+struct box {
+    vec3 min, max;
+
+    double volume() const { return (max.x - min.x) * (max.y - min.y) * (max.z - min.z); }
+    solid make() const {
+        solid s = make_cube(max - min, false);
+        s.transform(mat4::translation(min));
+        return s;
+    }
+};
+
+double overlap(const box &a, const box &b) {
+    const double x = std::max(0.0, std::min(a.max.x, b.max.x) - std::max(a.min.x, b.min.x));
+    const double y = std::max(0.0, std::min(a.max.y, b.max.y) - std::max(a.min.y, b.min.y));
+    const double z = std::max(0.0, std::min(a.max.z, b.max.z) - std::max(a.min.z, b.min.z));
+    return x * y * z;
+}
+
+box random_box(bench_random &random) {
+    box b;
+    b.min = {double(random.below(8)), double(random.below(8)), double(random.below(8))};
+    b.max = b.min + vec3{1.0 + random.below(6), 1.0 + random.below(6), 1.0 + random.below(6)};
+    return b;
+}
+
+csg_node_ptr evaluate(const std::string &text) {
+    std::vector<scad_source> sources(1);
+    sources[0].path = "/bench/model.scad";
+    sources[0].text = text;
+    sources[0].tree = parse_scad(sources[0].text, 0);
+    return evaluate_scad(sources, evaluation_options()).root;
+}
+
+bool same_mesh(const mesh &a, const mesh &b) {
+    return a.positions == b.positions && a.indices == b.indices && a.parts == b.parts;
+}
+
+} // namespace
+
+int geometry_bench(const bench_options &options) {
+    bench_result result;
+
+    // Primitives against their volume, the round ones against their inscribed polygon
+    const double pi = std::acos(-1.0);
+    result.check(near(volume(make_cube({2, 3, 4}, true)), 24, 1e-9), "cube volume");
+    const int n = 64;
+    const double circle = 0.5 * n * std::sin(2 * pi / n);
+    result.check(near(volume(make_cylinder(2, 1, 1, n, false)), 2 * circle, 1e-6), "cylinder volume");
+    result.check(near(volume(make_sphere(1, n)), 4.0 / 3 * pi, 0.02), "sphere volume");
+    result.check(near(volume(linear_extrude(make_square({2, 2}, true), linear_extrusion{3, false, 0, 1, {1, 1}})), 12,
+                      1e-9),
+                 "linear_extrude volume");
+    result.check(near(volume(rotate_extrude(make_square({1, 1}, false), 360, n)), circle, 1e-6),
+                 "rotate_extrude volume");
+
+    // Boolean operations of boxes, whose results are known exactly
+    bench_random random(11);
+    const size_t cases = options.quick ? 100 : 1000;
+    for (size_t i = 0; i < cases; i++) {
+        const box a = random_box(random);
+        const box b = random_box(random);
+        const solid sa = a.make();
+        const solid sb = b.make();
+        const double shared = overlap(a, b);
+        const double u = volume(csg_union(sa, sb));
+        const double d = volume(csg_difference(sa, sb));
+        const double x = volume(csg_intersection(sa, sb));
+        if (!result.check(near(u, a.volume() + b.volume() - shared, 1e-6) && near(d, a.volume() - shared, 1e-6) &&
+                              near(x, shared, 1e-6),
+                          "boolean operations of boxes: union " + std::to_string(u) + ", difference " +
+                              std::to_string(d) + ", intersection " + std::to_string(x) + ", overlap " +
+                              std::to_string(shared))) {
+            break;
+        }
+    }
+    std::printf("  %zu random pairs of boxes, union, difference and intersection against their volumes\n", cases);
+
+    // A mirrored solid stays outside out
+    solid mirrored = make_cube({1, 2, 3}, false);
+    mirrored.transform(mat4::mirroring({1, 0, 0}));
+    result.check(near(volume(mirrored), 6, 1e-9), "a mirrored cube turned inside out");
+
+    // Built in parallel and from the cache, the solid and the warnings are those of a serial build
+    const std::string model = "for (i = [0:5]) translate([3 * i, 0, 0]) difference() {\n"
+                              "    cube(2, center = true);\n"
+                              "    sphere(1.2, $fn = 16);\n"
+                              "}\n"
+                              "translate([0, 10, 0]) intersection() {\n"
+                              "    cube(4);\n"
+                              "    translate([2, 2, 2]) sphere(3, $fn = 24);\n"
+                              "}\n"
+                              "square(1);\n";
+    const csg_node_ptr root = evaluate(model);
+    result.check(root != nullptr, "the geometry model did not evaluate");
+    if (root) {
+        std::vector<std::string> serial_warnings;
+        const mesh serial = triangulate(*build_geometry(*root, serial_warnings));
+        result.check(serial_warnings.size() == 1, "the 2D square outside an extrusion was not warned about once");
+
+        task_pool pool(3);
+        geometry_cache cache;
+        build_options parallel;
+        parallel.tasks = &pool;
+        parallel.cache = &cache;
+        for (int pass = 0; pass < 2; pass++) {
+            std::vector<std::string> warnings;
+            const mesh built = triangulate(*build_geometry(*root, warnings, parallel));
+            result.check(same_mesh(serial, built) && warnings == serial_warnings,
+                         pass ? "a build from the cache differs from a serial build"
+                              : "a parallel build differs from a serial build");
+        }
+        const geometry_cache_stats stats = cache.stats();
+        result.check(stats.hits > 0, "the second build found nothing in the cache");
+
+        // The parts do not touch, so the model is as big as the parts built by themselves
+        solid ball = make_sphere(3, 24);
+        ball.transform(mat4::translation({2, 2, 2}));
+        const double expected = 6 * volume(csg_difference(make_cube({2, 2, 2}, true), make_sphere(1.2, 16))) +
+                                volume(csg_intersection(make_cube({4, 4, 4}, false), ball));
+        result.check(near(volume(serial), expected, 1e-6),
+                     "the model has a volume of " + std::to_string(volume(serial)) + " instead of " +
+                         std::to_string(expected));
+    }
+
+    // The kernel on curved solids
+    const int fragments = options.quick ? 16 : 48;
+    const solid ball = make_sphere(6, fragments);
+    const solid rod = make_cylinder(20, 3, 3, fragments, true);
+    solid drilled;
+    const double difference = time_per_call([&] { drilled = csg_difference(ball, rod); });
+    const double triangulation = time_per_call([&] { keep(triangulate(drilled)); });
+    std::printf("  sphere minus cylinder, %d fragments: difference %8.2f ms, triangulation %6.2f ms, %zu polygons\n",
+                fragments, difference * 1e3, triangulation * 1e3, drilled.polygons.size());
+    return result.failures;
+}
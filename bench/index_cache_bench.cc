@@ -0,0 +1,301 @@
+#include "bench.h"
+#include "document.h"
+#include "index_cache.h"
+#include "scad_parser.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+// Where the header of a snapshot keeps its fields and the table of sections, see index_cache.cc
+constexpr size_t VERSION_OFFSET = 8;
+constexpr size_t BYTE_ORDER_OFFSET = 12;
+constexpr size_t SECTIONS_OFFSET = 24;
+enum section_index { FILES = 0, LOWER_NAMES = 3, POSTING_KEYS = 6, POSTING_NAMES = 8, SYMBOLS = 9, REFERENCES = 14 };
+
+// What a file of the workspace contributes to a snapshot
+struct indexed_file {
+    std::string path;
+    file_stamp stamp;
+    document_symbols symbols;
+    std::vector<file_import> imports;
+    document_references references;
+};
+
+indexed_file index_file(const std::string &path, const std::string &text) {
+    indexed_file file;
+    file.path = path;
+    file.stamp.size = text.size();
+    file.stamp.hash = content_hash(text);
+    line_index lines;
+    lines.build(text);
+    const syntax_tree tree = parse_scad(text, 0);
+    file.symbols.extract(text, lines, tree);
+    extract_imports(text, lines, tree, file.imports);
+    file.references.extract(text, lines, tree);
+    return file;
+}
+
+std::string read_bytes(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+void write_bytes(const std::string &path, const std::string &data) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), data.size());
+}
+
+template <typename T>
+T field(const std::string &data, size_t offset) {
+    T value;
+    memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void set_field(std::string &data, size_t offset, T value) {
+    memcpy(&data[offset], &value, sizeof(T));
+}
+
+uint64_t section_offset(const std::string &data, section_index section) {
+    return field<uint64_t>(data, SECTIONS_OFFSET + 16 * section);
+}
+
+bool same_range(const lsRange &a, const lsRange &b) {
+    return a.start.line == b.start.line && a.start.character == b.start.character && a.end.line == b.end.line &&
+           a.end.character == b.end.character;
+}
+
+// Everything a snapshot holds of a file, against what was written
+bool same_file(const index_snapshot &snapshot, const indexed_file &file, std::string &where) {
+    const uint32_t id = snapshot.find_file(file.path);
+    if (id == index_snapshot::NO_FILE) {
+        where = file.path + " is missing";
+        return false;
+    }
+    const file_stamp stamp = snapshot.stamp(id);
+    if (stamp.size != file.stamp.size || stamp.hash != file.stamp.hash || stamp.mtime_ns != file.stamp.mtime_ns ||
+        snapshot.symbol_count(id) != file.symbols.symbols.size()) {
+        where = file.path + ": stamp or symbol count";
+        return false;
+    }
+    std::vector<file_import> imports;
+    snapshot.imports(id, imports);
+    bool same = imports.size() == file.imports.size();
+    for (size_t i = 0; same && i < imports.size(); i++) {
+        same = imports[i].path == file.imports[i].path && imports[i].is_use == file.imports[i].is_use &&
+               same_range(imports[i].range, file.imports[i].range);
+    }
+    document_references references;
+    snapshot.references(id, references);
+    same = same && references.references.size() == file.references.references.size();
+    for (size_t i = 0; same && i < references.references.size(); i++) {
+        const auto &read = references.references[i];
+        const auto &written = file.references.references[i];
+        same = references.name(read) == file.references.name(written) && read.kind == written.kind &&
+               same_range(read.range, written.range);
+    }
+    // Every symbol once under its name, in the file and with the container it was written with
+    for (const document_symbols::symbol &sym : file.symbols.symbols) {
+        if (!same) break;
+        size_t found = 0;
+        for (uint32_t name = 0; name < snapshot.name_count(); name++) {
+            if (snapshot.name(name) != file.symbols.name(sym)) continue;
+            auto records = snapshot.symbols_of(name);
+            for (const index_snapshot::symbol_record *record = records.first; record != records.second; ++record) {
+                const std::string_view container = record->container == index_snapshot::NO_NAME
+                                                       ? std::string_view()
+                                                       : snapshot.name(record->container);
+                const std::string_view written = sym.container == document_symbols::NO_CONTAINER
+                                                     ? std::string_view()
+                                                     : file.symbols.name(file.symbols.symbols[sym.container]);
+                found += record->file == id && record->kind == static_cast<uint32_t>(sym.kind) &&
+                         record->start_line == sym.range.start.line && container == written;
+            }
+        }
+        same = found >= 1;
+    }
+    if (!same) where = file.path + ": imports, references or symbols";
+    return same;
+}
+
+} // namespace
+
+int index_cache_bench(const bench_options &options) {
+    bench_result result;
+    const std::string directory =
+        (std::filesystem::temp_directory_path() / ("lsptest_bench_" + std::to_string(::getpid()))).string();
+    const std::string path = directory + "/workspace.index";
+
+    // Written and opened again, every file reads back as it was written
+    std::vector<indexed_file> files;
+    files.push_back(index_file("/bench/cache/b.scad", "include <a.scad>\nuse <lib/c.scad>\n"
+                                                      "module part(size = 2) { inner = size * 2; cube(inner); }\n"
+                                                      "function twice(x) = 2 * x;\npart(twice(3));\n"));
+    files.push_back(index_file("/bench/cache/a.scad", "width = 10;\nmodule Part() { sphere(width); }\nPart();\n"));
+    files.push_back(index_file("/bench/cache/empty.scad", ""));
+    files[0].stamp.mtime_ns = 1234567890123;
+    index_snapshot_writer writer;
+    for (const indexed_file &file : files) {
+        writer.add_file(file.path, file.stamp, file.symbols, file.imports, file.references);
+    }
+    result.check(writer.write(path), "the snapshot could not be written to " + path);
+    std::unique_ptr<index_snapshot> snapshot = index_snapshot::open(path);
+    if (result.check(snapshot != nullptr, "the written snapshot does not open")) {
+        result.check(snapshot->file_count() == files.size() && snapshot->find_file("/bench/cache/c.scad") ==
+                                                                    index_snapshot::NO_FILE,
+                     "the files of the snapshot");
+        for (const indexed_file &file : files) {
+            std::string where;
+            result.check(same_file(*snapshot, file, where), "round trip: " + where);
+        }
+
+        // Unchanged files are copied from it into the next snapshot, with their new stamps
+        index_snapshot_writer next;
+        files[1].stamp.mtime_ns = 42;
+        next.add_files(*snapshot, {{snapshot->find_file(files[1].path), files[1].stamp}});
+        result.check(next.write(path + ".next"), "the copied snapshot could not be written");
+        std::unique_ptr<index_snapshot> copied = index_snapshot::open(path + ".next");
+        std::string where;
+        result.check(copied && copied->file_count() == 1 && same_file(*copied, files[1], where),
+                     "a file copied to the next snapshot: " + where);
+    }
+
+    // Cut short, of another version, byte order or magic, or with records pointing elsewhere
+    const std::string written = read_bytes(path);
+    struct damage {
+        const char *what;
+        std::string data;
+    };
+    std::vector<damage> damaged;
+    const size_t cuts[] = {written.size() - 1, written.size() - 8, written.size() / 2, SECTIONS_OFFSET, 0};
+    for (size_t size : cuts) {
+        damaged.push_back({"cut short", written.substr(0, size)});
+    }
+    damaged.push_back({"another version", written});
+    set_field<uint32_t>(damaged.back().data, VERSION_OFFSET, index_snapshot::VERSION + 1);
+    damaged.push_back({"another byte order", written});
+    set_field<uint32_t>(damaged.back().data, BYTE_ORDER_OFFSET, 0x04030201);
+    damaged.push_back({"another magic", written});
+    damaged.back().data[0] ^= 1;
+    damaged.push_back({"appended bytes", written + std::string(8, '\0')});
+
+    const size_t symbols = section_offset(written, SYMBOLS);
+    const size_t name_count = snapshot ? snapshot->name_count() : 0;
+    damaged.push_back({"a symbol with a name out of range", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, name), name_count);
+    damaged.push_back({"a symbol under another name", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, name),
+                        field<uint32_t>(written, symbols + offsetof(index_snapshot::symbol_record, name)) + 1);
+    damaged.push_back({"a symbol with a container out of range", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, container), name_count);
+    damaged.push_back({"a symbol in a file out of range", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, file), files.size());
+    damaged.push_back({"a symbol of another file", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, file),
+                        (field<uint32_t>(written, symbols + offsetof(index_snapshot::symbol_record, file)) + 1) %
+                            files.size());
+    damaged.push_back({"a symbol of an unknown kind", written});
+    set_field<uint32_t>(damaged.back().data, symbols + offsetof(index_snapshot::symbol_record, kind), 0);
+    damaged.push_back({"a posting out of range", written});
+    set_field<uint32_t>(damaged.back().data, section_offset(written, POSTING_NAMES), name_count);
+    damaged.push_back({"posting keys out of order", written});
+    set_field<uint32_t>(damaged.back().data, section_offset(written, POSTING_KEYS), ~uint32_t(0));
+    damaged.push_back({"a lower case name that is not", written});
+    damaged.back().data[section_offset(written, LOWER_NAMES)] = 'A';
+    damaged.push_back({"files out of order", written});
+    set_field<uint32_t>(damaged.back().data, section_offset(written, FILES) + sizeof(index_snapshot::file_record) +
+                                                 offsetof(index_snapshot::file_record, path_offset),
+                        0);
+    damaged.push_back({"a reference of an unknown kind", written});
+    damaged.back().data[section_offset(written, REFERENCES) + offsetof(index_snapshot::reference_record, kind)] = 9;
+    damaged.push_back({"a reference name out of range", written});
+    set_field<uint32_t>(damaged.back().data,
+                        section_offset(written, REFERENCES) + offsetof(index_snapshot::reference_record, name_offset),
+                        written.size());
+    for (const damage &d : damaged) {
+        write_bytes(path, d.data);
+        result.check(index_snapshot::open(path) == nullptr, std::string("a snapshot with ") + d.what + " was opened");
+    }
+    write_bytes(path, written);
+    result.check(index_snapshot::open(path) != nullptr, "the snapshot does not open once it is restored");
+
+    // Random bytes changed: whatever still opens can be queried
+    bench_random random(32);
+    const size_t flips = options.quick ? 300 : 3000;
+    size_t opened = 0;
+    for (size_t i = 0; i < flips; i++) {
+        std::string data = written;
+        const uint32_t changes = 1 + random.below(4);
+        for (uint32_t k = 0; k < changes; k++) data[random.below(data.size())] ^= 1 << random.below(8);
+        write_bytes(path, data);
+        std::unique_ptr<index_snapshot> changed = index_snapshot::open(path);
+        if (!changed) continue;
+        opened++;
+        std::vector<file_import> imports;
+        document_references references;
+        for (uint32_t file = 0; file < changed->file_count(); file++) {
+            changed->imports(file, imports);
+            changed->references(file, references);
+            keep(changed->find_file(changed->file_path(file)));
+        }
+        symbol_index index;
+        index.attach_snapshot(std::move(changed));
+        for (const char *query : {"", "pa", "part", "twice", "wdth"}) {
+            symbol_results found;
+            index.query(query, 100, found);
+            keep(found);
+        }
+    }
+    std::printf("  round trip, %zu damaged snapshots rejected, %zu of %zu with random bytes changed still opened\n",
+                damaged.size(), opened, flips);
+
+    // Startup: opening the snapshot of a workspace and answering the first query, against indexing it
+    const size_t count = options.quick ? 200 : 5000;
+    std::vector<std::string> texts;
+    for (size_t i = 0; i < count; i++) texts.push_back(generate_scad(2000 + i % 7 * 500, i, false));
+    index_snapshot_writer workspace;
+    double started = time_per_call(
+        [&] {
+            symbol_index index;
+            for (size_t i = 0; i < count; i++) {
+                const std::string file_path = "/bench/cache/workspace/" + std::to_string(i) + ".scad";
+                const indexed_file file = index_file(file_path, texts[i]);
+                index.update(uri_table::global().intern_path(file_path), file.symbols);
+            }
+            symbol_results found;
+            index.query("module", 100, found);
+            keep(found);
+        },
+        0);
+    for (size_t i = 0; i < count; i++) {
+        const indexed_file file = index_file("/bench/cache/workspace/" + std::to_string(i) + ".scad", texts[i]);
+        workspace.add_file(file.path, file.stamp, file.symbols, file.imports, file.references);
+    }
+    workspace.write(path);
+    size_t indexed_symbols = 0;
+    const double reopened = time_per_call([&] {
+        symbol_index index;
+        index.attach_snapshot(index_snapshot::open(path));
+        symbol_results found;
+        index.query("module", 100, found);
+        keep(found);
+        indexed_symbols = index.symbol_count();
+    });
+    std::printf("  %zu files, %zu symbols: first workspace/symbol answer after indexing %8.1f ms, from the snapshot "
+                "%6.2f ms\n",
+                count, indexed_symbols, started * 1e3, reopened * 1e3);
+
+    std::error_code err;
+    std::filesystem::remove_all(directory, err);
+    return result.failures;
+}
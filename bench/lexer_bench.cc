@@ -0,0 +1,96 @@
+#include "bench.h"
+#include "scad_lexer.h"
+
+#include <cstdio>
+
+namespace {
+
+// The tokens repeated lex_token calls produce, in the layout of a token_stream
+void tokenize_one_by_one(std::string_view text, token_stream &out) {
+    out.clear();
+    uint32_t pos = 0;
+    syntax_kind previous = syntax_kind::end_of_file;
+    while (true) {
+        const scad_token token = lex_token(text, pos, previous);
+        out.push(token.kind, token.text_offset(), token.length);
+        if (token.kind == syntax_kind::end_of_file) break;
+        previous = token.kind;
+        pos = token.end();
+    }
+}
+
+bool same_tokens(const token_stream &a, const token_stream &b, std::string &where) {
+    const size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        if (a.kinds[i] != b.kinds[i] || a.offsets[i] != b.offsets[i] || a.lengths[i] != b.lengths[i]) {
+            where = "token " + std::to_string(i) + ": " + kind_name(a.kinds[i]) + " at " + std::to_string(a.offsets[i]) +
+                    "+" + std::to_string(a.lengths[i]) + " against " + kind_name(b.kinds[i]) + " at " +
+                    std::to_string(b.offsets[i]) + "+" + std::to_string(b.lengths[i]);
+            return false;
+        }
+    }
+    if (a.size() != b.size()) {
+        where = std::to_string(a.size()) + " tokens against " + std::to_string(b.size());
+        return false;
+    }
+    return true;
+}
+
+// Long runs of one character class and the bytes the classes must not take for their own
+// (non-ASCII, '@', '`', '{')
+std::string random_source(bench_random &random) {
+    static const char *const pieces[] = {
+        " ", "\t", "\n", "\r\n", "                    ", "\v\f", "0", "1234567890123456789", "1.5", "2e-3", ".5",
+        "1e", "abcdefghijklmnopqrstuvwxyz_$", "ABCXYZ", "x1", "$fn", "module", "function", "include", "<a/b.scad>",
+        "use", "<", ">", "<=", "==", "!=", "&&", "||", "!", "=", "[", "]", "(", ")", "{", "}", ";", ",", ", ",
+        ",-", ":", "?", "+", "-", "*", "/", "%", "^", "#", ".", "\"str\\\"ing\"", "\"unterminated", "// line\n",
+        "/* block */", "/*", "*/", "@", "`", "~", "\x80", "\xC3\xA4", "\xFF", "'", "\\", "&", "|",
+    };
+    std::string text;
+    const uint32_t count = random.below(80);
+    for (uint32_t i = 0; i < count; i++) text += pieces[random.below(sizeof(pieces) / sizeof(*pieces))];
+    // Number lists take the fast path
+    if (random.chance(30)) {
+        text += "[";
+        const uint32_t numbers = random.below(40);
+        for (uint32_t i = 0; i < numbers; i++) {
+            text += i ? (random.chance(50) ? ", " : ",") : "";
+            if (random.chance(30)) text += "-";
+            text += std::to_string(random.below(100000));
+            if (random.chance(50)) text += "." + std::to_string(random.below(1000));
+        }
+        text += random.chance(80) ? "]" : "";
+    }
+    return text;
+}
+
+} // namespace
+
+int lexer_bench(const bench_options &options) {
+    bench_result result;
+    bench_random random(29);
+
+    const size_t cases = options.quick ? 20000 : 2000000;
+    token_stream whole, one_by_one;
+    for (size_t i = 0; i < cases && result.failures < 10; i++) {
+        const std::string text = random_source(random);
+        tokenize_scad(text, whole);
+        tokenize_one_by_one(text, one_by_one);
+        std::string where;
+        const bool same = same_tokens(whole, one_by_one, where);
+        result.check(same, "tokenize_scad against lex_token, " + where + " in [" + text + "]");
+    }
+    std::printf("  %zu random sources tokenized at once and token by token\n", cases);
+
+    for (const auto &corpus : scad_corpora(options)) {
+        const std::string &text = corpus.second;
+        const double fast = time_per_call([&] { tokenize_scad(text, whole); });
+        const double single = time_per_call([&] { tokenize_one_by_one(text, one_by_one); });
+        std::string where;
+        result.check(same_tokens(whole, one_by_one, where), corpus.first + ": " + where);
+        std::printf("  %-22s %7.1f MB, %9zu tokens: tokenize_scad %5.2f GB/s, lex_token %5.2f GB/s\n",
+                    corpus.first.c_str(), text.size() / 1e6, whole.size(), text.size() / fast / 1e9,
+                    text.size() / single / 1e9);
+    }
+    return result.failures;
+}
@@ -0,0 +1,59 @@
+#include "bench.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+struct section {
+    const char *name;
+    int (*run)(const bench_options &);
+};
+
+const section sections[] = {
+    {"uri", &uri_bench},
+    {"lexer", &lexer_bench},
+    {"parser", &parser_bench},
+    {"position", &position_bench},
+    {"tasks", &request_task_bench},
+    {"evaluator", &evaluator_bench},
+    {"geometry", &geometry_bench},
+    {"symbols", &symbol_index_bench},
+    {"snapshot", &index_cache_bench},
+    {"xrefs", &xref_index_bench},
+    {"workspace", &workspace_bench},
+};
+
+} // namespace
+
+// lsptest_bench [--quick] [section...] [file.scad...]
+int main(int argc, char **argv) {
+    bench_options options;
+    std::vector<const section *> selected;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--quick")) {
+            options.quick = true;
+            continue;
+        }
+        bool known = false;
+        for (const section &s : sections) {
+            if (!std::strcmp(argv[i], s.name)) {
+                selected.push_back(&s);
+                known = true;
+            }
+        }
+        if (!known) options.files.push_back(argv[i]);
+    }
+    if (selected.empty()) {
+        for (const section &s : sections) selected.push_back(&s);
+    }
+
+    int failures = 0;
+    for (const section *s : selected) {
+        std::cout << "[" << s->name << "]\n";
+        const int failed = s->run(options);
+        if (failed) std::cout << "  " << failed << " mismatches\n";
+        failures += failed;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+#include "bench.h"
+#include "scad_parser.h"
+
+#include <cstdio>
+
+namespace {
+
+std::string describe(const syntax_element &element) {
+    std::string out = kind_name(element.kind());
+    out += "/" + std::to_string(element.width);
+    if (!element.is_node()) return out;
+    const syntax_node &node = *element.node();
+    if (node.kind == syntax_kind::error) out += "!" + std::to_string(static_cast<int>(node.error));
+    out += "(";
+    size_t shown = 0;
+    for_each_item(node, 0, [&](const syntax_element &child, uint32_t) {
+        if (shown++ < 8) out += (shown > 1 ? " " : "") + std::string(kind_name(child.kind()));
+    });
+    return out + (shown > 8 ? " ...)" : ")");
+}
+
+/**
+ * Same kinds, widths, trivia and errors everywhere. Lists are compared item by item, an
+ * incremental parse may keep the chunks of a list where a full parse would group it differently.
+ */
+bool same_tree(const syntax_element &a, const syntax_element &b, uint32_t offset, std::string &where) {
+    if (a.kind() != b.kind() || a.width != b.width || (!a.is_node() && a.trivia() != b.trivia())) {
+        where = "at " + std::to_string(offset) + ": incremental " + describe(a) + ", full " + describe(b);
+        return false;
+    }
+    if (!a.is_node()) return true;
+    if (a.node()->error != b.node()->error || a.node()->has_error() != b.node()->has_error()) {
+        where = "at " + std::to_string(offset) + ": errors differ in " + describe(a) + " and " + describe(b);
+        return false;
+    }
+
+    struct item {
+        const syntax_element *element;
+        uint32_t offset;
+    };
+    std::vector<item> left, right;
+    for_each_item(*a.node(), offset, [&](const syntax_element &e, uint32_t o) { left.push_back({&e, o}); });
+    for_each_item(*b.node(), offset, [&](const syntax_element &e, uint32_t o) { right.push_back({&e, o}); });
+    if (left.size() != right.size()) {
+        where = "at " + std::to_string(offset) + ": incremental " + describe(a) + ", full " + describe(b);
+        return false;
+    }
+    for (size_t i = 0; i < left.size(); i++) {
+        if (!same_tree(*left[i].element, *right[i].element, left[i].offset, where)) return false;
+    }
+    return true;
+}
+
+// Edits that broke the incremental parse once: before, offset, removed length, inserted text
+struct known_edit {
+    const char *text;
+    uint32_t offset;
+    uint32_t old_length;
+    const char *insert;
+};
+const known_edit known_edits[] = {
+    // The reused first element of a vector starts a range
+    {"x = [0,n-1 : 10];", 5, 2, ""},
+    {"x = [0,n-1 : 2 : 10];", 5, 2, ""},
+    {"x = [a, for (i = [0 : 3]) i];", 5, 3, ""},
+    {"size;\ncube(size);", 4, 0, " = 10"},
+};
+
+bool same_parse(const std::string &text, const syntax_tree &incremental, bench_result &result,
+                const std::string &before) {
+    syntax_tree full = parse_scad(text, incremental.version);
+    std::string where;
+    const bool same = same_tree(syntax_element(incremental.root), syntax_element(full.root), 0, where);
+    return result.check(same, where + "\n    before: " + before + "\n    after:  " + text);
+}
+
+} // namespace
+
+int parser_bench(const bench_options &options) {
+    bench_result result;
+    bench_random random(28);
+
+    for (const known_edit &edit : known_edits) {
+        std::string text = edit.text;
+        const syntax_tree tree = parse_scad(text, 0);
+        text_edit_span span;
+        span.offset = edit.offset;
+        span.old_length = edit.old_length;
+        span.new_length = std::string(edit.insert).size();
+        text.replace(span.offset, span.old_length, edit.insert);
+        same_parse(text, reparse_scad(tree, text, span, 1), result, edit.text);
+    }
+
+    // Random edits, each parsed incrementally from the previous incremental tree and in full
+    const size_t documents = options.quick ? 200 : 20000;
+    const size_t edits = 50;
+    size_t reused = 0, total = 0;
+    for (size_t d = 0; d < documents && result.failures < 10; d++) {
+        std::string text = random.chance(50) ? random_document(random)
+                                             : generate_scad(200 + random.below(1500), d, random.chance(20));
+        syntax_tree tree = parse_scad(text, 0);
+        for (size_t e = 1; e <= edits; e++) {
+            const std::string before = text;
+            text_edit_span span = random_edit(text, random);
+            // Several changes of one didChange are combined
+            if (random.chance(20)) span = span.then(random_edit(text, random));
+
+            syntax_tree incremental = reparse_scad(tree, text, span, e);
+            if (!same_parse(text, incremental, result, before)) break;
+            reused += incremental.reused_bytes;
+            total += text.size();
+            tree = std::move(incremental);
+        }
+    }
+    std::printf("  %zu random edits parsed incrementally and in full, %.0f%% of the text reused\n",
+                documents * edits, total ? 100.0 * reused / total : 0.0);
+
+    for (const auto &corpus : scad_corpora(options)) {
+        const std::string &text = corpus.second;
+        syntax_tree tree;
+        const double full = time_per_call([&] { tree = parse_scad(text, 0); });
+
+        // A keystroke in the middle of the document
+        std::string edited = text;
+        text_edit_span span;
+        span.offset = static_cast<uint32_t>(text.find(',', text.size() / 2));
+        span.new_length = 2;
+        edited.insert(span.offset, ",1");
+        syntax_tree incremental;
+        const double reparse = time_per_call([&] { incremental = reparse_scad(tree, edited, span, 1); });
+
+        std::printf("  %-22s %7.1f MB: full parse %8.1f ms (%6.1f MB/s), keystroke %8.1f us (%.4f%% parsed again)\n",
+                    corpus.first.c_str(), text.size() / 1e6, full * 1e3, text.size() / full / 1e6, reparse * 1e6,
+                    100.0 * (edited.size() - incremental.reused_bytes) / edited.size());
+    }
+    return result.failures;
+}
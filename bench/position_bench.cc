@@ -0,0 +1,92 @@
+#include "bench.h"
+#include "position_index.h"
+#include "scad_parser.h"
+
+#include <cstdio>
+
+namespace {
+
+bool same_index(const position_index &updated, const position_index &built, std::string &where) {
+    const std::vector<interval_index::interval> &a = updated.nodes().all();
+    const std::vector<interval_index::interval> &b = built.nodes().all();
+    for (size_t i = 0; i < std::min(a.size(), b.size()); i++) {
+        if (a[i].start != b[i].start || a[i].end != b[i].end || a[i].value != b[i].value) {
+            where = "interval " + std::to_string(i) + ": updated " + kind_name(static_cast<syntax_kind>(a[i].value)) +
+                    " [" + std::to_string(a[i].start) + ", " + std::to_string(a[i].end) + "), built " +
+                    kind_name(static_cast<syntax_kind>(b[i].value)) + " [" + std::to_string(b[i].start) + ", " +
+                    std::to_string(b[i].end) + ")";
+            return false;
+        }
+    }
+    if (a.size() != b.size()) {
+        where = std::to_string(a.size()) + " intervals updated, " + std::to_string(b.size()) + " built";
+        return false;
+    }
+    if (updated.errors().size() != built.errors().size()) {
+        where = "errors differ";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int position_bench(const bench_options &options) {
+    bench_result result;
+    bench_random random(37);
+
+    // Random edits, the index of the previous version updated against one built from scratch
+    const size_t documents = options.quick ? 200 : 20000;
+    const size_t edits = 50;
+    for (size_t d = 0; d < documents && result.failures < 10; d++) {
+        std::string text = random.chance(50) ? random_document(random)
+                                             : generate_scad(200 + random.below(1500), d, random.chance(20));
+        syntax_tree tree = parse_scad(text, 0);
+        position_index index;
+        index.build(text, tree);
+        for (size_t e = 1; e <= edits; e++) {
+            const std::string before = text;
+            text_edit_span span = random_edit(text, random);
+            if (random.chance(20)) span = span.then(random_edit(text, random));
+
+            syntax_tree next = reparse_scad(tree, text, span, e);
+            index.update(text, tree, next);
+            position_index built;
+            built.build(text, next);
+            std::string where;
+            const bool same = same_index(index, built, where);
+            if (!result.check(same, where + "\n    before: " + before + "\n    after:  " + text)) break;
+            tree = std::move(next);
+        }
+    }
+    std::printf("  %zu random edits, updated index compared with a full build\n", documents * edits);
+
+    for (const auto &corpus : scad_corpora(options)) {
+        const std::string &text = corpus.second;
+        const syntax_tree tree = parse_scad(text, 0);
+        position_index index;
+        const double build = time_per_call([&] { index.build(text, tree); });
+
+        std::string edited = text;
+        text_edit_span span;
+        span.offset = static_cast<uint32_t>(text.find(',', text.size() / 2));
+        span.new_length = 2;
+        edited.insert(span.offset, ",1");
+        const syntax_tree next = reparse_scad(tree, edited, span, 1);
+        position_index updated;
+        const double update = time_per_call([&] {
+            updated = index;
+            updated.update(edited, tree, next);
+        });
+        const double copy = time_per_call([&] { updated = index; });
+
+        bench_random positions(3);
+        const double query = time_per_call([&] {
+            for (int i = 0; i < 1000; i++) keep(updated.node_at(positions.below(edited.size())));
+        });
+        std::printf("  %-22s %9zu intervals: build %8.1f ms, update after a keystroke %8.1f ms (%.1f ms of it copying "
+                    "the index), node_at %5.0f ns\n",
+                    corpus.first.c_str(), index.nodes().size(), build * 1e3, update * 1e3, copy * 1e3, query * 1e6);
+    }
+    return result.failures;
+}
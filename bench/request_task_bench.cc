@@ -0,0 +1,85 @@
+#include "bench.h"
+#include "connection.h"
+#include "messages.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+
+// Runs the event loop until done or a second passed
+template <typename Done>
+bool process_events_until(Done done) {
+    QElapsedTimer timer;
+    timer.start();
+    while (!done() && timer.elapsed() < 1000) QCoreApplication::processEvents();
+    return done();
+}
+
+RequestId int_id(int value) {
+    RequestId id;
+    id.type = RequestId::INT;
+    id.value_int = value;
+    return id;
+}
+
+} // namespace
+
+int request_task_bench(const bench_options &) {
+    bench_result result;
+
+    int argc = 1;
+    char name[] = "lsptest_bench";
+    char *argv[] = {name, nullptr};
+    QCoreApplication app(argc, argv);
+
+    // A connection to a client on this machine that never answers
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost, 0);
+    QTcpSocket client;
+    client.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    if (!result.check(server.waitForNewConnection(1000), "no connection to the test client")) return result.failures;
+    Connection conn(nullptr, server.nextPendingConnection());
+
+    // A task waiting for the client is resumed with RequestCancelled once the request is given up
+    bool resumed = false;
+    client_response response;
+    conn.tasks.start(int_id(1), [&](request_task &task) {
+        ShowDocumentParams params;
+        params.uri.setPath("/tmp/a.scad");
+        response = task.request(params, "window/showDocument");
+        resumed = true;
+    });
+    result.check(conn.tasks.suspended() == 1, "the task did not suspend in request()");
+    conn.clean_pending_messages(Connection::PENDING_TIMEOUT);
+    process_events_until([] { return false; });
+    result.check(!resumed, "a request younger than the timeout was given up");
+    conn.clean_pending_messages(std::chrono::seconds(-1));
+    result.check(process_events_until([&] { return resumed; }), "the task was not resumed by the cleanup");
+    result.check(response.failed && response.error_code == static_cast<int>(ErrorCode::RequestCancelled),
+                 "the task was resumed without RequestCancelled, code " + std::to_string(response.error_code));
+    result.check(conn.tasks.suspended() == 0, "the resumed task was not dropped");
+
+    // What a task throws is answered to its request, also when it is no std::exception
+    client.readAll();
+    conn.tasks.start(int_id(2), [](request_task &) { throw 42; });
+    conn.tasks.start(int_id(3), [](request_task &) { throw std::runtime_error("failed"); });
+    QByteArray answers;
+    process_events_until([&] {
+        client.waitForReadyRead(10);
+        answers += client.readAll();
+        return answers.count("\"code\":-32603") >= 2;
+    });
+    result.check(answers.contains("\"id\":2") && answers.contains("\"id\":3") && answers.count("\"code\":-32603") == 2,
+                 "the failures of the tasks were not answered: " + answers.toStdString());
+    result.check(conn.tasks.suspended() == 0, "a failed task was not dropped");
+
+    std::printf("  request tasks resumed by the cleanup of pending requests and answered when they throw\n");
+    return result.failures;
+}
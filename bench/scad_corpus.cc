@@ -0,0 +1,125 @@
+#include "bench.h"
+#include "scad_parser.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+void append_number(std::string &out, bench_random &random) {
+    char buffer[32];
+    const int whole = static_cast<int>(random.below(2000)) - 1000;
+    std::snprintf(buffer, sizeof(buffer), "%d.%06u", whole, random.below(1000000));
+    out += buffer;
+}
+
+// What CAD exporters write: one polyhedron with long point and face lists
+void append_polyhedron(std::string &out, bench_random &random, size_t points) {
+    out += "polyhedron(\n  points=[";
+    for (size_t i = 0; i < points; i++) {
+        out += i ? ",[" : "[";
+        append_number(out, random);
+        out += ',';
+        append_number(out, random);
+        out += ',';
+        append_number(out, random);
+        out += ']';
+        if (i % 4 == 3) out += "\n    ";
+    }
+    out += "],\n  faces=[";
+    for (size_t i = 0; i + 2 < points; i++) {
+        out += i ? ",[" : "[";
+        out += std::to_string(i) + "," + std::to_string(i + 1) + "," + std::to_string(i + 2) + "]";
+    }
+    out += "]);\n";
+}
+
+// Modules and functions as people write them, every construct of the grammar once
+void append_library(std::string &out, bench_random &random, int n) {
+    const std::string id = std::to_string(n);
+    out += "// Part " + id + "\n";
+    out += "include <parts/part" + id + ".scad>\nuse <lib/util.scad>\n";
+    out += "size" + id + " = [" + std::to_string(random.below(100)) + ", 20, 3.5];\n";
+    out += "/* radius of the holes\n   in mm */\nr" + id + " = size" + id + ".x / 4 + $fn * 0.01;\n";
+    out += "function f" + id + "(x, y = 2) = let(a = x * y, b = [for (i = [0 : 2 : a]) if (i % 3 != 0) i else -i])\n";
+    out += "    len(b) > 0 ? b[0] + (a ^ 2) : undef;\n";
+    out += "module m" + id + "(h = 10, center = true) {\n";
+    out += "    assert(h > 0, \"height must be positive\");\n";
+    out += "    difference() {\n";
+    out += "        translate([0, 0, -h / 2]) cube([size" + id + "[0], size" + id + "[1], h], center = center);\n";
+    out += "        for (x = [-1, 1], y = [-1 : 1]) #translate([x * 5, y * 5, 0]) cylinder(r = r" + id +
+           ", h = h + 1, $fn = 32);\n";
+    out += "        if (h > 5) { %sphere(r = 2); } else !cube(1);\n";
+    out += "        echo(v = [each [1, 2, 3], for (i = [0 : 3]) let (j = i * i) j], f = function (x) x + 1);\n";
+    out += "    }\n}\n";
+    out += "m" + id + "(h = f" + id + "(3) * -1 >= 2 && true || !false ? 12 : 8);\n";
+}
+
+// The pieces of random_insert
+const char *const fragments[] = {
+    "0,", ":", "[", "]", "(", ")", "{", "}", ";", ",", "=", " ", "\n", "x", "n-1", "10", "1.5e3",
+    "+", "-", "*", "?", "!", "#", "%", ".", "<", ">=", "&&", "[0:2:10]", "[a:b]", "for(i=[0:3])",
+    "if(x)", "else", "let(a=1)", "each", "function f(x)=", "module m(){", "include <a.scad>", "use <",
+    "\"str", "\"", "/*", "*/", "// c\n", "cube([1,2,3]);", "a = b;", "echo(", "assert(", "$fn=8",
+    "function(x)x", "[for(i=a)if(i)i else j]", "undef", "true",
+};
+
+} // namespace
+
+std::string generate_scad(size_t bytes, uint64_t seed, bool generated) {
+    bench_random random(seed);
+    std::string out;
+    out.reserve(bytes + 4096);
+    int n = 0;
+    while (out.size() < bytes) {
+        if (generated) {
+            append_polyhedron(out, random, 2000);
+        } else {
+            append_library(out, random, n++);
+        }
+    }
+    return out;
+}
+
+std::vector<std::pair<std::string, std::string>> scad_corpora(const bench_options &options) {
+    const size_t bytes = options.quick ? (size_t(1) << 20) : (size_t(64) << 20);
+    std::vector<std::pair<std::string, std::string>> corpora;
+    corpora.emplace_back("generated polyhedra", generate_scad(bytes, 1, true));
+    corpora.emplace_back("handwritten modules", generate_scad(bytes, 2, false));
+    for (const std::string &file : options.files) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+            std::cerr << "  cannot read " << file << "\n";
+            continue;
+        }
+        std::stringstream content;
+        content << in.rdbuf();
+        corpora.emplace_back(file, content.str());
+    }
+    return corpora;
+}
+
+std::string random_insert(bench_random &random) {
+    std::string text;
+    const uint32_t count = random.below(3);
+    for (uint32_t i = 0; i < count; i++) text += fragments[random.below(sizeof(fragments) / sizeof(*fragments))];
+    return text;
+}
+
+text_edit_span random_edit(std::string &text, bench_random &random) {
+    text_edit_span span;
+    span.offset = random.below(text.size() + 1);
+    span.old_length = random.below(std::min<uint32_t>(12, text.size() - span.offset) + 1);
+    const std::string insert = random_insert(random);
+    span.new_length = insert.size();
+    text.replace(span.offset, span.old_length, insert);
+    return span;
+}
+
+std::string random_document(bench_random &random) {
+    std::string text;
+    const uint32_t count = 10 + random.below(60);
+    for (uint32_t i = 0; i < count; i++) text += random_insert(random);
+    return text;
+}
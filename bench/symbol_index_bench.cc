@@ -0,0 +1,183 @@
+#include "bench.h"
+#include "document.h"
+#include "index_cache.h"
+#include "scad_parser.h"
+#include "symbol_index.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+
+namespace {
+
+DocumentId path_document(const std::string &path) {
+    return uri_table::global().intern_path(path);
+}
+
+document_symbols parsed_symbols(const std::string &text) {
+    line_index lines;
+    lines.build(text);
+    document_symbols symbols;
+    symbols.extract(text, lines, parse_scad(text, 0));
+    return symbols;
+}
+
+// Top level symbols without parsing
+document_symbols listed_symbols(const std::vector<std::string> &names) {
+    document_symbols symbols;
+    for (const std::string &name : names) {
+        symbols.symbols.push_back({static_cast<uint32_t>(symbols.names.size()), static_cast<uint32_t>(name.size()),
+                                   document_symbols::NO_CONTAINER, SymbolKind::Function, lsRange()});
+        symbols.names += name;
+    }
+    return symbols;
+}
+
+std::vector<std::string> found_names(const symbol_index &index, std::string_view query, size_t limit = 100) {
+    symbol_results results;
+    index.query(query, limit, results);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < results.size(); i++) names.emplace_back(results.name(i));
+    return names;
+}
+
+std::string listed(const std::vector<std::string> &names) {
+    std::string text;
+    for (const std::string &name : names) text += (text.empty() ? "" : " ") + name;
+    return "[" + text + "]";
+}
+
+// Made of syllables, so names share trigrams like real ones do
+std::string random_name(bench_random &random) {
+    static const char *const syllables[] = {"cu", "be", "ro", "und", "ed", "hol", "der", "bolt", "nut", "plate", "_",
+                                            "wall", "hex", "mount", "base", "lid", "gear", "tooth", "arc", "in"};
+    std::string name;
+    const uint32_t count = 2 + random.below(4);
+    for (uint32_t i = 0; i < count; i++) name += syllables[random.below(sizeof(syllables) / sizeof(*syllables))];
+    return name;
+}
+
+} // namespace
+
+int symbol_index_bench(const bench_options &options) {
+    bench_result result;
+
+    // Exact matches first, then prefixes, substrings by position and subsequences, case insensitive
+    symbol_index index;
+    const DocumentId a = path_document("/bench/symbols/a.scad");
+    const DocumentId b = path_document("/bench/symbols/b.scad");
+    index.update(a, listed_symbols({"rounded_cube", "my_cube", "cube_helper", "Cube", "sphere"}));
+    std::vector<std::string> names = found_names(index, "cube");
+    result.check(names == std::vector<std::string>{"Cube", "cube_helper", "my_cube", "rounded_cube"},
+                 "ranking of cube: " + listed(names));
+    names = found_names(index, "helpr");
+    result.check(names == std::vector<std::string>{"cube_helper"}, "a query with a letter missing: " + listed(names));
+    names = found_names(index, "cu");
+    result.check(names == std::vector<std::string>{"Cube", "cube_helper"}, "a short query: " + listed(names));
+    names = found_names(index, "cube", 2);
+    result.check(names == std::vector<std::string>{"Cube", "cube_helper"}, "the limit: " + listed(names));
+
+    // Nested definitions name their container
+    index.update(b, parsed_symbols("module outer() { inner = 1; }\nfunction f() = 2;\n"));
+    symbol_results nested;
+    index.query("inner", 10, nested);
+    result.check(nested.size() == 1 && nested.container(0) == "outer" && nested.document(0) == b &&
+                     nested.range(0).start.line == 0,
+                 "the nested variable was not found in its module");
+
+    // An update replaces the symbols of the document, a removal drops them
+    index.update(a, listed_symbols({"cylinder_helper"}));
+    result.check(found_names(index, "cube").empty() && found_names(index, "cylinder") == std::vector<std::string>{
+                     "cylinder_helper"}, "an update kept the old symbols");
+    result.check(index.symbol_count() == 4, "symbol_count after an update is " + std::to_string(index.symbol_count()));
+    index.remove(a);
+    result.check(found_names(index, "cylinder").empty() && index.symbol_count() == 3, "a removal kept the symbols");
+
+    // Removing most documents compacts the columns, the answers stay those of a fresh index
+    bench_random random(30);
+    std::vector<std::vector<std::string>> documents(600);
+    for (auto &document : documents) {
+        for (int i = 0; i < 20; i++) document.push_back(random_name(random));
+    }
+    symbol_index churned, fresh;
+    for (size_t i = 0; i < documents.size(); i++) {
+        churned.update(path_document("/bench/symbols/churn/" + std::to_string(i) + ".scad"),
+                       listed_symbols(documents[i]));
+    }
+    for (size_t i = 0; i < documents.size(); i++) {
+        const DocumentId doc = path_document("/bench/symbols/churn/" + std::to_string(i) + ".scad");
+        if (i % 10 == 0) {
+            fresh.update(doc, listed_symbols(documents[i]));
+        } else {
+            churned.remove(doc);
+        }
+    }
+    result.check(churned.symbol_count() == fresh.symbol_count(), "the symbol count after a compaction");
+    const char *queries[] = {"cube", "hexnut", "mountplate", "gera", "bo", "lid_"};
+    for (const char *query : queries) {
+        const std::vector<std::string> kept = found_names(churned, query, 1000);
+        const std::vector<std::string> built = found_names(fresh, query, 1000);
+        result.check(kept == built, std::string("after a compaction, ") + query + ": " + listed(kept) + " against " +
+                                        listed(built));
+    }
+
+    // The base layer from a snapshot, hidden where the live index has newer symbols
+    const std::string snapshot_path =
+        (std::filesystem::temp_directory_path() / ("lsptest_bench_" + std::to_string(::getpid()) + ".index")).string();
+    index_snapshot_writer writer;
+    writer.add_file("/bench/symbols/base/x.scad", file_stamp(), listed_symbols({"old_bracket", "shared_name"}), {},
+                    document_references());
+    writer.add_file("/bench/symbols/base/y.scad", file_stamp(), listed_symbols({"other_bracket"}), {},
+                    document_references());
+    result.check(writer.write(snapshot_path), "the snapshot could not be written");
+    std::unique_ptr<index_snapshot> snapshot = index_snapshot::open(snapshot_path);
+    std::filesystem::remove(snapshot_path);
+    result.check(snapshot != nullptr, "the snapshot could not be opened");
+    if (snapshot) {
+        symbol_index layered;
+        layered.attach_snapshot(std::move(snapshot));
+        const DocumentId x = path_document("/bench/symbols/base/x.scad");
+        const DocumentId y = path_document("/bench/symbols/base/y.scad");
+        names = found_names(layered, "bracket");
+        result.check(names == std::vector<std::string>{"old_bracket", "other_bracket"},
+                     "the snapshot symbols: " + listed(names));
+        layered.update(x, listed_symbols({"new_bracket", "shared_name"}));
+        names = found_names(layered, "bracket");
+        result.check(names == std::vector<std::string>{"new_bracket", "other_bracket"},
+                     "the updated document did not hide its snapshot symbols: " + listed(names));
+        names = found_names(layered, "shared_name");
+        result.check(names.size() == 1, "a name in both layers was reported " + std::to_string(names.size()) + " times");
+        layered.remove(y);
+        names = found_names(layered, "bracket");
+        result.check(names == std::vector<std::string>{"new_bracket"},
+                     "the removed document did not hide its snapshot symbols: " + listed(names));
+        result.check(layered.symbol_count() == 2 && layered.documents_in("/bench/symbols/base") ==
+                                                         std::vector<DocumentId>{x},
+                     "the counts and documents of the layered index");
+    }
+    std::printf("  ranking, updates, removals, compaction and the snapshot layer checked\n");
+
+    // Latency on 100k symbols, the target is below a millisecond per query
+    const size_t symbols = options.quick ? 10000 : 100000;
+    symbol_index large;
+    for (size_t i = 0; i < symbols / 20; i++) {
+        std::vector<std::string> document;
+        for (int k = 0; k < 20; k++) document.push_back(random_name(random));
+        large.update(path_document("/bench/symbols/large/" + std::to_string(i) + ".scad"), listed_symbols(document));
+    }
+    const char *timed[] = {"cube", "hexnutplate", "gera_tooth", "mo", "roundedholder"};
+    for (const char *query : timed) {
+        symbol_results found;
+        const double seconds = time_per_call([&] {
+            symbol_results results;
+            large.query(query, 100, results);
+            keep(results);
+            found = std::move(results);
+        });
+        std::printf("  %zu symbols, %zu names, query %-15s %3zu results %8.1f us%s\n", large.symbol_count(),
+                    large.name_count(), query, found.size(), seconds * 1e6, seconds > 1e-3 ? "  over 1 ms" : "");
+    }
+    return result.failures;
+}
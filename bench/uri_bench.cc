@@ -0,0 +1,190 @@
+#include "bench.h"
+#include "lsp.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// DocumentUri::setPath before it was table driven
+std::string reference_set_path(const std::string &path) {
+    std::string raw_uri = path;
+
+    size_t index = raw_uri.find(':');
+    if (index == 1) {
+        raw_uri.replace(raw_uri.begin() + index, raw_uri.begin() + index + 1, "%3A");
+    }
+
+    std::string t;
+    t.reserve(8 + raw_uri.size());
+#if defined(_WIN32)
+    t += "file:///";
+#else
+    t += "file://";
+#endif
+    for (char c : raw_uri) {
+        switch (c) {
+        case ' ': t += "%20"; break;
+        case '#': t += "%23"; break;
+        case '$': t += "%24"; break;
+        case '&': t += "%26"; break;
+        case '(': t += "%28"; break;
+        case ')': t += "%29"; break;
+        case '+': t += "%2B"; break;
+        case ',': t += "%2C"; break;
+        case ';': t += "%3B"; break;
+        case '?': t += "%3F"; break;
+        case '@': t += "%40"; break;
+        default: t += c; break;
+        }
+    }
+    return t;
+}
+
+// DocumentUri::getPath before it copied clean runs in bulk, for URIs starting with file://
+std::string reference_get_path(const std::string &raw_uri) {
+    std::string ret;
+#ifdef _WIN32
+    size_t i = 8;
+#else
+    size_t i = 7;
+#endif
+    auto from_hex = [](unsigned char c) {
+        return c - '0' < 10 ? c - '0' : (c | 32) - 'a' + 10;
+    };
+    for (; i < raw_uri.size(); i++) {
+        if (i + 3 <= raw_uri.size() && raw_uri[i] == '%') {
+            ret.push_back(from_hex(raw_uri[i + 1]) * 16 + from_hex(raw_uri[i + 2]));
+            i += 2;
+        } else {
+            ret.push_back(raw_uri[i]);
+        }
+    }
+#ifdef _WIN32
+    std::replace(ret.begin(), ret.end(), '\\', '/');
+    if (ret.size() > 1 && ret[0] >= 'a' && ret[0] <= 'z' && ret[1] == ':') {
+        ret[0] = toupper(ret[0]);
+    }
+#endif
+    return ret;
+}
+
+std::string printable(const std::string &s) {
+    std::string out;
+    for (unsigned char c : s) {
+        if (c >= 0x20 && c < 0x7f) {
+            out += static_cast<char>(c);
+        } else {
+            char hex[5];
+            std::snprintf(hex, sizeof(hex), "\\x%02X", c);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+// Mostly path characters, with the reserved ones, colons, percent signs and any other byte
+// mixed in, so the drive letter and the edges of the clean runs are hit often
+char random_path_byte(bench_random &random) {
+    static const char common[] = "abcdefghijklmnopqrstuvwxyz0123456789/._-";
+    static const char special[] = " #$&()+,;?@:%\\";
+    const uint32_t kind = random.below(10);
+    if (kind < 6) return common[random.below(sizeof(common) - 1)];
+    if (kind < 9) return special[random.below(sizeof(special) - 1)];
+    return static_cast<char>(random.below(256));
+}
+
+std::string random_path(bench_random &random) {
+    std::string path;
+    const uint32_t length = random.below(random.chance(10) ? 300 : 40);
+    for (uint32_t i = 0; i < length; i++) path += random_path_byte(random);
+    // Windows drive letters and colons right behind them
+    if (random.chance(20) && path.size() > 1) path[1] = ':';
+    return path;
+}
+
+std::string random_uri(bench_random &random) {
+    static const char hex[] = "0123456789abcdefABCDEFgz%";
+    std::string uri = "file://";
+    const uint32_t length = random.below(random.chance(10) ? 300 : 40);
+    for (uint32_t i = 0; i < length; i++) {
+        if (random.chance(15)) {
+            uri += '%';
+            // Escapes cut off at the end and malformed digits as well
+            if (random.chance(90)) uri += hex[random.below(sizeof(hex) - 1)];
+            if (random.chance(90)) uri += hex[random.below(sizeof(hex) - 1)];
+        } else {
+            uri += random_path_byte(random);
+        }
+    }
+    return uri;
+}
+
+} // namespace
+
+int uri_bench(const bench_options &options) {
+    bench_result result;
+    bench_random random(27);
+
+    const size_t cases = options.quick ? 20000 : 2000000;
+    for (size_t i = 0; i < cases && result.failures < 10; i++) {
+        const std::string path = random_path(random);
+        const std::string expected = reference_set_path(path);
+        const std::string encoded = DocumentUri::fromPath(path).raw_uri;
+        result.check(encoded == expected, "setPath(" + printable(path) + ") = " + printable(encoded) +
+                                          ", expected " + printable(expected));
+
+        DocumentUri uri{random_uri(random)};
+        const std::string decoded = uri.getPath();
+        result.check(decoded == reference_get_path(uri.raw_uri),
+                     "getPath(" + printable(uri.raw_uri) + ") = " + printable(decoded));
+
+        // Decoding what was encoded gives the path back, apart from the drive letter
+        if (path.find('%') == std::string::npos && !(path.size() > 1 && path[1] == ':')) {
+            result.check(DocumentUri::fromPath(path).getPath() == path, "round trip of " + printable(path));
+        }
+    }
+    std::cout << "  " << cases << " random paths and URIs compared\n";
+
+    // Workspace paths as they come from the file system, few of them need an escape
+    std::vector<std::string> paths;
+    bench_random names(1);
+    for (int i = 0; i < 1000; i++) {
+        std::string path = "/home/user/projects/mechanical-parts/library";
+        const uint32_t depth = 1 + names.below(5);
+        for (uint32_t d = 0; d < depth; d++) {
+            path += '/';
+            const uint32_t length = 4 + names.below(16);
+            for (uint32_t c = 0; c < length; c++) path += static_cast<char>('a' + names.below(26));
+            if (names.chance(10)) path += " (copy)";
+        }
+        path += ".scad";
+        paths.push_back(path);
+    }
+    std::vector<DocumentUri> uris;
+    size_t bytes = 0;
+    for (const std::string &path : paths) {
+        uris.push_back(DocumentUri::fromPath(path));
+        bytes += path.size();
+    }
+
+    const double old_encode = time_per_call([&] {
+        for (const std::string &path : paths) keep(reference_set_path(path));
+    });
+    const double new_encode = time_per_call([&] {
+        for (const std::string &path : paths) keep(DocumentUri::fromPath(path));
+    });
+    const double old_decode = time_per_call([&] {
+        for (const DocumentUri &uri : uris) keep(reference_get_path(uri.raw_uri));
+    });
+    const double new_decode = time_per_call([&] {
+        for (const DocumentUri &uri : uris) keep(uri.getPath());
+    });
+    const double per_path = 1e9 / paths.size();
+    std::printf("  setPath %7.1f ns/path, loop %7.1f ns/path, %.2fx (%.0f MB/s)\n", new_encode * per_path,
+                old_encode * per_path, old_encode / new_encode, bytes / new_encode / 1e6);
+    std::printf("  getPath %7.1f ns/path, loop %7.1f ns/path, %.2fx (%.0f MB/s)\n", new_decode * per_path,
+                old_decode * per_path, old_decode / new_decode, bytes / new_decode / 1e6);
+
+    return result.failures;
+}
@@ -0,0 +1,151 @@
+#include "bench.h"
+#include "connection.h"
+#include "messages.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Runs the event loop until done or the time is up
+template <typename Done>
+bool process_events_until(Done done, int milliseconds) {
+    QElapsedTimer timer;
+    timer.start();
+    while (!done() && timer.elapsed() < milliseconds) QCoreApplication::processEvents();
+    return done();
+}
+
+void write_file(const fs::path &path, const std::string &text) {
+    fs::create_directories(path.parent_path());
+    std::ofstream(path, std::ios::trunc) << text;
+}
+
+// Indexes the folder and waits for the indexer, false if it did not finish in time
+bool index_workspace(workspace_indexer &indexer, project &proj, const fs::path &folder) {
+    proj.workspace_folders.resize(1);
+    proj.workspace_folders[0].uri.setPath(folder.string());
+    indexer.start();
+    return process_events_until([&] { return !indexer.running(); }, 600000);
+}
+
+bool defines(const project &proj, const std::string &name, DocumentId doc) {
+    symbol_results found;
+    proj.symbols.query(name, 100, found);
+    for (size_t i = 0; i < found.size(); i++) {
+        if (found.name(i) == name && found.document(i) == doc) return true;
+    }
+    return false;
+}
+
+size_t references_in(project &proj, reference_kind kind, const std::string &name, DocumentId doc) {
+    const xref_index::target_id target = proj.xrefs.find(kind, name);
+    if (target == xref_index::NO_TARGET) return 0;
+    const std::vector<DocumentId> docs = {doc};
+    location_results found;
+    proj.xrefs.references(target, &docs, found);
+    return found.size();
+}
+
+} // namespace
+
+int workspace_bench(const bench_options &options) {
+    bench_result result;
+
+    int argc = 1;
+    char name[] = "lsptest_bench";
+    char *argv[] = {name, nullptr};
+    QCoreApplication app(argc, argv);
+
+    // Snapshots go below the directory of the run, not into the cache of the user
+    const fs::path directory = fs::temp_directory_path() / ("lsptest_bench_" + std::to_string(::getpid()));
+    ::setenv("XDG_CACHE_HOME", (directory / "cache").c_str(), 1);
+
+    // A connection to a client on this machine that never answers
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost, 0);
+    QTcpSocket client;
+    client.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    if (!result.check(server.waitForNewConnection(1000), "no connection to the test client")) return result.failures;
+    Connection conn(nullptr, server.nextPendingConnection());
+    project &proj = conn.active_project;
+
+    // An open document keeps the symbols, references and imports of the editor's text, from the
+    // files read by the workers and from the snapshot of the run before
+    const fs::path folder = directory / "open";
+    write_file(folder / "a.scad", "include <disk.scad>\nmodule disk_only() { from_disk(); }\n");
+    write_file(folder / "b.scad", "module on_disk() {}\n");
+    write_file(folder / "disk.scad", "module from_disk() {}\n");
+    write_file(folder / "editor.scad", "module from_editor() {}\n");
+    const DocumentId a = uri_table::global().intern_path((folder / "a.scad").string());
+    const DocumentId b = uri_table::global().intern_path((folder / "b.scad").string());
+    DidOpenTextDocument open;
+    open.textDocument.uri.setPath((folder / "a.scad").string());
+    open.textDocument.version = 1;
+    open.textDocument.text = "include <editor.scad>\nmodule editor_only() { from_editor(); }\n";
+    open.process(&conn, &proj, RequestId());
+
+    for (const char *run : {"read from disk", "taken from the snapshot"}) {
+        const std::string when = std::string(" when the files were ") + run;
+        if (!result.check(index_workspace(conn.indexer, proj, folder), "the indexer did not finish" + when)) break;
+        result.check(defines(proj, "editor_only", a) && !defines(proj, "disk_only", a),
+                     "the symbols of the open document were replaced" + when);
+        result.check(defines(proj, "on_disk", b), "the symbols of a closed document were not indexed" + when);
+        result.check(references_in(proj, reference_kind::module, "from_editor", a) == 1 &&
+                         references_in(proj, reference_kind::module, "from_disk", a) == 0,
+                     "the references of the open document were replaced" + when);
+        const std::vector<file_import> &imports = proj.dependencies.imports(a);
+        result.check(imports.size() == 1 && imports[0].path == "editor.scad",
+                     "the imports of the open document were replaced" + when);
+    }
+
+    // Cold indexing of a workspace without snapshot by the number of threads
+    const size_t files = options.quick ? 200 : 20000;
+    const fs::path large = directory / "large";
+    for (size_t i = 0; i < files; i++) {
+        write_file(large / std::to_string(i % 100) / (std::to_string(i) + ".scad"),
+                   generate_scad(2000 + i % 7 * 500, i, i % 10 == 0));
+    }
+    const std::string snapshot = index_cache_path({large.string()});
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts = {1, 2, 4, 8};
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [&](unsigned n) { return n >= cores; }), counts.end());
+    counts.push_back(cores);
+    double single = 0;
+    size_t symbols = 0;
+    for (unsigned threads : counts) {
+        project cold;
+        workspace_indexer indexer(&conn, &cold, threads);
+        fs::remove(snapshot);
+        QElapsedTimer timer;
+        timer.start();
+        if (!result.check(index_workspace(indexer, cold, large), "the indexer did not finish")) break;
+        const double seconds = timer.nsecsElapsed() * 1e-9;
+        if (threads == 1) {
+            single = seconds;
+            symbols = cold.symbols.symbol_count();
+        }
+        result.check(symbols > 0 && cold.symbols.symbol_count() == symbols,
+                     std::to_string(threads) + " threads found " + std::to_string(cold.symbols.symbol_count()) +
+                         " symbols instead of " + std::to_string(symbols));
+        std::printf("  %zu files, %2u threads: cold indexing %8.1f ms, %zu symbols, %.2fx\n", files, threads,
+                    seconds * 1e3, cold.symbols.symbol_count(), single / seconds);
+    }
+
+    std::error_code err;
+    fs::remove_all(directory, err);
+    return result.failures;
+}
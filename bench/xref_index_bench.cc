@@ -0,0 +1,232 @@
+#include "bench.h"
+#include "scad_parser.h"
+#include "xref_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+
+namespace {
+
+DocumentId path_document(const std::string &path) {
+    return uri_table::global().intern_path(path);
+}
+
+document_references extracted(const std::string &text) {
+    line_index lines;
+    lines.build(text);
+    document_references references;
+    references.extract(text, lines, parse_scad(text, 0));
+    return references;
+}
+
+const char *kind_text(reference_kind kind) {
+    switch (kind) {
+    case reference_kind::module:
+        return "module";
+    case reference_kind::function:
+        return "function";
+    case reference_kind::variable:
+        return "variable";
+    }
+    return "?";
+}
+
+// As kind:name@line:character, in document order
+std::string listed(const document_references &references) {
+    std::string text;
+    for (const document_references::reference &ref : references.references) {
+        text += (text.empty() ? "" : " ") + std::string(kind_text(ref.kind)) + ":" +
+                std::string(references.name(ref)) + "@" + std::to_string(ref.range.start.line) + ":" +
+                std::to_string(ref.range.start.character);
+    }
+    return "[" + text + "]";
+}
+
+using location_list = std::vector<std::pair<DocumentId, lsRange>>;
+
+location_list found_locations(xref_index &index, reference_kind kind, std::string_view name,
+                              const std::vector<DocumentId> *docs = nullptr) {
+    location_list locations;
+    const xref_index::target_id target = index.find(kind, name);
+    if (target == xref_index::NO_TARGET) return locations;
+    location_results results;
+    index.references(target, docs, results);
+    for (size_t i = 0; i < results.size(); i++) locations.emplace_back(results.document(i), results.range(i));
+    return locations;
+}
+
+// What the index must answer: the references of the current documents, by document and in document order
+location_list expected_locations(const std::vector<std::pair<DocumentId, const document_references *>> &current,
+                                 reference_kind kind, std::string_view name, const std::vector<DocumentId> *docs) {
+    location_list locations;
+    for (const auto &doc : current) {
+        if (!doc.second || (docs && !std::binary_search(docs->begin(), docs->end(), doc.first))) continue;
+        for (const document_references::reference &ref : doc.second->references) {
+            if (ref.kind == kind && doc.second->name(ref) == name) locations.emplace_back(doc.first, ref.range);
+        }
+    }
+    return locations;
+}
+
+} // namespace
+
+int xref_index_bench(const bench_options &options) {
+    bench_result result;
+    // Global names by namespace, names bound by parameters, let and for and keywords like echo are left out
+    struct extraction_case {
+        const char *source;
+        const char *references;
+    };
+    const extraction_case cases[] = {
+        {"cube(size);", "[module:cube@0:0 variable:size@0:5]"},
+        {"x = f(y);", "[function:f@0:4 variable:y@0:6]"},
+        {"module m(a, b = a + c) { cube(a); }", "[variable:c@0:20 module:cube@0:25]"},
+        {"function f(x) = let(y = x, z = y + w) z;", "[variable:w@0:35]"},
+        {"for (i = [0:n]) translate([i, 0, 0]) part(i);", "[variable:n@0:12 module:translate@0:16 module:part@0:37]"},
+        {"v = [for (p = points) p.x + q.y];", "[variable:points@0:14 variable:q@0:28]"},
+        {"g = function (x) h(x); echo(g(1));", "[function:h@0:17 function:g@0:28]"},
+        {"cylinder(h = height, r = 1);", "[module:cylinder@0:0 variable:height@0:13]"},
+    };
+    for (const extraction_case &c : cases) {
+        const std::string found = listed(extracted(c.source));
+        result.check(found == c.references, std::string(c.source) + " has the references " + found + " instead of " +
+                                                c.references);
+    }
+
+    // The reference under the cursor, also right behind the name
+    xref_index index;
+    const DocumentId a = path_document("/bench/xrefs/a.scad");
+    const DocumentId b = path_document("/bench/xrefs/b.scad");
+    const document_references a_refs = extracted("part(1);\nwidth = 2;\ncube(width);\n");
+    index.update(a, a_refs);
+    lsRange range;
+    const xref_index::target_id at = index.target_at(a, Position{2, 9}, &range);
+    result.check(at != xref_index::NO_TARGET && index.name(at) == "width" &&
+                     index.kind(at) == reference_kind::variable && range.start.character == 5 &&
+                     range.end.character == 10,
+                 "the reference at 2:9");
+    result.check(index.target_at(a, Position{2, 10}) == at, "the position right behind the name");
+    result.check(index.target_at(a, Position{1, 3}) == xref_index::NO_TARGET, "a reference where there is none");
+    result.check(index.target_at(b, Position{0, 0}) == xref_index::NO_TARGET, "a reference in an unknown document");
+
+    // Updates replace the references of a document, removals drop them, documents restrict them
+    const document_references b_refs = extracted("part(2);\npart(3);\n");
+    index.update(b, b_refs);
+    result.check(found_locations(index, reference_kind::module, "part").size() == 3, "the references of part");
+    const std::vector<DocumentId> only_b = {b};
+    const location_list in_b = found_locations(index, reference_kind::module, "part", &only_b);
+    result.check(in_b.size() == 2 && in_b[0].first == b && in_b[0].second.start.line == 0 &&
+                     in_b[1].second.start.line == 1,
+                 "the references of part restricted to b.scad");
+    index.update(a, extracted("cube(1);\n"));
+    result.check(found_locations(index, reference_kind::module, "part").size() == 2 &&
+                     found_locations(index, reference_kind::variable, "width").empty(),
+                 "an update kept the old references");
+    index.remove(b);
+    result.check(found_locations(index, reference_kind::module, "part").empty() && index.reference_count() == 1,
+                 "a removal kept the references");
+
+    // Random updates and removals in any document order, against the references of the documents
+    bench_random random(39);
+    const size_t documents = options.quick ? 40 : 200;
+    const size_t rounds = options.quick ? 2000 : 20000;
+    std::vector<document_references> pieces;
+    for (int i = 0; i < 16; i++) pieces.push_back(extracted(random_document(random)));
+    std::vector<std::pair<DocumentId, const document_references *>> current;
+    for (size_t i = 0; i < documents; i++) {
+        current.emplace_back(path_document("/bench/xrefs/random/" + std::to_string(i) + ".scad"), nullptr);
+    }
+    std::sort(current.begin(), current.end());
+    xref_index changed;
+    std::vector<std::pair<reference_kind, std::string>> names;
+    for (const document_references &piece : pieces) {
+        for (const auto &ref : piece.references) names.emplace_back(ref.kind, std::string(piece.name(ref)));
+    }
+    for (size_t round = 0; round < rounds && !names.empty(); round++) {
+        auto &doc = current[random.below(current.size())];
+        if (random.chance(20)) {
+            changed.remove(doc.first);
+            doc.second = nullptr;
+        } else {
+            doc.second = &pieces[random.below(pieces.size())];
+            changed.update(doc.first, *doc.second);
+        }
+        if (!random.chance(10)) continue;
+        const auto &name = names[random.below(names.size())];
+        std::vector<DocumentId> docs;
+        for (const auto &d : current) {
+            if (random.chance(30)) docs.push_back(d.first);
+        }
+        const std::vector<DocumentId> *restrict_to = random.chance(50) ? &docs : nullptr;
+        if (!result.check(found_locations(changed, name.first, name.second, restrict_to) ==
+                              expected_locations(current, name.first, name.second, restrict_to),
+                          "the references of " + name.second + " after " + std::to_string(round) + " changes")) {
+            break;
+        }
+    }
+    size_t live = 0;
+    for (const auto &doc : current) live += doc.second ? doc.second->references.size() : 0;
+    result.check(changed.reference_count() == live, "the reference count after random changes");
+    std::printf("  %zu extractions, %zu random updates and removals checked\n", std::size(cases), rounds);
+
+    // Find references in a workspace of 20k files, the target is below 5 ms
+    const size_t files = options.quick ? 1000 : 20000;
+    xref_index workspace;
+    std::vector<DocumentId> workspace_docs;
+    std::vector<document_references> file_refs;
+    for (size_t i = 0; i < 64; i++) file_refs.push_back(extracted(generate_scad(2000 + i % 7 * 500, i, false)));
+    for (size_t i = 0; i < files; i++) {
+        workspace_docs.push_back(path_document("/bench/xrefs/workspace/" + std::to_string(i) + ".scad"));
+        workspace.update(workspace_docs.back(), file_refs[i % file_refs.size()]);
+    }
+    std::sort(workspace_docs.begin(), workspace_docs.end());
+
+    // The name with the most references is the slowest to answer
+    xref_index::target_id widest = 0;
+    size_t widest_count = 0;
+    for (xref_index::target_id target = 0; target < workspace.target_count(); target++) {
+        location_results results;
+        workspace.references(target, nullptr, results);
+        if (results.size() > widest_count) {
+            widest = target;
+            widest_count = results.size();
+        }
+    }
+    std::vector<DocumentId> tenth;
+    for (size_t i = 0; i < workspace_docs.size(); i += 10) tenth.push_back(workspace_docs[i]);
+    const std::string widest_name(workspace.name(widest));
+    size_t edit = 0;
+    struct timed_case {
+        const char *what;
+        std::function<size_t()> run;
+    };
+    const timed_case timed[] = {
+        {"all documents", [&] {
+             location_results results;
+             workspace.references(widest, nullptr, results);
+             return results.size();
+         }},
+        {"a tenth of the documents", [&] {
+             location_results results;
+             workspace.references(widest, &tenth, results);
+             return results.size();
+         }},
+        {"all documents after an edit", [&] {
+             // Settles the target again, the entries of the edited document were appended
+             const DocumentId doc = workspace_docs[edit++ % workspace_docs.size()];
+             workspace.update(doc, file_refs[edit % file_refs.size()]);
+             location_results results;
+             workspace.references(workspace.find(workspace.kind(widest), widest_name), nullptr, results);
+             return results.size();
+         }},
+    };
+    for (const timed_case &t : timed) {
+        size_t found = 0;
+        const double seconds = time_per_call([&] { found = t.run(); });
+        std::printf("  %zu files, %zu references, %s in %-28s %7zu found %8.3f ms%s\n", files,
+                    workspace.reference_count(), widest_name.c_str(), t.what, found, seconds * 1e3,
+                    seconds > 5e-3 ? "  over 5 ms" : "");
+    }
+    return result.failures;
+}
@@ -2,24 +2,36 @@
 #include "connection_handler.h"
 #include "messages.h"
 
+#include <QJsonArray>
+#include <QJsonDocument>
 #include <QTcpSocket>
+#include <QTimer>
 
 #include <iostream>
 #include <list>
 #include <memory>
 
 
-#define DEBUG_MESSAGETRAFFIC
-
 Connection::Connection(ConnectionHandler *handler, QTcpSocket *client) :
+        indexer(this, &active_project),
+        renderer(this),
+        meshes(this),
+        exporter(this),
+        refinements(this, &active_project),
+        picks(this),
+        tasks(this),
         handler(handler),
         socket(client)
 {
    connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
-
-    // start a qtimer every 10 seconds to run:
-    //this->clean_pending_messages(std::chrono::seconds(10));
-
+   // More mesh frames fit into the socket
+   connect(socket, &QTcpSocket::bytesWritten, this, [this] { meshes.pump(); });
+
+    // Requests the client never answers would keep their callbacks, and request tasks their
+    // stacks, for the whole connection
+    QTimer *cleanup = new QTimer(this);
+    connect(cleanup, &QTimer::timeout, this, [this] { this->clean_pending_messages(PENDING_TIMEOUT); });
+    cleanup->start(std::chrono::duration_cast<std::chrono::milliseconds>(PENDING_TIMEOUT).count() / 2);
 }
 
 
@@ -116,18 +128,28 @@ void Connection::clean_pending_messages(const std::chrono::system_clock::duratio
     //pending_messages.erase(std::remove_if(pending_messages.begin(), pending_messages.end(), [&](const std::pair<int, pending_message> &msg) {
     //    return (now - msg.second.pending_since) > max_age;
     //}));
-    int cnt = 0;
+    std::vector<std::pair<int, request_callback_t>> stale;
     for(auto it = pending_messages.begin(); it != pending_messages.end();){
         if ((now - it->second.pending_since) > max_age) {
+            stale.emplace_back(it->first, std::move(it->second.callback));
             it = pending_messages.erase(it); // previously this was something like m_map.erase(it++);
-            cnt ++;
         } else {
             ++it;
         }
     }
 
-    if (cnt > 0)
-        std::cout << "Cleared " << cnt << "stale messages with a missing response\n";
+    if (!stale.empty())
+        std::cout << "Cleared " << stale.size() << " stale messages with a missing response\n";
+
+    // The callbacks get a failed response, a request_task waiting for one is resumed by it. Called
+    // after the loop, a callback may send a new request.
+    for (auto &message : stale) {
+        ResponseMessage failed(nullptr);
+        failed.id.type = RequestId::INT;
+        failed.id.value_int = message.first;
+        failed.error = ResponseError(ErrorCode::RequestCancelled, "The client did not answer the request");
+        message.second(failed, this, &this->active_project);
+    }
 }
 
 void Connection::default_reporting_message_handler(const ResponseMessage &msg, Connection *, project *) {
@@ -184,10 +206,37 @@ void Connection::send(const QByteArray &data) {
 #endif
 }
 
+void Connection::send_frame(uint64_t stream, uint64_t offset, const char *data, size_t size) {
+    QByteArray headerbuf;
+    headerbuf.append("Content-Length: ")
+        .append(QString::number(static_cast<qint64>(size)).toUtf8())
+        .append("\r\nContent-Type: application/vnd.openscad.mesh-frame\r\nMesh-Stream: ")
+        .append(QString::number(static_cast<qint64>(stream)).toUtf8())
+        .append("\r\nMesh-Offset: ")
+        .append(QString::number(static_cast<qint64>(offset)).toUtf8())
+        .append("\r\n\r\n");
+    this->socket->write(headerbuf);
+    // Copied into the socket buffer straight from the render output
+    this->socket->write(data, static_cast<qint64>(size));
+#ifdef DEBUG_MESSAGETRAFFIC
+    std::cout << "SENDING: [" << size << "]: mesh frame " << stream << " at " << offset << "\n";
+#endif
+}
+
+size_t Connection::unsent_bytes() const {
+    return static_cast<size_t>(this->socket->bytesToWrite());
+}
+
+bool Connection::is_local() const {
+    return this->socket->peerAddress().isLoopback();
+}
+
 void Connection::send(ResponseMessage &msg, const RequestId &id) {
     if (!msg.id.is_set())
         msg.id = id;
 
+    if (this->collect(msg.id, msg)) return;
+
     QByteArray responsebuffer;
     decode_env env(storage_direction::WRITE);
     env.store(&responsebuffer, msg);
@@ -218,6 +267,18 @@ void Connection::send(RequestMessage &msg, const std::string &method, const Requ
     this->send(responsebuffer);
 }
 
+void Connection::send_notification(RequestMessage &msg, const std::string &method) {
+    msg.id.type = RequestId::UNSET;
+    if (msg.method.empty()) {
+        msg.method = method;
+    }
+
+    QByteArray buffer;
+    decode_env env(storage_direction::WRITE);
+    env.store(&buffer, msg);
+
+    this->send(buffer);
+}
 
 void Connection::send(ResponseResult &result, const RequestId &id) {
     ResponseMessage msg(result);
@@ -240,3 +301,150 @@ void Connection::send(ResponseError &&error, const RequestId &id) {
     msg.error = error;
     this->send(msg, id);
 }
+
+// Ids of other types are not collected
+static std::string batch_key(const RequestId &id) {
+    switch (id.type) {
+    case RequestId::INT:
+        return "i" + std::to_string(id.value_int);
+    case RequestId::STRING:
+        return "s" + id.value_str;
+    default:
+        return {};
+    }
+}
+
+// An element whose id is used by an earlier one of the batch is answered with an error here
+std::shared_ptr<Connection::response_batch> Connection::begin_batch(const std::vector<RequestId> &ids) {
+    auto batch = std::make_shared<response_batch>();
+    batch->replies.resize(ids.size());
+
+    // Earlier batches only waiting for a request whose id is used again
+    std::vector<std::shared_ptr<response_batch>> given_up;
+    {
+        std::lock_guard<std::mutex> lock(this->batch_mutex);
+        for (size_t i = 0; i < ids.size(); i++) {
+            std::string key = batch_key(ids[i]);
+            if (key.empty()) continue;
+            auto inserted = this->batch_requests.emplace(key, std::make_pair(batch, i));
+            if (!inserted.second) {
+                std::pair<std::shared_ptr<response_batch>, size_t> &earlier = inserted.first->second;
+                if (earlier.first == batch) {
+                    // The answers could not be told apart
+                    ResponseMessage msg(nullptr);
+                    msg.id = ids[i];
+                    msg.error = ResponseError(ErrorCode::InvalidRequest, "Request id used twice in the batch");
+                    decode_env env(storage_direction::WRITE);
+                    batch->replies[i] = env.store(msg);
+                    continue;
+                }
+                if (--earlier.first->missing == 0) given_up.push_back(earlier.first);
+                earlier = {batch, i};
+            }
+            batch->missing++;
+        }
+    }
+
+    for (const std::shared_ptr<response_batch> &earlier : given_up) {
+        this->send_batch(*earlier);
+    }
+    return batch;
+}
+
+void Connection::answer_batch(response_batch &batch, size_t element, ResponseError &&error) {
+    ResponseMessage msg(nullptr);
+    msg.error = error;
+    decode_env env(storage_direction::WRITE);
+    QJsonObject reply = env.store(msg);
+
+    std::lock_guard<std::mutex> lock(this->batch_mutex);
+    batch.replies[element] = std::move(reply);
+}
+
+void Connection::end_batch(response_batch &batch) {
+    bool complete;
+    {
+        std::lock_guard<std::mutex> lock(this->batch_mutex);
+        complete = --batch.missing == 0;
+    }
+    if (complete) this->send_batch(batch);
+}
+
+void Connection::batch_element(response_batch *batch, size_t element, bool notification) {
+    std::lock_guard<std::mutex> lock(this->batch_mutex);
+    this->unnamed_batch = batch;
+    this->unnamed_element = element;
+    this->unnamed_notification = notification;
+}
+
+void Connection::settle_batch(response_batch &batch, const RequestId &id) {
+    std::lock_guard<std::mutex> lock(this->batch_mutex);
+    auto it = this->batch_requests.find(batch_key(id));
+    if (it == this->batch_requests.end() || it->second.first.get() != &batch) return;
+    const size_t element = it->second.second;
+    this->batch_requests.erase(it);
+
+    ResponseMessage msg(nullptr);
+    msg.id = id;
+    decode_env env(storage_direction::WRITE);
+    batch.replies[element] = env.store(msg);
+    // Still dispatched, so this is not the last answer
+    batch.missing--;
+}
+
+void Connection::leave_batch(response_batch &batch, const RequestId &id) {
+    std::lock_guard<std::mutex> lock(this->batch_mutex);
+    auto it = this->batch_requests.find(batch_key(id));
+    if (it == this->batch_requests.end() || it->second.first.get() != &batch) return;
+    this->batch_requests.erase(it);
+    // Still dispatched, so this is not the last answer
+    batch.missing--;
+}
+
+bool Connection::collect(const RequestId &id, ResponseMessage &msg) {
+    std::string key = batch_key(id);
+    if (key.empty()) {
+        // Only on this thread while an element is dispatched, which keeps the batch from completing
+        std::lock_guard<std::mutex> lock(this->batch_mutex);
+        if (!this->unnamed_batch) return false;
+        if (this->unnamed_notification) return true;
+        decode_env env(storage_direction::WRITE);
+        this->unnamed_batch->replies[this->unnamed_element] = env.store(msg);
+        return true;
+    }
+
+    std::shared_ptr<response_batch> batch;
+    size_t element;
+    {
+        std::lock_guard<std::mutex> lock(this->batch_mutex);
+        auto it = this->batch_requests.find(key);
+        if (it == this->batch_requests.end()) return false;
+        batch = std::move(it->second.first);
+        element = it->second.second;
+        this->batch_requests.erase(it);
+    }
+
+    // Outside of the lock, the answers of a batch processed in parallel are written in parallel
+    decode_env env(storage_direction::WRITE);
+    QJsonObject reply = env.store(msg);
+
+    bool complete;
+    {
+        std::lock_guard<std::mutex> lock(this->batch_mutex);
+        batch->replies[element] = std::move(reply);
+        complete = --batch->missing == 0;
+    }
+    if (complete) this->send_batch(*batch);
+    return true;
+}
+
+void Connection::send_batch(const response_batch &batch) {
+    QJsonArray replies;
+    for (const QJsonObject &reply : batch.replies) {
+        if (!reply.isEmpty()) replies.append(reply);
+    }
+    // Only notifications, JSON-RPC sends nothing back
+    if (replies.isEmpty()) return;
+
+    this->send(QJsonDocument(replies).toJson(QJsonDocument::JsonFormat::Compact));
+}
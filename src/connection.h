@@ -2,11 +2,27 @@
 
 #include "project.h"
 #include "lsp.h"
-
+#include "mesh_channel.h"
+#include "mesh_export.h"
+#include "mesh_pick.h"
+#include "render_pool.h"
+#include "render_progress.h"
+#include "request_task.h"
+#include "workspace.h"
+
+#include <QJsonObject>
 #include <QObject>
 
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
+#include <vector>
+
+// Defined, every message received, sent and handled is printed. The lines of the requests of a
+// batch processed in parallel interleave.
+// #define DEBUG_MESSAGETRAFFIC
 
 class QTcpSocket;
 
@@ -36,6 +52,9 @@ public:
             const RequestId &id,
             request_callback_t = &Connection::default_reporting_message_handler);
 
+    // Notifications have no id and get no response
+    void send_notification(RequestMessage &message, const std::string &method);
+
     void send(ResponseMessage &message, const RequestId &id);
     void send(ResponseResult &result, const RequestId &id);
     void send(ResponseError &error, const RequestId &id);
@@ -44,14 +63,62 @@ public:
     void send(ResponseResult &&result, const RequestId &id);
     void send(ResponseError &&error, const RequestId &id);
 
-    // to be called on a regular basis to avoid overfilling the pending messages buffer
+    // The answers to the requests of a JSON-RPC batch, sent as one array once all are there
+    struct response_batch {
+        // One per element of the batch, empty for the elements that get no answer
+        std::vector<QJsonObject> replies;
+        // Answers still missing, one more until the batch is dispatched
+        size_t missing = 1;
+    };
+
+    // Collects the answers to the requests with these ids instead of sending them, one id per
+    // element of the batch and unset for notifications
+    std::shared_ptr<response_batch> begin_batch(const std::vector<RequestId> &ids);
+    // Answers an element that is no request, so it has no id to collect the answer by
+    void answer_batch(response_batch &batch, size_t element, ResponseError &&error);
+    // Answers sent without an id go into this element of the batch until it is called with
+    // nullptr. Those of a notification are dropped, JSON-RPC does not answer notifications.
+    void batch_element(response_batch *batch, size_t element, bool notification = false);
+    // A request of the batch that did not answer while it was processed gets a null result
+    void settle_batch(response_batch &batch, const RequestId &id);
+    // The request is answered on its own, as soon as its answer is there
+    void leave_batch(response_batch &batch, const RequestId &id);
+    // All elements are dispatched, the batch is sent when the last answer is there
+    void end_batch(response_batch &batch);
+
+    // Requests to the client older than this are given up, their callbacks get a RequestCancelled
+    static constexpr std::chrono::seconds PENDING_TIMEOUT{30};
+
+    // Called by a timer, to avoid overfilling the pending messages buffer
     void clean_pending_messages(const std::chrono::system_clock::duration &max_age);
     void handle_pending_response(const ResponseMessage &msg);
 
+    // A binary frame of a mesh stream, see mesh_channel
+    void send_frame(uint64_t stream, uint64_t offset, const char *data, size_t size);
+    // Written to the socket but not sent yet
+    size_t unsent_bytes() const;
+    // The client is on this machine
+    bool is_local() const;
+
     void close();
     bool is_done();
 
     project active_project;
+    // Declared behind the project, so its threads are stopped before the project goes away
+    workspace_indexer indexer;
+    // Render workers of this connection, their callbacks use the project as well
+    render_pool renderer;
+    // Meshes of render results that are not sent as JSON
+    mesh_channel meshes;
+    // Writes the exports of render requests, on a thread of its own
+    mesh_exporter exporter;
+    // Renders with a time budget, declared behind the pool whose jobs it cancels
+    render_progress refinements;
+    // Ray picks on rendered models, builds their hierarchies on a thread of its own
+    pick_cache picks;
+    // Request handlers suspended as coroutines, declared last so they are unwound while
+    // everything they use is still there
+    task_runner tasks;
 
 private slots:
     void onReadyRead();
@@ -77,6 +144,19 @@ protected:
 protected:
     virtual void send(const QByteArray &buffer);
 
+    // Takes the answer if its request is part of a batch. Requests of a batch are answered on
+    // worker threads as well, those never send the batch as it is not dispatched yet.
+    bool collect(const RequestId &id, ResponseMessage &msg);
+    void send_batch(const response_batch &batch);
+
+    std::mutex batch_mutex;
+    // Batch and element of the requests whose answers are collected, by batch_key
+    std::unordered_map<std::string, std::pair<std::shared_ptr<response_batch>, size_t>> batch_requests;
+    // Set by batch_element
+    response_batch *unnamed_batch = nullptr;
+    size_t unnamed_element = 0;
+    bool unnamed_notification = false;
+
 
     struct pending_message {
         pending_message(const request_callback_t &callback) :
@@ -1,6 +1,12 @@
 #include "connection_handler.h"
 #include "connection.h"
 #include "messages.h"
+#include "task_pool.h"
+
+#include <QJsonDocument>
+
+#include <utility>
+#include <vector>
 
 ConnectionHandler::ConnectionHandler(QObject *parent, uint16_t port) :
         QObject(parent)
@@ -38,14 +44,144 @@ void ConnectionHandler::onSocketStateChanged(QAbstractSocket::SocketState socket
 template <>
 bool decode_env::declare_field(JSONObject &object, RequestId &target, const FieldNameType &field);
 
+// Read only requests of batches. Apart from the render threads, the connection thread helps
+// with the tasks of the pool while it waits and must not pick up a geometry build there.
+static task_pool &batch_threads() {
+    static task_pool threads;
+    return threads;
+}
+
+void answer_failure(Connection *conn, const RequestId &id) {
+    try {
+        throw;
+    }
+    catch (std::unique_ptr<ResponseMessage> &msg) {
+#ifdef DEBUG_MESSAGETRAFFIC
+        std::cout << "Cought response message\n";
+#endif
+        conn->send(*msg, id);
+    }
+    catch (std::unique_ptr<ResponseError> &msg) {
+#ifdef DEBUG_MESSAGETRAFFIC
+        std::cout << "Cought error ptr message: " << msg->message << "\n";
+#endif
+        conn->send(*msg, id);
+    }
+    catch (ResponseError &msg) {
+#ifdef DEBUG_MESSAGETRAFFIC
+        std::cout << "Cought error message: " << msg.message << "\n";
+#endif
+        conn->send(msg, id);
+    }
+    catch(std::exception &err) {
+        std::cerr << "cought std::exception during message handling: " << err.what() << "\n";
+        conn->send(ResponseError(ErrorCode::InternalError, err.what()), id);
+    }
+    catch(...) {
+        conn->send(ResponseError(ErrorCode::InternalError, "Unspecified internal error"), id);
+    }
+}
+
 void ConnectionHandler::handle_message(const QByteArray &buffer, Connection *conn) {
+    QJsonDocument document;
+    try {
+        document = decode_env(buffer, storage_direction::READ).document;
+    }
+    catch (...) {
+        answer_failure(conn, {});
+        return;
+    }
+
+    if (document.isArray()) {
+        this->handle_batch(document.array(), conn);
+        return;
+    }
+
     // Convert to json and construct the message from it
     RequestId id;
+    std::unique_ptr<RequestMessage> msg = this->decode_message(document.object(), id, conn);
+    if (msg) this->process_message(*msg, id, conn);
+}
+
+void ConnectionHandler::handle_batch(const QJsonArray &elements, Connection *conn) {
+    if (elements.isEmpty()) {
+        conn->send(ResponseError(ErrorCode::InvalidRequest, "Empty batch"), {});
+        return;
+    }
+
+    // The ids first, so that the answers sent while the batch is dispatched are collected. The
+    // responses of the client in a batch get no answer.
+    std::vector<RequestId> ids(elements.size());
+    for (int i = 0; i < elements.size(); i++) {
+        QJsonObject root = elements[i].toObject();
+        if (root.contains("result") || root.contains("error")) continue;
+        decode_env env(root);
+        EncapsulatedObjectRef wrapper(root, storage_direction::READ);
+        env.declare_field_default(wrapper, ids[i], "id", {});
+    }
+    std::shared_ptr<Connection::response_batch> batch = conn->begin_batch(ids);
+
+    // Read only requests in a row, processed together on threads of their own. The elements
+    // around them may change the project, so they are processed in order on this thread.
+    std::vector<std::pair<std::unique_ptr<RequestMessage>, RequestId>> run;
+    auto flush = [&] {
+        if (run.size() == 1) {
+            this->process_message(*run[0].first, run[0].second, conn);
+        } else if (run.size() > 1) {
+            batch_threads().parallel_for(run.size(), [&](size_t i) {
+                this->process_message(*run[i].first, run[i].second, conn);
+            });
+        }
+        for (const auto &request : run) conn->settle_batch(*batch, request.second);
+        run.clear();
+    };
+
+    for (int i = 0; i < elements.size(); i++) {
+        // An id used twice in the batch was answered already
+        if (!batch->replies[i].isEmpty()) continue;
+        if (!elements[i].isObject()) {
+            conn->answer_batch(*batch, i, ResponseError(ErrorCode::InvalidRequest, "Batch element is no object"));
+            continue;
+        }
+
+        // The errors of elements whose id can't be read are answered in the batch as well, those
+        // of notifications not at all
+        const QJsonObject element = elements[i].toObject();
+        const bool notification = element.contains("method") && !element.contains("id");
+        RequestId id;
+        conn->batch_element(batch.get(), i, notification);
+        std::unique_ptr<RequestMessage> msg = this->decode_message(element, id, conn);
+        conn->batch_element(nullptr, 0);
+        if (!msg) {
+            conn->settle_batch(*batch, id);
+            continue;
+        }
+        if (msg->answered_alone()) conn->leave_batch(*batch, id);
+        // Notifications of a worker would be written to the socket right away
+        if (msg->read_only() && id.is_set()) {
+            run.emplace_back(std::move(msg), id);
+            continue;
+        }
+        flush();
+        conn->batch_element(batch.get(), i, notification);
+        this->process_message(*msg, id, conn);
+        conn->batch_element(nullptr, 0);
+        // Requests like initialized or didOpen sent with an id answer nothing, they must not hold
+        // back the batch
+        conn->settle_batch(*batch, id);
+    }
+    flush();
+
+    conn->end_batch(*batch);
+}
+
+std::unique_ptr<RequestMessage> ConnectionHandler::decode_message(const QJsonObject &object, RequestId &id,
+                                                                  Connection *conn) {
     std::string method;
 
     try {
-        decode_env env(buffer, storage_direction::READ);
-        auto root = env.document.object();
+        decode_env env(object);
+        auto root = object;
         {
             EncapsulatedObjectRef wrapper(root, storage_direction::READ);
             env.declare_field_default(wrapper, id, "id", {});
@@ -64,43 +200,38 @@ void ConnectionHandler::handle_message(const QByteArray &buffer, Connection *con
                         env.declare_field(wrapper, msg, "");
                     }
                     conn->handle_pending_response(msg);
-                    return;
+                    return nullptr;
                 } else {
                     std::cout << "ERROR: No Method!\n";
                     conn->send(ResponseError(ErrorCode::InvalidRequest, "No Method given"), id);
-                    return;
+                    return nullptr;
                 }
             }
         }
 
+#ifdef DEBUG_MESSAGETRAFFIC
         std::cout << "Handling Message [id " << id.value()  << "] with method " << method << "\n";
+#endif
         auto it = this->typemap.find(method);
         if (it == this->typemap.end()) {
             std::cerr << "Not defined method requested " << method << "\n";
             conn->send(ResponseError(ErrorCode::MethodNotFound, std::string("Method [") + method + "] not implemented"), id);
-            return;
+            return nullptr;
         } else {
-            auto decoded_msg = it->second(env);
-            decoded_msg->process(conn, &conn->active_project, id);
+            return it->second(env);
         }
     }
-    catch (std::unique_ptr<ResponseMessage> &msg) {
-        std::cout << "Cought response message\n";
-        conn->send(*msg, id);
+    catch (...) {
+        answer_failure(conn, id);
     }
-    catch (std::unique_ptr<ResponseError> &msg) {
-        std::cout << "Cought error ptr message: " << msg->message << "\n";
-        conn->send(*msg, id);
-    }
-    catch (ResponseError &msg) {
-        std::cout << "Cought error message: " << msg.message << "\n";
-        conn->send(msg, id);
+    return nullptr;
+}
+
+void ConnectionHandler::process_message(RequestMessage &msg, const RequestId &id, Connection *conn) {
+    try {
+        msg.process(conn, &conn->active_project, id);
     }
-    catch(std::exception &err) {
-        std::cerr << "cought std::exception during message handling: " << err.what() << "\n";
-        conn->send(ResponseError(ErrorCode::InternalError, err.what()), {});
+    catch (...) {
+        answer_failure(conn, id);
     }
-    /*catch(...) {
-        conn->send(ResponseError(ErrorCode::InternalError, "Unspecified internal error"));
-    }*/
 }
@@ -9,6 +9,8 @@
 #include <string>
 #include <cstdint>
 
+#include <QJsonArray>
+#include <QJsonObject>
 #include <QObject>
 #include <QTcpServer>
 #include <QList>
@@ -17,6 +19,10 @@
 // Forward declare Connection in order to speed up compile times
 class Connection;
 
+// Answers the exception being handled, the handlers throw their error responses. Call it from a
+// catch block.
+void answer_failure(Connection *conn, const RequestId &id);
+
 class ConnectionHandler : public QObject {
 	Q_OBJECT
     /** This is the listener class which creates threads with Connections* running */
@@ -35,6 +41,11 @@ private:
     void register_messages();
     // Implemented in decoding.cc - needed for scoping of the decoding template magic.
     void handle_message(const QByteArray &, Connection *);
+    // The elements in order, runs of read only requests are processed in parallel
+    void handle_batch(const QJsonArray &, Connection *);
+    // nullptr if the message was answered already or is a response of the client
+    std::unique_ptr<RequestMessage> decode_message(const QJsonObject &object, RequestId &id, Connection *);
+    void process_message(RequestMessage &, const RequestId &id, Connection *);
 
 private:
 	// Since the message handling is single threaded
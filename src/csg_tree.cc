@@ -0,0 +1,666 @@
+#include "csg_tree.h"
+
+#include "task_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_set>
+
+namespace {
+
+using extruder = std::function<solid(const outline &)>;
+
+// Mixes the value into the state, the order of the values matters
+class hasher {
+public:
+    void add(uint64_t value) {
+        uint64_t x = state ^ value;
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        state = x ^ (x >> 31);
+    }
+    void add(double value) {
+        // -0 and 0 build the same
+        if (value == 0) value = 0;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        add(bits);
+    }
+    void add(const vec3 &v) {
+        add(v.x);
+        add(v.y);
+        add(v.z);
+    }
+
+    uint64_t value() const { return state; }
+
+private:
+    uint64_t state = 0x243f6a8885a308d3;
+};
+
+// Hashes every node once, modules share their subtrees between instances sometimes. Only
+// lookups are thread safe, the root has to be hashed before the threads start.
+class subtree_hasher {
+public:
+    uint64_t operator()(const csg_node &node) {
+        auto known = memo.find(&node);
+        if (known != memo.end()) return known->second;
+
+        hasher h;
+        h.add(static_cast<uint64_t>(node.type));
+        h.add(static_cast<uint64_t>(node.dimension));
+        h.add(node.size);
+        h.add(node.r1);
+        h.add(node.r2);
+        h.add(node.height);
+        h.add(static_cast<uint64_t>(node.fragments));
+        h.add(static_cast<uint64_t>(node.center));
+        h.add(static_cast<uint64_t>(node.points.size()));
+        for (const vec3 &p : node.points) h.add(p);
+        h.add(static_cast<uint64_t>(node.faces.size()));
+        for (const std::vector<uint32_t> &face : node.faces) {
+            h.add(static_cast<uint64_t>(face.size()));
+            for (uint32_t i : face) h.add(static_cast<uint64_t>(i));
+        }
+        for (const auto &row : node.matrix.m) {
+            for (double x : row) h.add(x);
+        }
+        for (bool axis : node.auto_size) h.add(static_cast<uint64_t>(axis));
+        // $fn, $fs and $fa only matter where geometry computes fragments, the primitives have theirs
+        if (node.type == csg_node::kind::linear_extrude || node.type == csg_node::kind::rotate_extrude) {
+            h.add(node.extrusion.height);
+            h.add(static_cast<uint64_t>(node.extrusion.center));
+            h.add(node.extrusion.twist);
+            h.add(static_cast<uint64_t>(node.extrusion.slices));
+            h.add(node.extrusion.scale.x);
+            h.add(node.extrusion.scale.y);
+            h.add(node.detail.fn);
+            h.add(node.detail.fs);
+            h.add(node.detail.fa);
+        }
+        h.add(static_cast<uint64_t>(node.children.size()));
+        for (const csg_node_ptr &child : node.children) h.add((*this)(*child));
+        return memo[&node] = h.value();
+    }
+
+private:
+    std::unordered_map<const csg_node *, uint64_t> memo;
+};
+
+// Primitives below every node. Counted for the whole tree before the build, the builders only read it.
+class primitive_counter {
+public:
+    uint32_t operator()(const csg_node &node) {
+        auto known = memo.find(&node);
+        if (known != memo.end()) return known->second;
+        uint32_t count = node.is_primitive() ? 1 : 0;
+        for (const csg_node_ptr &child : node.children) count += (*this)(*child);
+        return memo[&node] = count;
+    }
+
+private:
+    std::unordered_map<const csg_node *, uint32_t> memo;
+};
+
+// Shared by the builders of one render
+struct build_state {
+    geometry_cache *cache = nullptr;
+    task_pool *tasks = nullptr;
+    bool preview = false;
+    subtree_hasher hash;
+    primitive_counter primitives;
+};
+
+// Polyhedra with more faces are shown as their bounding box in previews
+constexpr size_t PREVIEW_MAX_FACES = 256;
+
+/**
+ * Builds a tree, the children of an operation in parallel if there is a task pool. Every child
+ * is built by a builder of its own and its warnings are added in the order of the children, the
+ * solids are combined in that order as well. So the result is the same as a serial build.
+ *
+ * The part of a polygon is the primitive it comes from, counted depth first from the first
+ * primitive of the subtree that was built. Equal subtrees number their parts the same, so a
+ * cached solid fits wherever its subtree appears. A parent renumbers the parts of a child by the
+ * primitives of the children before it.
+ */
+class geometry_builder {
+public:
+    // Without warnings the builder only collects what was raised, for its parent
+    geometry_builder(build_state &state, std::vector<std::string> *warnings) : warnings(warnings), state(state) {}
+
+    solid_ptr build(const csg_node &node) {
+        switch (node.type) {
+        case csg_node::kind::difference:
+        case csg_node::kind::intersection:
+        case csg_node::kind::linear_extrude:
+        case csg_node::kind::rotate_extrude:
+            if (state.cache) return remember(state.hash(node), [&] { return build_node(node); });
+            [[fallthrough]];
+        default:
+            return build_node(node);
+        }
+    }
+
+    // The cache entry building the node creates, 0 if it does not create one
+    uint64_t cache_key(const csg_node &node) {
+        if (node.dimension == 2) return 0;
+        switch (node.type) {
+        case csg_node::kind::difference:
+        case csg_node::kind::intersection:
+        case csg_node::kind::linear_extrude:
+        case csg_node::kind::rotate_extrude:
+            return state.hash(node);
+        case csg_node::kind::transform:
+        case csg_node::kind::group:
+        case csg_node::kind::resize:
+            return node.children.size() > 1 ? union_key(node.children) : 0;
+        default:
+            return 0;
+        }
+    }
+
+    // Everything raised, without removing repetitions
+    std::vector<std::string> raised;
+
+private:
+    // Marks the union of a list of children, as opposed to a group node
+    static constexpr uint64_t UNION_TAG = 0x756e696f6e;
+
+    template <typename F>
+    solid_ptr remember(uint64_t key, F &&make) {
+        solid_ptr geometry;
+        std::vector<std::string> own;
+        if (state.cache->find(key, geometry, own)) {
+            for (const std::string &warning : own) warn(warning);
+            return geometry;
+        }
+        const size_t mark = raised.size();
+        geometry = make();
+        for (size_t i = mark; i < raised.size(); i++) {
+            if (std::find(own.begin(), own.end(), raised[i]) == own.end()) own.push_back(raised[i]);
+        }
+        state.cache->store(key, geometry, std::move(own));
+        return geometry;
+    }
+
+    // make(builder, i) builds part i with the given builder
+    template <typename F>
+    std::vector<solid_ptr> build_parts(size_t count, F &&make) {
+        std::vector<solid_ptr> parts(count);
+        if (!state.tasks || count < 2) {
+            for (size_t i = 0; i < count; i++) parts[i] = make(*this, i);
+            return parts;
+        }
+        std::vector<std::vector<std::string>> logs(count);
+        state.tasks->parallel_for(count, [&](size_t i) {
+            geometry_builder part(state, nullptr);
+            parts[i] = make(part, i);
+            logs[i] = std::move(part.raised);
+        });
+        for (const std::vector<std::string> &log : logs) {
+            for (const std::string &warning : log) warn(warning);
+        }
+        return parts;
+    }
+
+    std::vector<solid_ptr> build_children(const std::vector<csg_node_ptr> &children) {
+        std::vector<solid_ptr> parts = build_parts(children.size(), [&children](geometry_builder &builder, size_t i) {
+            return builder.build(*children[i]);
+        });
+        renumber(children, parts);
+        return parts;
+    }
+
+    // Counts the parts of every solid from the first primitive of the list of children
+    void renumber(const std::vector<csg_node_ptr> &children, std::vector<solid_ptr> &parts) {
+        uint32_t first = 0;
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (first > 0 && !parts[i]->empty()) {
+                auto moved = std::make_shared<solid>(*parts[i]);
+                for (polygon &p : moved->polygons) p.part += first;
+                parts[i] = std::move(moved);
+            }
+            first += state.primitives(*children[i]);
+        }
+    }
+
+    solid_ptr build_node(const csg_node &node) {
+        if (node.dimension == 2) {
+            warn("2D objects are only rendered inside linear_extrude or rotate_extrude");
+            return std::make_shared<solid>();
+        }
+
+        switch (node.type) {
+        case csg_node::kind::cube:
+            return std::make_shared<solid>(make_cube(node.size, node.center));
+        case csg_node::kind::sphere:
+            return std::make_shared<solid>(make_sphere(node.r1, node.fragments));
+        case csg_node::kind::cylinder:
+            return std::make_shared<solid>(make_cylinder(node.height, node.r1, node.r2, node.fragments, node.center));
+        case csg_node::kind::polyhedron:
+            if (state.preview && node.faces.size() > PREVIEW_MAX_FACES) return bounding_proxy(node.points);
+            return std::make_shared<solid>(make_polyhedron(node.points, node.faces));
+        case csg_node::kind::transform: {
+            solid_ptr child = build_union(node.children);
+            if (node.matrix.is_identity() || child->empty()) return child;
+            auto result = std::make_shared<solid>(*child);
+            result->transform(node.matrix);
+            return result;
+        }
+        case csg_node::kind::difference:
+        case csg_node::kind::intersection: {
+            if (node.children.empty()) return std::make_shared<solid>();
+            // The first child is where the result can be at most
+            if (state.preview) return build(*node.children[0]);
+            const std::vector<solid_ptr> parts = build_children(node.children);
+            auto result = std::make_shared<solid>(*parts[0]);
+            for (size_t i = 1; i < parts.size(); i++) {
+                *result = node.type == csg_node::kind::difference ? csg_difference(*result, *parts[i])
+                                                                  : csg_intersection(*result, *parts[i]);
+            }
+            return result;
+        }
+        case csg_node::kind::resize:
+            return resize(node, build_union(node.children));
+        case csg_node::kind::linear_extrude:
+            return std::make_shared<solid>(build_linear_extrude(node));
+        case csg_node::kind::rotate_extrude:
+            return std::make_shared<solid>(build_rotate_extrude(node));
+        default:
+            return build_union(node.children);
+        }
+    }
+
+    solid_ptr build_union(const std::vector<csg_node_ptr> &children) {
+        if (children.size() == 1) return build(*children[0]);
+        auto make = [&] { return std::make_shared<const solid>(union_all(build_children(children))); };
+        if (!state.cache) return make();
+        return remember(union_key(children), make);
+    }
+
+    uint64_t union_key(const std::vector<csg_node_ptr> &children) {
+        hasher h;
+        h.add(UNION_TAG);
+        for (const csg_node_ptr &child : children) h.add(state.hash(*child));
+        return h.value();
+    }
+
+    /**
+     * Children that do not touch each other are only put together, the boolean operation is
+     * done for groups of overlapping children. Previews put all of them together.
+     */
+    solid union_all(const std::vector<solid_ptr> &solids) {
+        if (state.preview) {
+            solid result;
+            for (const solid_ptr &s : solids) {
+                result.polygons.insert(result.polygons.end(), s->polygons.begin(), s->polygons.end());
+            }
+            return result;
+        }
+        std::vector<solid> groups;
+        std::vector<bounding_box> bounds;
+        for (const solid_ptr &s : solids) {
+            if (s->empty()) continue;
+            solid merged = *s;
+            bounding_box box = s->bounds();
+            for (size_t i = groups.size(); i-- > 0;) {
+                if (!bounds[i].overlaps(box)) continue;
+                merged = csg_union(groups[i], merged);
+                box.extend(bounds[i]);
+                groups.erase(groups.begin() + i);
+                bounds.erase(bounds.begin() + i);
+            }
+            groups.emplace_back(std::move(merged));
+            bounds.push_back(box);
+        }
+        solid result;
+        for (solid &group : groups) {
+            std::move(group.polygons.begin(), group.polygons.end(), std::back_inserter(result.polygons));
+        }
+        return result;
+    }
+
+    solid_ptr resize(const csg_node &node, solid_ptr child) {
+        const bounding_box box = child->bounds();
+        if (box.empty()) return child;
+        const double current[3] = {box.max.x - box.min.x, box.max.y - box.min.y, box.max.z - box.min.z};
+        const double wanted[3] = {node.size.x, node.size.y, node.size.z};
+        double factor[3] = {1, 1, 1};
+        double common = 0;
+        for (int i = 0; i < 3; i++) {
+            if (wanted[i] > 0 && current[i] > 0) {
+                factor[i] = wanted[i] / current[i];
+                common = std::max(common, factor[i]);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            if (wanted[i] <= 0 && node.auto_size[i] && common > 0) factor[i] = common;
+        }
+        auto result = std::make_shared<solid>(*child);
+        result->transform(mat4::scaling({factor[0], factor[1], factor[2]}));
+        return result;
+    }
+
+    solid build_linear_extrude(const csg_node &node) {
+        linear_extrusion params = node.extrusion;
+        if (params.slices <= 0) {
+            // Like OpenSCAD, twisted extrusions get a slice for every fragment of the outermost point
+            params.slices = 1;
+            if (params.twist != 0) {
+                const double radius = max_radius(node, mat4(), false);
+                const int fragments = circle_fragments(radius, node.detail.fn, node.detail.fs, node.detail.fa);
+                params.slices = std::max(1, static_cast<int>(std::ceil(fragments * std::abs(params.twist) / 360)));
+            }
+        }
+        return extrude_children(node, [&params](const outline &shape) { return linear_extrude(shape, params); });
+    }
+
+    solid build_rotate_extrude(const csg_node &node) {
+        const double angle = node.extrusion.twist;
+        const double radius = max_radius(node, mat4(), true);
+        if (radius < 0) {
+            warn("rotate_extrude: all points must have the same X coordinate sign, "
+                 "X coordinates below zero are not supported");
+            return solid();
+        }
+        const int fragments = circle_fragments(radius, node.detail.fn, node.detail.fs, node.detail.fa);
+        return extrude_children(node, [angle, fragments](const outline &shape) {
+            return rotate_extrude(shape, angle, fragments);
+        });
+    }
+
+    solid extrude_children(const csg_node &node, const extruder &make) {
+        std::vector<solid_ptr> parts = build_parts(node.children.size(), [&](geometry_builder &builder, size_t i) {
+            return std::make_shared<const solid>(builder.extrude(*node.children[i], mat4(), make));
+        });
+        renumber(node.children, parts);
+        return union_all(parts);
+    }
+
+    std::vector<solid_ptr> extrude_all(const std::vector<csg_node_ptr> &children, const mat4 &matrix,
+                                       const extruder &make) {
+        std::vector<solid_ptr> parts;
+        for (const csg_node_ptr &child : children) {
+            parts.push_back(std::make_shared<solid>(extrude(*child, matrix, make)));
+        }
+        renumber(children, parts);
+        return parts;
+    }
+
+    // Extrusions commute with the boolean operations, each 2D primitive is extruded on its own
+    solid extrude(const csg_node &node, const mat4 &matrix, const extruder &make) {
+        if (node.dimension != 2) {
+            warn("Ignoring 3D child object of an extrusion");
+            return solid();
+        }
+        switch (node.type) {
+        case csg_node::kind::square:
+            return make(transformed(make_square({node.size.x, node.size.y}, node.center), matrix));
+        case csg_node::kind::circle:
+            return make(transformed(make_circle(node.r1, node.fragments), matrix));
+        case csg_node::kind::polygon: {
+            std::vector<outline> paths = polygon_paths(node);
+            if (paths.empty()) return solid();
+            // The first path is the outline, the others are holes in it
+            solid result = make(transformed(paths[0], matrix));
+            for (size_t i = 1; i < paths.size() && !state.preview; i++) {
+                result = csg_difference(result, make(transformed(paths[i], matrix)));
+            }
+            return result;
+        }
+        case csg_node::kind::transform:
+            return union_all(extrude_all(node.children, matrix * node.matrix, make));
+        case csg_node::kind::difference:
+        case csg_node::kind::intersection: {
+            if (node.children.empty()) return solid();
+            if (state.preview) return extrude(*node.children[0], matrix, make);
+            const std::vector<solid_ptr> parts = extrude_all(node.children, matrix, make);
+            solid result = *parts[0];
+            for (size_t i = 1; i < parts.size(); i++) {
+                result = node.type == csg_node::kind::difference ? csg_difference(result, *parts[i])
+                                                                  : csg_intersection(result, *parts[i]);
+            }
+            return result;
+        }
+        default:
+            return union_all(extrude_all(node.children, matrix, make));
+        }
+    }
+
+    static solid_ptr bounding_proxy(const std::vector<vec3> &points) {
+        bounding_box box;
+        for (const vec3 &p : points) box.extend(p);
+        if (box.empty()) return std::make_shared<solid>();
+        auto proxy = std::make_shared<solid>(make_cube(box.max - box.min, false));
+        proxy->transform(mat4::translation(box.min));
+        return proxy;
+    }
+
+    static std::vector<outline> polygon_paths(const csg_node &node) {
+        std::vector<outline> paths;
+        if (node.faces.empty()) {
+            outline shape;
+            for (const vec3 &p : node.points) shape.push_back({p.x, p.y});
+            paths.push_back(std::move(shape));
+            return paths;
+        }
+        for (const std::vector<uint32_t> &path : node.faces) {
+            outline shape;
+            for (uint32_t i : path) {
+                if (i < node.points.size()) shape.push_back({node.points[i].x, node.points[i].y});
+            }
+            paths.push_back(std::move(shape));
+        }
+        return paths;
+    }
+
+    static outline transformed(outline shape, const mat4 &matrix) {
+        for (vec2 &p : shape) {
+            const vec3 q = matrix.apply({p.x, p.y, 0});
+            p = {q.x, q.y};
+        }
+        return shape;
+    }
+
+    /**
+     * Largest distance of a 2D point from the origin, or with x_only the largest X coordinate.
+     * -1 if x_only and some point has a negative X coordinate.
+     */
+    double max_radius(const csg_node &node, const mat4 &matrix, bool x_only) {
+        double radius = 0;
+        auto visit = [&](const outline &shape) {
+            for (const vec2 &p : shape) {
+                if (x_only && p.x < -1e-9) radius = -HUGE_VAL;
+                radius = std::max(radius, x_only ? p.x : std::hypot(p.x, p.y));
+            }
+        };
+        switch (node.type) {
+        case csg_node::kind::square:
+            visit(transformed(make_square({node.size.x, node.size.y}, node.center), matrix));
+            break;
+        case csg_node::kind::circle:
+            visit(transformed(make_circle(node.r1, node.fragments), matrix));
+            break;
+        case csg_node::kind::polygon:
+            for (const outline &path : polygon_paths(node)) visit(transformed(path, matrix));
+            break;
+        default:
+            for (const csg_node_ptr &child : node.children) {
+                if (child->dimension != 2) continue;
+                const double r = max_radius(*child, node.type == csg_node::kind::transform ? matrix * node.matrix : matrix,
+                                            x_only);
+                if (r < 0) return -1;
+                radius = std::max(radius, r);
+            }
+            break;
+        }
+        return radius < 0 ? -1 : radius;
+    }
+
+    // Every warning goes into the render once, but a cached subtree remembers all it raised
+    void warn(const std::string &message) {
+        raised.push_back(message);
+        if (warnings && reported.insert(message).second) warnings->push_back(message);
+    }
+
+    std::vector<std::string> *warnings;
+    std::unordered_set<std::string> reported;
+
+    build_state &state;
+};
+
+} // namespace
+
+const char *kind_name(csg_node::kind kind) {
+    switch (kind) {
+    case csg_node::kind::cube: return "cube";
+    case csg_node::kind::sphere: return "sphere";
+    case csg_node::kind::cylinder: return "cylinder";
+    case csg_node::kind::polyhedron: return "polyhedron";
+    case csg_node::kind::square: return "square";
+    case csg_node::kind::circle: return "circle";
+    case csg_node::kind::polygon: return "polygon";
+    case csg_node::kind::transform: return "multmatrix";
+    case csg_node::kind::group: return "group";
+    case csg_node::kind::difference: return "difference";
+    case csg_node::kind::intersection: return "intersection";
+    case csg_node::kind::resize: return "resize";
+    case csg_node::kind::linear_extrude: return "linear_extrude";
+    case csg_node::kind::rotate_extrude: return "rotate_extrude";
+    }
+    return "?";
+}
+
+uint64_t subtree_hash(const csg_node &node) {
+    return subtree_hasher()(node);
+}
+
+void collect_primitives(const csg_node &root, std::vector<const csg_node *> &primitives) {
+    if (root.is_primitive()) primitives.push_back(&root);
+    for (const csg_node_ptr &child : root.children) collect_primitives(*child, primitives);
+}
+
+///////////////////////////////////////////////////////////
+// geometry_cache
+///////////////////////////////////////////////////////////
+
+bool geometry_cache::find(uint64_t hash, solid_ptr &geometry, std::vector<std::string> &warnings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (it == entries.end()) {
+        counters.misses++;
+        return false;
+    }
+    recent.splice(recent.begin(), recent, it->second);
+    geometry = it->second->geometry;
+    warnings = it->second->warnings;
+    counters.hits++;
+    return true;
+}
+
+void geometry_cache::store(uint64_t hash, solid_ptr geometry, std::vector<std::string> warnings) {
+    size_t bytes = sizeof(entry) + geometry->memory_size();
+    for (const std::string &warning : warnings) bytes += sizeof(std::string) + warning.capacity();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (it != entries.end()) {
+        counters.bytes -= it->second->bytes;
+        recent.erase(it->second);
+        entries.erase(it);
+    }
+    if (bytes <= memory_limit) {
+        recent.push_front({hash, std::move(geometry), std::move(warnings), bytes});
+        entries[hash] = recent.begin();
+        counters.bytes += bytes;
+    }
+    while (counters.bytes > memory_limit && !recent.empty()) {
+        counters.bytes -= recent.back().bytes;
+        entries.erase(recent.back().hash);
+        recent.pop_back();
+        counters.evictions++;
+    }
+    counters.entries = entries.size();
+}
+
+namespace {
+
+// Counts how often the cache entries of a tree are used and how high their subtrees are
+class repeat_counter {
+public:
+    struct entry {
+        const csg_node *node = nullptr;
+        size_t height = 0;
+        size_t uses = 0;
+    };
+
+    explicit repeat_counter(geometry_builder &builder) : builder(builder) {}
+
+    size_t visit(const csg_node &node) {
+        auto known = heights.find(&node);
+        if (known == heights.end()) {
+            size_t height = 0;
+            for (const csg_node_ptr &child : node.children) height = std::max(height, visit(*child) + 1);
+            known = heights.emplace(&node, height).first;
+        }
+        if (const uint64_t key = builder.cache_key(node)) {
+            entry &e = entries[key];
+            e.node = &node;
+            e.height = known->second;
+            e.uses++;
+        }
+        return known->second;
+    }
+
+    std::unordered_map<uint64_t, entry> entries;
+
+private:
+    geometry_builder &builder;
+    std::unordered_map<const csg_node *, size_t> heights;
+};
+
+/**
+ * With threads, instances of a module would be built by several threads at once before the first
+ * one is in the cache. So subtrees used more than once are built first, the lowest ones first,
+ * and all subtrees of the same height in parallel. Waiting for another thread building the same
+ * subtree instead could deadlock, a waiting thread runs other tasks on top of its stack.
+ */
+void build_repeated(build_state &state, const csg_node &root) {
+    geometry_builder scratch(state, nullptr);
+    repeat_counter counter(scratch);
+    counter.visit(root);
+
+    std::vector<std::pair<size_t, const csg_node *>> repeated;
+    for (const auto &e : counter.entries) {
+        if (e.second.uses > 1) repeated.emplace_back(e.second.height, e.second.node);
+    }
+    std::sort(repeated.begin(), repeated.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    for (size_t begin = 0; begin < repeated.size();) {
+        size_t end = begin;
+        while (end < repeated.size() && repeated[end].first == repeated[begin].first) end++;
+        // The warnings come again from the cache when the tree is built
+        state.tasks->parallel_for(end - begin, [&](size_t i) {
+            geometry_builder(state, nullptr).build(*repeated[begin + i].second);
+        });
+        begin = end;
+    }
+}
+
+} // namespace
+
+solid_ptr build_geometry(const csg_node &root, std::vector<std::string> &warnings, const build_options &options) {
+    build_state state;
+    // Previews differ from the real solids, they are not cached
+    state.cache = options.preview ? nullptr : options.cache;
+    state.tasks = options.tasks;
+    state.preview = options.preview;
+    state.primitives(root);
+    if (state.cache) {
+        state.hash(root);
+        if (state.tasks && state.tasks->thread_count() > 0) build_repeated(state, root);
+    }
+    return geometry_builder(state, &warnings).build(root);
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "geometry.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class task_pool;
+struct csg_node;
+using csg_node_ptr = std::shared_ptr<const csg_node>;
+
+// Bytes [begin, end) of a file of the render, the index into the sources given to the evaluator
+struct source_span {
+    uint32_t file = 0;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+};
+
+// $fn, $fs and $fa where a node was instantiated, some nodes only know their size in geometry
+struct resolution {
+    double fn = 0;
+    double fs = 2;
+    double fa = 12;
+};
+
+/**
+ * What evaluating a SCAD document produces: the primitives with their parameters resolved, and
+ * the transformations and boolean operations around them. Modules, loops and expressions are
+ * gone. Turning the tree into geometry is the expensive part of a render.
+ *
+ * 2D shapes are only rendered as part of an extrusion, the extrusion is applied to every 2D
+ * primitive below it and the boolean operations between them are done in 3D.
+ */
+struct csg_node {
+    enum class kind : uint8_t {
+        cube,
+        sphere,
+        cylinder,
+        polyhedron,
+        square,
+        circle,
+        polygon,
+        transform,
+        group,
+        difference,
+        intersection,
+        resize,
+        linear_extrude,
+        rotate_extrude,
+    };
+
+    kind type = kind::group;
+    uint8_t dimension = 3;
+
+    // Primitives: the size of cubes and squares, radii and height of spheres, cylinders and circles
+    vec3 size;
+    double r1 = 0;
+    double r2 = 0;
+    double height = 0;
+    int fragments = 0;
+    bool center = false;
+    // polyhedron points and faces, polygon points (z = 0) and paths
+    std::vector<vec3> points;
+    std::vector<std::vector<uint32_t>> faces;
+
+    // transform
+    mat4 matrix;
+    // resize: the new size and which axes scale with the others
+    bool auto_size[3] = {false, false, false};
+    // Extrusions, rotate_extrude takes its angle from twist
+    linear_extrusion extrusion;
+    resolution detail;
+
+    std::vector<csg_node_ptr> children;
+    // The module call that made the node, not part of the subtree_hash
+    source_span source;
+
+    bool is_primitive() const { return type <= kind::polygon; }
+};
+
+const char *kind_name(csg_node::kind kind);
+
+// Equal for subtrees that build the same solid, whatever module and arguments produced them
+uint64_t subtree_hash(const csg_node &node);
+
+// Depth first, the parts of the built solid index into them
+void collect_primitives(const csg_node &root, std::vector<const csg_node *> &primitives);
+
+struct geometry_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+/**
+ * Solids of subtrees by their subtree_hash, kept from one render to the next. Every instance
+ * of a module with the same arguments and special variables evaluates to the same subtree, so
+ * only the first one is built. After an edit only the subtrees that changed are built again.
+ *
+ * Only the boolean operations and extrusions are kept, primitives and transformations are cheap
+ * to build again. The least recently used solids are dropped beyond the memory limit.
+ * Thread safe.
+ */
+class geometry_cache {
+public:
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = size_t(256) << 20;
+
+    explicit geometry_cache(size_t memory_limit = DEFAULT_MEMORY_LIMIT) : memory_limit(memory_limit) {}
+
+    // The warnings are the ones building the subtree raised
+    bool find(uint64_t hash, solid_ptr &geometry, std::vector<std::string> &warnings);
+    void store(uint64_t hash, solid_ptr geometry, std::vector<std::string> warnings);
+
+    geometry_cache_stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+private:
+    struct entry {
+        uint64_t hash;
+        solid_ptr geometry;
+        std::vector<std::string> warnings;
+        size_t bytes;
+    };
+
+    // Most recently used first
+    std::list<entry> recent;
+    std::unordered_map<uint64_t, std::list<entry>::iterator> entries;
+    size_t memory_limit;
+    geometry_cache_stats counters;
+    mutable std::mutex mutex;
+};
+
+struct build_options {
+    geometry_cache *cache = nullptr;
+    // With a task pool the children of unions, differences, intersections and extrusions are
+    // built in parallel. The solid and the warnings are the same as without one.
+    task_pool *tasks = nullptr;
+    // Only puts the parts together: differences and intersections are their first child, polygons
+    // lose their holes and big polyhedra become their bounding box. Not cached.
+    bool preview = false;
+};
+
+/**
+ * Build the solid of a CSG tree. Every warning is reported once.
+ * The part of every polygon is the primitive it comes from, see collect_primitives.
+ */
+solid_ptr build_geometry(const csg_node &root, std::vector<std::string> &warnings,
+                         const build_options &options = build_options());
@@ -5,9 +5,13 @@
 
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QSysInfo>
 
 #include <assert.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
 #include <functional>
 #include <iostream>
 #include <utility>                                                  // for move
@@ -150,8 +154,8 @@ bool decode_env::declare_field(JSONObject &parent, TextDocumentItem &target, con
 template <>
 bool decode_env::declare_field(JSONObject &parent, TextDocumentContentChangeEvent &target, const FieldNameType &field) {
     auto object = start_object(parent, field);
-    //declare_field_optional(object, target.range, "range");
-    //declare_field_optional(object, target.rangeLength, "rangeLength");
+    declare_field_optional(object, target.range, "range");
+    declare_field_optional(object, target.rangeLength, "rangeLength");
     declare_field(object, target.text, "text");
     return true;
 }
@@ -216,6 +220,10 @@ bool decode_env::declare_field(JSONObject &object, ResponseMessage &target, cons
     std::string jsonprocversion = "2.0";
     declare_field(object, jsonprocversion, "jsonrpc");
     declare_field(object, target.id, "id");
+    if (this->dir == storage_direction::WRITE && target.id.type == RequestId::UNSET) {
+        // The answer to a request whose id could not be read, JSON-RPC wants the id anyway
+        object->insert("id", QJsonValue::Null);
+    }
 
     declare_field_optional(object, target.error, "error");
 
@@ -225,27 +233,61 @@ bool decode_env::declare_field(JSONObject &object, ResponseMessage &target, cons
     } else {
         if (target.use_result && target.result) {
 //            assert(target.result);
-            auto child = start_object(object, "result");
-            target.result->decode(*this, child, "result");
+            // The result decides itself whether it is stored as an object or an array
+            target.result->decode(*this, object, "result");
+        } else if (!target.error) {
+            // Requests like shutdown answer without a result of their own
+            object->insert("result", QJsonValue::Null);
         }
     }
 
-    if (!target.error && !(target.result || !target.use_result)) {
-        std::cerr << "Having a message with neither error nor result\n";
-    }
-
     return true;
 }
 
 template<>
 bool decode_env::declare_field(JSONObject &object, InitializeRequest &target, const FieldNameType &) {
-    // TODO
+    // rootUri and workspaceFolders may be null
+    declare_field(object, target.rootUri, "rootUri");
+    declare_field(object, target.rootPath, "rootPath");
+    declare_field_array(object, target.workspaceFolders, "workspaceFolders");
+    declare_field(object, target.capabilities, "capabilities");
+    auto options = start_object(object, "initializationOptions");
+    declare_field(options, target.renderCache, "renderCache");
+    declare_field(options, target.renderWorkers, "renderWorkers");
+    return true;
+}
 
+template<>
+bool decode_env::declare_field(JSONObject &parent, RenderWorkerOptions &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field_optional(object, target.count, "count");
+    declare_field_optional(object, target.cpuTimeLimit, "cpuTimeLimit");
+    declare_field_optional(object, target.memoryLimit, "memoryLimit");
     return true;
 }
 
 template<>
-bool decode_env::declare_field(JSONObject &object, InitializeResult &target, const FieldNameType &) {
+bool decode_env::declare_field(JSONObject &parent, RenderCacheOptions &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field_optional(object, target.directory, "directory");
+    declare_field_optional(object, target.memoryLimit, "memoryLimit");
+    declare_field_optional(object, target.diskLimit, "diskLimit");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, ClientCapabilities &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    auto window = start_object(object, "window");
+    declare_field(window, target.workDoneProgress, "workDoneProgress");
+    auto show_document = start_object(window, "showDocument");
+    declare_field(show_document, target.showDocument, "support");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, InitializeResult &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
     declare_field(object, target.capabilities, "capabilities");
     return true;
 }
@@ -257,9 +299,12 @@ bool decode_env::declare_field(JSONObject &object, ServerCapabilities &, const F
 
     object[field] = QJsonObject {
         {"hoverProvider", true},
+        {"definitionProvider", true},
+        {"referencesProvider", true},
+        {"workspaceSymbolProvider", true},
         {"textDocumentSync", QJsonObject {
                 {"openClose", true },
-                {"change", 1 }, // None = 0, Full = 1, Incremental = 2
+                {"change", 2 }, // None = 0, Full = 1, Incremental = 2
             },
         },
         {"window", QJsonObject {
@@ -303,7 +348,7 @@ bool decode_env::declare_field(JSONObject &object, DidOpenTextDocument &target,
 template<>
 bool decode_env::declare_field(JSONObject &object, DidChangeTextDocument &target, const FieldNameType &) {
     declare_field(object, target.textDocument, "textDocument");
-    declare_field(object, target.contentChanges, "contentChanges");
+    declare_field_array(object, target.contentChanges, "contentChanges");
     return true;
 }
 
@@ -327,7 +372,8 @@ bool decode_env::declare_field(JSONObject &object, TextDocumentHover &target, co
 }
 
 template<>
-bool decode_env::declare_field(JSONObject &object, HoverResponse &target, const FieldNameType &) {
+bool decode_env::declare_field(JSONObject &parent, HoverResponse &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
     declare_field(object, target.contents, "contents");
     declare_field(object, target.range, "range");
     return true;
@@ -348,6 +394,7 @@ bool decode_env::declare_field(JSONObject &parent, Diagnostic &target, const Fie
     declare_field(object, target.range, "range");
     declare_field(object, target.severity, "severity");
     declare_field(object, target.message, "message");
+    return true;
 }
 
 template<>
@@ -355,16 +402,319 @@ bool decode_env::declare_field(JSONObject &object, PublishDiagnosticsParams &tar
     declare_field(object, target.uri, "uri");
     declare_field_optional(object, target.version, "version");
     declare_field_array(object, target.diagnostics, "diagnostics");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, WorkDoneProgressCreateParams &target, const FieldNameType &) {
+    declare_field(object, target.token, "token");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, ProgressParams &target, const FieldNameType &) {
+    declare_field(object, target.token, "token");
+    declare_field(object, target.value, "value");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, WorkspaceSymbolRequest &target, const FieldNameType &) {
+    declare_field(object, target.query, "query");
+    return true;
 }
 
+// Results kept in columns are turned into their LSP struct one element at a time
+template <typename Results>
+static void write_columns(decode_env &env, JSONObject &object, const Results &results, const FieldNameType &field) {
+    QJsonArray array;
+    for (size_t i = 0; i < results.size(); i++) {
+        auto item = results.materialize(i);
+        QJsonObject holder;
+        {
+            JSONObject wrapper(holder, storage_direction::WRITE);
+            env.declare_field(wrapper, item, "");
+        }
+        array.append(holder.value(""));
+    }
+    object[field] = array;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, WorkspaceSymbolResult &target, const FieldNameType &field) {
+    if (this->dir == storage_direction::WRITE) {
+        write_columns(*this, object, target.symbols, field);
+        return true;
+    }
+    std::vector<SymbolInformation> symbols;
+    declare_field_array(object, symbols, field);
+    target.symbols = symbol_results();
+    for (const SymbolInformation &info : symbols) {
+        const DocumentId doc = uri_table::global().intern(info.location.uri);
+        target.symbols.add(info.name, info.containerName.value_or(std::string()), info.kind, doc, info.location.range);
+    }
+    return true;
+}
 
+template<>
+bool decode_env::declare_field(JSONObject &object, TextDocumentDefinition &target, const FieldNameType &field) {
+    declare_field(object, (TextDocumentPositionParams &)target, field);
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, TextDocumentReferences &target, const FieldNameType &field) {
+    declare_field(object, (TextDocumentPositionParams &)target, field);
+    auto context = start_object(object, "context");
+    declare_field(context, target.includeDeclaration, "includeDeclaration");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, LocationsResult &target, const FieldNameType &field) {
+    if (this->dir == storage_direction::WRITE) {
+        write_columns(*this, object, target.locations, field);
+        return true;
+    }
+    std::vector<Location> locations;
+    declare_field_array(object, locations, field);
+    target.locations = location_results();
+    for (const Location &location : locations) {
+        target.locations.add(uri_table::global().intern(location.uri), location.range);
+    }
+    return true;
+}
 
 ///////////////////////////////////////////////////////////
 // OpenSCAD extensions
 ///////////////////////////////////////////////////////////
+// A JSON value as an OpenSCAD expression, objects and null become undef
+static std::string scad_literal(const QJsonValue &value) {
+    switch (value.type()) {
+    case QJsonValue::Bool:
+        return value.toBool() ? "true" : "false";
+    case QJsonValue::Double: {
+        char number[32];
+        snprintf(number, sizeof(number), "%.17g", value.toDouble());
+        return number;
+    }
+    case QJsonValue::String: {
+        std::string quoted = "\"";
+        for (char c : value.toString().toStdString()) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            if (c == '\n') {
+                quoted += "\\n";
+            } else {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+    case QJsonValue::Array: {
+        std::string list = "[";
+        const QJsonArray array = value.toArray();
+        for (int i = 0; i < array.size(); i++) {
+            if (i) list += ", ";
+            list += scad_literal(array[i]);
+        }
+        return list + "]";
+    }
+    default:
+        return "undef";
+    }
+}
+
+// Only plain variable names can be overridden, anything else could inject statements
+static bool is_scad_identifier(const std::string &name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) return false;
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    });
+}
+
 template<>
-bool decode_env::declare_field(JSONObject &object, OpenSCADRender &target, const FieldNameType &uri) {
+bool decode_env::declare_field(JSONObject &object, OpenSCADRender &target, const FieldNameType &) {
     declare_field(object, target.uri, "uri");
+    declare_field_optional(object, target.timeBudget, "timeBudget");
+    declare_field_optional(object, target.partialResultToken, "partialResultToken");
+    if (this->dir == storage_direction::READ) {
+        const QString delivery = object->value("meshDelivery").toString();
+        if (delivery == "handle") {
+            target.delivery = mesh_delivery::handle;
+        } else if (delivery == "frames") {
+            target.delivery = mesh_delivery::frames;
+        }
+        const QJsonObject exported = object->value("export").toObject();
+        target.exportUri.raw_uri = exported.value("uri").toString().toStdString();
+        target.exportFormat = exported.value("format").toString().toStdString();
+        const QJsonObject variables = object->value("variables").toObject();
+        for (auto it = variables.begin(); it != variables.end(); ++it) {
+            const std::string name = it.key().toStdString();
+            if (is_scad_identifier(name)) {
+                target.parameters.variables.emplace_back(name, scad_literal(it.value()));
+            }
+        }
+    }
+    return true;
+}
+
+static QJsonArray json_vector(const vec3 &v) {
+    return QJsonArray{v.x, v.y, v.z};
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, OpenSCADRenderResult &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field(object, target.cached, "cached");
+    declare_field(object, target.key, "key");
+    if (this->dir == storage_direction::WRITE) {
+        object["quality"] = quality_name(target.quality);
+        if (!target.progressToken.empty()) object["progressToken"] = QString::fromStdString(target.progressToken);
+        if (target.superseded) object["superseded"] = true;
+        if (!target.exportPath.empty()) {
+            QJsonObject exported{{"path", QString::fromStdString(target.exportPath)}};
+            if (target.exportError.empty()) {
+                exported["bytes"] = static_cast<qint64>(target.exportBytes);
+            } else {
+                exported["error"] = QString::fromStdString(target.exportError);
+            }
+            object["export"] = exported;
+        }
+    }
+    if (this->dir == storage_direction::WRITE && target.output) {
+        const render_output &output = *target.output;
+        object["failed"] = output.failed;
+        QJsonArray messages;
+        for (const std::string &message : output.messages) messages.append(QString::fromStdString(message));
+        object["messages"] = messages;
+        const mesh_reference &mesh = target.mesh;
+        if (mesh.delivery == mesh_delivery::json) {
+            QJsonArray vertices;
+            for (float coordinate : output.geometry.positions) vertices.append(coordinate);
+            object["vertices"] = vertices;
+            QJsonArray triangles;
+            for (uint32_t index : output.geometry.indices) triangles.append(static_cast<qint64>(index));
+            object["triangles"] = triangles;
+        } else {
+            QJsonObject binary{
+                {"delivery", mesh.delivery == mesh_delivery::handle ? "handle" : "frames"},
+                {"size", static_cast<qint64>(mesh.size)},
+                {"vertexCount", static_cast<qint64>(output.geometry.vertex_count())},
+                {"triangleCount", static_cast<qint64>(output.geometry.triangle_count())},
+                {"indexOffset", static_cast<qint64>(mesh.vertex_bytes)},
+                {"littleEndian", QSysInfo::ByteOrder == QSysInfo::LittleEndian},
+            };
+            if (mesh.delivery == mesh_delivery::handle) {
+                binary["socket"] = QString::fromStdString(mesh.socket);
+                binary["handle"] = static_cast<qint64>(mesh.id);
+            } else {
+                binary["stream"] = static_cast<qint64>(mesh.id);
+            }
+            object["mesh"] = binary;
+        }
+        const bounding_box bounds = output.geometry.bounds();
+        if (!bounds.empty()) {
+            object["bounds"] = QJsonObject{{"min", json_vector(bounds.min)}, {"max", json_vector(bounds.max)}};
+        }
+    }
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, RenderProgressParams &target, const FieldNameType &) {
+    declare_field(object, target.token, "token");
+    declare_field(object, target.value, "value");
+    return true;
+}
+
+static vec3 json_to_vector(const QJsonValue &value) {
+    const QJsonArray array = value.toArray();
+    return {array.at(0).toDouble(), array.at(1).toDouble(), array.at(2).toDouble()};
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, OpenSCADPick &target, const FieldNameType &) {
+    declare_field(object, target.key, "key");
+    declare_field_optional(object, target.show, "show");
+    declare_field_optional(object, target.takeFocus, "takeFocus");
+    if (this->dir == storage_direction::READ) {
+        target.origin = json_to_vector(object->value("origin"));
+        target.direction = json_to_vector(object->value("direction"));
+    }
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, OpenSCADPickResult &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field(object, target.hit, "hit");
+    if (this->dir == storage_direction::WRITE && target.hit) {
+        object["triangle"] = static_cast<qint64>(target.triangle);
+        object["distance"] = target.distance;
+        if (target.part) object["part"] = static_cast<qint64>(*target.part);
+    }
+    declare_field_optional(object, target.source, "source");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &, OpenSCADStats &, const FieldNameType &) {
+    // Does not have fields
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, OpenSCADStatsResult &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    if (this->dir == storage_direction::WRITE) {
+        const render_cache_stats &renders = target.renders;
+        const uint64_t hits = renders.memory_hits + renders.disk_hits;
+        object["renderCache"] = QJsonObject{
+            {"directory", QString::fromStdString(target.renderCacheDirectory)},
+            {"memoryHits", static_cast<qint64>(renders.memory_hits)},
+            {"diskHits", static_cast<qint64>(renders.disk_hits)},
+            {"misses", static_cast<qint64>(renders.misses)},
+            {"hitRate", hits + renders.misses ? double(hits) / double(hits + renders.misses) : 0.0},
+            {"stores", static_cast<qint64>(renders.stores)},
+            {"memoryEvictions", static_cast<qint64>(renders.memory_evictions)},
+            {"diskEvictions", static_cast<qint64>(renders.disk_evictions)},
+            {"memoryEntries", static_cast<qint64>(renders.memory_entries)},
+            {"memoryBytes", static_cast<qint64>(renders.memory_bytes)},
+            {"diskEntries", static_cast<qint64>(renders.disk_entries)},
+            {"diskBytes", static_cast<qint64>(renders.disk_bytes)},
+        };
+        object["rendersRunning"] = static_cast<qint64>(target.rendersRunning);
+        object["rendersQueued"] = static_cast<qint64>(target.rendersQueued);
+        object["openDocuments"] = static_cast<qint64>(target.openDocuments);
+        object["indexedDocuments"] = static_cast<qint64>(target.indexedDocuments);
+    }
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &object, OpenSCADDependencies &target, const FieldNameType &) {
+    declare_field(object, target.uri, "uri");
+    declare_field_optional(object, target.transitive, "transitive");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, OpenSCADImport &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field(object, target.path, "path");
+    declare_field_optional(object, target.uri, "uri");
+    declare_field(object, target.use, "use");
+    declare_field(object, target.range, "range");
+    return true;
+}
+
+template<>
+bool decode_env::declare_field(JSONObject &parent, OpenSCADDependenciesResult &target, const FieldNameType &field) {
+    auto object = start_object(parent, field);
+    declare_field_array(object, target.imports, "imports");
+    declare_field_array(object, target.importedBy, "importedBy");
+    declare_field_array(object, target.dependencies, "dependencies");
+    declare_field_array(object, target.dependents, "dependents");
     return true;
 }
 
@@ -403,9 +753,16 @@ void ConnectionHandler::register_messages() {
     MAP("shutdown", ShutdownRequest);
     MAP("textDocument/didOpen", DidOpenTextDocument);
     MAP("textDocument/didChange", DidChangeTextDocument);
+    MAP("textDocument/didClose", DidCloseTextDocument);
     MAP("textDocument/hover", TextDocumentHover);
+    MAP("textDocument/definition", TextDocumentDefinition);
+    MAP("textDocument/references", TextDocumentReferences);
+    MAP("workspace/symbol", WorkspaceSymbolRequest);
 
     MAP("$openscad/render", OpenSCADRender);
+    MAP("$openscad/pick", OpenSCADPick);
+    MAP("$openscad/dependencies", OpenSCADDependencies);
+    MAP("$openscad/stats", OpenSCADStats);
 
 
 
@@ -433,14 +790,24 @@ decode_env::decode_env(storage_direction dir) :
     assert(dir == storage_direction::WRITE);
 }
 
+decode_env::decode_env(const QJsonObject &root) :
+        dir(storage_direction::READ),
+        document(root)
+{
+}
+
 void decode_env::store(QByteArray *buffer, ResponseMessage &msg) {
+    this->document.setObject(this->store(msg));
+    buffer->append(this->document.toJson(QJsonDocument::JsonFormat::Compact));
+}
+
+QJsonObject decode_env::store(ResponseMessage &msg) {
     QJsonObject root;
     {
         EncapsulatedObjectRef wrapper(root, storage_direction::WRITE);
         this->declare_field(wrapper, msg, "");
     }
-    this->document.setObject(root);
-    buffer->append(this->document.toJson(QJsonDocument::JsonFormat::Compact));
+    return root;
 }
 
 void decode_env::store(QByteArray *buffer, RequestMessage &msg) {
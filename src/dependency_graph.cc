@@ -0,0 +1,165 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+
+namespace {
+
+// Statements can only be nested in these
+bool contains_statements(syntax_kind kind) {
+    switch (kind) {
+    case syntax_kind::file:
+    case syntax_kind::list_chunk:
+    case syntax_kind::block:
+    case syntax_kind::module_definition:
+    case syntax_kind::module_instantiation:
+    case syntax_kind::if_statement:
+    case syntax_kind::error:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void collect_imports(std::string_view text, const line_index &lines, const syntax_node &node, uint32_t offset,
+                     std::vector<file_import> &out) {
+    for (const syntax_element &child : node) {
+        const syntax_kind kind = child.kind();
+        if (kind == syntax_kind::include_statement || kind == syntax_kind::use_statement) {
+            const syntax_node &statement = *child.node();
+            if (statement.size >= 2 && statement[1].kind() == syntax_kind::include_path) {
+                const uint32_t path_offset = offset + statement[0].width;
+                const std::string_view path = token_text(text, statement[1], path_offset);
+                const uint32_t start = text_start(text, statement[1], path_offset);
+
+                file_import import;
+                import.path = std::string(path.substr(1, path.size() - 2));
+                import.is_use = kind == syntax_kind::use_statement;
+                import.range = lines.range_of(text, start, path.size());
+                out.emplace_back(std::move(import));
+            }
+        } else if (is_node(kind) && contains_statements(kind)) {
+            collect_imports(text, lines, *child.node(), offset, out);
+        }
+        offset += child.width;
+    }
+}
+
+const std::vector<file_import> no_imports;
+const std::vector<DocumentId> no_documents;
+
+} // namespace
+
+void extract_imports(std::string_view text, const line_index &lines, const syntax_tree &tree, std::vector<file_import> &out) {
+    out.clear();
+    if (!tree.empty()) {
+        collect_imports(text, lines, *tree.root, 0, out);
+    }
+}
+
+void dependency_graph::set_imports(DocumentId doc, std::vector<file_import> imports, std::vector<DocumentId> targets) {
+    node &n = nodes[doc];
+
+    std::vector<DocumentId> old_targets = std::move(n.targets);
+    n.imports = std::move(imports);
+    n.targets = std::move(targets);
+
+    std::vector<DocumentId> added = n.targets;
+    std::sort(old_targets.begin(), old_targets.end());
+    old_targets.erase(std::unique(old_targets.begin(), old_targets.end()), old_targets.end());
+    std::sort(added.begin(), added.end());
+    added.erase(std::unique(added.begin(), added.end()), added.end());
+
+    // Only the difference touches the reverse edges
+    for (DocumentId target : old_targets) {
+        if (target == INVALID_DOCUMENT_ID || std::binary_search(added.begin(), added.end(), target)) continue;
+        auto it = nodes.find(target);
+        if (it == nodes.end()) continue;
+        std::vector<DocumentId> &importers = it->second.importers;
+        auto pos = std::lower_bound(importers.begin(), importers.end(), doc);
+        if (pos != importers.end() && *pos == doc) importers.erase(pos);
+    }
+    for (DocumentId target : added) {
+        if (target == INVALID_DOCUMENT_ID || std::binary_search(old_targets.begin(), old_targets.end(), target)) continue;
+        std::vector<DocumentId> &importers = nodes[target].importers;
+        auto pos = std::lower_bound(importers.begin(), importers.end(), doc);
+        if (pos == importers.end() || *pos != doc) importers.insert(pos, doc);
+    }
+}
+
+void dependency_graph::remove(DocumentId doc) {
+    auto it = nodes.find(doc);
+    if (it == nodes.end()) return;
+    // Keep the node for its importers and version
+    set_imports(doc, {}, {});
+}
+
+const std::vector<file_import> &dependency_graph::imports(DocumentId doc) const {
+    auto it = nodes.find(doc);
+    return it == nodes.end() ? no_imports : it->second.imports;
+}
+
+const std::vector<DocumentId> &dependency_graph::targets(DocumentId doc) const {
+    auto it = nodes.find(doc);
+    return it == nodes.end() ? no_documents : it->second.targets;
+}
+
+const std::vector<DocumentId> &dependency_graph::importers(DocumentId doc) const {
+    auto it = nodes.find(doc);
+    return it == nodes.end() ? no_documents : it->second.importers;
+}
+
+template <typename Next>
+void dependency_graph::closure(DocumentId doc, Next next, std::vector<DocumentId> &out) const {
+    // Breadth first, import cycles are common enough in libraries
+    std::unordered_set<DocumentId> seen{doc};
+    const size_t first = out.size();
+    out.push_back(doc);
+    for (size_t i = first; i < out.size(); i++) {
+        auto it = nodes.find(out[i]);
+        if (it == nodes.end()) continue;
+        for (DocumentId neighbour : next(it->second)) {
+            if (neighbour != INVALID_DOCUMENT_ID && seen.insert(neighbour).second) {
+                out.push_back(neighbour);
+            }
+        }
+    }
+    out.erase(out.begin() + first);
+}
+
+void dependency_graph::dependencies(DocumentId doc, std::vector<DocumentId> &out) const {
+    closure(doc, [](const node &n) -> const std::vector<DocumentId> & { return n.targets; }, out);
+}
+
+void dependency_graph::dependents(DocumentId doc, std::vector<DocumentId> &out) const {
+    closure(doc, [](const node &n) -> const std::vector<DocumentId> & { return n.importers; }, out);
+}
+
+uint32_t dependency_graph::version(DocumentId doc) const {
+    auto it = nodes.find(doc);
+    return it == nodes.end() ? 0 : it->second.version;
+}
+
+void dependency_graph::invalidate(DocumentId doc) {
+    std::vector<DocumentId> affected{doc};
+    dependents(doc, affected);
+    for (DocumentId d : affected) {
+        nodes[d].version++;
+    }
+}
+
+void dependency_graph::unresolved_imports_of(const std::unordered_set<std::string_view> &file_names,
+                                             std::vector<DocumentId> &out) const {
+    for (const auto &entry : nodes) {
+        const node &n = entry.second;
+        for (size_t i = 0; i < n.imports.size(); i++) {
+            if (n.targets[i] != INVALID_DOCUMENT_ID) continue;
+            std::string_view path = n.imports[i].path;
+            const size_t slash = path.find_last_of('/');
+            if (slash != std::string_view::npos) path.remove_prefix(slash + 1);
+            if (file_names.count(path)) {
+                out.push_back(entry.first);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "document.h"
+#include "lsp.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// An include <...> or use <...> statement as written in a document
+struct file_import {
+    std::string path;       // between the angle brackets
+    bool is_use = false;    // use only imports modules and functions, include the whole file
+    lsRange range;          // of the <path>
+};
+
+// All include and use statements of a syntax tree, in document order
+void extract_imports(std::string_view text, const line_index &lines, const syntax_tree &tree, std::vector<file_import> &out);
+
+/**
+ * include/use edges between the documents of the workspace, with the reverse edges to find
+ * everything that depends on a document.
+ *
+ * Every document has a version that is incremented when the document or one of its transitive
+ * dependencies changes. Results computed for a document stay valid as long as its version
+ * does, so editing a leaf library only invalidates the files that actually use it.
+ */
+class dependency_graph {
+public:
+    /**
+     * Replace the imports of doc, targets holds the resolved document of every import or
+     * INVALID_DOCUMENT_ID if it could not be resolved.
+     */
+    void set_imports(DocumentId doc, std::vector<file_import> imports, std::vector<DocumentId> targets);
+    // Drop the imports of doc, documents importing it keep their edges to it
+    void remove(DocumentId doc);
+
+    const std::vector<file_import> &imports(DocumentId doc) const;
+    const std::vector<DocumentId> &targets(DocumentId doc) const;
+    const std::vector<DocumentId> &importers(DocumentId doc) const;
+
+    // Transitive closure in both directions, doc itself is not part of the result
+    void dependencies(DocumentId doc, std::vector<DocumentId> &out) const;
+    void dependents(DocumentId doc, std::vector<DocumentId> &out) const;
+
+    uint32_t version(DocumentId doc) const;
+    // doc changed: increment the version of doc and of everything depending on it
+    void invalidate(DocumentId doc);
+
+    // Documents with an unresolved import of a file with one of these names, in any directory
+    void unresolved_imports_of(const std::unordered_set<std::string_view> &file_names, std::vector<DocumentId> &out) const;
+
+    size_t document_count() const { return nodes.size(); }
+
+private:
+    struct node {
+        std::vector<file_import> imports;
+        std::vector<DocumentId> targets;
+        // Sorted, every importer once even if it imports the document several times
+        std::vector<DocumentId> importers;
+        uint32_t version = 0;
+    };
+
+    template <typename Next>
+    void closure(DocumentId doc, Next next, std::vector<DocumentId> &out) const;
+
+    std::unordered_map<DocumentId, node> nodes;
+};
@@ -0,0 +1,34 @@
+#include "diagnostics.h"
+#include "connection.h"
+#include "messages.h"
+#include "project.h"
+#include "uri_table.h"
+
+void publish_diagnostics(Connection *conn, const project &proj, const text_document &doc) {
+    const std::vector<syntax_diagnostic> &errors = doc.positions().errors();
+
+    PublishDiagnosticsParams params;
+    params.uri = uri_table::global().uri(doc.id);
+    params.version = doc.version();
+    params.diagnostics.reserve(errors.size());
+    for (const syntax_diagnostic &error : errors) {
+        Diagnostic diag;
+        diag.range = doc.range_of(error.offset, error.length);
+        diag.severity = 1; // Error
+        diag.message = error_message(error.error);
+        params.diagnostics.emplace_back(std::move(diag));
+    }
+
+    // Same wording as OpenSCAD itself
+    const std::vector<file_import> &imports = proj.dependencies.imports(doc.id);
+    const std::vector<DocumentId> &targets = proj.dependencies.targets(doc.id);
+    for (size_t i = 0; i < imports.size(); i++) {
+        if (targets[i] != INVALID_DOCUMENT_ID) continue;
+        Diagnostic diag;
+        diag.range = imports[i].range;
+        diag.severity = 2; // Warning
+        diag.message = (imports[i].is_use ? "Can't open library '" : "Can't open include file '") + imports[i].path + "'";
+        params.diagnostics.emplace_back(std::move(diag));
+    }
+    conn->send_notification(params, "textDocument/publishDiagnostics");
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "document.h"
+
+class Connection;
+struct project;
+
+/**
+ * Send all diagnostics of the current version of an open document: syntax errors and include or
+ * use statements whose file could not be found. An empty list clears earlier ones.
+ */
+void publish_diagnostics(Connection *conn, const project &proj, const text_document &doc);
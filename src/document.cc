@@ -0,0 +1,121 @@
+#include "document.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Number of bytes of the UTF-8 sequence starting with lead (1 for stray continuation bytes)
+static inline uint32_t utf8_length(unsigned char lead) {
+    if (lead < 0xC0) return 1;
+    if (lead < 0xE0) return 2;
+    if (lead < 0xF0) return 3;
+    return 4;
+}
+
+void line_index::build(std::string_view text) {
+    starts.assign(1, 0);
+    for (const char *p = text.data(), *end = p + text.size();
+         (p = static_cast<const char *>(memchr(p, '\n', end - p))); ) {
+        p++;
+        starts.push_back(p - text.data());
+    }
+}
+
+void line_index::replace(uint32_t begin, uint32_t end, std::string_view replacement) {
+    // Lines starting inside the replaced range are gone, the ones behind it move by the size difference
+    auto first = std::upper_bound(starts.begin(), starts.end(), begin);
+    auto last = std::upper_bound(first, starts.end(), end);
+    first = starts.erase(first, last);
+    const uint32_t delta = replacement.size() - (end - begin);
+    for (auto it = first; it != starts.end(); ++it) {
+        *it += delta;
+    }
+
+    std::vector<uint32_t> inserted;
+    for (size_t i = replacement.find('\n'); i != std::string_view::npos; i = replacement.find('\n', i + 1)) {
+        inserted.push_back(begin + i + 1);
+    }
+    starts.insert(first, inserted.begin(), inserted.end());
+}
+
+uint32_t line_index::offset_of(std::string_view text, const Position &pos) const {
+    if (pos.line < 0) return 0;
+    if (static_cast<size_t>(pos.line) >= starts.size()) return text.size();
+
+    uint32_t offset = starts[pos.line];
+    const uint32_t line_end = static_cast<size_t>(pos.line) + 1 < starts.size() ?
+        starts[pos.line + 1] - 1 : text.size();
+
+    // Positions behind the end of the line are clamped to the line end (before "\r\n")
+    int units = 0;
+    while (offset < line_end && units < pos.character) {
+        if (text[offset] == '\r' && offset + 1 == line_end) break;
+        uint32_t length = utf8_length(text[offset]);
+        units += length == 4 ? 2 : 1;
+        offset = std::min(offset + length, line_end);
+    }
+    return offset;
+}
+
+Position line_index::position_of(std::string_view text, uint32_t offset) const {
+    offset = std::min<uint32_t>(offset, text.size());
+    auto line = std::upper_bound(starts.begin(), starts.end(), offset) - 1;
+
+    Position pos;
+    pos.line = line - starts.begin();
+    for (uint32_t i = *line; i < offset; ) {
+        uint32_t length = utf8_length(text[i]);
+        pos.character += length == 4 ? 2 : 1;
+        i += length;
+    }
+    return pos;
+}
+
+lsRange line_index::range_of(std::string_view text, uint32_t offset, uint32_t length) const {
+    lsRange range;
+    range.start = position_of(text, offset);
+    range.end = position_of(text, offset + length);
+    return range;
+}
+
+void text_document::set_text(std::string text, int version) {
+    content = std::move(text);
+    line_starts.build(content);
+    tree = parse_scad(content, version);
+    index.build(content, tree);
+}
+
+text_edit_span text_document::replace(uint32_t begin, uint32_t end, const std::string &text) {
+    content.replace(begin, end - begin, text);
+    line_starts.replace(begin, end, text);
+
+    text_edit_span span;
+    span.offset = begin;
+    span.old_length = end - begin;
+    span.new_length = text.size();
+    return span;
+}
+
+void text_document::apply_changes(const std::vector<TextDocumentContentChangeEvent> &changes, int version) {
+    text_edit_span combined;
+    bool changed = false;
+    for (const TextDocumentContentChangeEvent &change : changes) {
+        uint32_t begin = 0;
+        uint32_t end = content.size();
+        if (change.range) {
+            begin = offset_of(change.range->start);
+            end = std::max(begin, offset_of(change.range->end));
+        }
+        text_edit_span span = replace(begin, end, change.text);
+        combined = changed ? combined.then(span) : span;
+        changed = true;
+    }
+
+    if (tree.empty()) {
+        tree = parse_scad(content, version);
+        index.build(content, tree);
+    } else {
+        syntax_tree old = std::move(tree);
+        tree = reparse_scad(old, content, combined, version);
+        index.update(content, old, tree);
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "lsp.h"
+#include "position_index.h"
+#include "scad_parser.h"
+#include "uri_table.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Start offset of every line of a text, converts between byte offsets and LSP positions.
+ * The text itself is passed in, so the same table works for owned and memory mapped text.
+ */
+class line_index {
+public:
+    line_index() { starts.push_back(0); }
+
+    void build(std::string_view text);
+    // Update the table after the bytes [begin, end) were replaced by replacement
+    void replace(uint32_t begin, uint32_t end, std::string_view replacement);
+
+    uint32_t offset_of(std::string_view text, const Position &pos) const;
+    Position position_of(std::string_view text, uint32_t offset) const;
+    lsRange range_of(std::string_view text, uint32_t offset, uint32_t length) const;
+
+    size_t size() const { return starts.size(); }
+
+private:
+    std::vector<uint32_t> starts;
+};
+
+/**
+ * The server side copy of an open document: its text, the start offset of every line, the
+ * syntax tree of the current version and the index of what sits at every position in it.
+ *
+ * LSP positions count UTF-16 code units while the text and the syntax tree use byte offsets
+ * into the UTF-8 text, offset_of and position_of convert between the two.
+ */
+class text_document {
+public:
+
+    DocumentId id = INVALID_DOCUMENT_ID;
+
+    const std::string &text() const { return content; }
+    int version() const { return tree.version; }
+    const syntax_tree &syntax() const { return tree; }
+    const position_index &positions() const { return index; }
+
+    // Replace the whole text and parse it from scratch
+    void set_text(std::string text, int version);
+
+    /**
+     * Apply the changes of one didChange notification in order. All edits are combined into one
+     * span, so the document is reparsed once per notification and not once per change.
+     */
+    void apply_changes(const std::vector<TextDocumentContentChangeEvent> &changes, int version);
+
+    const line_index &lines() const { return line_starts; }
+
+    uint32_t offset_of(const Position &pos) const { return line_starts.offset_of(content, pos); }
+    Position position_of(uint32_t offset) const { return line_starts.position_of(content, offset); }
+    lsRange range_of(uint32_t offset, uint32_t length) const { return line_starts.range_of(content, offset, length); }
+
+    size_t line_count() const { return line_starts.size(); }
+
+private:
+    text_edit_span replace(uint32_t begin, uint32_t end, const std::string &text);
+
+    std::string content;
+    line_index line_starts;
+    syntax_tree tree;
+    position_index index;
+};
@@ -0,0 +1,1900 @@
+#include "evaluator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <variant>
+
+namespace {
+
+constexpr double PI = 3.14159265358979323846;
+
+///////////////////////////////////////////////////////////
+// Values
+///////////////////////////////////////////////////////////
+
+struct value;
+struct scope;
+using scope_ptr = std::shared_ptr<scope>;
+using value_vector = std::vector<value>;
+using vector_ptr = std::shared_ptr<const value_vector>;
+
+struct range_value {
+    double begin = 0;
+    double step = 1;
+    double end = 0;
+
+    // Number of values, 0 if the step does not lead from begin to end
+    double count() const {
+        if (step == 0 || std::isnan(begin) || std::isnan(step) || std::isnan(end)) return 0;
+        if ((step > 0 && begin > end) || (step < 0 && begin < end)) return 0;
+        return std::floor((end - begin) / step + 1e-9) + 1;
+    }
+};
+
+// A function literal with the scope it was created in
+struct function_value {
+    const syntax_node *parameters;
+    uint32_t parameters_offset;
+    const syntax_element *body;
+    uint32_t body_offset;
+    uint32_t file;
+    scope_ptr closure;
+};
+using function_ptr = std::shared_ptr<const function_value>;
+
+struct value {
+    std::variant<std::monostate, bool, double, std::string, vector_ptr, range_value, function_ptr> data;
+
+    value() = default;
+    value(bool b) : data(b) {}
+    value(double d) : data(d) {}
+    value(std::string s) : data(std::move(s)) {}
+    value(value_vector v) : data(std::make_shared<const value_vector>(std::move(v))) {}
+    value(range_value r) : data(r) {}
+    value(function_ptr f) : data(std::move(f)) {}
+
+    bool is_undef() const { return data.index() == 0; }
+    const bool *boolean() const { return std::get_if<bool>(&data); }
+    const double *number() const { return std::get_if<double>(&data); }
+    const std::string *string() const { return std::get_if<std::string>(&data); }
+    const value_vector *vector() const {
+        const vector_ptr *v = std::get_if<vector_ptr>(&data);
+        return v ? v->get() : nullptr;
+    }
+    const range_value *range() const { return std::get_if<range_value>(&data); }
+    const function_value *function() const {
+        const function_ptr *f = std::get_if<function_ptr>(&data);
+        return f ? f->get() : nullptr;
+    }
+
+    bool truthy() const {
+        switch (data.index()) {
+        case 0: return false;
+        case 1: return *boolean();
+        case 2: return *number() != 0;
+        case 3: return !string()->empty();
+        case 4: return !vector()->empty();
+        default: return true;
+        }
+    }
+};
+
+bool operator==(const value &a, const value &b) {
+    if (a.data.index() != b.data.index()) return false;
+    if (const value_vector *va = a.vector()) {
+        const value_vector &vb = *b.vector();
+        if (va->size() != vb.size()) return false;
+        for (size_t i = 0; i < va->size(); i++) {
+            if (!((*va)[i] == vb[i])) return false;
+        }
+        return true;
+    }
+    if (const range_value *ra = a.range()) {
+        const range_value *rb = b.range();
+        return ra->begin == rb->begin && ra->step == rb->step && ra->end == rb->end;
+    }
+    if (a.function()) return a.function() == b.function();
+    return a.data == b.data;
+}
+
+std::string format_number(double d) {
+    if (std::isnan(d)) return "nan";
+    if (std::isinf(d)) return d > 0 ? "inf" : "-inf";
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%g", d);
+    return buffer;
+}
+
+// How echo and str() print values, strings inside vectors are always quoted
+std::string to_text(const value &v, bool quote) {
+    switch (v.data.index()) {
+    case 0: return "undef";
+    case 1: return *v.boolean() ? "true" : "false";
+    case 2: return format_number(*v.number());
+    case 3: return quote ? "\"" + *v.string() + "\"" : *v.string();
+    case 4: {
+        std::string text = "[";
+        const value_vector &items = *v.vector();
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i) text += ", ";
+            text += to_text(items[i], true);
+        }
+        return text + "]";
+    }
+    case 5: {
+        const range_value &r = *v.range();
+        return "[" + format_number(r.begin) + " : " + format_number(r.step) + " : " + format_number(r.end) + "]";
+    }
+    default:
+        return "function";
+    }
+}
+
+bool to_number(const value &v, double &out) {
+    if (const double *d = v.number()) {
+        out = *d;
+        return true;
+    }
+    return false;
+}
+
+// [x, y] or [x, y, z], missing coordinates are filled in
+bool to_vec3(const value &v, vec3 &out, double fill) {
+    const value_vector *items = v.vector();
+    if (!items || items->size() < 2) return false;
+    double c[3] = {fill, fill, fill};
+    for (size_t i = 0; i < 3 && i < items->size(); i++) {
+        if (!to_number((*items)[i], c[i])) return false;
+    }
+    out = {c[0], c[1], c[2]};
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+// Scopes
+///////////////////////////////////////////////////////////
+
+/**
+ * Names bound in one scope in the order of their first binding. Most scopes hold a few
+ * parameters, an index is only built for the large scopes of library files.
+ */
+template <typename T>
+class binding_table {
+public:
+    static constexpr size_t INDEX_THRESHOLD = 16;
+
+    const T *find(std::string_view name) const {
+        if (!index.empty()) {
+            auto it = index.find(std::string(name));
+            return it == index.end() ? nullptr : &items[it->second].second;
+        }
+        for (const auto &item : items) {
+            if (item.first == name) return &item.second;
+        }
+        return nullptr;
+    }
+
+    void set(std::string_view name, T value) {
+        if (T *existing = const_cast<T *>(find(name))) {
+            *existing = std::move(value);
+            return;
+        }
+        items.emplace_back(std::string(name), std::move(value));
+        if (items.size() > INDEX_THRESHOLD) {
+            if (index.empty()) {
+                for (size_t i = 0; i < items.size(); i++) index.emplace(items[i].first, i);
+            } else {
+                index.emplace(items.back().first, items.size() - 1);
+            }
+        }
+    }
+
+    void clear() {
+        items.clear();
+        index.clear();
+    }
+
+private:
+    std::vector<std::pair<std::string, T>> items;
+    std::unordered_map<std::string, size_t> index;
+};
+
+// A module or function definition
+struct definition {
+    const syntax_node *node;
+    uint32_t offset;
+    uint32_t file;
+};
+
+struct statement {
+    const syntax_element *element;
+    uint32_t offset;
+    uint32_t file;
+};
+
+// The child statements of a module instantiation, with the scope they are evaluated in
+struct children_context {
+    std::vector<statement> statements;
+    scope_ptr scope;
+};
+
+/**
+ * Variables are looked up along the lexical parents. Special variables ($fn, ...) are looked
+ * up along the callers instead: a module sees the $ variables of the place it was
+ * instantiated from, not of the place it was defined in.
+ */
+struct scope {
+    scope_ptr parent;
+    // Set in module and function calls and children() scopes
+    scope_ptr caller;
+    binding_table<value> variables;
+    binding_table<definition> functions;
+    binding_table<definition> modules;
+    // File scopes: the scopes of the files named in use statements
+    std::vector<scope_ptr> uses;
+    // Module calls: the statements children() instantiates
+    std::shared_ptr<const children_context> children;
+
+    static scope_ptr nested(const scope_ptr &parent) {
+        auto s = std::make_shared<scope>();
+        s->parent = parent;
+        return s;
+    }
+};
+
+inline bool is_special(std::string_view name) { return !name.empty() && name[0] == '$'; }
+
+inline bool is_modifier(syntax_kind kind) {
+    return kind == syntax_kind::bang || kind == syntax_kind::hash || kind == syntax_kind::percent ||
+           kind == syntax_kind::star;
+}
+
+struct evaluation_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct call_arguments {
+    std::vector<value> positional;
+    std::vector<std::pair<std::string, value>> named;
+
+    // The named argument name, or else the positional one at position
+    const value *get(std::string_view name, size_t position = SIZE_MAX) const {
+        for (const auto &arg : named) {
+            if (arg.first == name) return &arg.second;
+        }
+        return position < positional.size() ? &positional[position] : nullptr;
+    }
+
+    double number(std::string_view name, size_t position, double fallback) const {
+        const value *v = get(name, position);
+        double d;
+        return v && to_number(*v, d) ? d : fallback;
+    }
+
+    bool flag(std::string_view name, size_t position, bool fallback) const {
+        const value *v = get(name, position);
+        return v && !v->is_undef() ? v->truthy() : fallback;
+    }
+};
+
+///////////////////////////////////////////////////////////
+// Evaluator
+///////////////////////////////////////////////////////////
+
+enum class builtin_function {
+    abs, sign, sin, cos, tan, asin, acos, atan, atan2, floor, round, ceil, ln, log, pow, sqrt, exp,
+    min, max, norm, cross, len, concat, lookup, str, chr, ord, rands, is_undef, is_bool, is_num,
+    is_string, is_list, is_function, version, version_num,
+};
+
+const std::unordered_map<std::string_view, builtin_function> &builtin_functions() {
+    static const std::unordered_map<std::string_view, builtin_function> functions = {
+        {"abs", builtin_function::abs}, {"sign", builtin_function::sign}, {"sin", builtin_function::sin},
+        {"cos", builtin_function::cos}, {"tan", builtin_function::tan}, {"asin", builtin_function::asin},
+        {"acos", builtin_function::acos}, {"atan", builtin_function::atan}, {"atan2", builtin_function::atan2},
+        {"floor", builtin_function::floor}, {"round", builtin_function::round}, {"ceil", builtin_function::ceil},
+        {"ln", builtin_function::ln}, {"log", builtin_function::log}, {"pow", builtin_function::pow},
+        {"sqrt", builtin_function::sqrt}, {"exp", builtin_function::exp}, {"min", builtin_function::min},
+        {"max", builtin_function::max}, {"norm", builtin_function::norm}, {"cross", builtin_function::cross},
+        {"len", builtin_function::len}, {"concat", builtin_function::concat}, {"lookup", builtin_function::lookup},
+        {"str", builtin_function::str}, {"chr", builtin_function::chr}, {"ord", builtin_function::ord},
+        {"rands", builtin_function::rands}, {"is_undef", builtin_function::is_undef},
+        {"is_bool", builtin_function::is_bool}, {"is_num", builtin_function::is_num},
+        {"is_string", builtin_function::is_string}, {"is_list", builtin_function::is_list},
+        {"is_function", builtin_function::is_function}, {"version", builtin_function::version},
+        {"version_num", builtin_function::version_num},
+    };
+    return functions;
+}
+
+enum class builtin_module {
+    cube, sphere, cylinder, polyhedron, square, circle, polygon, translate, rotate, scale, mirror,
+    multmatrix, color, resize, group, union_, difference, intersection, render, linear_extrude,
+    rotate_extrude, children, unsupported,
+};
+
+const std::unordered_map<std::string_view, builtin_module> &builtin_modules() {
+    static const std::unordered_map<std::string_view, builtin_module> modules = {
+        {"cube", builtin_module::cube}, {"sphere", builtin_module::sphere}, {"cylinder", builtin_module::cylinder},
+        {"polyhedron", builtin_module::polyhedron}, {"square", builtin_module::square},
+        {"circle", builtin_module::circle}, {"polygon", builtin_module::polygon},
+        {"translate", builtin_module::translate}, {"rotate", builtin_module::rotate},
+        {"scale", builtin_module::scale}, {"mirror", builtin_module::mirror},
+        {"multmatrix", builtin_module::multmatrix}, {"color", builtin_module::color},
+        {"resize", builtin_module::resize}, {"group", builtin_module::group}, {"union", builtin_module::union_},
+        {"difference", builtin_module::difference}, {"intersection", builtin_module::intersection},
+        {"render", builtin_module::render}, {"linear_extrude", builtin_module::linear_extrude},
+        {"rotate_extrude", builtin_module::rotate_extrude}, {"children", builtin_module::children},
+        // Any geometry in their place would be wrong, the render fails
+        {"hull", builtin_module::unsupported}, {"minkowski", builtin_module::unsupported},
+        {"import", builtin_module::unsupported},
+        {"surface", builtin_module::unsupported}, {"text", builtin_module::unsupported},
+        {"projection", builtin_module::unsupported}, {"offset", builtin_module::unsupported},
+    };
+    return modules;
+}
+
+// Assignments and instantiations of one statement list, definitions go straight into the scope
+struct statement_list {
+    struct assignment {
+        std::string_view name;
+        statement value;
+    };
+    std::vector<assignment> assignments;
+    std::vector<statement> instantiations;
+};
+
+csg_node_ptr make_group(std::vector<csg_node_ptr> children, csg_node::kind kind = csg_node::kind::group) {
+    children.erase(std::remove(children.begin(), children.end(), nullptr), children.end());
+    if (children.empty()) return nullptr;
+    if (children.size() == 1 && kind == csg_node::kind::group) return children[0];
+    auto node = std::make_shared<csg_node>();
+    node->type = kind;
+    node->dimension = 2;
+    for (const csg_node_ptr &child : children) {
+        if (child->dimension != 2) node->dimension = 3;
+    }
+    node->children = std::move(children);
+    return node;
+}
+
+class evaluator {
+public:
+    evaluator(const std::vector<scad_source> &sources, const evaluation_options &options) : options(options) {
+        for (const scad_source &source : sources) files.push_back(&source);
+        if (options.overrides) files.push_back(options.overrides);
+        file_scopes.resize(files.size());
+        text = files[0]->text;
+
+        base = std::make_shared<scope>();
+        base->variables.set("PI", PI);
+        base->variables.set("$fn", 0.0);
+        base->variables.set("$fs", 2.0);
+        base->variables.set("$fa", 12.0);
+        base->variables.set("$t", 0.0);
+        base->variables.set("$preview", false);
+        base->variables.set("$children", 0.0);
+    }
+
+    ~evaluator() {
+        // Function literals stored in the scope they were created in keep it alive
+        for (const std::weak_ptr<scope> &captured : closures) {
+            if (scope_ptr s = captured.lock()) s->variables.clear();
+        }
+    }
+
+    evaluation_result run() {
+        evaluation_result result;
+        try {
+            for (size_t i = 0; i < files.size(); i++) {
+                if (!files[i]->tree.root || files[i]->tree.root->has_error()) {
+                    throw evaluation_error("Parser error in file \"" + files[i]->path + "\", can't render");
+                }
+            }
+            scope_ptr main = scope::nested(base);
+            file_scopes[0] = main;
+            including.push_back(0);
+            statement_list list;
+            const syntax_element root(files[0]->tree.root);
+            collect(root, 0, 0, *main, list);
+            if (options.overrides) {
+                const syntax_element overrides(files.back()->tree.root);
+                collect(overrides, 0, files.size() - 1, *main, list);
+            }
+            assign(list, main);
+            csg_node_ptr top = make_group(instantiate(list, main));
+            result.root = root_override ? root_override : top;
+        } catch (const evaluation_error &error) {
+            result.failed = true;
+            result.root = nullptr;
+            message("ERROR: " + std::string(error.what()), true);
+        }
+        if (suppressed) {
+            messages.push_back(std::to_string(suppressed) + " more messages were suppressed");
+        }
+        result.messages = std::move(messages);
+        return result;
+    }
+
+private:
+    ///////////////////////////////////////////////////////
+    // Messages
+    ///////////////////////////////////////////////////////
+    void message(std::string text, bool always = false) {
+        if (messages.size() >= options.max_messages && !always) {
+            suppressed++;
+            return;
+        }
+        messages.push_back(std::move(text));
+    }
+
+    std::string location(uint32_t offset) const {
+        const std::string_view text = files[file]->text;
+        const size_t line = std::count(text.begin(), text.begin() + std::min<size_t>(offset, text.size()), '\n') + 1;
+        return "in file " + files[file]->path + ", line " + std::to_string(line);
+    }
+
+    void warn(const std::string &text, uint32_t offset) {
+        message("WARNING: " + text + " " + location(offset));
+    }
+
+    ///////////////////////////////////////////////////////
+    // Files and statements
+    ///////////////////////////////////////////////////////
+    // Switches the file whose text the evaluated syntax elements belong to
+    class file_switch {
+    public:
+        file_switch(evaluator &e, uint32_t file) : e(e), saved(e.file) {
+            e.file = file;
+            e.text = e.files[file]->text;
+        }
+        ~file_switch() {
+            e.file = saved;
+            e.text = e.files[saved]->text;
+        }
+
+    private:
+        evaluator &e;
+        uint32_t saved;
+    };
+
+    class depth_guard {
+    public:
+        explicit depth_guard(evaluator &e) : e(e) {
+            if (++e.depth > e.options.max_depth) {
+                throw evaluation_error("Recursion detected, more than " + std::to_string(e.options.max_depth) +
+                                       " nested calls");
+            }
+        }
+        ~depth_guard() { e.depth--; }
+
+    private:
+        evaluator &e;
+    };
+
+    std::string_view token(const syntax_element &element, uint32_t offset) const {
+        return token_text(text, element, offset);
+    }
+
+    // The file an include or use statement refers to, or -1
+    int64_t resolve_import(const syntax_node &statement, uint32_t offset, uint32_t in_file) {
+        if (statement.size < 2 || statement[1].kind() != syntax_kind::include_path) return -1;
+        const std::string_view path = token_text(files[in_file]->text, statement[1], offset + statement[0].width);
+        const std::string name(path.substr(1, path.size() - 2));
+        auto it = files[in_file]->imports.find(name);
+        if (it == files[in_file]->imports.end() || it->second >= files.size()) {
+            file_switch in(*this, in_file);
+            warn("Can't open library '" + name + "'.", offset);
+            return -1;
+        }
+        return static_cast<int64_t>(it->second);
+    }
+
+    /**
+     * Sort the statements of a file, block or child statement into the list. Definitions are
+     * hoisted into the scope, include statements are replaced with the statements of the file.
+     */
+    void collect(const syntax_element &element, uint32_t offset, uint32_t in_file, scope &s, statement_list &out) {
+        if (!element.is_node()) return;
+        const syntax_node &node = *element.node();
+        const std::string_view source = files[in_file]->text;
+        switch (node.kind) {
+        case syntax_kind::file:
+        case syntax_kind::block:
+            for_each_item(node, offset, [&](const syntax_element &child, uint32_t child_offset) {
+                collect(child, child_offset, in_file, s, out);
+            });
+            break;
+        case syntax_kind::include_statement: {
+            const int64_t target = resolve_import(node, offset, in_file);
+            if (target < 0) break;
+            if (std::find(including.begin(), including.end(), target) != including.end()) {
+                file_switch in(*this, in_file);
+                warn("Recursive include of '" + files[target]->path + "' ignored", offset);
+                break;
+            }
+            including.push_back(target);
+            const syntax_element root(files[target]->tree.root);
+            collect(root, 0, target, s, out);
+            including.pop_back();
+            break;
+        }
+        case syntax_kind::use_statement: {
+            const int64_t target = resolve_import(node, offset, in_file);
+            if (target >= 0) s.uses.push_back(file_scope(target));
+            break;
+        }
+        case syntax_kind::module_definition:
+        case syntax_kind::function_definition:
+            if (node.size > 1 && node[1].kind() == syntax_kind::identifier) {
+                const std::string_view name = token_text(source, node[1], offset + node[0].width);
+                const definition def{&node, offset, in_file};
+                if (node.kind == syntax_kind::module_definition) {
+                    s.modules.set(name, def);
+                } else {
+                    s.functions.set(name, def);
+                }
+            }
+            break;
+        case syntax_kind::assignment: {
+            const std::string_view name = token_text(source, node[0], offset);
+            // The last assignment of a name wins, in the place of the first one
+            const statement value{&node[2], offset + node[0].width + node[1].width, in_file};
+            auto it = std::find_if(out.assignments.begin(), out.assignments.end(),
+                                   [name](const statement_list::assignment &a) { return a.name == name; });
+            if (it != out.assignments.end()) {
+                it->value = value;
+            } else {
+                out.assignments.push_back({name, value});
+            }
+            break;
+        }
+        case syntax_kind::module_instantiation:
+        case syntax_kind::if_statement:
+            out.instantiations.push_back({&element, offset, in_file});
+            break;
+        default:
+            break;
+        }
+    }
+
+    // The scope of a used file: its definitions and top level variables, its geometry is ignored
+    scope_ptr file_scope(size_t index) {
+        if (file_scopes[index]) return file_scopes[index];
+        scope_ptr s = scope::nested(base);
+        file_scopes[index] = s;
+        statement_list list;
+        const syntax_element root(files[index]->tree.root);
+        collect(root, 0, index, *s, list);
+        assign(list, s);
+        return s;
+    }
+
+    void assign(const statement_list &list, const scope_ptr &s) {
+        for (const statement_list::assignment &a : list.assignments) {
+            file_switch in(*this, a.value.file);
+            s->variables.set(a.name, evaluate(*a.value.element, a.value.offset, s));
+        }
+    }
+
+    std::vector<csg_node_ptr> instantiate(const statement_list &list, const scope_ptr &s) {
+        std::vector<csg_node_ptr> nodes;
+        for (const statement &st : list.instantiations) {
+            file_switch in(*this, st.file);
+            nodes.push_back(instantiate(*st.element->node(), st.offset, s));
+        }
+        return nodes;
+    }
+
+    // A child statement or module body in a new scope below parent
+    csg_node_ptr run(const syntax_element &element, uint32_t offset, const scope_ptr &s) {
+        statement_list list;
+        collect(element, offset, file, *s, list);
+        assign(list, s);
+        return make_group(instantiate(list, s));
+    }
+
+    ///////////////////////////////////////////////////////
+    // Lookup
+    ///////////////////////////////////////////////////////
+    value lookup(std::string_view name, const scope_ptr &s, uint32_t offset) {
+        if (is_special(name)) {
+            for (const scope *at = s.get(); at; at = at->caller ? at->caller.get() : at->parent.get()) {
+                if (const value *v = at->variables.find(name)) return *v;
+            }
+        } else {
+            for (const scope *at = s.get(); at; at = at->parent.get()) {
+                if (const value *v = at->variables.find(name)) return *v;
+            }
+        }
+        warn("Ignoring unknown variable '" + std::string(name) + "'", offset);
+        return value();
+    }
+
+    double special(const scope_ptr &s, std::string_view name) {
+        double d = 0;
+        to_number(lookup(name, s, 0), d);
+        return d;
+    }
+
+    resolution resolution_of(const scope_ptr &s) {
+        resolution detail{special(s, "$fn"), special(s, "$fs"), special(s, "$fa")};
+        if (options.coarsest.fn > 0 && detail.fn > options.coarsest.fn) detail.fn = options.coarsest.fn;
+        detail.fs = std::max(detail.fs, options.coarsest.fs);
+        detail.fa = std::max(detail.fa, options.coarsest.fa);
+        return detail;
+    }
+
+    // Modules or functions, along the lexical scopes and the used files of file scopes
+    bool find_definition(std::string_view name, const scope_ptr &s, bool module, definition &def, scope_ptr &owner) {
+        for (scope_ptr at = s; at; at = at->parent) {
+            const definition *found = module ? at->modules.find(name) : at->functions.find(name);
+            if (found) {
+                def = *found;
+                owner = at;
+                return true;
+            }
+            for (auto used = at->uses.rbegin(); used != at->uses.rend(); ++used) {
+                found = module ? (*used)->modules.find(name) : (*used)->functions.find(name);
+                if (found) {
+                    def = *found;
+                    owner = *used;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    ///////////////////////////////////////////////////////
+    // Calls
+    ///////////////////////////////////////////////////////
+    call_arguments arguments(const syntax_element &list, uint32_t offset, const scope_ptr &s) {
+        call_arguments args;
+        if (list.kind() != syntax_kind::argument_list) return args;
+        for_each_item(*list.node(), offset, [&](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() == syntax_kind::named_argument) {
+                const syntax_node &arg = *item.node();
+                const uint32_t value_offset = item_offset + arg[0].width + arg[1].width;
+                args.named.emplace_back(std::string(token(arg[0], item_offset)), evaluate(arg[2], value_offset, s));
+            } else if (item.is_node() || !is_token_separator(item.kind())) {
+                args.positional.push_back(evaluate(item, item_offset, s));
+            }
+        });
+        return args;
+    }
+
+    static bool is_token_separator(syntax_kind kind) {
+        return kind == syntax_kind::lparen || kind == syntax_kind::rparen || kind == syntax_kind::comma ||
+               kind == syntax_kind::semicolon;
+    }
+
+    // Parameters are bound in order, defaults may use the parameters before them
+    void bind_parameters(const syntax_node &parameters, uint32_t offset, const call_arguments &args, const scope_ptr &call) {
+        size_t position = 0;
+        for_each_item(parameters, offset, [&](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() != syntax_kind::parameter) return;
+            const syntax_node &param = *item.node();
+            const std::string_view name = token(param[0], item_offset);
+            const value *given = args.get(name, position++);
+            if (given) {
+                call->variables.set(name, *given);
+            } else if (param.size >= 3) {
+                const uint32_t default_offset = item_offset + param[0].width + param[1].width;
+                call->variables.set(name, evaluate(param[2], default_offset, call));
+            } else {
+                call->variables.set(name, value());
+            }
+        });
+        // $ variables can be passed to any call
+        for (const auto &arg : args.named) {
+            if (is_special(arg.first)) call->variables.set(arg.first, arg.second);
+        }
+    }
+
+    value call_function(const definition &def, const scope_ptr &owner, const call_arguments &args, const scope_ptr &caller) {
+        depth_guard guard(*this);
+        file_switch in(*this, def.file);
+        const syntax_node &node = *def.node;
+        // function name(parameters) = body;
+        uint32_t offset = def.offset + node[0].width + node[1].width;
+        if (node[2].kind() != syntax_kind::parameter_list) return value();
+        auto call = std::make_shared<scope>();
+        call->parent = owner;
+        call->caller = caller;
+        bind_parameters(*node[2].node(), offset, args, call);
+        offset += node[2].width + node[3].width;
+        return evaluate(node[4], offset, call);
+    }
+
+    value call_literal(const function_value &f, const call_arguments &args, const scope_ptr &caller) {
+        depth_guard guard(*this);
+        file_switch in(*this, f.file);
+        auto call = std::make_shared<scope>();
+        call->parent = f.closure;
+        call->caller = caller;
+        bind_parameters(*f.parameters, f.parameters_offset, args, call);
+        return evaluate(*f.body, f.body_offset, call);
+    }
+
+    value call(const syntax_node &node, uint32_t offset, const scope_ptr &s) {
+        const syntax_element &callee = node[0];
+        const uint32_t args_offset = offset + callee.width;
+        if (callee.kind() == syntax_kind::identifier) {
+            const std::string_view name = token(callee, offset);
+            definition def;
+            scope_ptr owner;
+            if (find_definition(name, s, false, def, owner)) {
+                return call_function(def, owner, arguments(node[1], args_offset, s), s);
+            }
+            // A variable holding a function literal
+            for (const scope *at = s.get(); at; at = at->parent.get()) {
+                if (const value *v = at->variables.find(name)) {
+                    const value target = *v;
+                    if (const function_value *f = target.function()) {
+                        return call_literal(*f, arguments(node[1], args_offset, s), s);
+                    }
+                    break;
+                }
+            }
+            auto builtin = builtin_functions().find(name);
+            if (builtin != builtin_functions().end()) {
+                return call_builtin(builtin->second, arguments(node[1], args_offset, s), offset);
+            }
+            warn("Ignoring unknown function '" + std::string(name) + "'", offset);
+            return value();
+        }
+        const value target = evaluate(callee, offset, s);
+        if (const function_value *f = target.function()) {
+            return call_literal(*f, arguments(node[1], args_offset, s), s);
+        }
+        warn("Can't call a value that is not a function", offset);
+        return value();
+    }
+
+    ///////////////////////////////////////////////////////
+    // Expressions
+    ///////////////////////////////////////////////////////
+    value evaluate(const syntax_element &element, uint32_t offset, const scope_ptr &s) {
+        if (!element.is_node()) {
+            switch (element.kind()) {
+            case syntax_kind::number: {
+                const std::string digits(token(element, offset));
+                return std::strtod(digits.c_str(), nullptr);
+            }
+            case syntax_kind::string:
+                return unescape(token(element, offset));
+            case syntax_kind::identifier:
+                return lookup(token(element, offset), s, offset);
+            case syntax_kind::kw_true:
+                return true;
+            case syntax_kind::kw_false:
+                return false;
+            default:
+                return value();
+            }
+        }
+
+        const syntax_node &node = *element.node();
+        switch (node.kind) {
+        case syntax_kind::paren_expression:
+            return evaluate(node[1], offset + node[0].width, s);
+        case syntax_kind::unary_expression: {
+            const value operand = evaluate(node[1], offset + node[0].width, s);
+            switch (node[0].kind()) {
+            case syntax_kind::bang: return !operand.truthy();
+            case syntax_kind::minus: return negate(operand);
+            default: return operand.number() || operand.vector() ? operand : value();
+            }
+        }
+        case syntax_kind::binary_expression:
+            return binary(node, offset, s);
+        case syntax_kind::ternary_expression: {
+            const uint32_t then_offset = offset + node[0].width + node[1].width;
+            if (evaluate(node[0], offset, s).truthy()) {
+                return evaluate(node[2], then_offset, s);
+            }
+            return evaluate(node[4], then_offset + node[2].width + node[3].width, s);
+        }
+        case syntax_kind::call_expression:
+            return call(node, offset, s);
+        case syntax_kind::index_expression: {
+            const value base = evaluate(node[0], offset, s);
+            const value index = evaluate(node[2], offset + node[0].width + node[1].width, s);
+            return subscript(base, index);
+        }
+        case syntax_kind::member_expression: {
+            const value base = evaluate(node[0], offset, s);
+            const std::string_view member = token(node[2], offset + node[0].width + node[1].width);
+            if (const range_value *r = base.range()) {
+                if (member == "begin") return r->begin;
+                if (member == "step") return r->step;
+                if (member == "end") return r->end;
+                return value();
+            }
+            const double index = member == "x" ? 0 : member == "y" ? 1 : member == "z" ? 2 : -1;
+            return index < 0 ? value() : subscript(base, index);
+        }
+        case syntax_kind::vector_expression: {
+            value_vector items;
+            for_each_item(node, offset, [&](const syntax_element &item, uint32_t item_offset) {
+                const syntax_kind kind = item.kind();
+                if (kind == syntax_kind::lbracket || kind == syntax_kind::rbracket || kind == syntax_kind::comma) return;
+                generate(item, item_offset, s, items);
+            });
+            return items;
+        }
+        case syntax_kind::range_expression: {
+            // [begin : end] or [begin : step : end]
+            value parts[3];
+            size_t count = 0;
+            for_each_item(node, offset, [&](const syntax_element &item, uint32_t item_offset) {
+                const syntax_kind kind = item.kind();
+                if (kind == syntax_kind::lbracket || kind == syntax_kind::rbracket || kind == syntax_kind::colon) return;
+                if (count < 3) parts[count++] = evaluate(item, item_offset, s);
+            });
+            range_value r;
+            const bool valid = count == 2 ? to_number(parts[0], r.begin) && to_number(parts[1], r.end)
+                                          : to_number(parts[0], r.begin) && to_number(parts[1], r.step) &&
+                                                to_number(parts[2], r.end);
+            return valid ? value(r) : value();
+        }
+        case syntax_kind::let_expression: {
+            scope_ptr inner = bind_sequentially(node[1], offset + node[0].width, s);
+            return evaluate(node[2], offset + node[0].width + node[1].width, inner);
+        }
+        case syntax_kind::assert_expression:
+            check_assertion(node[1], offset + node[0].width, s);
+            return evaluate(node[2], offset + node[0].width + node[1].width, s);
+        case syntax_kind::echo_expression:
+            echo(arguments(node[1], offset + node[0].width, s));
+            return evaluate(node[2], offset + node[0].width + node[1].width, s);
+        case syntax_kind::function_literal: {
+            if (node[1].kind() != syntax_kind::parameter_list) return value();
+            auto f = std::make_shared<function_value>();
+            f->parameters = node[1].node();
+            f->parameters_offset = offset + node[0].width;
+            f->body = &node[2];
+            f->body_offset = f->parameters_offset + node[1].width;
+            f->file = file;
+            f->closure = s;
+            closures.push_back(s);
+            return function_ptr(std::move(f));
+        }
+        case syntax_kind::comprehension_for:
+        case syntax_kind::comprehension_if:
+        case syntax_kind::comprehension_each:
+            warn("List comprehension outside of a vector", offset);
+            return value();
+        default:
+            return value();
+        }
+    }
+
+    static std::string unescape(std::string_view quoted) {
+        std::string out;
+        const std::string_view body = quoted.substr(1, quoted.size() >= 2 ? quoted.size() - 2 : 0);
+        for (size_t i = 0; i < body.size(); i++) {
+            if (body[i] != '\\' || i + 1 == body.size()) {
+                out += body[i];
+                continue;
+            }
+            const char c = body[++i];
+            switch (c) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'x':
+                if (i + 2 < body.size()) {
+                    const std::string hex(body.substr(i + 1, 2));
+                    out += static_cast<char>(std::strtol(hex.c_str(), nullptr, 16));
+                    i += 2;
+                }
+                break;
+            default: out += c; break;
+            }
+        }
+        return out;
+    }
+
+    value binary(const syntax_node &node, uint32_t offset, const scope_ptr &s) {
+        value left = evaluate(node[0], offset, s);
+        offset += node[0].width;
+        for (size_t i = 1; i + 1 < node.size; i += 2) {
+            const syntax_kind op = node[i].kind();
+            const uint32_t right_offset = offset + node[i].width;
+            offset = right_offset + node[i + 1].width;
+            if (op == syntax_kind::logical_and) {
+                left = left.truthy() && evaluate(node[i + 1], right_offset, s).truthy();
+                continue;
+            }
+            if (op == syntax_kind::logical_or) {
+                left = left.truthy() || evaluate(node[i + 1], right_offset, s).truthy();
+                continue;
+            }
+            const value right = evaluate(node[i + 1], right_offset, s);
+            left = apply(op, left, right);
+        }
+        return left;
+    }
+
+    static value negate(const value &v) {
+        if (const double *d = v.number()) return -*d;
+        if (const value_vector *items = v.vector()) {
+            value_vector out;
+            for (const value &item : *items) out.push_back(negate(item));
+            return out;
+        }
+        return value();
+    }
+
+    // Element wise for vectors of equal nesting, like OpenSCAD's + and -
+    static value elementwise(const value &a, const value &b, bool subtract) {
+        const double *x = a.number();
+        const double *y = b.number();
+        if (x && y) return subtract ? *x - *y : *x + *y;
+        const value_vector *va = a.vector();
+        const value_vector *vb = b.vector();
+        if (!va || !vb) return value();
+        value_vector out;
+        for (size_t i = 0; i < va->size() && i < vb->size(); i++) {
+            out.push_back(elementwise((*va)[i], (*vb)[i], subtract));
+        }
+        return out;
+    }
+
+    static value scaled(const value &v, double factor, bool divide) {
+        if (const double *d = v.number()) return divide ? *d / factor : *d * factor;
+        if (const value_vector *items = v.vector()) {
+            value_vector out;
+            for (const value &item : *items) out.push_back(scaled(item, factor, divide));
+            return out;
+        }
+        return value();
+    }
+
+    static bool is_numbers(const value_vector &items) {
+        return std::all_of(items.begin(), items.end(), [](const value &v) { return v.number() != nullptr; });
+    }
+
+    // Dot product, matrix times vector, vector times matrix and matrix times matrix
+    static value multiply(const value_vector &a, const value_vector &b) {
+        if (is_numbers(a) && is_numbers(b)) {
+            if (a.size() != b.size()) return value();
+            double sum = 0;
+            for (size_t i = 0; i < a.size(); i++) sum += *a[i].number() * *b[i].number();
+            return sum;
+        }
+        if (is_numbers(b)) {
+            value_vector out;
+            for (const value &row : a) {
+                const value_vector *r = row.vector();
+                if (!r) return value();
+                out.push_back(multiply(*r, b));
+            }
+            return out;
+        }
+        // a is a row vector or a matrix, b a matrix: multiply with the columns of b
+        const size_t columns = b.empty() || !b[0].vector() ? 0 : b[0].vector()->size();
+        value_vector transposed;
+        for (size_t c = 0; c < columns; c++) {
+            value_vector column;
+            for (const value &row : b) {
+                const value_vector *r = row.vector();
+                if (!r || c >= r->size()) return value();
+                column.push_back((*r)[c]);
+            }
+            transposed.push_back(value(std::move(column)));
+        }
+        if (is_numbers(a)) return multiply(transposed, a);
+        value_vector out;
+        for (const value &row : a) {
+            const value_vector *r = row.vector();
+            if (!r) return value();
+            out.push_back(multiply(transposed, *r));
+        }
+        return out;
+    }
+
+    static value apply(syntax_kind op, const value &a, const value &b) {
+        const double *x = a.number();
+        const double *y = b.number();
+        switch (op) {
+        case syntax_kind::plus: return elementwise(a, b, false);
+        case syntax_kind::minus: return elementwise(a, b, true);
+        case syntax_kind::star:
+            if (x && y) return *x * *y;
+            if (x && b.vector()) return scaled(b, *x, false);
+            if (y && a.vector()) return scaled(a, *y, false);
+            if (a.vector() && b.vector()) return multiply(*a.vector(), *b.vector());
+            return value();
+        case syntax_kind::slash:
+            if (x && y) return *x / *y;
+            if (y && a.vector()) return scaled(a, *y, true);
+            return value();
+        case syntax_kind::percent:
+            return x && y ? value(std::fmod(*x, *y)) : value();
+        case syntax_kind::caret:
+            return x && y ? value(std::pow(*x, *y)) : value();
+        case syntax_kind::equal: return a == b;
+        case syntax_kind::not_equal: return !(a == b);
+        case syntax_kind::less:
+        case syntax_kind::less_equal:
+        case syntax_kind::greater:
+        case syntax_kind::greater_equal: {
+            int order;
+            if (x && y) {
+                order = *x < *y ? -1 : *x > *y ? 1 : 0;
+            } else if (a.string() && b.string()) {
+                order = a.string()->compare(*b.string());
+            } else if (a.boolean() && b.boolean()) {
+                order = int(*a.boolean()) - int(*b.boolean());
+            } else {
+                return value();
+            }
+            switch (op) {
+            case syntax_kind::less: return order < 0;
+            case syntax_kind::less_equal: return order <= 0;
+            case syntax_kind::greater: return order > 0;
+            default: return order >= 0;
+            }
+        }
+        default:
+            return value();
+        }
+    }
+
+    static value subscript(const value &base, const value &index) {
+        double d;
+        if (!to_number(index, d) || d < 0 || std::isnan(d)) return value();
+        const size_t i = static_cast<size_t>(d);
+        if (const value_vector *items = base.vector()) {
+            return i < items->size() ? (*items)[i] : value();
+        }
+        if (const std::string *s = base.string()) {
+            return i < s->size() ? value(std::string(1, (*s)[i])) : value();
+        }
+        return value();
+    }
+
+    /**
+     * The elements an item of a vector contributes: expressions add one, comprehensions
+     * any number.
+     */
+    void generate(const syntax_element &item, uint32_t offset, const scope_ptr &s, value_vector &out) {
+        const syntax_kind kind = item.kind();
+        if (kind == syntax_kind::comprehension_for) {
+            const syntax_node &node = *item.node();
+            const uint32_t args_offset = offset + node[0].width;
+            const uint32_t body_offset = args_offset + node[1].width;
+            if (is_c_style(node[1])) {
+                c_style_loop(*node[1].node(), args_offset, s, [&](const scope_ptr &inner) {
+                    generate(node[2], body_offset, inner, out);
+                });
+            } else {
+                loop(node[1], args_offset, s, [&](const scope_ptr &inner) {
+                    generate(node[2], body_offset, inner, out);
+                });
+            }
+        } else if (kind == syntax_kind::comprehension_if) {
+            // if ( condition ) body [else body]
+            const syntax_node &node = *item.node();
+            const uint32_t condition_offset = offset + node[0].width + node[1].width;
+            const uint32_t body_offset = condition_offset + node[2].width + node[3].width;
+            if (evaluate(node[2], condition_offset, s).truthy()) {
+                generate(node[4], body_offset, s, out);
+            } else if (node.size >= 7) {
+                generate(node[6], body_offset + node[4].width + node[5].width, s, out);
+            }
+        } else if (kind == syntax_kind::comprehension_each) {
+            const syntax_node &node = *item.node();
+            value_vector values;
+            generate(node[1], offset + node[0].width, s, values);
+            for (const value &v : values) {
+                if (const value_vector *items = v.vector()) {
+                    out.insert(out.end(), items->begin(), items->end());
+                } else if (const range_value *r = v.range()) {
+                    const double count = checked_count(*r, offset);
+                    for (double i = 0; i < count; i++) out.push_back(r->begin + i * r->step);
+                } else if (const std::string *text = v.string()) {
+                    for (char c : *text) out.push_back(std::string(1, c));
+                } else {
+                    out.push_back(v);
+                }
+            }
+        } else if (kind == syntax_kind::let_expression) {
+            const syntax_node &node = *item.node();
+            scope_ptr inner = bind_sequentially(node[1], offset + node[0].width, s);
+            generate(node[2], offset + node[0].width + node[1].width, inner, out);
+        } else {
+            out.push_back(evaluate(item, offset, s));
+        }
+        if (out.size() > options.max_elements) {
+            throw evaluation_error("Vector with more than " + std::to_string(options.max_elements) + " elements");
+        }
+    }
+
+    double checked_count(const range_value &r, uint32_t offset) {
+        const double count = r.count();
+        if (count > options.max_elements) {
+            throw evaluation_error("Range with more than " + std::to_string(options.max_elements) + " elements " +
+                                   location(offset));
+        }
+        return count;
+    }
+
+    static bool is_c_style(const syntax_element &args) {
+        if (args.kind() != syntax_kind::argument_list) return false;
+        bool found = false;
+        for_each_item(*args.node(), 0, [&found](const syntax_element &item, uint32_t) {
+            found = found || item.kind() == syntax_kind::semicolon;
+        });
+        return found;
+    }
+
+    // let (a = 1, b = a + 1): every binding sees the ones before it
+    scope_ptr bind_sequentially(const syntax_element &args, uint32_t offset, const scope_ptr &s) {
+        scope_ptr inner = scope::nested(s);
+        if (args.kind() != syntax_kind::argument_list) return inner;
+        for_each_item(*args.node(), offset, [&](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() != syntax_kind::named_argument) return;
+            const syntax_node &arg = *item.node();
+            const uint32_t value_offset = item_offset + arg[0].width + arg[1].width;
+            inner->variables.set(token(arg[0], item_offset), evaluate(arg[2], value_offset, inner));
+        });
+        return inner;
+    }
+
+    /**
+     * for (a = [...], b = [...]): nested loops over every binding, body is called with a scope
+     * holding one combination.
+     */
+    template <typename Body>
+    void loop(const syntax_element &args, uint32_t offset, const scope_ptr &s, Body &&body) {
+        std::vector<std::pair<const syntax_node *, uint32_t>> bindings;
+        if (args.kind() == syntax_kind::argument_list) {
+            for_each_item(*args.node(), offset, [&](const syntax_element &item, uint32_t item_offset) {
+                if (item.kind() == syntax_kind::named_argument) bindings.emplace_back(item.node(), item_offset);
+            });
+        }
+        loop_level(bindings, 0, s, body);
+    }
+
+    template <typename Body>
+    void loop_level(const std::vector<std::pair<const syntax_node *, uint32_t>> &bindings, size_t level,
+                    const scope_ptr &s, Body &body) {
+        if (level == bindings.size()) {
+            body(s);
+            return;
+        }
+        const syntax_node &arg = *bindings[level].first;
+        const uint32_t arg_offset = bindings[level].second;
+        const std::string_view name = token(arg[0], arg_offset);
+        const value values = evaluate(arg[2], arg_offset + arg[0].width + arg[1].width, s);
+        auto iteration = [&](value v) {
+            scope_ptr inner = scope::nested(s);
+            inner->variables.set(name, std::move(v));
+            loop_level(bindings, level + 1, inner, body);
+        };
+        if (const range_value *r = values.range()) {
+            const double count = checked_count(*r, arg_offset);
+            for (double i = 0; i < count; i++) iteration(r->begin + i * r->step);
+        } else if (const value_vector *items = values.vector()) {
+            for (const value &v : *items) iteration(v);
+        } else if (const std::string *text = values.string()) {
+            for (char c : *text) iteration(std::string(1, c));
+        } else if (!values.is_undef()) {
+            iteration(values);
+        }
+    }
+
+    // for (init; condition; update) in list comprehensions
+    template <typename Body>
+    void c_style_loop(const syntax_node &args, uint32_t offset, const scope_ptr &s, Body &&body) {
+        std::vector<std::pair<const syntax_element *, uint32_t>> parts[3];
+        size_t part = 0;
+        for_each_item(args, offset, [&](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() == syntax_kind::semicolon) {
+                part++;
+            } else if (part < 3 && !is_token_separator(item.kind())) {
+                parts[part].emplace_back(&item, item_offset);
+            }
+        });
+        auto bind = [this](const std::vector<std::pair<const syntax_element *, uint32_t>> &assignments,
+                           const scope_ptr &from) {
+            scope_ptr next = scope::nested(from->parent);
+            next->variables = from->variables;
+            for (const auto &a : assignments) {
+                if (a.first->kind() != syntax_kind::named_argument) continue;
+                const syntax_node &arg = *a.first->node();
+                const uint32_t value_offset = a.second + arg[0].width + arg[1].width;
+                next->variables.set(token(arg[0], a.second), evaluate(arg[2], value_offset, from));
+            }
+            return next;
+        };
+        scope_ptr current = scope::nested(s);
+        current = bind(parts[0], current);
+        for (size_t iterations = 0;; iterations++) {
+            if (iterations > options.max_elements) {
+                throw evaluation_error("Loop with more than " + std::to_string(options.max_elements) + " iterations");
+            }
+            bool running = true;
+            for (const auto &condition : parts[1]) {
+                running = running && evaluate(*condition.first, condition.second, current).truthy();
+            }
+            if (!running) break;
+            body(current);
+            current = bind(parts[2], current);
+        }
+    }
+
+    void echo(const call_arguments &args) {
+        std::string text = "ECHO: ";
+        bool first = true;
+        for (const value &v : args.positional) {
+            if (!first) text += ", ";
+            first = false;
+            text += to_text(v, true);
+        }
+        for (const auto &arg : args.named) {
+            if (!first) text += ", ";
+            first = false;
+            text += arg.first + " = " + to_text(arg.second, true);
+        }
+        message(std::move(text));
+    }
+
+    void check_assertion(const syntax_element &args, uint32_t offset, const scope_ptr &s) {
+        const call_arguments values = arguments(args, offset, s);
+        const value *condition = values.get("condition", 0);
+        if (condition && condition->truthy()) return;
+        const value *text = values.get("message", 1);
+        throw evaluation_error("Assertion failed" + (text ? ": " + to_text(*text, false) : std::string()) + " " +
+                               location(offset));
+    }
+
+    ///////////////////////////////////////////////////////
+    // Builtin functions
+    ///////////////////////////////////////////////////////
+    value call_builtin(builtin_function f, const call_arguments &args, uint32_t offset) {
+        const value *first = args.positional.empty() ? nullptr : &args.positional[0];
+        double x = 0;
+        double y = 0;
+        const bool number = first && to_number(*first, x);
+        auto math = [&](double (*fn)(double)) { return number ? value(fn(x)) : value(); };
+
+        switch (f) {
+        case builtin_function::abs: return math(std::fabs);
+        case builtin_function::sign: return number ? value(double((x > 0) - (x < 0))) : value();
+        case builtin_function::sin: return math(sin_degrees);
+        case builtin_function::cos: return math(cos_degrees);
+        case builtin_function::tan: return number ? value(sin_degrees(x) / cos_degrees(x)) : value();
+        case builtin_function::asin: return number ? value(std::asin(x) * 180 / PI) : value();
+        case builtin_function::acos: return number ? value(std::acos(x) * 180 / PI) : value();
+        case builtin_function::atan: return number ? value(std::atan(x) * 180 / PI) : value();
+        case builtin_function::atan2:
+            return args.positional.size() == 2 && to_number(args.positional[0], y) && to_number(args.positional[1], x)
+                       ? value(std::atan2(y, x) * 180 / PI) : value();
+        case builtin_function::floor: return math(std::floor);
+        case builtin_function::round: return math(std::round);
+        case builtin_function::ceil: return math(std::ceil);
+        case builtin_function::ln: return math(std::log);
+        case builtin_function::log:
+            if (args.positional.size() == 2 && to_number(args.positional[1], y)) {
+                return number ? value(std::log(y) / std::log(x)) : value();
+            }
+            return math(std::log10);
+        case builtin_function::pow:
+            return number && args.positional.size() == 2 && to_number(args.positional[1], y) ? value(std::pow(x, y))
+                                                                                              : value();
+        case builtin_function::sqrt: return math(std::sqrt);
+        case builtin_function::exp: return math(std::exp);
+        case builtin_function::min:
+        case builtin_function::max: {
+            if (args.positional.size() == 1 && number) return x;
+            const value_vector *items = args.positional.size() == 1 ? first->vector() : &args.positional;
+            if (!items || items->empty()) return value();
+            double best = f == builtin_function::min ? HUGE_VAL : -HUGE_VAL;
+            for (const value &v : *items) {
+                double d;
+                if (!to_number(v, d)) return value();
+                best = f == builtin_function::min ? std::min(best, d) : std::max(best, d);
+            }
+            return best;
+        }
+        case builtin_function::norm: {
+            const value_vector *items = first ? first->vector() : nullptr;
+            if (!items) return value();
+            double sum = 0;
+            for (const value &v : *items) {
+                double d;
+                if (!to_number(v, d)) return value();
+                sum += d * d;
+            }
+            return std::sqrt(sum);
+        }
+        case builtin_function::cross: {
+            vec3 a;
+            vec3 b;
+            if (args.positional.size() != 2 || !to_vec3(args.positional[0], a, 0) || !to_vec3(args.positional[1], b, 0)) {
+                return value();
+            }
+            if (args.positional[0].vector()->size() == 2 && args.positional[1].vector()->size() == 2) {
+                return a.x * b.y - a.y * b.x;
+            }
+            const vec3 c = a.cross(b);
+            return value_vector{c.x, c.y, c.z};
+        }
+        case builtin_function::len:
+            if (!first) return value();
+            if (const value_vector *items = first->vector()) return double(items->size());
+            if (const std::string *s = first->string()) return double(s->size());
+            return value();
+        case builtin_function::concat: {
+            value_vector out;
+            for (const value &v : args.positional) {
+                if (const value_vector *items = v.vector()) {
+                    out.insert(out.end(), items->begin(), items->end());
+                } else {
+                    out.push_back(v);
+                }
+            }
+            return out;
+        }
+        case builtin_function::lookup: {
+            const value_vector *table = args.positional.size() == 2 ? args.positional[1].vector() : nullptr;
+            if (!number || !table) return value();
+            double low_key = -HUGE_VAL, low = 0, high_key = HUGE_VAL, high = 0;
+            double min_key = HUGE_VAL, min_value = 0, max_key = -HUGE_VAL, max_value = 0;
+            for (const value &entry : *table) {
+                const value_vector *pair = entry.vector();
+                double key, v;
+                if (!pair || pair->size() < 2 || !to_number((*pair)[0], key) || !to_number((*pair)[1], v)) continue;
+                if (key <= x && key > low_key) low_key = key, low = v;
+                if (key >= x && key < high_key) high_key = key, high = v;
+                if (key < min_key) min_key = key, min_value = v;
+                if (key > max_key) max_key = key, max_value = v;
+            }
+            if (x <= min_key) return min_value;
+            if (x >= max_key) return max_value;
+            if (high_key == low_key) return low;
+            return low + (high - low) * (x - low_key) / (high_key - low_key);
+        }
+        case builtin_function::str: {
+            std::string out;
+            for (const value &v : args.positional) out += to_text(v, false);
+            return out;
+        }
+        case builtin_function::chr: {
+            std::string out;
+            std::function<void(const value &)> add = [&](const value &v) {
+                double code;
+                if (to_number(v, code)) {
+                    append_utf8(out, static_cast<uint32_t>(code));
+                } else if (const value_vector *items = v.vector()) {
+                    for (const value &item : *items) add(item);
+                }
+            };
+            for (const value &v : args.positional) add(v);
+            return out;
+        }
+        case builtin_function::ord: {
+            const std::string *s = first ? first->string() : nullptr;
+            return s && s->size() == 1 ? value(double(static_cast<unsigned char>((*s)[0]))) : value();
+        }
+        case builtin_function::rands: {
+            // Without a seed OpenSCAD returns new numbers every time, here a render is reproducible
+            const double low = args.number("min_value", 0, 0);
+            const double high = args.number("max_value", 1, 1);
+            const double count = args.number("value_count", 2, 1);
+            const double seed = args.number("seed_value", 3, 0);
+            if (count < 0 || count > options.max_elements) return value();
+            std::mt19937 generator(static_cast<uint32_t>(seed));
+            std::uniform_real_distribution<double> distribution(std::min(low, high), std::max(low, high));
+            value_vector out;
+            for (double i = 0; i < count; i++) out.push_back(distribution(generator));
+            return out;
+        }
+        case builtin_function::is_undef: return first && first->is_undef();
+        case builtin_function::is_bool: return first && first->boolean();
+        case builtin_function::is_num: return first && first->number() && !std::isnan(*first->number());
+        case builtin_function::is_string: return first && first->string();
+        case builtin_function::is_list: return first && first->vector();
+        case builtin_function::is_function: return first && first->function();
+        case builtin_function::version: return value_vector{2021.0, 1.0, 0.0};
+        case builtin_function::version_num: return 20210100.0;
+        }
+        warn("Unsupported function", offset);
+        return value();
+    }
+
+    static void append_utf8(std::string &out, uint32_t code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x110000) {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    ///////////////////////////////////////////////////////
+    // Module instantiations
+    ///////////////////////////////////////////////////////
+    csg_node_ptr instantiate(const syntax_node &node, uint32_t offset, const scope_ptr &s) {
+        if (node.kind == syntax_kind::if_statement) {
+            // if ( condition ) statement [else statement]
+            const uint32_t condition_offset = offset + node[0].width + node[1].width;
+            const uint32_t then_offset = condition_offset + node[2].width + node[3].width;
+            if (evaluate(node[2], condition_offset, s).truthy()) {
+                return run(node[4], then_offset, scope::nested(s));
+            }
+            if (node.size >= 7) {
+                return run(node[6], then_offset + node[4].width + node[5].width, scope::nested(s));
+            }
+            return nullptr;
+        }
+
+        // Modifiers, name, arguments, child statement
+        size_t i = 0;
+        bool root = false;
+        for (; i < node.size && is_modifier(node[i].kind()); offset += node[i++].width) {
+            switch (node[i].kind()) {
+            case syntax_kind::star:
+            case syntax_kind::percent:
+                // Disabled and background objects are not part of the model
+                return nullptr;
+            case syntax_kind::bang:
+                root = true;
+                break;
+            default:
+                break;
+            }
+        }
+        if (i + 2 >= node.size) return nullptr;
+        if (options.max_instances && ++instances > options.max_instances) {
+            if (instances == options.max_instances + 1) {
+                message("WARNING: More than " + std::to_string(options.max_instances) +
+                            " module instances, the rest of the model is left out", true);
+            }
+            return nullptr;
+        }
+        const syntax_element &name = node[i];
+        const uint32_t args_offset = offset + name.width;
+        const syntax_element &args = node[i + 1];
+        const uint32_t child_offset = args_offset + args.width;
+        const syntax_element &child = node[i + 2];
+
+        csg_node_ptr result;
+        switch (name.kind()) {
+        case syntax_kind::kw_for: {
+            std::vector<csg_node_ptr> iterations;
+            loop(args, args_offset, s, [&](const scope_ptr &inner) {
+                iterations.push_back(run(child, child_offset, scope::nested(inner)));
+            });
+            result = make_group(std::move(iterations));
+            break;
+        }
+        case syntax_kind::kw_let:
+            result = run(child, child_offset, bind_sequentially(args, args_offset, s));
+            break;
+        case syntax_kind::kw_echo:
+            echo(arguments(args, args_offset, s));
+            result = run(child, child_offset, scope::nested(s));
+            break;
+        case syntax_kind::kw_assert:
+            check_assertion(args, args_offset, s);
+            result = run(child, child_offset, scope::nested(s));
+            break;
+        case syntax_kind::identifier:
+            result = call_module(token(name, offset), offset, args, args_offset, child, child_offset, s);
+            break;
+        default:
+            break;
+        }
+        if (root && !root_override) root_override = result;
+        return result;
+    }
+
+    csg_node_ptr call_module(std::string_view name, uint32_t offset, const syntax_element &args, uint32_t args_offset,
+                             const syntax_element &child, uint32_t child_offset, const scope_ptr &s) {
+        definition def;
+        scope_ptr owner;
+        if (find_definition(name, s, true, def, owner)) {
+            depth_guard guard(*this);
+            // The child statements run in the instantiating scope, their assignments once
+            auto children = std::make_shared<children_context>();
+            children->scope = scope::nested(s);
+            statement_list list;
+            collect(child, child_offset, file, *children->scope, list);
+            assign(list, children->scope);
+            children->statements = std::move(list.instantiations);
+
+            const call_arguments values = arguments(args, args_offset, s);
+            file_switch in(*this, def.file);
+            const syntax_node &module = *def.node;
+            // module name(parameters) statement
+            const uint32_t parameters_offset = def.offset + module[0].width + module[1].width;
+            auto call = std::make_shared<scope>();
+            call->parent = owner;
+            call->caller = s;
+            call->variables.set("$children", double(children->statements.size()));
+            call->children = std::move(children);
+            if (module[2].kind() == syntax_kind::parameter_list) {
+                bind_parameters(*module[2].node(), parameters_offset, values, call);
+            }
+            return run(module[3], parameters_offset + module[2].width, call);
+        }
+
+        if (name == "intersection_for") {
+            std::vector<csg_node_ptr> iterations;
+            loop(args, args_offset, s, [&](const scope_ptr &inner) {
+                iterations.push_back(run(child, child_offset, scope::nested(inner)));
+            });
+            return make_group(std::move(iterations), csg_node::kind::intersection);
+        }
+        auto builtin = builtin_modules().find(name);
+        if (builtin == builtin_modules().end()) {
+            warn("Ignoring unknown module '" + std::string(name) + "'", offset);
+            return nullptr;
+        }
+        const call_arguments values = arguments(args, args_offset, s);
+        // $fn and friends given as arguments apply to the object and its children
+        scope_ptr inner = scope::nested(s);
+        for (const auto &arg : values.named) {
+            if (is_special(arg.first)) inner->variables.set(arg.first, arg.second);
+        }
+        // Every child statement is one operand of a boolean operation
+        auto children = [&]() {
+            scope_ptr body = scope::nested(inner);
+            statement_list list;
+            collect(child, child_offset, file, *body, list);
+            assign(list, body);
+            return instantiate(list, body);
+        };
+        // The call without its children, for picking the source of a part of the model
+        const source_span call{file, static_cast<uint32_t>(name.data() - text.data()), child_offset};
+        return builtin_module_node(builtin->second, name, offset, call, values, inner, children);
+    }
+
+    csg_node_ptr children_of_module(const call_arguments &values, const scope_ptr &s, uint32_t offset) {
+        const children_context *context = nullptr;
+        for (const scope *at = s.get(); at && !context; at = at->parent.get()) {
+            context = at->children.get();
+        }
+        if (!context) return nullptr;
+
+        std::vector<size_t> selected;
+        const value *index = values.get("index", 0);
+        double d;
+        if (!index || index->is_undef()) {
+            for (size_t i = 0; i < context->statements.size(); i++) selected.push_back(i);
+        } else if (to_number(*index, d)) {
+            selected.push_back(static_cast<size_t>(std::max(0.0, d)));
+        } else if (const value_vector *items = index->vector()) {
+            for (const value &v : *items) {
+                if (to_number(v, d)) selected.push_back(static_cast<size_t>(std::max(0.0, d)));
+            }
+        } else if (const range_value *r = index->range()) {
+            const double count = checked_count(*r, offset);
+            for (double i = 0; i < count; i++) selected.push_back(static_cast<size_t>(std::max(0.0, r->begin + i * r->step)));
+        }
+
+        std::vector<csg_node_ptr> nodes;
+        for (size_t i : selected) {
+            if (i >= context->statements.size()) continue;
+            // Lexically inside the instantiation, but with the $ variables of the module
+            auto inner = std::make_shared<scope>();
+            inner->parent = context->scope;
+            inner->caller = s;
+            const statement &st = context->statements[i];
+            file_switch in(*this, st.file);
+            nodes.push_back(instantiate(*st.element->node(), st.offset, inner));
+        }
+        return make_group(std::move(nodes));
+    }
+
+    template <typename Children>
+    csg_node_ptr builtin_module_node(builtin_module module, std::string_view name, uint32_t offset,
+                                     const source_span &call, const call_arguments &values, const scope_ptr &s,
+                                     Children &&children) {
+        auto node = std::make_shared<csg_node>();
+        node->source = call;
+        switch (module) {
+        case builtin_module::cube: {
+            node->type = csg_node::kind::cube;
+            const value *size = values.get("size", 0);
+            double d = 1;
+            if (!size || !to_vec3(*size, node->size, 0)) {
+                if (size) to_number(*size, d);
+                node->size = {d, d, d};
+            }
+            node->center = values.flag("center", 1, false);
+            return node;
+        }
+        case builtin_module::sphere: {
+            node->type = csg_node::kind::sphere;
+            node->r1 = radius(values, "r", "d", 0, 1);
+            const resolution detail = resolution_of(s);
+            node->fragments = circle_fragments(node->r1, detail.fn, detail.fs, detail.fa);
+            return node;
+        }
+        case builtin_module::cylinder: {
+            node->type = csg_node::kind::cylinder;
+            node->height = values.number("h", 0, 1);
+            const double r = radius(values, "r", "d", SIZE_MAX, 1);
+            node->r1 = radius(values, "r1", "d1", 1, r);
+            node->r2 = radius(values, "r2", "d2", 2, r);
+            node->center = values.flag("center", SIZE_MAX, false);
+            const resolution detail = resolution_of(s);
+            node->fragments = circle_fragments(std::max(node->r1, node->r2), detail.fn, detail.fs, detail.fa);
+            return node;
+        }
+        case builtin_module::polyhedron: {
+            node->type = csg_node::kind::polyhedron;
+            const value *faces = values.get("faces", 1);
+            if (!faces) faces = values.get("triangles");
+            if (!points_of(values.get("points", 0), node->points, false) || !faces || !indices_of(*faces, node->faces)) {
+                warn("Invalid polyhedron, ignored", offset);
+                return nullptr;
+            }
+            return node;
+        }
+        case builtin_module::square: {
+            node->type = csg_node::kind::square;
+            node->dimension = 2;
+            const value *size = values.get("size", 0);
+            double d = 1;
+            if (!size || !to_vec3(*size, node->size, 0)) {
+                if (size) to_number(*size, d);
+                node->size = {d, d, 0};
+            }
+            node->center = values.flag("center", 1, false);
+            return node;
+        }
+        case builtin_module::circle: {
+            node->type = csg_node::kind::circle;
+            node->dimension = 2;
+            node->r1 = radius(values, "r", "d", 0, 1);
+            const resolution detail = resolution_of(s);
+            node->fragments = circle_fragments(node->r1, detail.fn, detail.fs, detail.fa);
+            return node;
+        }
+        case builtin_module::polygon: {
+            node->type = csg_node::kind::polygon;
+            node->dimension = 2;
+            const value *paths = values.get("paths", 1);
+            if (!points_of(values.get("points", 0), node->points, true) ||
+                (paths && !paths->is_undef() && !indices_of(*paths, node->faces))) {
+                warn("Invalid polygon, ignored", offset);
+                return nullptr;
+            }
+            return node;
+        }
+        case builtin_module::translate:
+        case builtin_module::rotate:
+        case builtin_module::scale:
+        case builtin_module::mirror:
+        case builtin_module::multmatrix:
+            return transform(module, values, children(), offset);
+        case builtin_module::resize: {
+            node->type = csg_node::kind::resize;
+            const value *size = values.get("newsize", 0);
+            if (!size || !to_vec3(*size, node->size, 0)) return make_group(children());
+            const value *automatic = values.get("auto", 1);
+            for (int axis = 0; automatic && axis < 3; axis++) {
+                if (const value_vector *flags = automatic->vector()) {
+                    node->auto_size[axis] = axis < int(flags->size()) && (*flags)[axis].truthy();
+                } else {
+                    node->auto_size[axis] = automatic->truthy();
+                }
+            }
+            csg_node_ptr resized = with_children(node, children(), true);
+            if (resized && resized->dimension == 2) {
+                throw evaluation_error("resize() of 2D objects is not supported by the renderer " + location(offset));
+            }
+            return resized;
+        }
+        case builtin_module::color:
+        case builtin_module::group:
+        case builtin_module::union_:
+        case builtin_module::render:
+            return make_group(children());
+        case builtin_module::difference:
+            return make_group(children(), csg_node::kind::difference);
+        case builtin_module::intersection:
+            return make_group(children(), csg_node::kind::intersection);
+        case builtin_module::linear_extrude: {
+            node->type = csg_node::kind::linear_extrude;
+            node->extrusion.height = values.number("height", 0, 100);
+            node->extrusion.center = values.flag("center", SIZE_MAX, false);
+            node->extrusion.twist = values.number("twist", SIZE_MAX, 0);
+            node->extrusion.slices = static_cast<int>(values.number("slices", SIZE_MAX, 0));
+            const value *scale = values.get("scale");
+            vec3 factor;
+            double d;
+            if (scale && to_vec3(*scale, factor, 1)) {
+                node->extrusion.scale = {factor.x, factor.y};
+            } else if (scale && to_number(*scale, d)) {
+                node->extrusion.scale = {d, d};
+            }
+            node->detail = resolution_of(s);
+            return with_children(node, children(), false);
+        }
+        case builtin_module::rotate_extrude:
+            node->type = csg_node::kind::rotate_extrude;
+            node->extrusion.twist = std::clamp(values.number("angle", SIZE_MAX, 360), -360.0, 360.0);
+            node->detail = resolution_of(s);
+            return with_children(node, children(), false);
+        case builtin_module::children:
+            return children_of_module(values, s, offset);
+        case builtin_module::unsupported:
+            throw evaluation_error(std::string(name) + "() is not supported by the renderer " + location(offset));
+        }
+        return nullptr;
+    }
+
+    static double radius(const call_arguments &values, std::string_view r, std::string_view d, size_t position,
+                         double fallback) {
+        const value *diameter = values.get(d);
+        double v;
+        if (diameter && to_number(*diameter, v)) return v / 2;
+        const value *given = values.get(r, position);
+        return given && to_number(*given, v) ? v : fallback;
+    }
+
+    static bool points_of(const value *points, std::vector<vec3> &out, bool flat) {
+        const value_vector *items = points ? points->vector() : nullptr;
+        if (!items) return false;
+        for (const value &point : *items) {
+            vec3 p;
+            if (!to_vec3(point, p, 0)) return false;
+            if (flat) p.z = 0;
+            out.push_back(p);
+        }
+        return true;
+    }
+
+    static bool indices_of(const value &faces, std::vector<std::vector<uint32_t>> &out) {
+        const value_vector *items = faces.vector();
+        if (!items) return false;
+        for (const value &face : *items) {
+            const value_vector *indices = face.vector();
+            if (!indices) return false;
+            std::vector<uint32_t> path;
+            for (const value &index : *indices) {
+                double d;
+                if (!to_number(index, d) || d < 0) return false;
+                path.push_back(static_cast<uint32_t>(d));
+            }
+            out.push_back(std::move(path));
+        }
+        return true;
+    }
+
+    // keep_dimension: the node has the dimension of its children, extrusions are always 3D
+    static csg_node_ptr with_children(const std::shared_ptr<csg_node> &node, std::vector<csg_node_ptr> children,
+                                      bool keep_dimension) {
+        children.erase(std::remove(children.begin(), children.end(), nullptr), children.end());
+        if (children.empty()) return nullptr;
+        if (keep_dimension) {
+            node->dimension = 2;
+            for (const csg_node_ptr &child : children) {
+                if (child->dimension != 2) node->dimension = 3;
+            }
+        }
+        node->children = std::move(children);
+        return node;
+    }
+
+    csg_node_ptr transform(builtin_module module, const call_arguments &values, std::vector<csg_node_ptr> children,
+                           uint32_t offset) {
+        mat4 matrix;
+        vec3 v;
+        double d;
+        switch (module) {
+        case builtin_module::translate:
+            if (const value *given = values.get("v", 0); given && to_vec3(*given, v, 0)) {
+                matrix = mat4::translation(v);
+            }
+            break;
+        case builtin_module::rotate: {
+            const value *angle = values.get("a", 0);
+            const value *axis = values.get("v", 1);
+            if (angle && to_vec3(*angle, v, 0)) {
+                matrix = mat4::rotation(v);
+            } else if (angle && to_number(*angle, d)) {
+                vec3 around{0, 0, 1};
+                if (axis && to_vec3(*axis, v, 0) && v.length() > 0) around = v;
+                matrix = mat4::rotation(d, around);
+            }
+            break;
+        }
+        case builtin_module::scale:
+            if (const value *given = values.get("v", 0)) {
+                if (to_vec3(*given, v, 1)) {
+                    matrix = mat4::scaling(v);
+                } else if (to_number(*given, d)) {
+                    matrix = mat4::scaling({d, d, d});
+                }
+            }
+            break;
+        case builtin_module::mirror:
+            if (const value *given = values.get("v", 0); given && to_vec3(*given, v, 0)) {
+                if (v.length() > 0) matrix = mat4::mirroring(v);
+            } else {
+                matrix = mat4::mirroring({1, 0, 0});
+            }
+            break;
+        default:
+            if (!matrix_of(values.get("m", 0), matrix)) warn("Invalid multmatrix matrix, ignored", offset);
+            break;
+        }
+
+        csg_node_ptr group = make_group(std::move(children));
+        if (!group || matrix.is_identity()) return group;
+        auto node = std::make_shared<csg_node>();
+        node->type = csg_node::kind::transform;
+        node->dimension = group->dimension;
+        if (group->type == csg_node::kind::transform) {
+            // Nested transformations become one
+            node->matrix = matrix * group->matrix;
+            node->children = group->children;
+        } else {
+            node->matrix = matrix;
+            node->children.push_back(group);
+        }
+        return node;
+    }
+
+    static bool matrix_of(const value *given, mat4 &out) {
+        const value_vector *rows = given ? given->vector() : nullptr;
+        if (!rows || rows->size() < 3) return false;
+        for (size_t r = 0; r < 3; r++) {
+            const value_vector *row = (*rows)[r].vector();
+            if (!row || row->size() < 3) return false;
+            for (size_t c = 0; c < 4 && c < row->size(); c++) {
+                if (!to_number((*row)[c], out.m[r][c])) return false;
+            }
+        }
+        return true;
+    }
+
+    const evaluation_options &options;
+    std::vector<const scad_source *> files;
+    std::vector<scope_ptr> file_scopes;
+    scope_ptr base;
+    std::vector<std::weak_ptr<scope>> closures;
+    std::vector<int64_t> including;
+
+    uint32_t file = 0;
+    std::string_view text;
+    size_t depth = 0;
+    size_t instances = 0;
+    csg_node_ptr root_override;
+
+    std::vector<std::string> messages;
+    size_t suppressed = 0;
+};
+
+} // namespace
+
+evaluation_result evaluate_scad(const std::vector<scad_source> &sources, const evaluation_options &options) {
+    if (sources.empty()) return evaluation_result();
+    return evaluator(sources, options).run();
+}
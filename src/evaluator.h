@@ -0,0 +1,53 @@
+#pragma once
+
+#include "csg_tree.h"
+#include "syntax_tree.h"
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * One file taking part in a render. imports maps the path of every include and use statement,
+ * as written between the angle brackets, to the index of the file it resolves to.
+ */
+struct scad_source {
+    std::string path;
+    std::string text;
+    syntax_tree tree;
+    std::unordered_map<std::string, size_t> imports;
+};
+
+struct evaluation_options {
+    // Top level assignments run after the main file, like the -D options of OpenSCAD
+    const scad_source *overrides = nullptr;
+    // Nested module and function calls, the evaluation recurses on the C++ stack
+    size_t max_depth = 1000;
+    // Elements of one vector or iterations of one loop
+    size_t max_elements = 1000000;
+    // ECHO and WARNING lines kept, the rest is counted
+    size_t max_messages = 1000;
+    // Module instances, 0 for no limit. The ones past it are left out with a warning, so a preview
+    // of a big model comes back quickly with the part instantiated first.
+    size_t max_instances = 0;
+    // Caps the detail of circles and spheres for previews: $fn at most fn unless 0, $fs and $fa at
+    // least fs and fa. Scripts still see the values they set.
+    resolution coarsest{0, 0, 0};
+};
+
+struct evaluation_result {
+    // null if nothing was instantiated
+    csg_node_ptr root;
+    // ECHO:, WARNING: and ERROR: lines as OpenSCAD prints them
+    std::vector<std::string> messages;
+    // An error stopped the evaluation, root is null
+    bool failed = false;
+};
+
+/**
+ * Run sources[0] the way OpenSCAD does: all assignments of a scope are evaluated before its
+ * module instantiations, the last assignment of a name wins but takes the place of the first.
+ * Files must parse without errors.
+ */
+evaluation_result evaluate_scad(const std::vector<scad_source> &sources, const evaluation_options &options);
@@ -0,0 +1,186 @@
+#include "file_watcher.h"
+
+#include <QMetaObject>
+#include <QObject>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+namespace {
+
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+inline bool is_scad_file(std::string_view name) {
+    return name.size() > 5 && name.substr(name.size() - 5) == ".scad";
+}
+
+inline bool is_below(std::string_view path, std::string_view directory) {
+    return path.size() > directory.size() && path[directory.size()] == '/' &&
+           path.substr(0, directory.size()) == directory;
+}
+
+} // namespace
+
+struct file_watcher::pending_changes {
+    std::set<std::string> files;
+    std::set<std::string> new_directories;
+    std::set<std::string> removed_directories;
+    bool overflow = false;
+    std::chrono::steady_clock::time_point first_event;
+    std::chrono::steady_clock::time_point last_event;
+
+    bool empty() const { return files.empty() && new_directories.empty() && removed_directories.empty() && !overflow; }
+};
+
+file_watcher::file_watcher(QObject *context, change_callback callback) :
+        context(context),
+        callback(std::move(callback))
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        std::cerr << "inotify is not available, changes on disk are not picked up: " << strerror(errno) << "\n";
+        return;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    thread = std::thread(&file_watcher::run, this);
+}
+
+file_watcher::~file_watcher() {
+    if (thread.joinable()) {
+        const uint64_t one = 1;
+        ssize_t written = ::write(stop_fd, &one, sizeof(one));
+        (void)written;
+        thread.join();
+    }
+    if (stop_fd >= 0) ::close(stop_fd);
+    if (inotify_fd >= 0) ::close(inotify_fd);
+}
+
+void file_watcher::watch_directory(const std::string &path) {
+    if (inotify_fd < 0) return;
+    const int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (wd < 0) {
+        if (errno == ENOSPC && !watch_limit_reported) {
+            watch_limit_reported = true;
+            std::cerr << "inotify watch limit reached at " << path
+                      << ", raise fs.inotify.max_user_watches to pick up all changes on disk\n";
+        }
+        return;
+    }
+    directories[wd] = path;
+}
+
+void file_watcher::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : directories) {
+        inotify_rm_watch(inotify_fd, entry.first);
+    }
+    directories.clear();
+}
+
+void file_watcher::forget_directory(const std::string &path) {
+    // Watches of a directory that moved away stay active with stale paths
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = directories.begin(); it != directories.end(); ) {
+        if (it->second == path || is_below(it->second, path)) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = directories.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void file_watcher::run() {
+    pending_changes pending;
+    while (true) {
+        int timeout = -1;
+        if (!pending.empty()) {
+            const auto deadline = std::min(pending.last_event + DEBOUNCE, pending.first_event + MAX_DELAY);
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            timeout = std::max<long long>(0, remaining);
+        }
+
+        pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        if (::poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            std::cerr << "Watching for changes on disk failed: " << strerror(errno) << "\n";
+            return;
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents & POLLIN) {
+            read_events(pending);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (!pending.empty() && (now >= pending.last_event + DEBOUNCE || now >= pending.first_event + MAX_DELAY)) {
+            auto changes = std::make_shared<file_changes>();
+            changes->files.assign(pending.files.begin(), pending.files.end());
+            changes->new_directories.assign(pending.new_directories.begin(), pending.new_directories.end());
+            changes->removed_directories.assign(pending.removed_directories.begin(), pending.removed_directories.end());
+            changes->overflow = pending.overflow;
+            pending = pending_changes();
+            QMetaObject::invokeMethod(context, [this, changes] { callback(std::move(*changes)); }, Qt::QueuedConnection);
+        }
+    }
+}
+
+void file_watcher::read_events(pending_changes &pending) {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (true) {
+        const ssize_t length = ::read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) break;
+
+        const auto now = std::chrono::steady_clock::now();
+        if (pending.empty()) pending.first_event = now;
+        pending.last_event = now;
+
+        for (const char *p = buffer; p < buffer + length; ) {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                pending.overflow = true;
+                continue;
+            }
+
+            std::string path;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = directories.find(event->wd);
+                if (it == directories.end()) continue;
+                if (event->mask & IN_IGNORED) {
+                    directories.erase(it);
+                    continue;
+                }
+                path = it->second;
+            }
+            if (event->len == 0) continue;
+            const std::string_view name(event->name);
+            path.append("/").append(name);
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    pending.new_directories.insert(path);
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    pending.removed_directories.insert(path);
+                    pending.new_directories.erase(path);
+                    forget_directory(path);
+                }
+            } else if (is_scad_file(name)) {
+                pending.files.insert(std::move(path));
+            }
+        }
+    }
+}
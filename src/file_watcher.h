@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class QObject;
+
+// What changed on disk since the last report
+struct file_changes {
+    // Created, modified, moved or removed .scad files
+    std::vector<std::string> files;
+    // Directories that appeared, nothing below them was reported yet
+    std::vector<std::string> new_directories;
+    std::vector<std::string> removed_directories;
+    // The kernel dropped events, everything has to be checked again
+    bool overflow = false;
+
+    bool empty() const { return files.empty() && new_directories.empty() && removed_directories.empty() && !overflow; }
+};
+
+/**
+ * Watches directories with inotify on a thread of its own.
+ *
+ * Events are collected until nothing happened for DEBOUNCE, or for at most MAX_DELAY after the
+ * first one, so a branch switch that touches thousands of files is reported as one set of
+ * changes. The callback runs on the thread of the context object.
+ *
+ * inotify does not watch subdirectories, every directory is added on its own.
+ */
+class file_watcher {
+public:
+    static constexpr auto DEBOUNCE = std::chrono::milliseconds(200);
+    static constexpr auto MAX_DELAY = std::chrono::milliseconds(2000);
+
+    using change_callback = std::function<void(file_changes)>;
+
+    file_watcher(QObject *context, change_callback callback);
+    ~file_watcher();
+
+    file_watcher(const file_watcher &) = delete;
+    file_watcher &operator=(const file_watcher &) = delete;
+
+    bool valid() const { return inotify_fd >= 0; }
+
+    // Both are thread safe, the indexer adds the directories while it walks them
+    void watch_directory(const std::string &path);
+    void clear();
+
+private:
+    struct pending_changes;
+
+    void run();
+    void read_events(pending_changes &pending);
+    void forget_directory(const std::string &path);
+
+    QObject *context;
+    change_callback callback;
+
+    int inotify_fd = -1;
+    // Written to stop the thread
+    int stop_fd = -1;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::unordered_map<int, std::string> directories;
+    bool watch_limit_reported = false;
+};
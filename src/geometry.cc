@@ -0,0 +1,767 @@
+#include "geometry.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+
+namespace {
+
+constexpr double PI = 3.14159265358979323846;
+// Points closer than this to a plane are on it
+constexpr double PLANE_EPSILON = 1e-5;
+// Circles smaller than this get the minimum number of fragments, OpenSCAD's GRID_FINE
+constexpr double GRID_FINE = 0.00000095367431640625;
+
+inline bool same_point(const vec3 &a, const vec3 &b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+enum side : uint8_t {
+    COPLANAR = 0,
+    FRONT = 1,
+    BACK = 2,
+    SPANNING = 3,
+};
+
+/**
+ * Sort a polygon into the lists for the front and the back of a plane, splitting it if it
+ * crosses the plane. Polygons in the plane go to one of the coplanar lists depending on their
+ * orientation. The parts keep the plane of the polygon they were split from.
+ */
+void split_polygon(const plane &p, const polygon &poly, std::vector<polygon> &coplanar_front,
+                   std::vector<polygon> &coplanar_back, std::vector<polygon> &front, std::vector<polygon> &back) {
+    const size_t n = poly.vertices.size();
+    uint8_t polygon_side = COPLANAR;
+    // Most polygons have few vertices, larger ones fall back to the heap
+    uint8_t small_sides[16];
+    std::vector<uint8_t> large_sides;
+    uint8_t *sides = small_sides;
+    if (n > 16) {
+        large_sides.resize(n);
+        sides = large_sides.data();
+    }
+    for (size_t i = 0; i < n; i++) {
+        const double t = p.normal.dot(poly.vertices[i]) - p.w;
+        sides[i] = t < -PLANE_EPSILON ? BACK : t > PLANE_EPSILON ? FRONT : COPLANAR;
+        polygon_side |= sides[i];
+    }
+
+    switch (polygon_side) {
+    case COPLANAR:
+        (p.normal.dot(poly.support.normal) > 0 ? coplanar_front : coplanar_back).push_back(poly);
+        break;
+    case FRONT:
+        front.push_back(poly);
+        break;
+    case BACK:
+        back.push_back(poly);
+        break;
+    default: {
+        polygon f, b;
+        f.support = poly.support;
+        b.support = poly.support;
+        f.part = poly.part;
+        b.part = poly.part;
+        for (size_t i = 0; i < n; i++) {
+            const size_t j = (i + 1) % n;
+            const vec3 &vi = poly.vertices[i];
+            const vec3 &vj = poly.vertices[j];
+            if (sides[i] != BACK) f.vertices.push_back(vi);
+            if (sides[i] != FRONT) b.vertices.push_back(vi);
+            if ((sides[i] | sides[j]) == SPANNING) {
+                const double t = (p.w - p.normal.dot(vi)) / p.normal.dot(vj - vi);
+                const vec3 v = vi.lerp(vj, t);
+                f.vertices.push_back(v);
+                b.vertices.push_back(v);
+            }
+        }
+        if (f.vertices.size() >= 3) front.emplace_back(std::move(f));
+        if (b.vertices.size() >= 3) back.emplace_back(std::move(b));
+        break;
+    }
+    }
+}
+
+/**
+ * Binary space partitioning tree over the polygons of a solid, the boolean operations are the
+ * ones of csg.js. Nodes live in one vector and refer to each other by index, and all walks use
+ * an explicit stack, so degenerate trees as deep as the number of polygons do not overflow the
+ * call stack.
+ */
+class bsp_tree {
+public:
+    explicit bsp_tree(std::vector<polygon> polygons) {
+        nodes.emplace_back();
+        build(std::move(polygons));
+    }
+
+    // Add polygons, they are split along the planes already in the tree
+    void build(std::vector<polygon> polygons) {
+        std::vector<std::pair<int, std::vector<polygon>>> stack;
+        stack.emplace_back(0, std::move(polygons));
+        while (!stack.empty()) {
+            const int n = stack.back().first;
+            std::vector<polygon> list = std::move(stack.back().second);
+            stack.pop_back();
+            if (list.empty()) continue;
+            if (!nodes[n].has_plane) {
+                nodes[n].support = list[0].support;
+                nodes[n].has_plane = true;
+            }
+
+            std::vector<polygon> front, back;
+            const plane support = nodes[n].support;
+            for (const polygon &poly : list) {
+                split_polygon(support, poly, nodes[n].polygons, nodes[n].polygons, front, back);
+            }
+            if (!front.empty()) {
+                if (nodes[n].front < 0) {
+                    nodes[n].front = nodes.size();
+                    nodes.emplace_back();
+                }
+                stack.emplace_back(nodes[n].front, std::move(front));
+            }
+            if (!back.empty()) {
+                if (nodes[n].back < 0) {
+                    nodes[n].back = nodes.size();
+                    nodes.emplace_back();
+                }
+                stack.emplace_back(nodes[n].back, std::move(back));
+            }
+        }
+    }
+
+    // Swap inside and outside
+    void invert() {
+        for (node &n : nodes) {
+            for (polygon &poly : n.polygons) poly.flip();
+            n.support.flip();
+            std::swap(n.front, n.back);
+        }
+    }
+
+    // The parts of polygons outside of the solid of this tree
+    std::vector<polygon> clip_polygons(std::vector<polygon> polygons) const {
+        std::vector<polygon> result;
+        std::vector<std::pair<int, std::vector<polygon>>> stack;
+        stack.emplace_back(0, std::move(polygons));
+        while (!stack.empty()) {
+            const node &n = nodes[stack.back().first];
+            std::vector<polygon> list = std::move(stack.back().second);
+            stack.pop_back();
+            if (!n.has_plane) {
+                std::move(list.begin(), list.end(), std::back_inserter(result));
+                continue;
+            }
+            std::vector<polygon> front, back;
+            for (const polygon &poly : list) {
+                split_polygon(n.support, poly, front, back, front, back);
+            }
+            if (n.front >= 0) {
+                stack.emplace_back(n.front, std::move(front));
+            } else {
+                std::move(front.begin(), front.end(), std::back_inserter(result));
+            }
+            // Behind a leaf is inside
+            if (n.back >= 0) {
+                stack.emplace_back(n.back, std::move(back));
+            }
+        }
+        return result;
+    }
+
+    // Remove everything inside of other
+    void clip_to(const bsp_tree &other) {
+        for (node &n : nodes) {
+            n.polygons = other.clip_polygons(std::move(n.polygons));
+        }
+    }
+
+    std::vector<polygon> all_polygons() const {
+        std::vector<polygon> result;
+        for (const node &n : nodes) {
+            result.insert(result.end(), n.polygons.begin(), n.polygons.end());
+        }
+        return result;
+    }
+
+private:
+    struct node {
+        plane support;
+        bool has_plane = false;
+        int front = -1;
+        int back = -1;
+        std::vector<polygon> polygons;
+    };
+    std::vector<node> nodes;
+};
+
+inline bool separated(const solid &a, const solid &b) {
+    return !a.bounds().overlaps(b.bounds());
+}
+
+double signed_area(const outline &shape) {
+    double area = 0;
+    for (size_t i = 0; i < shape.size(); i++) {
+        const vec2 &p = shape[i];
+        const vec2 &q = shape[(i + 1) % shape.size()];
+        area += p.x * q.y - q.x * p.y;
+    }
+    return area / 2;
+}
+
+// Counter clockwise without repeated points, empty if nothing is left of it
+outline normalized(const outline &shape) {
+    outline result;
+    for (const vec2 &p : shape) {
+        if (result.empty() || p.x != result.back().x || p.y != result.back().y) result.push_back(p);
+    }
+    while (result.size() > 1 && result.front().x == result.back().x && result.front().y == result.back().y) {
+        result.pop_back();
+    }
+    if (result.size() < 3 || signed_area(result) == 0) return {};
+    if (signed_area(result) < 0) std::reverse(result.begin(), result.end());
+    return result;
+}
+
+inline double cross(const vec2 &o, const vec2 &a, const vec2 &b) {
+    return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+bool inside_triangle(const vec2 &p, const vec2 &a, const vec2 &b, const vec2 &c) {
+    return cross(a, b, p) >= 0 && cross(b, c, p) >= 0 && cross(c, a, p) >= 0;
+}
+
+// Ear clipping of a counter clockwise simple polygon, three indices per triangle
+std::vector<uint32_t> triangulate_outline(const outline &shape) {
+    std::vector<uint32_t> result;
+    std::vector<uint32_t> remaining(shape.size());
+    for (uint32_t i = 0; i < remaining.size(); i++) remaining[i] = i;
+
+    size_t misses = 0;
+    size_t i = 0;
+    while (remaining.size() > 3 && misses < remaining.size()) {
+        const size_t n = remaining.size();
+        const uint32_t a = remaining[(i + n - 1) % n];
+        const uint32_t b = remaining[i % n];
+        const uint32_t c = remaining[(i + 1) % n];
+        bool ear = cross(shape[a], shape[b], shape[c]) > 0;
+        for (size_t k = 0; ear && k < n; k++) {
+            const uint32_t p = remaining[k];
+            if (p == a || p == b || p == c) continue;
+            if (inside_triangle(shape[p], shape[a], shape[b], shape[c])) ear = false;
+        }
+        if (ear) {
+            result.insert(result.end(), {a, b, c});
+            remaining.erase(remaining.begin() + i % n);
+            misses = 0;
+        } else {
+            i++;
+            misses++;
+        }
+    }
+    // Self intersecting or collinear rests are closed with a fan
+    for (size_t k = 1; k + 1 < remaining.size(); k++) {
+        result.insert(result.end(), {remaining[0], remaining[k], remaining[k + 1]});
+    }
+    return result;
+}
+
+} // namespace
+
+double sin_degrees(double degrees) {
+    double x = std::fmod(degrees, 360.0);
+    if (x < 0) x += 360;
+    if (x == 0 || x == 180) return 0;
+    if (x == 90) return 1;
+    if (x == 270) return -1;
+    return std::sin(x * PI / 180);
+}
+
+double cos_degrees(double degrees) {
+    return sin_degrees(degrees + 90);
+}
+
+///////////////////////////////////////////////////////////
+// mat4
+///////////////////////////////////////////////////////////
+
+mat4 mat4::translation(const vec3 &v) {
+    mat4 r;
+    r.m[0][3] = v.x;
+    r.m[1][3] = v.y;
+    r.m[2][3] = v.z;
+    return r;
+}
+
+mat4 mat4::scaling(const vec3 &v) {
+    mat4 r;
+    r.m[0][0] = v.x;
+    r.m[1][1] = v.y;
+    r.m[2][2] = v.z;
+    return r;
+}
+
+mat4 mat4::rotation(const vec3 &degrees) {
+    mat4 x, y, z;
+    x.m[1][1] = cos_degrees(degrees.x);
+    x.m[1][2] = -sin_degrees(degrees.x);
+    x.m[2][1] = sin_degrees(degrees.x);
+    x.m[2][2] = cos_degrees(degrees.x);
+    y.m[0][0] = cos_degrees(degrees.y);
+    y.m[0][2] = sin_degrees(degrees.y);
+    y.m[2][0] = -sin_degrees(degrees.y);
+    y.m[2][2] = cos_degrees(degrees.y);
+    z.m[0][0] = cos_degrees(degrees.z);
+    z.m[0][1] = -sin_degrees(degrees.z);
+    z.m[1][0] = sin_degrees(degrees.z);
+    z.m[1][1] = cos_degrees(degrees.z);
+    return z * y * x;
+}
+
+mat4 mat4::rotation(double degrees, const vec3 &axis) {
+    const double length = axis.length();
+    if (length == 0) return mat4();
+    const vec3 u = axis * (1 / length);
+    const double c = cos_degrees(degrees);
+    const double s = sin_degrees(degrees);
+    const double t = 1 - c;
+    mat4 r;
+    r.m[0][0] = t * u.x * u.x + c;
+    r.m[0][1] = t * u.x * u.y - s * u.z;
+    r.m[0][2] = t * u.x * u.z + s * u.y;
+    r.m[1][0] = t * u.x * u.y + s * u.z;
+    r.m[1][1] = t * u.y * u.y + c;
+    r.m[1][2] = t * u.y * u.z - s * u.x;
+    r.m[2][0] = t * u.x * u.z - s * u.y;
+    r.m[2][1] = t * u.y * u.z + s * u.x;
+    r.m[2][2] = t * u.z * u.z + c;
+    return r;
+}
+
+mat4 mat4::mirroring(const vec3 &normal) {
+    const double length2 = normal.dot(normal);
+    if (length2 == 0) return mat4();
+    const double n[3] = {normal.x, normal.y, normal.z};
+    mat4 r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            r.m[i][j] = (i == j ? 1 : 0) - 2 * n[i] * n[j] / length2;
+        }
+    }
+    return r;
+}
+
+mat4 mat4::operator*(const mat4 &o) const {
+    mat4 r;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] + m[i][2] * o.m[2][j] + m[i][3] * o.m[3][j];
+        }
+    }
+    return r;
+}
+
+vec3 mat4::apply(const vec3 &p) const {
+    return {m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]};
+}
+
+bool mat4::is_identity() const {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            if (m[i][j] != (i == j ? 1 : 0)) return false;
+        }
+    }
+    return true;
+}
+
+bool mat4::flips() const {
+    const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                       m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                       m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    return det < 0;
+}
+
+///////////////////////////////////////////////////////////
+// Polygons and solids
+///////////////////////////////////////////////////////////
+
+bool plane::through(const std::vector<vec3> &points, plane &out) {
+    vec3 normal;
+    vec3 center;
+    for (size_t i = 0; i < points.size(); i++) {
+        const vec3 &a = points[i];
+        const vec3 &b = points[(i + 1) % points.size()];
+        normal.x += (a.y - b.y) * (a.z + b.z);
+        normal.y += (a.z - b.z) * (a.x + b.x);
+        normal.z += (a.x - b.x) * (a.y + b.y);
+        center = center + a;
+    }
+    const double length = normal.length();
+    if (length < 1e-12) return false;
+    out.normal = normal * (1 / length);
+    out.w = out.normal.dot(center * (1.0 / points.size()));
+    return true;
+}
+
+void polygon::flip() {
+    std::reverse(vertices.begin(), vertices.end());
+    support.flip();
+}
+
+void bounding_box::extend(const vec3 &p) {
+    min = {std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z)};
+    max = {std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z)};
+}
+
+void bounding_box::extend(const bounding_box &b) {
+    if (b.empty()) return;
+    extend(b.min);
+    extend(b.max);
+}
+
+bool bounding_box::overlaps(const bounding_box &b) const {
+    return !empty() && !b.empty() &&
+           min.x <= b.max.x + PLANE_EPSILON && b.min.x <= max.x + PLANE_EPSILON &&
+           min.y <= b.max.y + PLANE_EPSILON && b.min.y <= max.y + PLANE_EPSILON &&
+           min.z <= b.max.z + PLANE_EPSILON && b.min.z <= max.z + PLANE_EPSILON;
+}
+
+size_t solid::memory_size() const {
+    size_t bytes = sizeof(*this) + polygons.capacity() * sizeof(polygon);
+    for (const polygon &p : polygons) bytes += p.vertices.capacity() * sizeof(vec3);
+    return bytes;
+}
+
+bounding_box solid::bounds() const {
+    bounding_box box;
+    for (const polygon &poly : polygons) {
+        for (const vec3 &v : poly.vertices) box.extend(v);
+    }
+    return box;
+}
+
+void solid::transform(const mat4 &matrix) {
+    const bool flip = matrix.flips();
+    for (polygon &poly : polygons) {
+        for (vec3 &v : poly.vertices) v = matrix.apply(v);
+        if (flip) std::reverse(poly.vertices.begin(), poly.vertices.end());
+        if (!plane::through(poly.vertices, poly.support)) {
+            poly.vertices.clear();
+        }
+    }
+    // Scaling by zero flattens everything
+    polygons.erase(std::remove_if(polygons.begin(), polygons.end(),
+                                  [](const polygon &poly) { return poly.vertices.empty(); }),
+                   polygons.end());
+}
+
+void solid::add(std::vector<vec3> vertices) {
+    vertices.erase(std::unique(vertices.begin(), vertices.end(), same_point), vertices.end());
+    while (vertices.size() > 1 && same_point(vertices.front(), vertices.back())) vertices.pop_back();
+    if (vertices.size() < 3) return;
+    polygon poly;
+    if (!plane::through(vertices, poly.support)) return;
+    poly.vertices = std::move(vertices);
+    polygons.emplace_back(std::move(poly));
+}
+
+solid csg_union(const solid &a, const solid &b) {
+    if (a.empty() || b.empty() || separated(a, b)) {
+        solid result = a;
+        result.polygons.insert(result.polygons.end(), b.polygons.begin(), b.polygons.end());
+        return result;
+    }
+    bsp_tree ta(a.polygons), tb(b.polygons);
+    ta.clip_to(tb);
+    tb.clip_to(ta);
+    tb.invert();
+    tb.clip_to(ta);
+    tb.invert();
+    ta.build(tb.all_polygons());
+    solid result;
+    result.polygons = ta.all_polygons();
+    return result;
+}
+
+solid csg_difference(const solid &a, const solid &b) {
+    if (a.empty() || b.empty() || separated(a, b)) return a;
+    bsp_tree ta(a.polygons), tb(b.polygons);
+    ta.invert();
+    ta.clip_to(tb);
+    tb.clip_to(ta);
+    tb.invert();
+    tb.clip_to(ta);
+    tb.invert();
+    ta.build(tb.all_polygons());
+    ta.invert();
+    solid result;
+    result.polygons = ta.all_polygons();
+    return result;
+}
+
+solid csg_intersection(const solid &a, const solid &b) {
+    if (a.empty() || b.empty() || separated(a, b)) return solid();
+    bsp_tree ta(a.polygons), tb(b.polygons);
+    ta.invert();
+    tb.clip_to(ta);
+    tb.invert();
+    ta.clip_to(tb);
+    tb.clip_to(ta);
+    ta.build(tb.all_polygons());
+    ta.invert();
+    solid result;
+    result.polygons = ta.all_polygons();
+    return result;
+}
+
+///////////////////////////////////////////////////////////
+// Primitives
+///////////////////////////////////////////////////////////
+
+int circle_fragments(double r, double fn, double fs, double fa) {
+    if (r < GRID_FINE) return 3;
+    if (fn > 0) return fn >= 3 ? static_cast<int>(fn) : 3;
+    return static_cast<int>(std::ceil(std::max(std::min(360.0 / fa, r * 2 * PI / fs), 5.0)));
+}
+
+solid make_cube(const vec3 &size, bool center) {
+    solid s;
+    if (size.x <= 0 || size.y <= 0 || size.z <= 0) return s;
+    const vec3 a = center ? size * -0.5 : vec3();
+    const vec3 b = a + size;
+    s.add({{a.x, a.y, a.z}, {a.x, b.y, a.z}, {b.x, b.y, a.z}, {b.x, a.y, a.z}});    // bottom
+    s.add({{a.x, a.y, b.z}, {b.x, a.y, b.z}, {b.x, b.y, b.z}, {a.x, b.y, b.z}});    // top
+    s.add({{a.x, a.y, a.z}, {b.x, a.y, a.z}, {b.x, a.y, b.z}, {a.x, a.y, b.z}});    // front
+    s.add({{b.x, b.y, a.z}, {a.x, b.y, a.z}, {a.x, b.y, b.z}, {b.x, b.y, b.z}});    // back
+    s.add({{a.x, b.y, a.z}, {a.x, a.y, a.z}, {a.x, a.y, b.z}, {a.x, b.y, b.z}});    // left
+    s.add({{b.x, a.y, a.z}, {b.x, b.y, a.z}, {b.x, b.y, b.z}, {b.x, a.y, b.z}});    // right
+    return s;
+}
+
+solid make_sphere(double r, int fragments) {
+    solid s;
+    if (r <= 0) return s;
+    // Rings between the poles like OpenSCAD, so spheres line up with its cylinders
+    const int rings = (fragments + 1) / 2;
+    std::vector<std::vector<vec3>> points(rings);
+    for (int i = 0; i < rings; i++) {
+        const double phi = 180.0 * (i + 0.5) / rings;
+        const double radius = r * sin_degrees(phi);
+        const double z = r * cos_degrees(phi);
+        for (int j = 0; j < fragments; j++) {
+            const double a = 360.0 * j / fragments;
+            points[i].push_back({radius * cos_degrees(a), radius * sin_degrees(a), z});
+        }
+    }
+    s.add(points[0]);
+    s.add(std::vector<vec3>(points[rings - 1].rbegin(), points[rings - 1].rend()));
+    for (int i = 0; i + 1 < rings; i++) {
+        for (int j = 0; j < fragments; j++) {
+            const int k = (j + 1) % fragments;
+            s.add({points[i][j], points[i + 1][j], points[i + 1][k], points[i][k]});
+        }
+    }
+    return s;
+}
+
+solid make_cylinder(double h, double r1, double r2, int fragments, bool center) {
+    solid s;
+    if (h <= 0 || r1 < 0 || r2 < 0 || (r1 == 0 && r2 == 0)) return s;
+    const double z1 = center ? -h / 2 : 0;
+    const double z2 = z1 + h;
+    std::vector<vec3> bottom, top;
+    for (int i = 0; i < fragments; i++) {
+        const double a = 360.0 * i / fragments;
+        bottom.push_back({r1 * cos_degrees(a), r1 * sin_degrees(a), z1});
+        top.push_back({r2 * cos_degrees(a), r2 * sin_degrees(a), z2});
+    }
+    // Points of a cone's tip collapse to one in add
+    for (int i = 0; i < fragments; i++) {
+        const int j = (i + 1) % fragments;
+        s.add({bottom[i], bottom[j], top[j], top[i]});
+    }
+    if (r1 > 0) s.add(std::vector<vec3>(bottom.rbegin(), bottom.rend()));
+    if (r2 > 0) s.add(top);
+    return s;
+}
+
+solid make_polyhedron(const std::vector<vec3> &points, const std::vector<std::vector<uint32_t>> &faces) {
+    solid s;
+    for (const std::vector<uint32_t> &face : faces) {
+        std::vector<vec3> vertices;
+        for (auto it = face.rbegin(); it != face.rend(); ++it) {
+            if (*it < points.size()) vertices.push_back(points[*it]);
+        }
+        // Faces are not necessarily convex or planar, a fan keeps every part of them convex
+        for (size_t i = 1; i + 1 < vertices.size(); i++) {
+            s.add({vertices[0], vertices[i], vertices[i + 1]});
+        }
+    }
+    return s;
+}
+
+outline make_square(const vec2 &size, bool center) {
+    if (size.x <= 0 || size.y <= 0) return {};
+    const vec2 a = center ? vec2{-size.x / 2, -size.y / 2} : vec2();
+    return {{a.x, a.y}, {a.x + size.x, a.y}, {a.x + size.x, a.y + size.y}, {a.x, a.y + size.y}};
+}
+
+outline make_circle(double r, int fragments) {
+    outline shape;
+    if (r <= 0) return shape;
+    for (int i = 0; i < fragments; i++) {
+        const double a = 360.0 * i / fragments;
+        shape.push_back({r * cos_degrees(a), r * sin_degrees(a)});
+    }
+    return shape;
+}
+
+solid linear_extrude(const outline &shape, const linear_extrusion &params) {
+    solid s;
+    const outline points = normalized(shape);
+    if (points.empty() || params.height <= 0) return s;
+
+    const int slices = std::max(1, params.slices);
+    const double z0 = params.center ? -params.height / 2 : 0;
+    auto layer = [&](int k) {
+        const double t = static_cast<double>(k) / slices;
+        const double sx = 1 + (params.scale.x - 1) * t;
+        const double sy = 1 + (params.scale.y - 1) * t;
+        const double c = cos_degrees(-params.twist * t);
+        const double sn = sin_degrees(-params.twist * t);
+        std::vector<vec3> result;
+        for (const vec2 &p : points) {
+            const double x = p.x * sx;
+            const double y = p.y * sy;
+            result.push_back({x * c - y * sn, x * sn + y * c, z0 + params.height * t});
+        }
+        return result;
+    };
+
+    // Twisted or unevenly scaled sides are not planar
+    const bool planar_sides = params.twist == 0 && params.scale.x == params.scale.y;
+    std::vector<vec3> lower = layer(0);
+    const std::vector<vec3> first = lower;
+    for (int k = 1; k <= slices; k++) {
+        const std::vector<vec3> upper = layer(k);
+        for (size_t i = 0; i < points.size(); i++) {
+            const size_t j = (i + 1) % points.size();
+            if (planar_sides) {
+                s.add({lower[i], lower[j], upper[j], upper[i]});
+            } else {
+                s.add({lower[i], lower[j], upper[j]});
+                s.add({lower[i], upper[j], upper[i]});
+            }
+        }
+        lower = upper;
+    }
+
+    const std::vector<uint32_t> triangles = triangulate_outline(points);
+    for (size_t i = 0; i < triangles.size(); i += 3) {
+        s.add({first[triangles[i + 2]], first[triangles[i + 1]], first[triangles[i]]});
+        s.add({lower[triangles[i]], lower[triangles[i + 1]], lower[triangles[i + 2]]});
+    }
+    return s;
+}
+
+solid rotate_extrude(const outline &shape, double angle, int fragments) {
+    solid s;
+    const outline points = normalized(shape);
+    if (points.empty() || angle == 0) return s;
+    for (const vec2 &p : points) {
+        if (p.x < 0) return s;
+    }
+
+    const bool full = std::abs(angle) >= 360;
+    if (full) angle = 360;
+    const int steps = full ? fragments : std::max(1, static_cast<int>(std::ceil(fragments * std::abs(angle) / 360)));
+    auto ring = [&](int step) {
+        const double a = angle * step / steps;
+        std::vector<vec3> result;
+        for (const vec2 &p : points) {
+            result.push_back({p.x * cos_degrees(a), p.x * sin_degrees(a), p.y});
+        }
+        return result;
+    };
+
+    // A negative angle sweeps the other way round, which turns the sides inside out
+    const bool reversed = angle < 0;
+    const std::vector<vec3> first = ring(0);
+    std::vector<vec3> previous = first;
+    for (int step = 1; step <= steps; step++) {
+        const std::vector<vec3> next = full && step == steps ? first : ring(step);
+        for (size_t i = 0; i < points.size(); i++) {
+            const size_t j = (i + 1) % points.size();
+            std::vector<vec3> quad = {previous[i], next[i], next[j], previous[j]};
+            if (reversed) std::reverse(quad.begin(), quad.end());
+            s.add(std::move(quad));
+        }
+        previous = next;
+    }
+
+    if (!full) {
+        const std::vector<uint32_t> triangles = triangulate_outline(points);
+        for (size_t i = 0; i < triangles.size(); i += 3) {
+            std::vector<vec3> start = {first[triangles[i]], first[triangles[i + 1]], first[triangles[i + 2]]};
+            std::vector<vec3> end = {previous[triangles[i + 2]], previous[triangles[i + 1]], previous[triangles[i]]};
+            if (reversed) std::swap(start, end);
+            s.add(std::move(start));
+            s.add(std::move(end));
+        }
+    }
+    return s;
+}
+
+///////////////////////////////////////////////////////////
+// Meshes
+///////////////////////////////////////////////////////////
+
+bounding_box mesh::bounds() const {
+    bounding_box box;
+    for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+        box.extend(vec3{positions[i], positions[i + 1], positions[i + 2]});
+    }
+    return box;
+}
+
+mesh triangulate(const solid &s) {
+    struct key_hash {
+        size_t operator()(const std::array<float, 3> &k) const {
+            uint32_t bits[3];
+            memcpy(bits, k.data(), sizeof(bits));
+            return (static_cast<size_t>(bits[0]) * 0x9E3779B1u) ^ (static_cast<size_t>(bits[1]) * 0x85EBCA77u) ^
+                   (static_cast<size_t>(bits[2]) * 0xC2B2AE3Du);
+        }
+    };
+
+    mesh result;
+    std::unordered_map<std::array<float, 3>, uint32_t, key_hash> vertices;
+    auto vertex = [&](const vec3 &v) {
+        const std::array<float, 3> key = {static_cast<float>(v.x), static_cast<float>(v.y), static_cast<float>(v.z)};
+        auto inserted = vertices.emplace(key, static_cast<uint32_t>(vertices.size()));
+        if (inserted.second) {
+            result.positions.insert(result.positions.end(), key.begin(), key.end());
+        }
+        return inserted.first->second;
+    };
+
+    for (const polygon &poly : s.polygons) {
+        const uint32_t first = vertex(poly.vertices[0]);
+        uint32_t previous = vertex(poly.vertices[1]);
+        for (size_t i = 2; i < poly.vertices.size(); i++) {
+            const uint32_t current = vertex(poly.vertices[i]);
+            // Collapsed by the conversion to float
+            if (first != previous && previous != current && current != first) {
+                result.indices.insert(result.indices.end(), {first, previous, current});
+                result.parts.push_back(poly.part);
+            }
+            previous = current;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+struct vec2 {
+    double x = 0;
+    double y = 0;
+};
+
+struct vec3 {
+    double x = 0;
+    double y = 0;
+    double z = 0;
+
+    vec3 operator+(const vec3 &o) const { return {x + o.x, y + o.y, z + o.z}; }
+    vec3 operator-(const vec3 &o) const { return {x - o.x, y - o.y, z - o.z}; }
+    vec3 operator*(double f) const { return {x * f, y * f, z * f}; }
+    vec3 operator-() const { return {-x, -y, -z}; }
+
+    double dot(const vec3 &o) const { return x * o.x + y * o.y + z * o.z; }
+    vec3 cross(const vec3 &o) const { return {y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x}; }
+    double length() const { return std::sqrt(dot(*this)); }
+    vec3 lerp(const vec3 &o, double t) const { return *this + (o - *this) * t; }
+};
+
+// Sine and cosine of degrees, exact at multiples of 90 like OpenSCAD
+double sin_degrees(double degrees);
+double cos_degrees(double degrees);
+
+/**
+ * Affine transformation as a row major 4x4 matrix, applied to column vectors. multmatrix
+ * accepts any 4x4 matrix, but only the upper 3x4 part is used for points.
+ */
+struct mat4 {
+    double m[4][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+
+    static mat4 translation(const vec3 &v);
+    static mat4 scaling(const vec3 &v);
+    // OpenSCAD's rotate([x, y, z]): around x first, then y, then z
+    static mat4 rotation(const vec3 &degrees);
+    static mat4 rotation(double degrees, const vec3 &axis);
+    static mat4 mirroring(const vec3 &normal);
+
+    mat4 operator*(const mat4 &o) const;
+    vec3 apply(const vec3 &p) const;
+    bool is_identity() const;
+    // A mirroring transformation turns the polygons of a solid inside out
+    bool flips() const;
+};
+
+struct plane {
+    vec3 normal;
+    double w = 0;
+
+    // Newell's method, false for degenerate polygons
+    static bool through(const std::vector<vec3> &points, plane &out);
+    void flip() {
+        normal = -normal;
+        w = -w;
+    }
+};
+
+// Convex planar polygon, counter clockwise seen from outside the solid
+struct polygon {
+    std::vector<vec3> vertices;
+    plane support;
+    // Which part of the model the polygon comes from, kept by splits and boolean operations
+    uint32_t part = 0;
+
+    void flip();
+};
+
+struct bounding_box {
+    vec3 min{HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    vec3 max{-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+
+    bool empty() const { return min.x > max.x; }
+    void extend(const vec3 &p);
+    void extend(const bounding_box &b);
+    bool overlaps(const bounding_box &b) const;
+};
+
+/**
+ * A closed solid as the polygons of its boundary.
+ */
+struct solid {
+    std::vector<polygon> polygons;
+
+    bool empty() const { return polygons.empty(); }
+    bounding_box bounds() const;
+    // Bytes held in memory, for cache limits
+    size_t memory_size() const;
+    void transform(const mat4 &matrix);
+    // Adds a polygon if it is not degenerate, the vertices are counter clockwise seen from outside
+    void add(std::vector<vec3> vertices);
+};
+
+using solid_ptr = std::shared_ptr<const solid>;
+
+// Boolean operations on closed solids, the inputs are left unchanged
+solid csg_union(const solid &a, const solid &b);
+solid csg_difference(const solid &a, const solid &b);
+solid csg_intersection(const solid &a, const solid &b);
+
+// Number of segments of a circle, OpenSCAD's get_fragments_from_r
+int circle_fragments(double r, double fn, double fs, double fa);
+
+solid make_cube(const vec3 &size, bool center);
+solid make_sphere(double r, int fragments);
+solid make_cylinder(double h, double r1, double r2, int fragments, bool center);
+// faces index points and are clockwise seen from outside, as polyhedron() takes them
+solid make_polyhedron(const std::vector<vec3> &points, const std::vector<std::vector<uint32_t>> &faces);
+
+// A simple polygon in the XY plane, either orientation
+using outline = std::vector<vec2>;
+
+outline make_square(const vec2 &size, bool center);
+outline make_circle(double r, int fragments);
+
+struct linear_extrusion {
+    double height = 100;
+    bool center = false;
+    double twist = 0;       // degrees, clockwise seen from above
+    int slices = 1;
+    vec2 scale{1, 1};
+};
+solid linear_extrude(const outline &shape, const linear_extrusion &params);
+// Around the Z axis, the Y axis of the outline becomes Z. Outlines must not reach below x = 0.
+solid rotate_extrude(const outline &shape, double angle, int fragments);
+
+/**
+ * Triangle mesh with shared vertices, what a render produces.
+ */
+struct mesh {
+    std::vector<float> positions;      // x, y, z per vertex
+    std::vector<uint32_t> indices;     // three per triangle, counter clockwise seen from outside
+    std::vector<uint32_t> parts;       // per triangle, the part of its polygon
+
+    size_t vertex_count() const { return positions.size() / 3; }
+    size_t triangle_count() const { return indices.size() / 3; }
+    bounding_box bounds() const;
+
+    // The arrays as clients read them, in the byte order of the machine
+    std::string_view position_bytes() const {
+        return std::string_view(reinterpret_cast<const char *>(positions.data()), positions.size() * sizeof(float));
+    }
+    std::string_view index_bytes() const {
+        return std::string_view(reinterpret_cast<const char *>(indices.data()), indices.size() * sizeof(uint32_t));
+    }
+};
+
+mesh triangulate(const solid &s);
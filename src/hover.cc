@@ -0,0 +1,148 @@
+#include "hover.h"
+#include "project.h"
+
+#include <algorithm>
+
+namespace {
+
+// More definitions of one name are not shown
+constexpr size_t MAX_DEFINITIONS = 8;
+
+const char *kind_name(SymbolKind kind) {
+    switch (kind) {
+    case SymbolKind::Module: return "module";
+    case SymbolKind::Function: return "function";
+    default: return "variable";
+    }
+}
+
+std::string file_name(const std::string &path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+std::string describe_definitions(const project &proj, const text_document &doc, std::string_view name) {
+    std::vector<DocumentId> visible;
+    proj.dependencies.dependencies(doc.id, visible);
+    visible.push_back(doc.id);
+    std::sort(visible.begin(), visible.end());
+
+    symbol_results definitions;
+    proj.symbols.definitions(name, visible, definitions);
+    // Own definitions first, they shadow the included ones
+    std::vector<size_t> order(definitions.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_partition(order.begin(), order.end(),
+                          [&definitions, &doc](size_t i) { return definitions.document(i) == doc.id; });
+
+    std::string contents;
+    for (size_t i = 0; i < order.size() && i < MAX_DEFINITIONS; i++) {
+        const size_t d = order[i];
+        if (i) contents += "\n\n---\n\n";
+        contents += "```scad\n";
+        contents += kind_name(definitions.kind(d));
+        contents += ' ';
+        contents += definitions.name(d);
+        contents += "\n```\n";
+        if (!definitions.container(d).empty()) {
+            contents += "in `";
+            contents += definitions.container(d);
+            contents += "`, ";
+        }
+        const DocumentUri &uri = uri_table::global().uri(definitions.document(d));
+        const std::string line = std::to_string(definitions.range(d).start.line + 1);
+        contents += "[" + file_name(uri.getPath()) + ":" + line + "](" + uri.raw_uri + "#L" + line + ")";
+    }
+    if (definitions.size() > MAX_DEFINITIONS) {
+        contents += "\n\n" + std::to_string(definitions.size() - MAX_DEFINITIONS) + " more definitions";
+    }
+    return contents;
+}
+
+std::string describe_import(const project &proj, const text_document &doc, const lsRange &range) {
+    const std::vector<file_import> &imports = proj.dependencies.imports(doc.id);
+    const std::vector<DocumentId> &targets = proj.dependencies.targets(doc.id);
+    for (size_t i = 0; i < imports.size(); i++) {
+        if (!(imports[i].range == range)) continue;
+        if (targets[i] == INVALID_DOCUMENT_ID) {
+            return "Can't find `" + imports[i].path + "`";
+        }
+        const DocumentUri &uri = uri_table::global().uri(targets[i]);
+        return "[" + uri_table::global().path(targets[i]) + "](" + uri.raw_uri + ")";
+    }
+    return std::string();
+}
+
+} // namespace
+
+hover_info compute_hover(const project &proj, const text_document &doc, const Position &position) {
+    hover_info info;
+    const interval_index::interval *token = doc.positions().occurrence_at(doc.offset_of(position));
+    if (!token) {
+        info.range.start = info.range.end = position;
+        return info;
+    }
+    info.range = doc.range_of(token->start, token->end - token->start);
+
+    const std::string_view text = std::string_view(doc.text()).substr(token->start, token->end - token->start);
+    const syntax_kind kind = static_cast<syntax_kind>(token->value);
+    if (kind == syntax_kind::identifier) {
+        info.contents = describe_definitions(proj, doc, text);
+    } else if (kind == syntax_kind::include_path) {
+        info.contents = describe_import(proj, doc, info.range);
+    }
+    return info;
+}
+
+hover_cache::document_entries &hover_cache::entries_of(DocumentId doc, uint32_t version) {
+    document_entries &known = documents[doc];
+    if (known.version != version) {
+        for (entry_list::iterator it : known.entries) {
+            entries.erase(it);
+        }
+        known.entries.clear();
+        known.version = version;
+    }
+    return known;
+}
+
+bool hover_cache::find(DocumentId doc, uint32_t version, const Position &position, hover_info &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = documents.find(doc);
+    if (it == documents.end()) return false;
+    // A few entries per document, a scan is faster than any lookup structure
+    for (entry_list::iterator e : entries_of(doc, version).entries) {
+        const lsRange &range = e->info.range;
+        if (range.start <= position && position < range.end) {
+            entries.splice(entries.begin(), entries, e);
+            out = e->info;
+            return true;
+        }
+    }
+    return false;
+}
+
+void hover_cache::insert(DocumentId doc, uint32_t version, hover_info info) {
+    std::lock_guard<std::mutex> lock(mutex);
+    document_entries &known = entries_of(doc, version);
+    entries.push_front({doc, std::move(info)});
+    known.entries.push_back(entries.begin());
+
+    while (entries.size() > MAX_ENTRIES) {
+        const entry_list::iterator last = std::prev(entries.end());
+        std::vector<entry_list::iterator> &owner = documents[last->doc].entries;
+        owner.erase(std::find(owner.begin(), owner.end(), last));
+        if (owner.empty()) documents.erase(last->doc);
+        entries.erase(last);
+    }
+}
+
+void hover_cache::remove(DocumentId doc) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = documents.find(doc);
+    if (it == documents.end()) return;
+    for (entry_list::iterator e : it->second.entries) {
+        entries.erase(e);
+    }
+    documents.erase(it);
+}
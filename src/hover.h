@@ -0,0 +1,69 @@
+#pragma once
+
+#include "document.h"
+#include "lsp.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct project;
+
+// What a hover over one token shows
+struct hover_info {
+    std::string contents;   // markdown, empty if there is nothing to show
+    lsRange range;          // of the token
+};
+
+// Hover for a position of an open document, the range is empty if there is no token at it
+hover_info compute_hover(const project &proj, const text_document &doc, const Position &position);
+
+/**
+ * Hovers computed for the tokens of open documents. Editors ask again and again while the
+ * mouse rests on or moves inside a token, any position inside a cached token range is answered
+ * without looking at the syntax tree.
+ *
+ * Entries are stamped with the dependency_graph version of their document, which changes with
+ * every edit of the document and of the files it includes or uses. Entries of an older version
+ * are dropped as soon as the document is looked up again. At most MAX_ENTRIES are kept over all
+ * documents, the least recently used go first. Hovers of a batch are answered on worker
+ * threads, so the cache is locked.
+ */
+class hover_cache {
+public:
+    static constexpr size_t MAX_ENTRIES = 512;
+
+    // Copies the entry for the position in this version of the document, false if there is none
+    bool find(DocumentId doc, uint32_t version, const Position &position, hover_info &out);
+    void insert(DocumentId doc, uint32_t version, hover_info info);
+    void remove(DocumentId doc);
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    struct entry {
+        DocumentId doc;
+        hover_info info;
+    };
+    using entry_list = std::list<entry>;
+
+    struct document_entries {
+        uint32_t version = 0;
+        std::vector<entry_list::iterator> entries;
+    };
+
+    // Entries of another version are dropped, returns the (possibly new) entries of doc
+    document_entries &entries_of(DocumentId doc, uint32_t version);
+
+    // Most recently used first
+    entry_list entries;
+    std::unordered_map<DocumentId, document_entries> documents;
+    mutable std::mutex mutex;
+};
@@ -0,0 +1,193 @@
+#include "include_resolver.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void add_directory(std::vector<std::string> &libraries, const fs::path &directory) {
+    std::error_code err;
+    if (fs::is_directory(directory, err)) {
+        libraries.push_back(directory.lexically_normal().string());
+    }
+}
+
+inline bool is_file(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+inline bool is_below(std::string_view path, std::string_view directory) {
+    return path.size() > directory.size() && path[directory.size()] == '/' &&
+           path.substr(0, directory.size()) == directory;
+}
+
+} // namespace
+
+include_resolver::include_resolver() {
+    if (const char *path = std::getenv("OPENSCADPATH")) {
+        std::string_view entries(path);
+        while (!entries.empty()) {
+            const size_t colon = entries.find(':');
+            const std::string_view entry = entries.substr(0, colon);
+            if (!entry.empty()) add_directory(libraries, fs::path(entry));
+            entries.remove_prefix(colon == std::string_view::npos ? entries.size() : colon + 1);
+        }
+    }
+    if (const char *data = std::getenv("XDG_DATA_HOME"); data && *data) {
+        add_directory(libraries, fs::path(data) / "OpenSCAD" / "libraries");
+    } else if (const char *home = std::getenv("HOME"); home && *home) {
+        add_directory(libraries, fs::path(home) / ".local" / "share" / "OpenSCAD" / "libraries");
+    }
+    add_directory(libraries, "/usr/local/share/openscad/libraries");
+    add_directory(libraries, "/usr/share/openscad/libraries");
+}
+
+include_resolver::include_resolver(std::vector<std::string> library_path) :
+        libraries(std::move(library_path))
+{}
+
+std::string include_resolver::resolve(std::string_view from_file, std::string_view path) const {
+    if (path.empty()) return std::string();
+
+    const fs::path directory = fs::path(from_file).parent_path();
+    std::string key = directory.string();
+    key.push_back('\0');
+    key.append(path);
+    uint64_t seen;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = results.find(key);
+        if (it != results.end()) return it->second;
+        seen = generation;
+    }
+
+    const fs::path imported(path);
+    std::vector<fs::path> candidates;
+    if (imported.is_absolute()) {
+        candidates.push_back(imported);
+    } else {
+        candidates.push_back(directory / imported);
+        for (const std::string &library : libraries) {
+            candidates.push_back(fs::path(library) / imported);
+        }
+    }
+
+    std::string result;
+    for (const fs::path &candidate : candidates) {
+        const fs::path normal = candidate.lexically_normal();
+        if (normal.has_filename() && exists(normal.parent_path().string(), normal.filename().string(), seen)) {
+            result = normal.string();
+            break;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (generation == seen) {
+        results.emplace(std::move(key), result);
+    }
+    return result;
+}
+
+void include_resolver::resolve(std::string_view from_file, const std::vector<file_import> &imports,
+                               std::vector<DocumentId> &targets) const {
+    targets.clear();
+    targets.reserve(imports.size());
+    for (const file_import &import : imports) {
+        const std::string path = resolve(from_file, import.path);
+        targets.push_back(path.empty() ? INVALID_DOCUMENT_ID : uri_table::global().intern_path(path));
+    }
+}
+
+bool include_resolver::exists(const std::string &directory, std::string_view name, uint64_t seen) const {
+    return list(directory, seen)->count(std::string(name)) != 0;
+}
+
+std::shared_ptr<const include_resolver::listing> include_resolver::list(const std::string &directory, uint64_t seen) const {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = listings.find(directory);
+        if (it != listings.end()) return it->second;
+    }
+
+    // One readdir instead of a stat per candidate, only links and file systems without d_type
+    // need a stat
+    auto files = std::make_shared<listing>();
+    if (DIR *dir = ::opendir(directory.c_str())) {
+        while (const dirent *entry = ::readdir(dir)) {
+            bool regular = entry->d_type == DT_REG;
+            if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                regular = ::fstatat(::dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISREG(st.st_mode);
+            }
+            if (regular) files->emplace(entry->d_name);
+        }
+        ::closedir(dir);
+    }
+
+    // Another thread may have listed it in the meantime, or it changed since the lookup started
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (generation != seen) return files;
+    return listings.emplace(directory, std::move(files)).first->second;
+}
+
+void include_resolver::invalidate(const file_changes &changes) {
+    if (changes.overflow) {
+        clear();
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    bool changed = false;
+    for (const std::string &file : changes.files) {
+        // Modified files do not change any result, only files that appeared or went away do
+        const fs::path path(file);
+        auto it = listings.find(path.parent_path().string());
+        if (it == listings.end()) continue;
+        const std::string name = path.filename().string();
+        const bool listed = it->second->count(name) != 0;
+        if (is_file(file) == listed) continue;
+
+        auto files = std::make_shared<listing>(*it->second);
+        if (listed) {
+            files->erase(name);
+        } else {
+            files->insert(name);
+        }
+        it->second = std::move(files);
+        changed = true;
+    }
+
+    // Listings of new directories may have been cached as empty
+    auto forget = [&](const std::string &directory) {
+        for (auto it = listings.begin(); it != listings.end(); ) {
+            if (it->first == directory || is_below(it->first, directory)) {
+                it = listings.erase(it);
+                changed = true;
+            } else {
+                ++it;
+            }
+        }
+    };
+    for (const std::string &directory : changes.new_directories) forget(directory);
+    for (const std::string &directory : changes.removed_directories) forget(directory);
+
+    // Cheap to compute again from the listings
+    if (changed) {
+        results.clear();
+        generation++;
+    }
+}
+
+void include_resolver::clear() {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    results.clear();
+    listings.clear();
+    generation++;
+}
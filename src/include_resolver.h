@@ -0,0 +1,60 @@
+#pragma once
+
+#include "dependency_graph.h"
+#include "file_watcher.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Finds the file an include <...> or use <...> refers to, the same way OpenSCAD does: relative
+ * to the directory of the importing file first, then in the library directories.
+ *
+ * Results are cached per (directory of the importing file, include string), misses included.
+ * Existence is checked against cached directory listings instead of stat calls, every
+ * directory is read once no matter how many candidates are looked up in it. The file_watcher
+ * reports tell which listings to read again; library directories outside the workspace are
+ * not watched and only pick up changes on clear.
+ *
+ * All members are thread safe, the indexer workers resolve concurrently.
+ */
+class include_resolver {
+public:
+    // OPENSCADPATH, the user library directory and the installation library directories
+    include_resolver();
+    explicit include_resolver(std::vector<std::string> library_path);
+
+    // Normalized absolute path of the imported file, empty if it does not exist
+    std::string resolve(std::string_view from_file, std::string_view path) const;
+    // The document of every import, INVALID_DOCUMENT_ID for the ones that do not exist
+    void resolve(std::string_view from_file, const std::vector<file_import> &imports, std::vector<DocumentId> &targets) const;
+
+    // Files or directories appeared or went away
+    void invalidate(const file_changes &changes);
+    void clear();
+
+    const std::vector<std::string> &library_path() const { return libraries; }
+
+private:
+    // The regular files of a directory, empty if it does not exist
+    using listing = std::unordered_set<std::string>;
+
+    bool exists(const std::string &directory, std::string_view name, uint64_t seen) const;
+    std::shared_ptr<const listing> list(const std::string &directory, uint64_t seen) const;
+
+    std::vector<std::string> libraries;
+
+    mutable std::shared_mutex mutex;
+    // directory '\0' include string -> resolved path, empty if there is none
+    mutable std::unordered_map<std::string, std::string> results;
+    mutable std::unordered_map<std::string, std::shared_ptr<const listing>> listings;
+    // Incremented by every invalidation, what was computed before is not cached any more
+    uint64_t generation = 0;
+};
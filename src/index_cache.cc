@@ -0,0 +1,549 @@
+#include "index_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char MAGIC[8] = {'S', 'C', 'A', 'D', 'I', 'D', 'X', '\n'};
+constexpr uint32_t BYTE_ORDER_TAG = 0x01020304;
+
+enum section_id {
+    FILES,
+    PATHS,
+    NAMES,
+    LOWER_NAMES,
+    NAME_OFFSETS,
+    NAME_SYMBOLS,
+    POSTING_KEYS,
+    POSTING_OFFSETS,
+    POSTING_NAMES,
+    SYMBOLS,
+    FILE_IMPORTS,
+    IMPORTS,
+    IMPORT_PATHS,
+    FILE_REFERENCES,
+    REFERENCES,
+    REFERENCE_NAMES,
+    SECTION_COUNT
+};
+
+struct section {
+    uint64_t offset;
+    uint64_t size;      // in bytes
+};
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    section sections[SECTION_COUNT];
+};
+
+inline uint64_t rotate_left(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Offset tables have to start at 0, never decrease and end at the size of what they index
+bool valid_offsets(const uint32_t *offsets, size_t count, size_t end) {
+    if (count == 0 || offsets[0] != 0 || offsets[count - 1] != end) return false;
+    for (size_t i = 1; i < count; i++) {
+        if (offsets[i] < offsets[i - 1]) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+uint64_t content_hash(std::string_view text) {
+    const uint64_t k0 = 0x9E3779B97F4A7C15ull;
+    const uint64_t k1 = 0xBF58476D1CE4E5B9ull;
+    uint64_t hash = text.size() * k0;
+    size_t i = 0;
+    for (; i + 8 <= text.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, text.data() + i, 8);
+        hash = rotate_left(hash ^ (word * k0), 29) * k1;
+    }
+    if (i < text.size()) {
+        uint64_t word = 0;
+        memcpy(&word, text.data() + i, text.size() - i);
+        hash = rotate_left(hash ^ (word * k0), 29) * k1;
+    }
+    hash ^= hash >> 31;
+    hash *= 0x94D049BB133111EBull;
+    return hash ^ (hash >> 29);
+}
+
+///////////////////////////////////////////////////////////
+// Reading
+///////////////////////////////////////////////////////////
+
+std::unique_ptr<index_snapshot> index_snapshot::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    std::unique_ptr<index_snapshot> snapshot(new index_snapshot());
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(file_header)) {
+        void *mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            snapshot->data = static_cast<const char *>(mapping);
+            snapshot->size = st.st_size;
+        }
+    }
+    ::close(fd);
+
+    if (!snapshot->data || !snapshot->validate()) {
+        return nullptr;
+    }
+    return snapshot;
+}
+
+index_snapshot::~index_snapshot() {
+    if (data) ::munmap(const_cast<char *>(data), size);
+}
+
+bool index_snapshot::validate() {
+    file_header header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+            header.byte_order != BYTE_ORDER_TAG || header.file_size != size) {
+        return false;
+    }
+
+    static constexpr size_t record_sizes[SECTION_COUNT] = {
+        sizeof(file_record), 1, 1, 1, sizeof(uint32_t), sizeof(uint32_t),
+        sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(symbol_record),
+        sizeof(uint32_t), sizeof(import_record), 1, sizeof(uint32_t), sizeof(reference_record), 1,
+    };
+    size_t counts[SECTION_COUNT];
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        const section &s = header.sections[i];
+        if (s.offset % 8 != 0 || s.offset > size || s.size > size - s.offset || s.size % record_sizes[i] != 0) {
+            return false;
+        }
+        counts[i] = s.size / record_sizes[i];
+    }
+    auto at = [&](section_id id) { return data + header.sections[id].offset; };
+
+    files = reinterpret_cast<const file_record *>(at(FILES));
+    files_count = counts[FILES];
+    paths = at(PATHS);
+    paths_size = counts[PATHS];
+    names = at(NAMES);
+    lower_names = at(LOWER_NAMES);
+    name_offsets = reinterpret_cast<const uint32_t *>(at(NAME_OFFSETS));
+    name_symbols = reinterpret_cast<const uint32_t *>(at(NAME_SYMBOLS));
+    posting_keys = reinterpret_cast<const uint32_t *>(at(POSTING_KEYS));
+    posting_keys_count = counts[POSTING_KEYS];
+    posting_offsets = reinterpret_cast<const uint32_t *>(at(POSTING_OFFSETS));
+    posting_names = reinterpret_cast<const uint32_t *>(at(POSTING_NAMES));
+    symbols = reinterpret_cast<const symbol_record *>(at(SYMBOLS));
+    symbols_count = counts[SYMBOLS];
+    file_imports = reinterpret_cast<const uint32_t *>(at(FILE_IMPORTS));
+    import_records = reinterpret_cast<const import_record *>(at(IMPORTS));
+    import_paths = at(IMPORT_PATHS);
+    import_paths_size = counts[IMPORT_PATHS];
+    file_references = reinterpret_cast<const uint32_t *>(at(FILE_REFERENCES));
+    reference_records = reinterpret_cast<const reference_record *>(at(REFERENCES));
+    reference_names = at(REFERENCE_NAMES);
+    reference_names_size = counts[REFERENCE_NAMES];
+
+    // Every record is checked here, the lookups and queries use them as they are
+    if (counts[NAME_OFFSETS] == 0 || counts[LOWER_NAMES] != counts[NAMES]) return false;
+    names_count = counts[NAME_OFFSETS] - 1;
+    if (counts[NAME_SYMBOLS] != counts[NAME_OFFSETS] || counts[POSTING_OFFSETS] != posting_keys_count + 1) return false;
+    if (!valid_offsets(name_offsets, counts[NAME_OFFSETS], counts[NAMES]) ||
+            !valid_offsets(name_symbols, counts[NAME_SYMBOLS], symbols_count) ||
+            !valid_offsets(posting_offsets, counts[POSTING_OFFSETS], counts[POSTING_NAMES]) ||
+            counts[FILE_IMPORTS] != files_count + 1 ||
+            !valid_offsets(file_imports, counts[FILE_IMPORTS], counts[IMPORTS]) ||
+            counts[FILE_REFERENCES] != files_count + 1 ||
+            !valid_offsets(file_references, counts[FILE_REFERENCES], counts[REFERENCES])) {
+        return false;
+    }
+
+    // Files sorted by path for find_file, with as many symbols as they claim
+    std::vector<uint32_t> file_symbols(files_count, 0);
+    for (size_t i = 0; i < files_count; i++) {
+        if (files[i].path_offset > paths_size || files[i].path_length > paths_size - files[i].path_offset ||
+                (i > 0 && !(file_path(i - 1) < file_path(i)))) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < counts[LOWER_NAMES]; i++) {
+        if (lower_names[i] != symbol_index::to_lower(names[i])) return false;
+    }
+    for (uint32_t name = 0; name < names_count; name++) {
+        for (uint32_t i = name_symbols[name]; i < name_symbols[name + 1]; i++) {
+            const symbol_record &sym = symbols[i];
+            if (sym.name != name || (sym.container != NO_NAME && sym.container >= names_count) ||
+                    sym.file >= files_count || sym.kind < static_cast<uint32_t>(SymbolKind::File) ||
+                    sym.kind > static_cast<uint32_t>(SymbolKind::Operator)) {
+                return false;
+            }
+            file_symbols[sym.file]++;
+        }
+    }
+    for (size_t i = 0; i < files_count; i++) {
+        if (files[i].symbol_count != file_symbols[i]) return false;
+    }
+
+    // Keys and the names of every list strictly increasing, for the binary searches
+    for (size_t i = 0; i < posting_keys_count; i++) {
+        if (i > 0 && posting_keys[i] <= posting_keys[i - 1]) return false;
+        for (uint32_t k = posting_offsets[i]; k < posting_offsets[i + 1]; k++) {
+            if (posting_names[k] >= names_count || (k > posting_offsets[i] && posting_names[k] <= posting_names[k - 1])) {
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < counts[IMPORTS]; i++) {
+        const import_record &import = import_records[i];
+        if (import.path_offset > import_paths_size || import.path_length > import_paths_size - import.path_offset) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < counts[REFERENCES]; i++) {
+        const reference_record &record = reference_records[i];
+        if (record.name_offset > reference_names_size || record.name_length > reference_names_size - record.name_offset ||
+                record.kind > static_cast<uint8_t>(reference_kind::variable)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view index_snapshot::file_path(uint32_t file) const {
+    return std::string_view(paths + files[file].path_offset, files[file].path_length);
+}
+
+file_stamp index_snapshot::stamp(uint32_t file) const {
+    file_stamp stamp;
+    stamp.mtime_ns = files[file].mtime_ns;
+    stamp.size = files[file].size;
+    stamp.hash = files[file].hash;
+    return stamp;
+}
+
+void index_snapshot::imports(uint32_t file, std::vector<file_import> &out) const {
+    out.clear();
+    for (uint32_t i = file_imports[file]; i < file_imports[file + 1]; i++) {
+        const import_record &record = import_records[i];
+        file_import import;
+        import.path = std::string(import_paths + record.path_offset, record.path_length);
+        import.is_use = record.is_use != 0;
+        import.range.start.line = record.start_line;
+        import.range.start.character = record.start_character;
+        import.range.end.line = record.end_line;
+        import.range.end.character = record.end_character;
+        out.emplace_back(std::move(import));
+    }
+}
+
+void index_snapshot::references(uint32_t file, document_references &out) const {
+    out.names.clear();
+    out.references.clear();
+    for (uint32_t i = file_references[file]; i < file_references[file + 1]; i++) {
+        const reference_record &record = reference_records[i];
+        lsRange range;
+        range.start.line = record.line;
+        range.start.character = record.character;
+        range.end.line = record.line;
+        range.end.character = record.character + record.name_length;
+        out.add(std::string_view(reference_names + record.name_offset, record.name_length),
+                static_cast<reference_kind>(record.kind), range);
+    }
+}
+
+uint32_t index_snapshot::find_file(std::string_view path) const {
+    size_t first = 0;
+    size_t last = files_count;
+    while (first < last) {
+        const size_t middle = first + (last - first) / 2;
+        if (file_path(middle) < path) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+    return first < files_count && file_path(first) == path ? first : NO_FILE;
+}
+
+std::pair<const uint32_t *, const uint32_t *> index_snapshot::postings(uint32_t key) const {
+    const uint32_t *it = std::lower_bound(posting_keys, posting_keys + posting_keys_count, key);
+    if (it == posting_keys + posting_keys_count || *it != key) {
+        return {nullptr, nullptr};
+    }
+    const size_t i = it - posting_keys;
+    return {posting_names + posting_offsets[i], posting_names + posting_offsets[i + 1]};
+}
+
+///////////////////////////////////////////////////////////
+// Writing
+///////////////////////////////////////////////////////////
+
+uint32_t index_snapshot_writer::intern(std::string_view name) {
+    auto it = name_ids.emplace(std::string(name), name_list.size());
+    if (it.second) {
+        name_list.push_back(&it.first->first);
+    }
+    return it.first->second;
+}
+
+void index_snapshot_writer::add_references(const document_references &from,
+                                           std::vector<index_snapshot::reference_record> &to) {
+    to.reserve(from.references.size());
+    for (const document_references::reference &ref : from.references) {
+        const std::string_view name = from.name(ref);
+        // Names that do not fit the record are not worth a bigger one
+        if (name.size() > UINT16_MAX || ref.range.start.line != ref.range.end.line) continue;
+        auto it = reference_name_offsets.emplace(std::string(name), reference_names.size());
+        if (it.second) {
+            reference_names.append(name);
+        }
+        index_snapshot::reference_record record{};
+        record.name_offset = it.first->second;
+        record.name_length = name.size();
+        record.kind = static_cast<uint8_t>(ref.kind);
+        record.line = ref.range.start.line;
+        record.character = ref.range.start.character;
+        to.push_back(record);
+    }
+}
+
+void index_snapshot_writer::add_file(std::string_view path, const file_stamp &stamp, const document_symbols &symbols,
+                                     const std::vector<file_import> &imports, const document_references &references) {
+    const uint32_t file = files.size();
+    files.push_back({std::string(path), stamp, static_cast<uint32_t>(symbols.symbols.size()), imports, {}});
+    add_references(references, files.back().references);
+
+    const size_t first = this->symbols.size();
+    for (const document_symbols::symbol &sym : symbols.symbols) {
+        index_snapshot::symbol_record record;
+        record.name = intern(symbols.name(sym));
+        // Containers always come before the symbols they contain
+        record.container = sym.container == document_symbols::NO_CONTAINER ?
+            index_snapshot::NO_NAME : this->symbols[first + sym.container].name;
+        record.file = file;
+        record.kind = static_cast<uint32_t>(sym.kind);
+        record.start_line = sym.range.start.line;
+        record.start_character = sym.range.start.character;
+        record.end_line = sym.range.end.line;
+        record.end_character = sym.range.end.character;
+        this->symbols.push_back(record);
+    }
+}
+
+void index_snapshot_writer::add_files(const index_snapshot &from, const std::vector<std::pair<uint32_t, file_stamp>> &copied) {
+    // Snapshot file index -> index in files
+    std::vector<uint32_t> remap(from.file_count(), index_snapshot::NO_FILE);
+    document_references references;
+    for (const auto &entry : copied) {
+        remap[entry.first] = files.size();
+        files.push_back({std::string(from.file_path(entry.first)), entry.second, from.symbol_count(entry.first), {}, {}});
+        from.imports(entry.first, files.back().imports);
+        from.references(entry.first, references);
+        add_references(references, files.back().references);
+    }
+
+    // One pass over all symbols, they are sorted by name and not by file
+    const index_snapshot::symbol_record *all = from.all_symbols();
+    for (size_t i = 0; i < from.symbol_count(); i++) {
+        index_snapshot::symbol_record record = all[i];
+        if (remap[record.file] == index_snapshot::NO_FILE) continue;
+        record.file = remap[record.file];
+        record.name = intern(from.name(record.name));
+        if (record.container != index_snapshot::NO_NAME) record.container = intern(from.name(record.container));
+        symbols.push_back(record);
+    }
+}
+
+bool index_snapshot_writer::write(const std::string &path) const {
+    // Files sorted by path, so readers can binary search them
+    std::vector<uint32_t> order(files.size());
+    for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return files[a].path < files[b].path; });
+    std::vector<uint32_t> file_position(files.size());
+    std::vector<index_snapshot::file_record> file_records;
+    std::string paths;
+    std::vector<uint32_t> file_imports{0};
+    std::vector<index_snapshot::import_record> imports;
+    std::string import_paths;
+    std::vector<uint32_t> file_references{0};
+    std::vector<index_snapshot::reference_record> references;
+    for (uint32_t i = 0; i < order.size(); i++) {
+        const pending_file &file = files[order[i]];
+        file_position[order[i]] = i;
+        index_snapshot::file_record record{};
+        record.path_offset = paths.size();
+        record.path_length = file.path.size();
+        record.mtime_ns = file.stamp.mtime_ns;
+        record.size = file.stamp.size;
+        record.hash = file.stamp.hash;
+        record.symbol_count = file.symbol_count;
+        file_records.push_back(record);
+        paths.append(file.path);
+
+        for (const file_import &import : file.imports) {
+            index_snapshot::import_record import_record{};
+            import_record.path_offset = import_paths.size();
+            import_record.path_length = import.path.size();
+            import_record.is_use = import.is_use;
+            import_record.start_line = import.range.start.line;
+            import_record.start_character = import.range.start.character;
+            import_record.end_line = import.range.end.line;
+            import_record.end_character = import.range.end.character;
+            imports.push_back(import_record);
+            import_paths.append(import.path);
+        }
+        file_imports.push_back(imports.size());
+
+        references.insert(references.end(), file.references.begin(), file.references.end());
+        file_references.push_back(references.size());
+    }
+
+    std::string names;
+    std::string lower_names;
+    std::vector<uint32_t> name_offsets{0};
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+    for (uint32_t id = 0; id < name_list.size(); id++) {
+        const std::string &name = *name_list[id];
+        names.append(name);
+        std::string lower;
+        for (char c : name) lower.push_back(symbol_index::to_lower(c));
+        lower_names.append(lower);
+        name_offsets.push_back(names.size());
+
+        // Same keys as symbol_index, ids are increasing so every list stays sorted
+        for (size_t i = 0; i + 3 <= lower.size(); i++) {
+            std::vector<uint32_t> &list = postings[symbol_index::trigram_key(lower.data() + i)];
+            if (list.empty() || list.back() != id) list.push_back(id);
+        }
+        for (size_t length = 1; length <= 2 && length <= lower.size(); length++) {
+            postings[symbol_index::prefix_key(std::string_view(lower).substr(0, length))].push_back(id);
+        }
+    }
+
+    std::vector<uint32_t> posting_keys;
+    for (const auto &entry : postings) posting_keys.push_back(entry.first);
+    std::sort(posting_keys.begin(), posting_keys.end());
+    std::vector<uint32_t> posting_offsets{0};
+    std::vector<uint32_t> posting_names;
+    for (uint32_t key : posting_keys) {
+        const std::vector<uint32_t> &list = postings[key];
+        posting_names.insert(posting_names.end(), list.begin(), list.end());
+        posting_offsets.push_back(posting_names.size());
+    }
+
+    // Counting sort of the symbols by name
+    std::vector<uint32_t> name_symbols(name_list.size() + 1, 0);
+    for (const auto &sym : symbols) name_symbols[sym.name + 1]++;
+    for (size_t i = 1; i < name_symbols.size(); i++) name_symbols[i] += name_symbols[i - 1];
+    std::vector<index_snapshot::symbol_record> sorted(symbols.size());
+    {
+        std::vector<uint32_t> next(name_symbols.begin(), name_symbols.end() - 1);
+        for (index_snapshot::symbol_record sym : symbols) {
+            sym.file = file_position[sym.file];
+            sorted[next[sym.name]++] = sym;
+        }
+    }
+
+    file_header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = index_snapshot::VERSION;
+    header.byte_order = BYTE_ORDER_TAG;
+
+    const std::pair<const void *, size_t> contents[SECTION_COUNT] = {
+        {file_records.data(), file_records.size() * sizeof(index_snapshot::file_record)},
+        {paths.data(), paths.size()},
+        {names.data(), names.size()},
+        {lower_names.data(), lower_names.size()},
+        {name_offsets.data(), name_offsets.size() * sizeof(uint32_t)},
+        {name_symbols.data(), name_symbols.size() * sizeof(uint32_t)},
+        {posting_keys.data(), posting_keys.size() * sizeof(uint32_t)},
+        {posting_offsets.data(), posting_offsets.size() * sizeof(uint32_t)},
+        {posting_names.data(), posting_names.size() * sizeof(uint32_t)},
+        {sorted.data(), sorted.size() * sizeof(index_snapshot::symbol_record)},
+        {file_imports.data(), file_imports.size() * sizeof(uint32_t)},
+        {imports.data(), imports.size() * sizeof(index_snapshot::import_record)},
+        {import_paths.data(), import_paths.size()},
+        {file_references.data(), file_references.size() * sizeof(uint32_t)},
+        {references.data(), references.size() * sizeof(index_snapshot::reference_record)},
+        {reference_names.data(), reference_names.size()},
+    };
+    uint64_t offset = (sizeof(file_header) + 7) & ~uint64_t(7);
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].size = contents[i].second;
+        offset = (offset + contents[i].second + 7) & ~uint64_t(7);
+    }
+    header.file_size = offset;
+
+    std::error_code err;
+    fs::create_directories(fs::path(path).parent_path(), err);
+    const std::string temporary = path + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        static const char padding[8] = {};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(padding, header.sections[0].offset - sizeof(header));
+        for (int i = 0; i < SECTION_COUNT; i++) {
+            out.write(static_cast<const char *>(contents[i].first), contents[i].second);
+            const uint64_t end = i + 1 < SECTION_COUNT ? header.sections[i + 1].offset : header.file_size;
+            out.write(padding, end - header.sections[i].offset - contents[i].second);
+        }
+        if (!out) {
+            fs::remove(temporary, err);
+            return false;
+        }
+    }
+    fs::rename(temporary, path, err);
+    if (err) {
+        fs::remove(temporary, err);
+        return false;
+    }
+    return true;
+}
+
+std::string cache_directory() {
+    fs::path directory;
+    if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+        directory = cache;
+    } else if (const char *home = std::getenv("HOME"); home && *home) {
+        directory = fs::path(home) / ".cache";
+    } else {
+        return std::string();
+    }
+    return (directory / "openscad-lsp").string();
+}
+
+std::string index_cache_path(const std::vector<std::string> &roots) {
+    const std::string directory = cache_directory();
+    if (directory.empty()) return std::string();
+
+    // One snapshot per set of workspace folders
+    std::vector<std::string> sorted = roots;
+    std::sort(sorted.begin(), sorted.end());
+    std::string key;
+    for (const std::string &root : sorted) {
+        key.append(root).push_back('\0');
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.index", static_cast<unsigned long long>(content_hash(key)));
+    return (fs::path(directory) / name).string();
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "dependency_graph.h"
+#include "symbol_index.h"
+#include "xref_index.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// What a file on disk looked like when it was indexed
+struct file_stamp {
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+};
+
+uint64_t content_hash(std::string_view text);
+
+/**
+ * Read only view of a symbol index snapshot on disk. The file is memory mapped and queried in
+ * place. Opening it checks every table and record once, so a snapshot that opened can be used
+ * without further checks.
+ *
+ * The format is position independent: a header with magic, format version and byte order is
+ * followed by sections of fixed size records or characters, referenced by byte offset from the
+ * start of the file. Snapshots of another format version or byte order, files that were cut
+ * short and records that point outside their tables are rejected by open, the workspace is then
+ * indexed from scratch.
+ */
+class index_snapshot {
+public:
+    static constexpr uint32_t VERSION = 3;
+    static constexpr uint32_t NO_FILE = ~uint32_t(0);
+    static constexpr uint32_t NO_NAME = ~uint32_t(0);
+
+    struct file_record {
+        uint32_t path_offset;
+        uint32_t path_length;
+        int64_t mtime_ns;
+        uint64_t size;
+        uint64_t hash;
+        uint32_t symbol_count;
+        uint32_t reserved;
+    };
+
+    struct symbol_record {
+        uint32_t name;
+        uint32_t container;     // name id or NO_NAME
+        uint32_t file;
+        uint32_t kind;
+        int32_t start_line;
+        int32_t start_character;
+        int32_t end_line;
+        int32_t end_character;
+    };
+
+    struct import_record {
+        uint32_t path_offset;   // into the import paths
+        uint32_t path_length;
+        uint32_t is_use;
+        int32_t start_line;
+        int32_t start_character;
+        int32_t end_line;
+        int32_t end_character;
+        uint32_t reserved;
+    };
+
+    // References are identifiers, so they never span lines and their length is the one of the name
+    struct reference_record {
+        uint32_t name_offset;   // into the reference names
+        uint16_t name_length;
+        uint8_t kind;
+        uint8_t reserved;
+        int32_t line;
+        int32_t character;
+    };
+
+    // nullptr if the file does not exist or is not a valid snapshot
+    static std::unique_ptr<index_snapshot> open(const std::string &path);
+    ~index_snapshot();
+
+    index_snapshot(const index_snapshot &) = delete;
+    index_snapshot &operator=(const index_snapshot &) = delete;
+
+    // Files are sorted by path
+    size_t file_count() const { return files_count; }
+    std::string_view file_path(uint32_t file) const;
+    file_stamp stamp(uint32_t file) const;
+    uint32_t symbol_count(uint32_t file) const { return files[file].symbol_count; }
+    uint32_t find_file(std::string_view path) const;
+    // The include and use statements of a file, the files they refer to are resolved again
+    void imports(uint32_t file, std::vector<file_import> &out) const;
+    // The uses of global names in a file
+    void references(uint32_t file, document_references &out) const;
+
+    size_t name_count() const { return names_count; }
+    std::string_view name(uint32_t id) const {
+        return std::string_view(names + name_offsets[id], name_offsets[id + 1] - name_offsets[id]);
+    }
+    std::string_view lower_name(uint32_t id) const {
+        return std::string_view(lower_names + name_offsets[id], name_offsets[id + 1] - name_offsets[id]);
+    }
+
+    // Sorted name ids with that posting key
+    std::pair<const uint32_t *, const uint32_t *> postings(uint32_t key) const;
+
+    // Symbols are sorted by name
+    size_t symbol_count() const { return symbols_count; }
+    std::pair<const symbol_record *, const symbol_record *> symbols_of(uint32_t name) const {
+        return {symbols + name_symbols[name], symbols + name_symbols[name + 1]};
+    }
+    const symbol_record *all_symbols() const { return symbols; }
+
+private:
+    index_snapshot() = default;
+    bool validate();
+
+    const char *data = nullptr;
+    size_t size = 0;
+
+    const file_record *files = nullptr;
+    size_t files_count = 0;
+    const char *paths = nullptr;
+    size_t paths_size = 0;
+    const char *names = nullptr;
+    const char *lower_names = nullptr;
+    const uint32_t *name_offsets = nullptr;
+    const uint32_t *name_symbols = nullptr;
+    size_t names_count = 0;
+    const uint32_t *posting_keys = nullptr;
+    const uint32_t *posting_offsets = nullptr;
+    const uint32_t *posting_names = nullptr;
+    size_t posting_keys_count = 0;
+    const symbol_record *symbols = nullptr;
+    size_t symbols_count = 0;
+    const uint32_t *file_imports = nullptr;
+    const import_record *import_records = nullptr;
+    const char *import_paths = nullptr;
+    size_t import_paths_size = 0;
+    const uint32_t *file_references = nullptr;
+    const reference_record *reference_records = nullptr;
+    const char *reference_names = nullptr;
+    size_t reference_names_size = 0;
+};
+
+/**
+ * Collects the symbols, imports and references of files indexed from disk and writes them as a
+ * new snapshot. The file is written under a temporary name and renamed, so readers never see a
+ * partial snapshot.
+ */
+class index_snapshot_writer {
+public:
+    void add_file(std::string_view path, const file_stamp &stamp, const document_symbols &symbols,
+                  const std::vector<file_import> &imports, const document_references &references);
+    // Copy files of an older snapshot that are still up to date, with their current stamps
+    void add_files(const index_snapshot &from, const std::vector<std::pair<uint32_t, file_stamp>> &files);
+
+    bool write(const std::string &path) const;
+
+private:
+    uint32_t intern(std::string_view name);
+    void add_references(const document_references &from, std::vector<index_snapshot::reference_record> &to);
+
+    struct pending_file {
+        std::string path;
+        file_stamp stamp;
+        uint32_t symbol_count;
+        std::vector<file_import> imports;
+        std::vector<index_snapshot::reference_record> references;
+    };
+    std::vector<pending_file> files;
+
+    std::unordered_map<std::string, uint32_t> name_ids;
+    std::vector<const std::string *> name_list;
+
+    // file is the index into files until write sorts them
+    std::vector<index_snapshot::symbol_record> symbols;
+
+    // The names of the references, every name once
+    std::string reference_names;
+    std::unordered_map<std::string, uint32_t> reference_name_offsets;
+};
+
+// The per user cache directory of the server, empty if there is none
+std::string cache_directory();
+
+// Snapshot file for a set of workspace folders, empty if there is no cache directory
+std::string index_cache_path(const std::vector<std::string> &roots);
@@ -2,6 +2,7 @@
 
 
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <stdio.h>
 
@@ -11,20 +12,65 @@ DocumentUri DocumentUri::fromPath(const std::string &path) {
   return result;
 }
 
-void DocumentUri::setPath(const std::string &path) {
-  // file:///c%3A/Users/jacob/Desktop/superindex/indexer/full_tests
-  raw_uri = path;
+namespace {
+
+// Both tables are indexed by the raw byte. The encoder copies every run of bytes that do not need
+// an escape in one append, the decoder copies everything up to the next '%' in one append.
+struct uri_escape_table {
+  // Hex digits of the escape sequence, first_digit is 0 for bytes that are copied verbatim
+  char first_digit[256] = {};
+  char second_digit[256] = {};
+
+  constexpr uri_escape_table() {
+    // subset of reserved characters from the URI standard
+    // http://www.ecma-international.org/ecma-262/6.0/#sec-uri-syntax-and-semantics
+    const char reserved[] = " #$&()+,;?@";
+    const char hex[] = "0123456789ABCDEF";
+    for (const char *c = reserved; *c; ++c) {
+      unsigned char b = *c;
+      first_digit[b] = hex[b >> 4];
+      second_digit[b] = hex[b & 0xF];
+    }
+  }
+};
+constexpr uri_escape_table uri_escape;
 
-  size_t index = raw_uri.find(':');
-  if (index == 1) { // widows drive letters must always be 1 char
-    raw_uri.replace(raw_uri.begin() + index, raw_uri.begin() + index + 1,
-                    "%3A");
+struct uri_hex_table {
+  // Deliberately unchecked: malformed escapes are decoded into some byte instead of rejected
+  int value[256] = {};
+
+  constexpr uri_hex_table() {
+    for (int c = 0; c < 256; ++c) {
+      value[c] = c - '0' < 10 ? c - '0' : (c | 32) - 'a' + 10;
+    }
+  }
+};
+constexpr uri_hex_table uri_hex;
+
+inline size_t clean_run(const unsigned char *data, size_t begin, size_t end) {
+  // Unrolled table scan, the common path names contain no reserved characters at all
+  while (begin + 4 <= end) {
+    if (uri_escape.first_digit[data[begin]]) return begin;
+    if (uri_escape.first_digit[data[begin + 1]]) return begin + 1;
+    if (uri_escape.first_digit[data[begin + 2]]) return begin + 2;
+    if (uri_escape.first_digit[data[begin + 3]]) return begin + 3;
+    begin += 4;
+  }
+  while (begin < end && !uri_escape.first_digit[data[begin]]) {
+    ++begin;
   }
+  return begin;
+}
+
+} // namespace
+
+void DocumentUri::setPath(const std::string &path) {
+  // file:///c%3A/Users/jacob/Desktop/superindex/indexer/full_tests
+  const auto *data = reinterpret_cast<const unsigned char *>(path.data());
+  const size_t size = path.size();
 
-  // subset of reserved characters from the URI standard
-  // http://www.ecma-international.org/ecma-262/6.0/#sec-uri-syntax-and-semantics
   std::string t;
-  t.reserve(8 + raw_uri.size());
+  t.reserve(8 + size + size / 8);
   // TODO: proper fix
 #if defined(_WIN32)
   t += "file:///";
@@ -32,23 +78,25 @@ void DocumentUri::setPath(const std::string &path) {
   t += "file://";
 #endif
 
-  // clang-format off
-  for (char c : raw_uri)
-    switch (c) {
-    case ' ': t += "%20"; break;
-    case '#': t += "%23"; break;
-    case '$': t += "%24"; break;
-    case '&': t += "%26"; break;
-    case '(': t += "%28"; break;
-    case ')': t += "%29"; break;
-    case '+': t += "%2B"; break;
-    case ',': t += "%2C"; break;
-    case ';': t += "%3B"; break;
-    case '?': t += "%3F"; break;
-    case '@': t += "%40"; break;
-    default: t += c; break;
+  // widows drive letters must always be 1 char, their ':' is escaped as well
+  const size_t drive_colon = (size > 1 && data[0] != ':' && data[1] == ':') ? 1 : size;
+
+  size_t i = 0;
+  while (i < size) {
+    size_t run_end = clean_run(data, i, i <= drive_colon ? drive_colon : size);
+    t.append(path, i, run_end - i);
+    if (run_end == size) break;
+
+    if (run_end == drive_colon) {
+      t += "%3A";
+    } else {
+      unsigned char c = data[run_end];
+      const char escaped[3] = {'%', uri_escape.first_digit[c], uri_escape.second_digit[c]};
+      t.append(escaped, 3);
     }
-  // clang-format on
+    i = run_end + 1;
+  }
+
   raw_uri = std::move(t);
 }
 
@@ -66,15 +114,24 @@ std::string DocumentUri::getPath() const {
 #else
   size_t i = 7;
 #endif
-  auto from_hex = [](unsigned char c) {
-    return c - '0' < 10 ? c - '0' : (c | 32) - 'a' + 10;
-  };
-  for (; i < raw_uri.size(); i++) {
-    if (i + 3 <= raw_uri.size() && raw_uri[i] == '%') {
-      ret.push_back(from_hex(raw_uri[i + 1]) * 16 + from_hex(raw_uri[i + 2]));
-      i += 2;
-    } else
-      ret.push_back(raw_uri[i]);
+  const char *data = raw_uri.data();
+  const size_t size = raw_uri.size();
+  ret.reserve(size > i ? size - i : 0);
+
+  while (i < size) {
+    // memchr is vectorized, so clean runs are found and copied in bulk
+    const void *found = memchr(data + i, '%', size - i);
+    size_t escape = found ? static_cast<const char *>(found) - data : size;
+
+    // an escape needs two more characters, a '%' at the very end is copied verbatim
+    if (escape + 3 > size) {
+      ret.append(data + i, size - i);
+      break;
+    }
+    ret.append(data + i, escape - i);
+    ret.push_back(uri_hex.value[static_cast<unsigned char>(data[escape + 1])] * 16 +
+                  uri_hex.value[static_cast<unsigned char>(data[escape + 2])]);
+    i = escape + 3;
   }
 #ifdef _WIN32
   std::replace(ret.begin(), ret.end(), '\\', '/');
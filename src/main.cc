@@ -1,10 +1,14 @@
 #include "connection_handler.h"
+#include "render_pool.h"
 
-#include <QThread>
-#include <QApplication>
+#include <QCoreApplication>
 
 int main(int argc, char **argv) {
-    QApplication app (argc, argv);
+    // Forks while the process is still single threaded
+    render_pool::start_zygote();
+
+    // Without a GUI, so no display is needed and neither the widgets nor a platform plugin are loaded
+    QCoreApplication app(argc, argv);
 
     ConnectionHandler handler(&app);
 
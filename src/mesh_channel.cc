@@ -0,0 +1,174 @@
+#include "mesh_channel.h"
+#include "connection.h"
+#include "shared_segment.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+
+namespace {
+
+// Each connection has its own socket
+unsigned socket_counter = 0;
+
+// The size of a handle nobody has
+constexpr uint64_t UNKNOWN_HANDLE = ~uint64_t(0);
+
+} // namespace
+
+mesh_channel::mesh_channel(Connection *conn) :
+        conn(conn)
+{
+}
+
+mesh_channel::~mesh_channel() {
+    for (const auto &c : clients) ::close(c->fd);
+    for (const shared_mesh &m : meshes) ::close(m.fd);
+    if (listen_fd >= 0) ::close(listen_fd);
+}
+
+mesh_reference mesh_channel::offer(uint64_t key, std::shared_ptr<const render_output> output, mesh_delivery delivery) {
+    mesh_reference reference;
+    if (!output || delivery == mesh_delivery::json) return reference;
+    const mesh &geometry = output->geometry;
+    reference.vertex_bytes = geometry.positions.size() * sizeof(float);
+    reference.size = reference.vertex_bytes + geometry.indices.size() * sizeof(uint32_t);
+
+    if (delivery == mesh_delivery::handle && conn->is_local() && listen()) {
+        auto found = std::find_if(meshes.begin(), meshes.end(), [key](const shared_mesh &m) { return m.key == key; });
+        if (found != meshes.end()) {
+            meshes.splice(meshes.begin(), meshes, found);
+        } else {
+            // The client maps the memfd a render worker wrote the mesh into. A mesh rendered in the
+            // server or read from the disk cache is copied into a new one.
+            int fd = conn->renderer.take_mesh_segment(key, reference.size);
+            if (fd < 0) fd = make_segment("openscad-mesh", {geometry.position_bytes(), geometry.index_bytes()});
+            if (fd >= 0) {
+                meshes.push_front({next_handle++, key, fd, reference.size});
+                while (meshes.size() > KEPT_HANDLES) {
+                    ::close(meshes.back().fd);
+                    meshes.pop_back();
+                }
+                found = meshes.begin();
+            }
+        }
+        if (found != meshes.end()) {
+            reference.delivery = mesh_delivery::handle;
+            reference.socket = "@" + socket_name;
+            reference.id = meshes.front().handle;
+            return reference;
+        }
+    }
+
+    reference.delivery = mesh_delivery::frames;
+    reference.id = next_stream++;
+    streams.push_back({reference.id, std::move(output)});
+    if (!pump_scheduled) {
+        // After the response that announces the stream
+        pump_scheduled = true;
+        QTimer::singleShot(0, conn, [this] {
+            pump_scheduled = false;
+            pump();
+        });
+    }
+    return reference;
+}
+
+void mesh_channel::pump() {
+    while (!streams.empty() && conn->unsent_bytes() < 2 * FRAME_SIZE) {
+        stream &s = streams.front();
+        const mesh &geometry = s.output->geometry;
+        const std::string_view positions = geometry.position_bytes();
+        const std::string_view indices = geometry.index_bytes();
+        // A frame does not span both arrays
+        const std::string_view part = s.offset < positions.size() ? positions.substr(s.offset)
+                                                                  : indices.substr(s.offset - positions.size());
+        const size_t size = std::min(part.size(), FRAME_SIZE);
+        if (size > 0) conn->send_frame(s.id, s.offset, part.data(), size);
+        s.offset += size;
+        if (s.offset >= positions.size() + indices.size()) streams.pop_front();
+    }
+}
+
+bool mesh_channel::listen() {
+    if (listen_fd >= 0) return true;
+    const int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return false;
+
+    const std::string name = "openscad-lsp/" + std::to_string(::getpid()) + "/" + std::to_string(socket_counter++);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    // Abstract, it goes away with the server and leaves nothing in the file system
+    memcpy(address.sun_path + 1, name.data(), std::min(name.size(), sizeof(address.sun_path) - 1));
+    const socklen_t length = offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+    if (::bind(fd, reinterpret_cast<struct sockaddr *>(&address), length) != 0 || ::listen(fd, 8) != 0) {
+        std::cerr << "Can't open the mesh socket, meshes are sent as frames: " << strerror(errno) << "\n";
+        ::close(fd);
+        return false;
+    }
+    listen_fd = fd;
+    socket_name = name;
+    listener = std::make_unique<QSocketNotifier>(fd, QSocketNotifier::Read);
+    QObject::connect(listener.get(), &QSocketNotifier::activated, conn, [this] { accept(); });
+    return true;
+}
+
+void mesh_channel::accept() {
+    while (true) {
+        const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) return;
+
+        // Only processes of the same user get the meshes
+        struct ucred peer;
+        socklen_t size = sizeof(peer);
+        if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0 || peer.uid != ::getuid()) {
+            ::close(fd);
+            continue;
+        }
+
+        auto c = std::make_unique<client>();
+        c->fd = fd;
+        c->notifier = std::make_unique<QSocketNotifier>(fd, QSocketNotifier::Read);
+        client *accepted = c.get();
+        QObject::connect(c->notifier.get(), &QSocketNotifier::activated, conn, [this, accepted] { received(accepted); });
+        clients.push_back(std::move(c));
+    }
+}
+
+void mesh_channel::received(client *c) {
+    uint64_t handle;
+    int fd;
+    const ssize_t size = receive_message(c->fd, &handle, sizeof(handle), fd, MSG_DONTWAIT);
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (fd >= 0) ::close(fd);
+    if (size != sizeof(handle)) {
+        remove(c);
+        return;
+    }
+
+    auto found = std::find_if(meshes.begin(), meshes.end(), [handle](const shared_mesh &m) { return m.handle == handle; });
+    const uint64_t reply = found != meshes.end() ? found->size : UNKNOWN_HANDLE;
+    if (!send_message(c->fd, &reply, sizeof(reply), found != meshes.end() ? found->fd : -1)) remove(c);
+}
+
+void mesh_channel::remove(client *c) {
+    // Called from the notifier's own signal, it can only be deleted later
+    c->notifier->setEnabled(false);
+    c->notifier.release()->deleteLater();
+    ::close(c->fd);
+    for (auto it = clients.begin(); it != clients.end(); ++it) {
+        if (it->get() == c) {
+            clients.erase(it);
+            break;
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Connection;
+class QSocketNotifier;
+
+// How the mesh of a render result gets to the client
+enum class mesh_delivery : uint8_t {
+    // Inline as JSON arrays
+    json,
+    // A memfd fetched from a Unix socket, for clients on the same machine
+    handle,
+    // Binary frames on the LSP stream after the response
+    frames,
+};
+
+/**
+ * Where the client finds a mesh that is not in the JSON. The bytes are the float32 positions
+ * followed by the uint32 indices, in the byte order of the server.
+ */
+struct mesh_reference {
+    mesh_delivery delivery = mesh_delivery::json;
+    // handle: the abstract socket to connect to, written with a leading '@'
+    std::string socket;
+    // The handle to send to the socket, or the stream of the frames
+    uint64_t id = 0;
+    uint64_t size = 0;
+    // Offset of the indices
+    uint64_t vertex_bytes = 0;
+};
+
+/**
+ * Hands meshes to the client without JSON.
+ *
+ * handle: the client connects to the abstract Unix socket of the connection, sends the handle as
+ * a uint64 and gets back the size as a uint64 with a sealed memfd, which it can map. The mesh
+ * is at the start of the memfd, more may follow it. A mesh from a render worker is passed in the
+ * memfd the worker wrote it into, so it is copied twice on its way from the geometry to the
+ * client: into the memfd by the worker, and out of it into the render_output of the server. A
+ * mesh rendered in the server or read from the disk cache is copied into a new memfd once per
+ * render key. The memfds of the last few meshes stay available, other users of the machine are
+ * refused.
+ *
+ * frames: for clients on another machine. After the response the mesh follows in base
+ * protocol messages with a binary body:
+ *
+ *     Content-Length: <bytes>
+ *     Content-Type: application/vnd.openscad.mesh-frame
+ *     Mesh-Stream: <id>
+ *     Mesh-Offset: <offset of the bytes in the mesh>
+ *
+ * The frames are written from the render output while the socket has room, so other messages
+ * are not held up behind a big mesh.
+ */
+class mesh_channel {
+public:
+    static constexpr size_t KEPT_HANDLES = 8;
+    static constexpr size_t FRAME_SIZE = size_t(1) << 20;
+
+    explicit mesh_channel(Connection *conn);
+    ~mesh_channel();
+
+    mesh_channel(const mesh_channel &) = delete;
+    mesh_channel &operator=(const mesh_channel &) = delete;
+
+    // Falls back from handle to frames if the client is remote or the socket can't be opened.
+    // The frames are queued behind the message being sent right now.
+    mesh_reference offer(uint64_t key, std::shared_ptr<const render_output> output, mesh_delivery delivery);
+
+    // Writes queued frames while the socket has room
+    void pump();
+
+private:
+    struct shared_mesh {
+        uint64_t handle;
+        uint64_t key;
+        int fd;
+        uint64_t size;
+    };
+
+    struct client {
+        int fd = -1;
+        std::unique_ptr<QSocketNotifier> notifier;
+    };
+
+    struct stream {
+        uint64_t id;
+        std::shared_ptr<const render_output> output;
+        uint64_t offset = 0;
+    };
+
+    bool listen();
+    void accept();
+    void received(client *c);
+    void remove(client *c);
+
+    Connection *conn;
+
+    int listen_fd = -1;
+    std::string socket_name;
+    std::unique_ptr<QSocketNotifier> listener;
+    std::vector<std::unique_ptr<client>> clients;
+    // Newest first
+    std::list<shared_mesh> meshes;
+    uint64_t next_handle = 1;
+
+    std::deque<stream> streams;
+    uint64_t next_stream = 1;
+    bool pump_scheduled = false;
+};
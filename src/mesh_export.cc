@@ -0,0 +1,583 @@
+#include "mesh_export.h"
+
+#include <QMetaObject>
+#include <QObject>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MESH_EXPORT_SSE2 1
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "binary STL is written from the mesh as it is in memory");
+
+namespace {
+
+// About a MiB of file per piece
+constexpr size_t PIECE_SIZE = size_t(1) << 20;
+constexpr size_t STL_RECORD = 50;
+constexpr size_t STL_BATCH = PIECE_SIZE / STL_RECORD;
+
+bool cancelled(const std::atomic<bool> *cancel) {
+    return cancel && cancel->load(std::memory_order_relaxed);
+}
+
+class file_writer {
+public:
+    ~file_writer() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool open(const std::string &path, std::string &error) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) error = "Can't create " + path + ": " + strerror(errno);
+        return fd >= 0;
+    }
+
+    bool write(const char *data, size_t size) {
+        while (size > 0) {
+            const ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return failed();
+            data += n;
+            size -= n;
+            written += n;
+        }
+        return true;
+    }
+
+    // Into what was written before
+    bool write_at(uint64_t offset, const char *data, size_t size) {
+        while (size > 0) {
+            const ssize_t n = ::pwrite(fd, data, size, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return failed();
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    bool close() {
+        const int result = ::close(fd);
+        fd = -1;
+        return result == 0 || failed();
+    }
+
+    uint64_t offset() const { return written; }
+    const std::string &error() const { return message; }
+
+private:
+    bool failed() {
+        if (message.empty()) message = std::string("Can't write the export: ") + strerror(errno);
+        return false;
+    }
+
+    int fd = -1;
+    uint64_t written = 0;
+    std::string message;
+};
+
+///////////////////////////////////////////////////////////
+// Binary STL
+///////////////////////////////////////////////////////////
+
+void scalar_normal(const float *a, const float *b, const float *c, float *normal) {
+    const float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    const float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    const float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+    const float length2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+    // Degenerate triangles get a zero normal
+    const float inverse = length2 > 0 ? 1.0f / std::sqrt(length2) : 0.0f;
+    normal[0] = n[0] * inverse;
+    normal[1] = n[1] * inverse;
+    normal[2] = n[2] * inverse;
+    normal[3] = 0;
+}
+
+// Unit normals of count triangles from first, four floats each
+void triangle_normals(const mesh &geometry, size_t first, size_t count, float *normals) {
+    const float *positions = geometry.positions.data();
+    const uint32_t *indices = geometry.indices.data() + 3 * first;
+    size_t t = 0;
+#ifdef MESH_EXPORT_SSE2
+    for (; t + 4 <= count; t += 4) {
+        // The corners of four triangles, one lane each
+        alignas(16) float corners[9][4];
+        for (size_t lane = 0; lane < 4; lane++) {
+            for (size_t k = 0; k < 3; k++) {
+                const float *v = positions + 3 * size_t(indices[3 * (t + lane) + k]);
+                corners[3 * k][lane] = v[0];
+                corners[3 * k + 1][lane] = v[1];
+                corners[3 * k + 2][lane] = v[2];
+            }
+        }
+        const __m128 ax = _mm_load_ps(corners[0]), ay = _mm_load_ps(corners[1]), az = _mm_load_ps(corners[2]);
+        const __m128 e1x = _mm_sub_ps(_mm_load_ps(corners[3]), ax);
+        const __m128 e1y = _mm_sub_ps(_mm_load_ps(corners[4]), ay);
+        const __m128 e1z = _mm_sub_ps(_mm_load_ps(corners[5]), az);
+        const __m128 e2x = _mm_sub_ps(_mm_load_ps(corners[6]), ax);
+        const __m128 e2y = _mm_sub_ps(_mm_load_ps(corners[7]), ay);
+        const __m128 e2z = _mm_sub_ps(_mm_load_ps(corners[8]), az);
+        __m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+        __m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+        __m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+        const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+        // The same operations as scalar_normal, the infinity of a degenerate one is masked out
+        const __m128 inverse = _mm_and_ps(_mm_cmpgt_ps(length2, _mm_setzero_ps()),
+                                          _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length2)));
+        nx = _mm_mul_ps(nx, inverse);
+        ny = _mm_mul_ps(ny, inverse);
+        nz = _mm_mul_ps(nz, inverse);
+        __m128 nw = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+        _mm_storeu_ps(normals + 4 * t, nx);
+        _mm_storeu_ps(normals + 4 * t + 4, ny);
+        _mm_storeu_ps(normals + 4 * t + 8, nz);
+        _mm_storeu_ps(normals + 4 * t + 12, nw);
+    }
+#endif
+    for (; t < count; t++) {
+        const uint32_t *triangle = indices + 3 * t;
+        scalar_normal(positions + 3 * size_t(triangle[0]), positions + 3 * size_t(triangle[1]),
+                      positions + 3 * size_t(triangle[2]), normals + 4 * t);
+    }
+}
+
+bool write_stl(const mesh &geometry, file_writer &out, std::string &error, const std::atomic<bool> *cancel) {
+    const size_t count = geometry.triangle_count();
+    if (count > UINT32_MAX) {
+        error = "Binary STL can't hold more than 2^32 - 1 triangles";
+        return false;
+    }
+
+    // The header must not start with "solid", or readers take it for ASCII STL
+    char header[84] = {};
+    const char title[] = "Binary STL written by openscad-lsp";
+    memcpy(header, title, sizeof(title) - 1);
+    const uint32_t triangles = static_cast<uint32_t>(count);
+    memcpy(header + 80, &triangles, sizeof(triangles));
+    if (!out.write(header, sizeof(header))) return false;
+
+    std::vector<float> normals(4 * STL_BATCH);
+    std::vector<char> piece(STL_RECORD * STL_BATCH);
+    for (size_t first = 0; first < count; first += STL_BATCH) {
+        if (cancelled(cancel)) {
+            error = "The export was cancelled";
+            return false;
+        }
+        const size_t batch = std::min(STL_BATCH, count - first);
+        triangle_normals(geometry, first, batch, normals.data());
+        char *record = piece.data();
+        for (size_t t = 0; t < batch; t++, record += STL_RECORD) {
+            memcpy(record, &normals[4 * t], 3 * sizeof(float));
+            const uint32_t *triangle = &geometry.indices[3 * (first + t)];
+            for (size_t k = 0; k < 3; k++) {
+                memcpy(record + 12 + 12 * k, &geometry.positions[3 * size_t(triangle[k])], 3 * sizeof(float));
+            }
+            record[48] = record[49] = 0;
+        }
+        if (!out.write(piece.data(), record - piece.data())) return false;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+// 3MF
+///////////////////////////////////////////////////////////
+
+uint32_t crc32(uint32_t crc, std::string_view data) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (unsigned char byte : data) crc = table[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put16(std::string &out, uint16_t value) {
+    out += char(value & 0xFF);
+    out += char(value >> 8);
+}
+
+void put32(std::string &out, uint32_t value) {
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+void put64(std::string &out, uint64_t value) {
+    put32(out, value & 0xFFFFFFFF);
+    put32(out, value >> 32);
+}
+
+/**
+ * A zip of stored entries written front to back. The sizes are only known at the end of an
+ * entry, they are patched into its local header then. Every entry has a zip64 field, the model
+ * of a big mesh is more than 4 GiB of XML.
+ */
+class zip_writer {
+public:
+    explicit zip_writer(file_writer &out) : out(out) {}
+
+    bool begin(const std::string &name) {
+        entries.push_back({name, 0, 0, out.offset()});
+        std::string header;
+        put32(header, 0x04034b50);
+        put16(header, ZIP64_VERSION);
+        put16(header, 0);               // flags
+        put16(header, 0);               // stored
+        put16(header, DOS_TIME);
+        put16(header, DOS_DATE);
+        put32(header, 0);               // crc, patched
+        put32(header, 0xFFFFFFFF);      // sizes are in the zip64 field
+        put32(header, 0xFFFFFFFF);
+        put16(header, name.size());
+        put16(header, 20);
+        header += name;
+        put16(header, 0x0001);
+        put16(header, 16);
+        put64(header, 0);               // sizes, patched
+        put64(header, 0);
+        return out.write(header.data(), header.size());
+    }
+
+    bool add(std::string_view data) {
+        entry &e = entries.back();
+        e.crc = crc32(e.crc, data);
+        e.size += data.size();
+        return out.write(data.data(), data.size());
+    }
+
+    bool end() {
+        const entry &e = entries.back();
+        std::string crc;
+        put32(crc, e.crc);
+        std::string sizes;
+        put64(sizes, e.size);
+        put64(sizes, e.size);
+        return out.write_at(e.offset + 14, crc.data(), crc.size()) &&
+               out.write_at(e.offset + 30 + e.name.size() + 4, sizes.data(), sizes.size());
+    }
+
+    bool finish() {
+        const uint64_t directory_offset = out.offset();
+        std::string directory;
+        for (const entry &e : entries) {
+            put32(directory, 0x02014b50);
+            put16(directory, ZIP64_VERSION | (3 << 8));  // made on unix
+            put16(directory, ZIP64_VERSION);
+            put16(directory, 0);
+            put16(directory, 0);
+            put16(directory, DOS_TIME);
+            put16(directory, DOS_DATE);
+            put32(directory, e.crc);
+            put32(directory, 0xFFFFFFFF);
+            put32(directory, 0xFFFFFFFF);
+            put16(directory, e.name.size());
+            put16(directory, 28);
+            put16(directory, 0);        // comment
+            put16(directory, 0);        // disk
+            put16(directory, 0);        // internal attributes
+            put32(directory, 0100644u << 16);
+            put32(directory, 0xFFFFFFFF);
+            directory += e.name;
+            put16(directory, 0x0001);
+            put16(directory, 24);
+            put64(directory, e.size);
+            put64(directory, e.size);
+            put64(directory, e.offset);
+        }
+
+        const uint64_t end_offset = directory_offset + directory.size();
+        put32(directory, 0x06064b50);
+        put64(directory, 44);
+        put16(directory, ZIP64_VERSION | (3 << 8));
+        put16(directory, ZIP64_VERSION);
+        put32(directory, 0);
+        put32(directory, 0);
+        put64(directory, entries.size());
+        put64(directory, entries.size());
+        put64(directory, end_offset - directory_offset);
+        put64(directory, directory_offset);
+
+        put32(directory, 0x07064b50);
+        put32(directory, 0);
+        put64(directory, end_offset);
+        put32(directory, 1);
+
+        put32(directory, 0x06054b50);
+        put16(directory, 0);
+        put16(directory, 0);
+        put16(directory, std::min<size_t>(entries.size(), 0xFFFF));
+        put16(directory, std::min<size_t>(entries.size(), 0xFFFF));
+        put32(directory, std::min<uint64_t>(end_offset - directory_offset, 0xFFFFFFFF));
+        put32(directory, std::min<uint64_t>(directory_offset, 0xFFFFFFFF));
+        put16(directory, 0);
+        return out.write(directory.data(), directory.size());
+    }
+
+private:
+    static constexpr uint16_t ZIP64_VERSION = 45;
+    // 1980-01-01 00:00, the same model gives the same file
+    static constexpr uint16_t DOS_TIME = 0;
+    static constexpr uint16_t DOS_DATE = (1 << 5) | 1;
+
+    struct entry {
+        std::string name;
+        uint32_t crc;
+        uint64_t size;
+        uint64_t offset;
+    };
+
+    file_writer &out;
+    std::vector<entry> entries;
+};
+
+// Pieces of zip entries from the formatting thread to the writing thread
+class piece_pipe {
+public:
+    struct piece {
+        // Starts a new entry if set
+        std::string entry;
+        std::string data;
+    };
+
+    // Waits while the pipe is full, false if the writer gave up
+    bool push(piece p) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return failed || pieces.size() < DEPTH; });
+        if (failed) return false;
+        pieces.push_back(std::move(p));
+        changed.notify_all();
+        return true;
+    }
+
+    // False once closed and empty, or when the formatting failed
+    bool pop(piece &p) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return closed || failed || !pieces.empty(); });
+        if (failed || pieces.empty()) return false;
+        p = std::move(pieces.front());
+        pieces.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        changed.notify_all();
+    }
+
+    void fail() {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = true;
+        changed.notify_all();
+    }
+
+private:
+    // Pieces formatted ahead of the writer, this bounds the memory of an export
+    static constexpr size_t DEPTH = 4;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<piece> pieces;
+    bool closed = false;
+    bool failed = false;
+};
+
+const char CONTENT_TYPES[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+    "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+    "<Default Extension=\"model\" ContentType=\"application/vnd.ms-package.3dmanufacturing-3dmodel+xml\"/>"
+    "</Types>\n";
+
+const char RELATIONSHIPS[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+    "<Relationship Target=\"/3D/3dmodel.model\" Id=\"rel0\" "
+    "Type=\"http://schemas.microsoft.com/3dmanufacturing/2013/01/3dmodel\"/>"
+    "</Relationships>\n";
+
+const char MODEL_BEGIN[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<model unit=\"millimeter\" xml:lang=\"en-US\" "
+    "xmlns=\"http://schemas.microsoft.com/3dmanufacturing/core/2015/02\">\n"
+    "<resources>\n<object id=\"1\" type=\"model\">\n<mesh>\n<vertices>\n";
+
+const char MODEL_END[] = "</triangles>\n</mesh>\n</object>\n</resources>\n<build>\n<item objectid=\"1\"/>\n</build>\n</model>\n";
+
+template <typename T>
+void append_number(std::string &out, T value) {
+    char text[32];
+    const std::to_chars_result result = std::to_chars(text, text + sizeof(text), value);
+    out.append(text, result.ptr);
+}
+
+// Formats the model into pieces for the pipe, false if cancelled or the writer failed
+bool format_model(const mesh &geometry, piece_pipe &pipe, std::string &error, const std::atomic<bool> *cancel) {
+    piece_pipe::piece current{"3D/3dmodel.model", MODEL_BEGIN};
+    auto flush = [&](bool force) {
+        if (!force && current.data.size() < PIECE_SIZE) return true;
+        if (cancelled(cancel)) {
+            error = "The export was cancelled";
+            return false;
+        }
+        if (!pipe.push(std::move(current))) return false;
+        current = piece_pipe::piece();
+        current.data.reserve(PIECE_SIZE + 256);
+        return true;
+    };
+
+    const std::vector<float> &positions = geometry.positions;
+    for (size_t v = 0; v + 2 < positions.size(); v += 3) {
+        current.data += "<vertex x=\"";
+        append_number(current.data, positions[v]);
+        current.data += "\" y=\"";
+        append_number(current.data, positions[v + 1]);
+        current.data += "\" z=\"";
+        append_number(current.data, positions[v + 2]);
+        current.data += "\"/>\n";
+        if (!flush(false)) return false;
+    }
+    current.data += "</vertices>\n<triangles>\n";
+    const std::vector<uint32_t> &indices = geometry.indices;
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        current.data += "<triangle v1=\"";
+        append_number(current.data, indices[t]);
+        current.data += "\" v2=\"";
+        append_number(current.data, indices[t + 1]);
+        current.data += "\" v3=\"";
+        append_number(current.data, indices[t + 2]);
+        current.data += "\"/>\n";
+        if (!flush(false)) return false;
+    }
+    current.data += MODEL_END;
+    return flush(true);
+}
+
+bool write_3mf(const mesh &geometry, file_writer &out, std::string &error, const std::atomic<bool> *cancel) {
+    piece_pipe pipe;
+    bool written = true;
+    // Checksums and writes while the next pieces are formatted
+    std::thread writer([&pipe, &out, &written] {
+        zip_writer zip(out);
+        bool open = false;
+        piece_pipe::piece p;
+        while (written && pipe.pop(p)) {
+            if (!p.entry.empty()) {
+                written = (!open || zip.end()) && zip.begin(p.entry);
+                open = true;
+            }
+            written = written && zip.add(p.data);
+        }
+        written = written && (!open || zip.end()) && zip.finish();
+        if (!written) pipe.fail();
+    });
+
+    const bool formatted = pipe.push({"[Content_Types].xml", CONTENT_TYPES}) &&
+                           pipe.push({"_rels/.rels", RELATIONSHIPS}) && format_model(geometry, pipe, error, cancel);
+    if (!formatted) pipe.fail();
+    pipe.close();
+    writer.join();
+    return formatted && written;
+}
+
+} // namespace
+
+bool parse_export_format(const std::string &name, export_format &format) {
+    if (name == "stl") {
+        format = export_format::stl;
+    } else if (name == "3mf") {
+        format = export_format::threemf;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool export_mesh(const mesh &geometry, export_format format, const std::string &path, uint64_t &bytes,
+                 std::string &error, const std::atomic<bool> *cancel) {
+    const std::string partial = path + ".part";
+    file_writer out;
+    if (!out.open(partial, error)) return false;
+
+    bool done = format == export_format::stl ? write_stl(geometry, out, error, cancel)
+                                             : write_3mf(geometry, out, error, cancel);
+    bytes = out.offset();
+    done = out.close() && done;
+    if (done && ::rename(partial.c_str(), path.c_str()) != 0) {
+        error = "Can't rename the export to " + path + ": " + strerror(errno);
+        done = false;
+    }
+    if (!done) {
+        if (error.empty()) error = out.error();
+        ::unlink(partial.c_str());
+    }
+    return done;
+}
+
+mesh_exporter::mesh_exporter(QObject *context) :
+        context(context)
+{
+}
+
+mesh_exporter::~mesh_exporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) thread.join();
+}
+
+void mesh_exporter::submit(std::shared_ptr<const render_output> output, export_format format, std::string path,
+                           done_callback done) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back({std::move(output), format, std::move(path), std::move(done)});
+    }
+    wake.notify_one();
+    // Started on first use
+    if (!thread.joinable()) thread = std::thread(&mesh_exporter::run, this);
+}
+
+void mesh_exporter::run() {
+    while (true) {
+        job next;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            next = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        uint64_t bytes = 0;
+        std::string error;
+        const bool exported = export_mesh(next.output->geometry, next.format, next.path, bytes, error, &stopping);
+        done_callback done = std::move(next.done);
+        QMetaObject::invokeMethod(context, [done, exported, bytes, error] { done(exported, bytes, error); },
+                                  Qt::QueuedConnection);
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "geometry.h"
+#include "render.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class QObject;
+
+enum class export_format : uint8_t {
+    stl,
+    threemf,
+};
+
+// "stl" or "3mf", false for anything else
+bool parse_export_format(const std::string &name, export_format &format);
+
+/**
+ * Writes the mesh to path in the format, from the mesh as it is in memory. The file is written
+ * in pieces of about a MiB next to path and renamed to it when complete, so nothing more than a
+ * piece is held besides the mesh.
+ *
+ * Binary STL gets its normals computed four triangles at a time. 3MF is a zip with the model
+ * stored uncompressed; the XML is formatted on the calling thread while a second thread
+ * checksums and writes the pieces before it.
+ *
+ * False with a message if the file can't be written or cancel was set.
+ */
+bool export_mesh(const mesh &geometry, export_format format, const std::string &path, uint64_t &bytes,
+                 std::string &error, const std::atomic<bool> *cancel = nullptr);
+
+/**
+ * Runs exports one after the other on a thread of its own, so the server keeps answering
+ * while a big model is written.
+ */
+class mesh_exporter {
+public:
+    using done_callback = std::function<void(bool exported, uint64_t bytes, const std::string &error)>;
+
+    // The callbacks run on the thread of the context object
+    explicit mesh_exporter(QObject *context);
+    // Cancels the running export and waits for it, queued ones are dropped
+    ~mesh_exporter();
+
+    mesh_exporter(const mesh_exporter &) = delete;
+    mesh_exporter &operator=(const mesh_exporter &) = delete;
+
+    void submit(std::shared_ptr<const render_output> output, export_format format, std::string path,
+                done_callback done);
+
+private:
+    struct job {
+        std::shared_ptr<const render_output> output;
+        export_format format;
+        std::string path;
+        done_callback done;
+    };
+
+    void run();
+
+    QObject *context;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<job> jobs;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
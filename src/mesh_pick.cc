@@ -0,0 +1,370 @@
+#include "mesh_pick.h"
+#include "task_pool.h"
+
+#include <QMetaObject>
+#include <QObject>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+constexpr uint32_t LEAF_SIZE = 4;
+// A node this big is split even if the heuristic prefers a leaf
+constexpr uint32_t MAX_LEAF_SIZE = 16;
+constexpr int BINS = 16;
+// Below this depth the nodes are split at the median, which keeps the tree and the pick stack flat
+constexpr int MAX_SAH_DEPTH = 40;
+constexpr size_t PICK_STACK = 128;
+// Nodes with more triangles build their children on the task pool
+constexpr size_t PARALLEL_SIZE = size_t(1) << 16;
+
+struct box {
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    void add(const float *point) {
+        for (int k = 0; k < 3; k++) {
+            min[k] = std::min(min[k], point[k]);
+            max[k] = std::max(max[k], point[k]);
+        }
+    }
+    void add(const box &o) {
+        for (int k = 0; k < 3; k++) {
+            min[k] = std::min(min[k], o.min[k]);
+            max[k] = std::max(max[k], o.max[k]);
+        }
+    }
+    float area() const {
+        if (min[0] > max[0]) return 0;
+        const float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+        return x * y + y * z + z * x;
+    }
+};
+
+} // namespace
+
+struct mesh_bvh::builder {
+    // What the splits look at, moved around with the triangle so every pass reads memory in order
+    struct item {
+        box bounds;
+        float centroid[3];
+        uint32_t triangle;
+    };
+
+    task_pool *tasks;
+    std::vector<item> order;
+
+    builder(const mesh &geometry, task_pool *tasks) : tasks(tasks) {
+        order.resize(geometry.triangle_count());
+        in_chunks(order.size(), [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                item &it = order[t];
+                for (int c = 0; c < 3; c++) it.bounds.add(&geometry.positions[geometry.indices[t * 3 + c] * 3]);
+                for (int k = 0; k < 3; k++) it.centroid[k] = (it.bounds.min[k] + it.bounds.max[k]) * 0.5f;
+                it.triangle = static_cast<uint32_t>(t);
+            }
+        });
+    }
+
+    template <typename Body>
+    void in_chunks(size_t count, const Body &body) {
+        const size_t chunks = tasks && count >= PARALLEL_SIZE ? (count + PARALLEL_SIZE - 1) / PARALLEL_SIZE : 1;
+        auto run = [&](size_t chunk) { body(count * chunk / chunks, count * (chunk + 1) / chunks); };
+        if (chunks == 1) {
+            run(0);
+        } else {
+            tasks->parallel_for(chunks, run);
+        }
+    }
+
+    void root(std::vector<node> &out) {
+        box all, centers;
+        for (const item &it : order) {
+            all.add(it.bounds);
+            centers.add(it.centroid);
+        }
+        out.reserve(order.size() / LEAF_SIZE * 2 + 1);
+        build(0, static_cast<uint32_t>(order.size()), all, centers, 0, out);
+    }
+
+    // The children of an inner node are counted from the start of out, the triangles of a leaf
+    // from the start of order
+    void build(uint32_t begin, uint32_t end, const box &all, const box &centers, int depth, std::vector<node> &out) {
+        const size_t index = out.size();
+        out.emplace_back();
+        memcpy(out[index].min, all.min, sizeof(all.min));
+        memcpy(out[index].max, all.max, sizeof(all.max));
+        out[index].first = begin;
+        out[index].count = end - begin;
+
+        const uint32_t count = end - begin;
+        int axis = 0;
+        for (int k = 1; k < 3; k++) {
+            if (centers.max[k] - centers.min[k] > centers.max[axis] - centers.min[axis]) axis = k;
+        }
+        const float low = centers.min[axis];
+        const float extent = centers.max[axis] - low;
+        // The same centroid for all of them, no split separates them
+        if (count <= LEAF_SIZE || !(extent > 0)) return;
+        const float scale = BINS / extent;
+
+        uint32_t middle = begin;
+        box child_all[2], child_centers[2];
+        if (depth < MAX_SAH_DEPTH) {
+            box bins[BINS], bin_centers[BINS];
+            uint32_t counts[BINS] = {};
+            for (uint32_t i = begin; i < end; i++) {
+                const item &it = order[i];
+                const int b = bin_of(it.centroid[axis], low, scale);
+                bins[b].add(it.bounds);
+                bin_centers[b].add(it.centroid);
+                counts[b]++;
+            }
+            const int split = best_split(bins, counts, all, count);
+            if (split < 0) return;
+            if (split > 0) {
+                middle = static_cast<uint32_t>(
+                    std::partition(order.begin() + begin, order.begin() + end, [&](const item &it) {
+                        return bin_of(it.centroid[axis], low, scale) < split;
+                    }) - order.begin());
+                for (int b = 0; b < BINS; b++) {
+                    child_all[b >= split].add(bins[b]);
+                    child_centers[b >= split].add(bin_centers[b]);
+                }
+            }
+        }
+        if (middle == begin || middle == end) {
+            middle = begin + count / 2;
+            std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                             [axis](const item &a, const item &b) { return a.centroid[axis] < b.centroid[axis]; });
+            for (uint32_t i = begin; i < end; i++) {
+                child_all[i >= middle].add(order[i].bounds);
+                child_centers[i >= middle].add(order[i].centroid);
+            }
+        }
+
+        out[index].count = 0;
+        if (tasks && count >= PARALLEL_SIZE) {
+            // Built apart and appended, the node indices of the second child move by what comes before it
+            std::vector<node> parts[2];
+            const uint32_t ranges[3] = {begin, middle, end};
+            tasks->parallel_for(2, [&](size_t i) {
+                build(ranges[i], ranges[i + 1], child_all[i], child_centers[i], depth + 1, parts[i]);
+            });
+            for (int i = 0; i < 2; i++) {
+                const uint32_t base = static_cast<uint32_t>(out.size());
+                if (i == 1) out[index].first = base;
+                for (node n : parts[i]) {
+                    if (n.count == 0) n.first += base;
+                    out.push_back(n);
+                }
+            }
+            return;
+        }
+        build(begin, middle, child_all[0], child_centers[0], depth + 1, out);
+        out[index].first = static_cast<uint32_t>(out.size());
+        build(middle, end, child_all[1], child_centers[1], depth + 1, out);
+    }
+
+    static int bin_of(float centroid, float low, float scale) {
+        return std::min(BINS - 1, static_cast<int>((centroid - low) * scale));
+    }
+
+    // The first bin of the second child, -1 if a leaf is cheaper, 0 if the bins did not separate
+    // anything
+    static int best_split(const box *bins, const uint32_t *counts, const box &all, uint32_t count) {
+        // Sweeping from the right gives the cost of every second child
+        float right_cost[BINS];
+        box right;
+        uint32_t right_count = 0;
+        for (int b = BINS - 1; b > 0; b--) {
+            right.add(bins[b]);
+            right_count += counts[b];
+            right_cost[b] = right.area() * right_count;
+        }
+        box left;
+        uint32_t left_count = 0;
+        float best_cost = INFINITY;
+        int best = 0;
+        for (int b = 1; b < BINS; b++) {
+            left.add(bins[b - 1]);
+            left_count += counts[b - 1];
+            if (left_count == 0 || left_count == count) continue;
+            const float cost = left.area() * left_count + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = b;
+            }
+        }
+        // A visit of a node costs about as much as the test of a triangle
+        if (best > 0 && count <= MAX_LEAF_SIZE && all.area() + best_cost >= all.area() * count) return -1;
+        return best;
+    }
+};
+
+mesh_bvh::mesh_bvh(const mesh &geometry, task_pool *tasks) {
+    if (geometry.triangle_count() == 0) return;
+    builder b(geometry, tasks);
+    b.root(nodes);
+    // The leaves index into order, which is the leaf order of the triangles now
+    triangles.resize(b.order.size());
+    for (size_t i = 0; i < triangles.size(); i++) triangles[i] = b.order[i].triangle;
+}
+
+size_t mesh_bvh::memory_size() const {
+    return sizeof(*this) + nodes.capacity() * sizeof(node) + triangles.capacity() * sizeof(uint32_t);
+}
+
+bool mesh_bvh::pick(const mesh &geometry, const vec3 &origin, const vec3 &direction, pick_hit &hit) const {
+    const double length = direction.length();
+    if (nodes.empty() || !(length > 0)) return false;
+    const float *positions = geometry.positions.data();
+    const uint32_t *indices = geometry.indices.data();
+    const float o[3] = {float(origin.x), float(origin.y), float(origin.z)};
+    float d[3] = {float(direction.x / length), float(direction.y / length), float(direction.z / length)};
+    float inverse[3];
+    for (int k = 0; k < 3; k++) {
+        // Keeps the slabs free of 0 * infinity
+        if (std::fabs(d[k]) < 1e-20f) d[k] = std::copysign(1e-20f, d[k]);
+        inverse[k] = 1.0f / d[k];
+    }
+
+    // Where the ray enters the box, infinity if it misses it or enters behind the nearest hit
+    float nearest = INFINITY;
+    auto enter = [&](const node &n) {
+        float near = 0, far = nearest;
+        for (int k = 0; k < 3; k++) {
+            float t0 = (n.min[k] - o[k]) * inverse[k];
+            float t1 = (n.max[k] - o[k]) * inverse[k];
+            if (t0 > t1) std::swap(t0, t1);
+            near = std::max(near, t0);
+            far = std::min(far, t1);
+        }
+        return near <= far ? near : INFINITY;
+    };
+
+    uint32_t found = 0;
+    std::pair<uint32_t, float> stack[PICK_STACK];
+    size_t depth = 0;
+    stack[depth++] = {0, enter(nodes[0])};
+    while (depth > 0) {
+        const auto [index, entry] = stack[--depth];
+        if (!(entry < nearest)) continue;
+        const node &n = nodes[index];
+        if (n.count > 0) {
+            for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                // Möller-Trumbore
+                const uint32_t *corners = &indices[triangles[i] * 3];
+                const float *a = &positions[corners[0] * 3], *b = &positions[corners[1] * 3], *c = &positions[corners[2] * 3];
+                const float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+                const float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+                const float p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+                const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+                if (det == 0) continue;
+                const float f = 1.0f / det;
+                const float s[3] = {o[0] - a[0], o[1] - a[1], o[2] - a[2]};
+                const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * f;
+                if (u < 0 || u > 1) continue;
+                const float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+                const float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * f;
+                if (v < 0 || u + v > 1) continue;
+                const float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * f;
+                if (t > 0 && t < nearest) {
+                    nearest = t;
+                    found = triangles[i];
+                }
+            }
+            continue;
+        }
+        // The nearer child is popped first
+        const uint32_t first = index + 1, second = n.first;
+        const float first_entry = enter(nodes[first]), second_entry = enter(nodes[second]);
+        if (depth + 2 > PICK_STACK) return false;
+        if (first_entry <= second_entry) {
+            if (second_entry < nearest) stack[depth++] = {second, second_entry};
+            if (first_entry < nearest) stack[depth++] = {first, first_entry};
+        } else {
+            if (first_entry < nearest) stack[depth++] = {first, first_entry};
+            if (second_entry < nearest) stack[depth++] = {second, second_entry};
+        }
+    }
+    if (nearest == INFINITY) return false;
+    hit.triangle = found;
+    hit.distance = nearest;
+    return true;
+}
+
+pick_cache::pick_cache(QObject *context) :
+        context(context)
+{
+}
+
+pick_cache::~pick_cache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) thread.join();
+}
+
+void pick_cache::pick(uint64_t key, std::shared_ptr<const render_output> output, const vec3 &origin,
+                      const vec3 &direction, done_callback done) {
+    for (auto it = recent.begin(); it != recent.end(); ++it) {
+        if (it->key == key) {
+            recent.splice(recent.begin(), recent, it);
+            answer(recent.front(), {origin, direction, std::move(done)});
+            return;
+        }
+    }
+
+    // Picks of a render whose hierarchy is being built wait for it
+    auto waiting = pending.find(key);
+    if (waiting != pending.end()) {
+        waiting->second.push_back({origin, direction, std::move(done)});
+        return;
+    }
+    pending[key].push_back({origin, direction, std::move(done)});
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back({key, std::move(output), nullptr});
+    }
+    wake.notify_one();
+    // Started on first use
+    if (!thread.joinable()) thread = std::thread(&pick_cache::run, this);
+}
+
+void pick_cache::answer(const entry &e, const ray &r) {
+    pick_hit hit;
+    const bool found = e.bvh->pick(e.output->geometry, r.origin, r.direction, hit);
+    r.done(found, hit, *e.output);
+}
+
+void pick_cache::built(entry e) {
+    recent.push_front(std::move(e));
+    while (recent.size() > KEPT) recent.pop_back();
+    auto waiting = pending.find(recent.front().key);
+    if (waiting == pending.end()) return;
+    const std::vector<ray> rays = std::move(waiting->second);
+    pending.erase(waiting);
+    for (const ray &r : rays) answer(recent.front(), r);
+}
+
+void pick_cache::run() {
+    while (true) {
+        entry next;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            next = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        next.bvh = std::make_shared<const mesh_bvh>(next.output->geometry, &render_threads());
+        QMetaObject::invokeMethod(context, [this, next] { built(next); }, Qt::QueuedConnection);
+    }
+}
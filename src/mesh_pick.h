@@ -0,0 +1,113 @@
+#pragma once
+
+#include "geometry.h"
+#include "render.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class QObject;
+class task_pool;
+
+struct pick_hit {
+    // Into the triangles of the mesh
+    uint32_t triangle = 0;
+    // Along the ray, in model units
+    float distance = 0;
+};
+
+/**
+ * Bounding volume hierarchy over the triangles of a mesh, for finding the triangle under the
+ * mouse. The nodes are split by the surface area heuristic over 16 bins of the triangle
+ * centroids, small leaves are kept where the heuristic prefers them. Nodes are stored depth
+ * first with the first child right after its parent. Only the order of the triangles is kept,
+ * the corners are read from the mesh. Big meshes are built on a task pool, the halves of a node
+ * in parallel.
+ */
+class mesh_bvh {
+public:
+    explicit mesh_bvh(const mesh &geometry, task_pool *tasks = nullptr);
+
+    // The nearest triangle of the mesh the hierarchy was built for in front of the origin, from
+    // both sides
+    bool pick(const mesh &geometry, const vec3 &origin, const vec3 &direction, pick_hit &hit) const;
+
+    size_t memory_size() const;
+
+private:
+    struct node {
+        float min[3];
+        float max[3];
+        // The triangles of a leaf start at first, the second child of an inner node is at first
+        uint32_t first;
+        // Zero for inner nodes
+        uint32_t count;
+    };
+
+    struct builder;
+
+    std::vector<node> nodes;
+    // The triangle of the mesh for every one in leaf order
+    std::vector<uint32_t> triangles;
+};
+
+/**
+ * The hierarchies of the renders picked last. The first pick of a render builds the hierarchy
+ * on a thread of its own, so the server keeps answering meanwhile, and is answered when it is
+ * done together with the picks that came in while it was built.
+ */
+class pick_cache {
+public:
+    using done_callback = std::function<void(bool found, const pick_hit &hit, const render_output &output)>;
+
+    // The callbacks run on the thread of the context object
+    explicit pick_cache(QObject *context);
+    // Waits for the hierarchy being built, queued ones are dropped
+    ~pick_cache();
+
+    pick_cache(const pick_cache &) = delete;
+    pick_cache &operator=(const pick_cache &) = delete;
+
+    // Calls done right away if the hierarchy of the render is kept
+    void pick(uint64_t key, std::shared_ptr<const render_output> output, const vec3 &origin, const vec3 &direction,
+              done_callback done);
+
+private:
+    static constexpr size_t KEPT = 4;
+
+    struct entry {
+        uint64_t key = 0;
+        std::shared_ptr<const render_output> output;
+        std::shared_ptr<const mesh_bvh> bvh;
+    };
+
+    struct ray {
+        vec3 origin;
+        vec3 direction;
+        done_callback done;
+    };
+
+    void answer(const entry &e, const ray &r);
+    void built(entry e);
+    void run();
+
+    QObject *context;
+    // Most recently used first
+    std::list<entry> recent;
+    std::unordered_map<uint64_t, std::vector<ray>> pending;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<entry> jobs;
+    bool stopping = false;
+    std::thread thread;
+};
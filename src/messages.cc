@@ -1,27 +1,68 @@
 #include "messages.h"
 #include "connection.h"
+#include "diagnostics.h"
+#include "index_cache.h"
+#include "navigation.h"
 #include "project.h"
+#include "uri_table.h"
+#include "workspace.h"
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
 #include <iostream>
 
 #define UNUSED(x) (void)(x)
 
 void InitializeRequest::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
     InitializeResult msg;
     std::cout << "Processing InitializeRequest\n";
     // TODO fill in the initialize Result (Capabilities are automatically encoded)
 
-    // TODO initialize the project from the initalization parameters
+    // workspaceFolders supersedes the deprecated rootUri and rootPath
+    proj->workspace_folders = std::move(this->workspaceFolders);
+    if (proj->workspace_folders.empty() && (!this->rootUri.empty() || !this->rootPath.empty())) {
+        WorkspaceFolder root;
+        root.uri = this->rootUri.empty() ? DocumentUri::fromPath(this->rootPath) : DocumentUri{this->rootUri};
+        root.name = root.uri.getPath();
+        proj->workspace_folders.push_back(std::move(root));
+    }
+    proj->client_work_done_progress = this->capabilities.workDoneProgress;
+    proj->client_show_document = this->capabilities.showDocument;
+
+    const std::string cache = cache_directory();
+    auto limit = [](const OptionalType<double> &bytes, size_t fallback) {
+        return bytes ? static_cast<size_t>(std::max(0.0, *bytes)) : fallback;
+    };
+    proj->renders.configure(this->renderCache.directory.value_or(cache.empty() ? cache : cache + "/renders"),
+                            limit(this->renderCache.memoryLimit, render_cache::DEFAULT_MEMORY_LIMIT),
+                            limit(this->renderCache.diskLimit, render_cache::DEFAULT_DISK_LIMIT));
+
+    render_limits limits;
+    if (this->renderWorkers.cpuTimeLimit) limits.cpu_seconds = std::max(1.0, *this->renderWorkers.cpuTimeLimit);
+    limits.memory_bytes = limit(this->renderWorkers.memoryLimit, limits.memory_bytes);
+    const double workers = this->renderWorkers.count.value_or(render_pool::DEFAULT_WORKERS);
+    conn->renderer.configure(static_cast<unsigned>(std::clamp(workers, 0.0, 64.0)), limits);
 
     conn->send(msg, id);
+
+    // The response is out, the workspace is indexed in the background
+    conn->indexer.start();
 }
 
-void ShutdownRequest::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
+void InitializedNotifiy::process(Connection *conn, project *proj, const RequestId &id) {
     UNUSED(conn);
+    UNUSED(proj);
     UNUSED(id);
-    // TODO : Shutdown response
+    // Nothing to do, indexing already started with the initialize response
+}
+
+void ShutdownRequest::process(Connection *conn, project *proj, const RequestId &id) {
+    UNUSED(proj);
+    // The result is null, the connection is closed by the exit notification
+    ResponseMessage msg(nullptr);
+    conn->send(msg, id);
 }
 
 void ExitRequest::process(Connection *conn, project *proj, const RequestId &id) {
@@ -33,58 +74,284 @@ void ExitRequest::process(Connection *conn, project *proj, const RequestId &id)
 
 
 void DidOpenTextDocument::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
-    UNUSED(conn);
+    UNUSED(id);
     // Called when a document is opened
-    std::cout << "\nOpened Text document with contents: " << this->textDocument.text << "\n\n";
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
+    text_document &file = proj->open_files[doc];
+    file.id = doc;
+    file.set_text(std::move(this->textDocument.text), this->textDocument.version);
+    proj->symbols.update(doc, file);
+    proj->xrefs.update(doc, file);
+    update_imports(*proj, file);
+    std::cout << "Opened Text document " << uri_table::global().path(doc) << " [id " << doc << "]\n\n";
+    publish_diagnostics(conn, *proj, file);
 }
 
 void DidChangeTextDocument::process(Connection *conn, project *proj, const RequestId &id) {
-    // Called when a document is opened
-    std::cout << "Changed Text document with new contents: " << this->textDocument.text << "\n\n";
+    UNUSED(id);
+    // Called when a document is changed
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
+    auto it = proj->open_files.find(doc);
+    if (it == proj->open_files.end()) {
+        std::cerr << "Change for a document that was never opened: " << uri_table::global().path(doc) << "\n";
+        return;
+    }
+    text_document &file = it->second;
+    file.apply_changes(this->contentChanges, this->textDocument.version.value_or(file.version() + 1));
+    std::cout << "Changed Text document " << uri_table::global().path(doc) << " (version " << file.version()
+              << ", reused " << file.syntax().reused_bytes << " of " << file.text().size() << " bytes)\n\n";
+    proj->symbols.update(doc, file);
+    proj->xrefs.update(doc, file);
+    update_imports(*proj, file);
+    conn->refinements.document_changed();
+    publish_diagnostics(conn, *proj, file);
 }
 
 void DidCloseTextDocument::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
     UNUSED(conn);
-    // Called when a document is opened
-    std::cout << "Closed Text document " << this->textDocument.uri.getPath() << "\n\n";
+    UNUSED(id);
+    // Called when a document is closed
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
+    proj->open_files.erase(doc);
+    proj->hovers.remove(doc);
+    // Unsaved changes are gone, the index and the dependencies fall back to the file on disk
+    index_file(*proj, doc);
+    std::cout << "Closed Text document " << uri_table::global().path(doc) << "\n\n";
 }
 
 void TextDocumentHover::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
-    // Called when a document is opened
-    std::cout << "Hover over : " << this->textDocument.uri.getPath() << " at " << this->position.line << ":"<< this->position.character << "\n";
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
 
     HoverResponse hover;
-    hover.contents = "Hello VSCode! I Am Alive, you are at line " + std::to_string(this->position.line);
     hover.range.start = this->position;
     hover.range.end = this->position;
-
+    auto it = proj->open_files.find(doc);
+    if (it != proj->open_files.end()) {
+        // The dependency version changes with every edit of the document or its includes
+        const uint32_t version = proj->dependencies.version(doc);
+        hover_info info;
+        if (!proj->hovers.find(doc, version, this->position, info)) {
+            info = compute_hover(*proj, it->second, this->position);
+            if (!(info.range.start == info.range.end)) {
+                proj->hovers.insert(doc, version, info);
+            }
+        }
+        hover.contents = std::move(info.contents);
+        hover.range = info.range;
+    }
     conn->send(hover, id);
+}
 
-    // TODO change implement properly
+void TextDocumentDefinition::process(Connection *conn, project *proj, const RequestId &id) {
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
 
-    ShowDocumentParams showdoc;
-    showdoc.uri = DocumentUri::fromPath("/tmp/test");
-    showdoc.external = false;
-    showdoc.takeFocus = true;
-    showdoc.selection = lsRange();
-    showdoc.selection->start.line = 5;
-    showdoc.selection->start.character = 5;
-    showdoc.selection->end = showdoc.selection->start;
-    std::cout << "sending ShowDocument message\n";
-    conn->send(showdoc, "window/showDocument", {}, &Connection::no_reponse_expected);
+    LocationsResult result;
+    auto it = proj->open_files.find(doc);
+    if (it != proj->open_files.end()) {
+        find_definitions(*proj, it->second, this->position, result.locations);
+    }
+    conn->send(result, id);
+}
+
+void TextDocumentReferences::process(Connection *conn, project *proj, const RequestId &id) {
+    DocumentId doc = uri_table::global().intern(this->textDocument.uri);
+
+    LocationsResult result;
+    auto it = proj->open_files.find(doc);
+    if (it != proj->open_files.end()) {
+        find_references(*proj, it->second, this->position, this->includeDeclaration, result.locations);
+    }
+    conn->send(result, id);
+}
 
-    // Sending test message diagnostic
-    // TODO
+void WorkspaceSymbolRequest::process(Connection *conn, project *proj, const RequestId &id) {
+    WorkspaceSymbolResult result;
+    proj->symbols.query(this->query, 256, result.symbols);
+    conn->send(result, id);
 }
 
 ///////////////////////////////////////////////////////////
 // OpenSCAD Extensions
 ///////////////////////////////////////////////////////////
 
+// Sends the result, after writing the export if one was asked for
+static void send_render(Connection *conn, const RequestId &id, OpenSCADRenderResult result, uint64_t render_key,
+                        mesh_delivery delivery, const std::string &export_path, export_format format) {
+    if (export_path.empty()) {
+        result.mesh = conn->meshes.offer(render_key, result.output, delivery);
+        conn->send(result, id);
+        return;
+    }
+    result.exportPath = export_path;
+    if (result.output->failed) {
+        result.exportError = "The render failed, there is nothing to export";
+        result.mesh = conn->meshes.offer(render_key, result.output, delivery);
+        conn->send(result, id);
+        return;
+    }
+    std::shared_ptr<const render_output> output = result.output;
+    conn->exporter.submit(std::move(output), format, export_path,
+                          [conn, id, result, render_key, delivery](bool exported, uint64_t bytes,
+                                                                   const std::string &error) mutable {
+                              result.exportBytes = bytes;
+                              if (!exported) result.exportError = error;
+                              result.mesh = conn->meshes.offer(render_key, result.output, delivery);
+                              conn->send(result, id);
+                          });
+}
+
 void OpenSCADRender::process(Connection *conn, project *proj, const RequestId &id) {
-    UNUSED(proj);
-    std::cout << "Starting rendering\n";
-}
\ No newline at end of file
+    DocumentId doc = uri_table::global().intern(this->uri);
+
+    std::string export_path;
+    export_format format = export_format::stl;
+    if (!this->exportUri.raw_uri.empty()) {
+        export_path = this->exportUri.getPath();
+        std::string name = this->exportFormat;
+        if (name.empty()) {
+            const size_t dot = export_path.rfind('.');
+            if (dot != std::string::npos) name = export_path.substr(dot + 1);
+        }
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!parse_export_format(name, format)) {
+            conn->send(ResponseError(ErrorCode::InvalidParams, "Can't export as \"" + name + "\", only stl and 3mf"), id);
+            return;
+        }
+    }
+
+    // An export is always of the full render, so it does not take the progressive way
+    if (this->timeBudget && export_path.empty()) {
+        conn->refinements.start(doc, this->parameters, static_cast<int>(std::clamp(*this->timeBudget, 0.0, 1e9)),
+                                this->partialResultToken.value_or(std::string()), this->delivery, id);
+        return;
+    }
+
+    render_job job;
+    if (!prepare_render(*proj, doc, std::move(this->parameters), job)) {
+        conn->send(ResponseError(ErrorCode::InvalidParams, "Can't read " + uri_table::global().path(doc)), id);
+        return;
+    }
+
+    OpenSCADRenderResult result;
+    char key[32];
+    snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(job.key));
+    result.key = key;
+    result.output = proj->renders.find(job.key);
+    if (result.output) {
+        result.cached = true;
+        send_render(conn, id, std::move(result), job.key, this->delivery, export_path, format);
+        return;
+    }
+
+    // Rendered by a worker process, the answer is sent when it is done
+    const uint64_t render_key = job.key;
+    const std::string path = uri_table::global().path(doc);
+    conn->renderer.submit(std::move(job), [conn, proj, id, render_key, path, result, delivery = this->delivery,
+                                           export_path, format](render_status status,
+                                                                std::shared_ptr<const render_output> output) mutable {
+        // Failures from the limits or a crash depend on more than the key and are not kept
+        if (status == render_status::DONE) proj->renders.store(render_key, output);
+        result.output = std::move(output);
+        std::cout << "Rendered " << path << " [" << result.key << "] " << result.output->geometry.triangle_count()
+                  << " triangles\n";
+        send_render(conn, id, std::move(result), render_key, delivery, export_path, format);
+    });
+}
+
+void OpenSCADPick::process(Connection *conn, project *proj, const RequestId &id) {
+    uint64_t key = 0;
+    const char *end = this->key.data() + this->key.size();
+    const auto parsed = std::from_chars(this->key.data(), end, key, 16);
+    std::shared_ptr<const render_output> output;
+    if (!this->key.empty() && parsed.ec == std::errc() && parsed.ptr == end) output = proj->renders.find(key);
+    if (!output) {
+        conn->send(ResponseError(ErrorCode::InvalidParams, "No render " + this->key + " in the cache"), id);
+        return;
+    }
+
+    const bool show = this->show.value_or(true) && proj->client_show_document;
+    conn->tasks.start(id, [conn, id, key, output, origin = this->origin, direction = this->direction, show,
+                           focus = this->takeFocus](request_task &task) {
+        struct picked {
+            bool found;
+            pick_hit hit;
+        };
+        // The hierarchy may have to be built first
+        const picked p = task.await<picked>([&](std::function<void(picked)> done) {
+            conn->picks.pick(key, output, origin, direction, [done](bool found, const pick_hit &hit, const render_output &) {
+                done({found, hit});
+            });
+        });
+
+        OpenSCADPickResult result;
+        result.hit = p.found;
+        if (p.found) {
+            result.triangle = p.hit.triangle;
+            result.distance = p.hit.distance;
+            const uint32_t part = p.hit.triangle < output->geometry.parts.size() ? output->geometry.parts[p.hit.triangle]
+                                                                                 : ~uint32_t(0);
+            if (part < output->parts.size() && output->parts[part].file < output->files.size()) {
+                uri_table &uris = uri_table::global();
+                Location source;
+                source.uri = uris.uri(uris.intern_path(output->files[output->parts[part].file]));
+                source.range = output->parts[part].range;
+                result.part = part;
+                result.source = source;
+            }
+        }
+        conn->send(result, id);
+        if (!result.source || !show) return;
+
+        ShowDocumentParams params;
+        params.uri = result.source->uri;
+        params.takeFocus = focus;
+        params.selection = result.source->range;
+        const client_response shown = task.request(params, "window/showDocument");
+        if (shown.failed || !shown.result.toObject().value("success").toBool()) {
+            std::cout << "The client did not show " << params.uri.getPath() << " for a pick\n";
+        }
+    });
+}
+
+void OpenSCADStats::process(Connection *conn, project *proj, const RequestId &id) {
+    OpenSCADStatsResult result;
+    result.renders = proj->renders.stats();
+    result.renderCacheDirectory = proj->renders.directory();
+    result.rendersRunning = conn->renderer.running();
+    result.rendersQueued = conn->renderer.queued();
+    result.openDocuments = proj->open_files.size();
+    result.indexedDocuments = proj->dependencies.document_count();
+    conn->send(result, id);
+}
+
+void OpenSCADDependencies::process(Connection *conn, project *proj, const RequestId &id) {
+    const uri_table &uris = uri_table::global();
+    DocumentId doc = uri_table::global().intern(this->uri);
+    const dependency_graph &graph = proj->dependencies;
+
+    OpenSCADDependenciesResult result;
+    const std::vector<file_import> &imports = graph.imports(doc);
+    const std::vector<DocumentId> &targets = graph.targets(doc);
+    for (size_t i = 0; i < imports.size(); i++) {
+        OpenSCADImport import;
+        import.path = imports[i].path;
+        if (targets[i] != INVALID_DOCUMENT_ID) {
+            import.uri = uris.uri(targets[i]);
+        }
+        import.use = imports[i].is_use;
+        import.range = imports[i].range;
+        result.imports.emplace_back(std::move(import));
+    }
+    for (DocumentId importer : graph.importers(doc)) {
+        result.importedBy.push_back(uris.uri(importer));
+    }
+    if (this->transitive.value_or(false)) {
+        std::vector<DocumentId> docs;
+        graph.dependencies(doc, docs);
+        for (DocumentId d : docs) result.dependencies.push_back(uris.uri(d));
+        docs.clear();
+        graph.dependents(doc, docs);
+        for (DocumentId d : docs) result.dependents.push_back(uris.uri(d));
+    }
+    conn->send(result, id);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "lsp.h"
+#include "mesh_channel.h"
+#include "mesh_export.h"
 #include "project.h"
 
 #include <QJsonDocument>
@@ -95,8 +97,12 @@ struct decode_env {
 
     decode_env(const QByteArray &, storage_direction dir=storage_direction::READ);
     decode_env(storage_direction dir);
+    // Reads one element of a batch
+    explicit decode_env(const QJsonObject &root);
 
     void store(QByteArray *, ResponseMessage &);
+    // The object of a response in a batch reply
+    QJsonObject store(ResponseMessage &);
     void store(QByteArray *, RequestMessage &);
 
     template<typename value_type>
@@ -106,12 +112,13 @@ struct decode_env {
             auto object = parent.ref();
             auto it = object.find(field);
             if (it != object.end()) {
-                if constexpr (std::is_integral<value_type>::value) {
+                // bool is integral as well, so it has to be checked first
+                if constexpr(std::is_same<value_type, bool>::value) {
+                    dst = it->toBool();
+                } else if constexpr (std::is_integral<value_type>::value) {
                     dst = it->toInt();
                 } else if constexpr(std::is_floating_point<value_type>::value) {
                     dst = it->toDouble();
-                } else if constexpr(std::is_same<value_type, bool>::value) {
-                    dst = it->toBool();
                 } else if constexpr(std::is_convertible<value_type, std::string>::value) {
                     dst = it->toString().toStdString();
                 } else if constexpr(std::is_convertible<value_type, QString>::value) {
@@ -159,7 +166,7 @@ struct decode_env {
         if (this->dir == storage_direction::READ) {
             target.clear();
             auto field_it = parent->find(field);
-            if (field_it == parent->end()) {
+            if (field_it == parent->end() || field_it->isNull()) {
                 return false;
             }
             if (!field_it->isArray()) {
@@ -172,8 +179,10 @@ struct decode_env {
             for (const auto array_it : array) {
                 value_type t;
                 {
-                    QJsonObject obj = array_it.toObject();
-                    JSONObject wrapper(obj, this->dir);
+                    // Elements are declared as the field "" of a holder object, so scalar and struct
+                    // elements both go through their normal declare_field
+                    QJsonObject holder{{"", array_it}};
+                    JSONObject wrapper(holder, this->dir);
                     declare_field(wrapper, t, "");
                 }
                 target.emplace_back(std::move(t));
@@ -182,12 +191,12 @@ struct decode_env {
         } else {
             QJsonArray array;
             for (auto &it : target) {
-                QJsonObject dst;
+                QJsonObject holder;
                 {
-                    JSONObject wrapper(dst, this->dir);
+                    JSONObject wrapper(holder, this->dir);
                     declare_field(wrapper, it, "");
                 }
-                array.append(dst);
+                array.append(holder.value(""));
             }
             parent[field] = array;
         }
@@ -231,6 +240,13 @@ struct RequestMessage {
     virtual void process(Connection *conn, project *project, const RequestId &id) = 0;
     virtual void decode(decode_env &env, JSONObject &object, const FieldNameType &field) = 0;
 
+    // Only reads the project and answers right away, so requests of a batch that all do may be
+    // processed on worker threads at the same time
+    virtual bool read_only() const { return false; }
+    // Sends messages referring to its answer (mesh frames, progress, requests to the client),
+    // so the answer is not held back until the rest of a batch is answered
+    virtual bool answered_alone() const { return false; }
+
     virtual ~RequestMessage() {}
 };
 template<>
@@ -288,6 +304,35 @@ MESSAGE_CLASS(ResponseMessage) {
 ///////////////////////////////////////////////////////////
 // Begin Interaction Messages
 ///////////////////////////////////////////////////////////
+// Only the client capabilities the server makes use of
+MESSAGE_CLASS(ClientCapabilities) {
+    MAKE_DECODEABLE;
+
+    // window.workDoneProgress: the client accepts progress the server starts on its own
+    bool workDoneProgress = false;
+    // window.showDocument.support: the client opens documents the server asks for
+    bool showDocument = false;
+};
+
+// initializationOptions.renderCache, the limits are in bytes
+MESSAGE_CLASS(RenderCacheOptions) {
+    MAKE_DECODEABLE;
+
+    OptionalType<std::string> directory;
+    OptionalType<double> memoryLimit;
+    OptionalType<double> diskLimit;
+};
+
+// initializationOptions.renderWorkers, limits per render in seconds and bytes
+MESSAGE_CLASS(RenderWorkerOptions) {
+    MAKE_DECODEABLE;
+
+    // 0 renders on a thread of the server, one after the other
+    OptionalType<double> count;
+    OptionalType<double> cpuTimeLimit;
+    OptionalType<double> memoryLimit;
+};
+
 MESSAGE_CLASS(InitializeRequest) : public RequestMessage {
     MAKE_DECODEABLE;
     virtual void process(Connection *, project *, const RequestId &id);
@@ -297,7 +342,9 @@ MESSAGE_CLASS(InitializeRequest) : public RequestMessage {
 
     // Not used, here for completion
     // Config config;
-    // ClientCap capabilities;
+    ClientCapabilities capabilities;
+    RenderCacheOptions renderCache;
+    RenderWorkerOptions renderWorkers;
 
     std::vector<WorkspaceFolder> workspaceFolders;
 };
@@ -314,7 +361,7 @@ MESSAGE_CLASS(InitializeResult) : public ResponseResult {
 
 MESSAGE_CLASS(InitializedNotifiy) : public RequestMessage {
     MAKE_DECODEABLE;
-    virtual void process(Connection *, project *, const RequestId &){};
+    virtual void process(Connection *, project *, const RequestId &);
 };
 
 MESSAGE_CLASS(ShutdownRequest) : public RequestMessage {
@@ -351,10 +398,10 @@ MESSAGE_CLASS(DidOpenTextDocument) : public RequestMessage {
 MESSAGE_CLASS(DidChangeTextDocument) : public RequestMessage {
     MAKE_DECODEABLE;
 
-    TextDocumentItem textDocument;
+    VersionedTextDocumentIdentifier textDocument;
 
-    // Todo handle lists?
-    TextDocumentContentChangeEvent contentChanges;
+    // Applied in order, each range refers to the text after the previous change
+    std::vector<TextDocumentContentChangeEvent> contentChanges;
 
     virtual void process(Connection *, project *, const RequestId &id);
 };
@@ -371,6 +418,7 @@ MESSAGE_CLASS(TextDocumentHover) : public TextDocumentPositionParams {
     MAKE_DECODEABLE;
 
     virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool read_only() const { return true; }
 };
 
 MESSAGE_CLASS(HoverResponse) : public ResponseResult {
@@ -380,6 +428,31 @@ MESSAGE_CLASS(HoverResponse) : public ResponseResult {
     lsRange range;
 };
 
+/// capability: definitionProvider
+MESSAGE_CLASS(TextDocumentDefinition) : public TextDocumentPositionParams {
+    MAKE_DECODEABLE;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool read_only() const { return true; }
+};
+
+/// capability: referencesProvider
+MESSAGE_CLASS(TextDocumentReferences) : public TextDocumentPositionParams {
+    MAKE_DECODEABLE;
+
+    // context.includeDeclaration
+    bool includeDeclaration = false;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+};
+
+// Location[] for definition and references, turned into Locations while the response is written
+MESSAGE_CLASS(LocationsResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    location_results locations;
+};
+
 MESSAGE_CLASS(Diagnostic) {
     MAKE_DECODEABLE;
 
@@ -395,6 +468,9 @@ MESSAGE_CLASS(PublishDiagnosticsParams) : RequestMessage {
     DocumentUri uri;
     OptionalType<int> version;
     std::vector<Diagnostic> diagnostics;
+
+    // Only sent by the server
+    virtual void process(Connection *, project *, const RequestId &){ assert(false); };
 };
 
 // client capability: window.showDocument
@@ -409,15 +485,175 @@ MESSAGE_CLASS(ShowDocumentParams) : public RequestMessage {
     virtual void process(Connection *, project *, const RequestId &){ assert(false); };
 };
 
+// client capability: window.workDoneProgress
+MESSAGE_CLASS(WorkDoneProgressCreateParams) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    std::string token;
+
+    virtual void process(Connection *, project *, const RequestId &){ assert(false); };
+};
+
+MESSAGE_CLASS(ProgressParams) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    std::string token;
+    WorkDoneProgress value;
+
+    // Only sent by the server
+    virtual void process(Connection *, project *, const RequestId &){ assert(false); };
+};
+
+/// capability: workspaceSymbolProvider
+MESSAGE_CLASS(WorkspaceSymbolRequest) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    std::string query;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool read_only() const { return true; }
+};
+
+MESSAGE_CLASS(WorkspaceSymbolResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    // Turned into SymbolInformation one at a time while the response is written
+    symbol_results symbols;
+};
+
 ///////////////////////////////////////////////////////////
 // OpenSCAD extensions
 ///////////////////////////////////////////////////////////
 MESSAGE_CLASS(OpenSCADRender) : public RequestMessage {
     MAKE_DECODEABLE;
     DocumentUri uri;
+    // "variables": {name: value} overrides top level variables like -D name=value
+    render_parameters parameters;
+    // Milliseconds until the answer, with the best quality done by then. Better ones follow as
+    // $/progress with the partialResultToken. Without it only the full quality is rendered.
+    OptionalType<double> timeBudget;
+    OptionalType<std::string> partialResultToken;
+    // "meshDelivery": "json" (default), "handle" or "frames"
+    mesh_delivery delivery = mesh_delivery::json;
+    // "export": {uri, format} writes the full render to a file before answering. The format is
+    // "stl" or "3mf", by default from the extension of the uri.
+    DocumentUri exportUri;
+    std::string exportFormat;
 
     // load (if needed) and start the rendering of the given document
     virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool answered_alone() const { return true; }
+};
+
+MESSAGE_CLASS(OpenSCADRenderResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    // Answered from the render cache
+    bool cached = false;
+    // The render key as 16 hex digits
+    std::string key;
+    render_quality quality = render_quality::full;
+    // Set if better qualities follow as $/progress with this token
+    std::string progressToken;
+    // The last $/progress of a token whose document changed, without a model
+    bool superseded = false;
+    // Written as flat vertices [x, y, z, ...] and triangles [a, b, c, ...], with messages and bounds
+    std::shared_ptr<const render_output> output;
+    // If set, only the counts are written and the mesh is found there
+    mesh_reference mesh;
+    // The file written for "export", with its size or why it failed
+    std::string exportPath;
+    uint64_t exportBytes = 0;
+    std::string exportError;
+};
+
+MESSAGE_CLASS(RenderProgressParams) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    std::string token;
+    OpenSCADRenderResult value;
+
+    // Only sent by the server
+    virtual void process(Connection *, project *, const RequestId &){ assert(false); };
+};
+
+// The part of a rendered model a ray hits first, for click to code. The call that made the part
+// is also shown with window/showDocument if the client supports it.
+MESSAGE_CLASS(OpenSCADPick) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    // Of a render result, as long as the render is cached
+    std::string key;
+    // "origin": [x, y, z] and "direction": [x, y, z], in model coordinates
+    vec3 origin;
+    vec3 direction;
+    // window/showDocument is not sent if false
+    OptionalType<bool> show;
+    OptionalType<bool> takeFocus;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool answered_alone() const { return true; }
+};
+
+MESSAGE_CLASS(OpenSCADPickResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    bool hit = false;
+    // Only set for a hit
+    uint32_t triangle = 0;
+    double distance = 0;
+    // The index of the primitive, depth first in the CSG tree, and the call that made it
+    OptionalType<uint32_t> part;
+    OptionalType<Location> source;
+};
+
+// Counters of the caches, for tooling
+MESSAGE_CLASS(OpenSCADStats) : public RequestMessage {
+    MAKE_DECODEABLE;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+};
+
+MESSAGE_CLASS(OpenSCADStatsResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    render_cache_stats renders;
+    std::string renderCacheDirectory;
+    size_t rendersRunning = 0;
+    size_t rendersQueued = 0;
+    size_t openDocuments = 0;
+    size_t indexedDocuments = 0;
+};
+
+// The include/use graph around a document, for tooling
+MESSAGE_CLASS(OpenSCADDependencies) : public RequestMessage {
+    MAKE_DECODEABLE;
+    DocumentUri uri;
+    // Also list everything the document depends on and everything depending on it, indirectly
+    OptionalType<bool> transitive;
+
+    virtual void process(Connection *, project *, const RequestId &id);
+    virtual bool read_only() const { return true; }
+};
+
+MESSAGE_CLASS(OpenSCADImport) {
+    MAKE_DECODEABLE;
+
+    std::string path;
+    // Not set if the file could not be found
+    OptionalType<DocumentUri> uri;
+    bool use = false;
+    lsRange range;
+};
+
+MESSAGE_CLASS(OpenSCADDependenciesResult) : public ResponseResult {
+    MAKE_DECODEABLE;
+
+    std::vector<OpenSCADImport> imports;
+    std::vector<DocumentUri> importedBy;
+    // Only filled for transitive requests
+    std::vector<DocumentUri> dependencies;
+    std::vector<DocumentUri> dependents;
 };
 
 
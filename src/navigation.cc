@@ -0,0 +1,125 @@
+#include "navigation.h"
+#include "project.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// A global name at a position, either used or defined there
+struct named_target {
+    std::string_view name;
+    reference_kind kind;
+};
+
+bool declares(reference_kind kind, SymbolKind symbol) {
+    switch (kind) {
+    case reference_kind::module: return symbol == SymbolKind::Module;
+    case reference_kind::function: return symbol == SymbolKind::Function;
+    default: return symbol == SymbolKind::Variable;
+    }
+}
+
+// The name of the definition at offset, the first identifier of an assignment, module or function
+bool definition_at(const text_document &doc, uint32_t offset, named_target &out) {
+    const interval_index::interval *name = doc.positions().occurrence_at(offset);
+    const interval_index::interval *node = doc.positions().node_at(offset);
+    if (!name || !node || static_cast<syntax_kind>(name->value) != syntax_kind::identifier) return false;
+
+    const std::string_view text = doc.text();
+    const char *keyword = nullptr;
+    switch (static_cast<syntax_kind>(node->value)) {
+    case syntax_kind::assignment:
+        if (node->start != name->start) return false;
+        out.kind = reference_kind::variable;
+        break;
+    case syntax_kind::module_definition:
+        keyword = "module";
+        out.kind = reference_kind::module;
+        break;
+    case syntax_kind::function_definition:
+        keyword = "function";
+        out.kind = reference_kind::function;
+        break;
+    default:
+        return false;
+    }
+    if (keyword && skip_trivia(text, node->start + std::strlen(keyword)) != name->start) return false;
+    out.name = text.substr(name->start, name->end - name->start);
+    return true;
+}
+
+bool target_at(const project &proj, const text_document &doc, const Position &position, named_target &out) {
+    const xref_index::target_id target = proj.xrefs.target_at(doc.id, position);
+    if (target != xref_index::NO_TARGET) {
+        out.name = proj.xrefs.name(target);
+        out.kind = proj.xrefs.kind(target);
+        return true;
+    }
+    return definition_at(doc, doc.offset_of(position), out);
+}
+
+// Definitions of target visible from doc, own ones first
+void visible_definitions(const project &proj, const text_document &doc, const named_target &target,
+                         location_results &out) {
+    std::vector<DocumentId> visible;
+    proj.dependencies.dependencies(doc.id, visible);
+    visible.push_back(doc.id);
+    std::sort(visible.begin(), visible.end());
+
+    symbol_results found;
+    proj.symbols.definitions(target.name, visible, found);
+    // Variables can hold function literals, they are called like functions
+    reference_kind kind = target.kind;
+    auto matching = [&found, &kind](size_t i) { return declares(kind, found.kind(i)); };
+    size_t count = 0;
+    for (size_t i = 0; i < found.size(); i++) count += matching(i);
+    if (count == 0 && kind == reference_kind::function) {
+        kind = reference_kind::variable;
+    }
+
+    for (int own = 1; own >= 0; own--) {
+        for (size_t i = 0; i < found.size(); i++) {
+            if (matching(i) && (found.document(i) == doc.id) == (own == 1)) {
+                out.add(found.document(i), found.range(i));
+            }
+        }
+    }
+}
+
+} // namespace
+
+void find_definitions(const project &proj, const text_document &doc, const Position &position, location_results &out) {
+    named_target target;
+    if (target_at(proj, doc, position, target)) {
+        visible_definitions(proj, doc, target, out);
+    }
+}
+
+void find_references(project &proj, const text_document &doc, const Position &position, bool include_declaration,
+                     location_results &out) {
+    named_target target;
+    if (!target_at(proj, doc, position, target)) return;
+
+    location_results definitions;
+    visible_definitions(proj, doc, target, definitions);
+
+    // Only documents seeing one of the definitions refer to it
+    std::vector<DocumentId> seeing;
+    for (size_t i = 0; i < definitions.size(); i++) {
+        seeing.push_back(definitions.document(i));
+        proj.dependencies.dependents(definitions.document(i), seeing);
+    }
+    std::sort(seeing.begin(), seeing.end());
+    seeing.erase(std::unique(seeing.begin(), seeing.end()), seeing.end());
+
+    if (include_declaration) {
+        for (size_t i = 0; i < definitions.size(); i++) {
+            out.add(definitions.document(i), definitions.range(i));
+        }
+    }
+    const xref_index::target_id id = proj.xrefs.find(target.kind, target.name);
+    if (id != xref_index::NO_TARGET) {
+        proj.xrefs.references(id, definitions.empty() ? nullptr : &seeing, out);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "document.h"
+#include "lsp.h"
+#include "xref_index.h"
+
+struct project;
+
+// Definitions of the name at a position of an open document, the document's own ones first
+void find_definitions(const project &proj, const text_document &doc, const Position &position, location_results &out);
+
+/**
+ * References to the name at a position of an open document, in the documents that can see its
+ * definitions. A name without a known definition (builtins like cube) is looked up everywhere.
+ */
+void find_references(project &proj, const text_document &doc, const Position &position, bool include_declaration,
+                     location_results &out);
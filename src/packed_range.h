@@ -0,0 +1,96 @@
+#pragma once
+
+#include "lsp.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * LSP position in 32 bits: 20 bits of line and 12 bits of character. Practically every position
+ * in a SCAD file fits, the ones that do not are kept aside by range_column.
+ */
+struct packed_position {
+    static constexpr uint32_t CHARACTER_BITS = 12;
+    static constexpr uint32_t MAX_LINE = (1u << (32 - CHARACTER_BITS)) - 1;
+    static constexpr uint32_t MAX_CHARACTER = (1u << CHARACTER_BITS) - 1;
+
+    uint32_t bits = 0;
+
+    static bool fits(const Position &pos) {
+        return pos.line >= 0 && pos.character >= 0 &&
+               static_cast<uint32_t>(pos.line) <= MAX_LINE && static_cast<uint32_t>(pos.character) <= MAX_CHARACTER;
+    }
+    static packed_position pack(const Position &pos) {
+        return {static_cast<uint32_t>(pos.line) << CHARACTER_BITS | static_cast<uint32_t>(pos.character)};
+    }
+    Position unpack() const {
+        Position pos;
+        pos.line = bits >> CHARACTER_BITS;
+        pos.character = bits & MAX_CHARACTER;
+        return pos;
+    }
+
+    // Packed positions compare like the positions themselves
+    bool operator<(packed_position o) const { return bits < o.bits; }
+    bool operator==(packed_position o) const { return bits == o.bits; }
+};
+
+struct packed_range {
+    packed_position start;
+    packed_position end;
+};
+
+/**
+ * Column of ranges at 8 bytes per range instead of the 16 of an lsRange. Ranges with a position
+ * that does not pack are stored in full on the side, their entry holds the index of that copy.
+ */
+class range_column {
+public:
+    void push_back(const lsRange &range) {
+        if (packed_position::fits(range.start) && packed_position::fits(range.end) &&
+                packed_position::pack(range.start).bits != WIDE) {
+            packed.push_back({packed_position::pack(range.start), packed_position::pack(range.end)});
+        } else {
+            packed.push_back({{WIDE}, {static_cast<uint32_t>(wide.size())}});
+            wide.push_back(range);
+        }
+    }
+
+    // Copy a range of another column without unpacking it
+    void append(const range_column &from, size_t i) {
+        const packed_range &range = from.packed[i];
+        if (range.start.bits == WIDE) {
+            push_back(from.wide[range.end.bits]);
+        } else {
+            packed.push_back(range);
+        }
+    }
+
+    lsRange operator[](size_t i) const {
+        const packed_range &range = packed[i];
+        if (range.start.bits == WIDE) return wide[range.end.bits];
+        return {range.start.unpack(), range.end.unpack()};
+    }
+
+    // Fetch range i into the cache ahead of reading it
+    void prefetch(size_t i) const { __builtin_prefetch(packed.data() + i); }
+
+    size_t size() const { return packed.size(); }
+    bool empty() const { return packed.empty(); }
+    void reserve(size_t n) { packed.reserve(n); }
+    void clear() {
+        packed.clear();
+        wide.clear();
+    }
+    void shrink_to_fit() {
+        packed.shrink_to_fit();
+        wide.shrink_to_fit();
+    }
+
+private:
+    // Marks a start kept aside, a range really starting at the last packed position is kept aside too
+    static constexpr uint32_t WIDE = ~uint32_t(0);
+
+    std::vector<packed_range> packed;
+    std::vector<lsRange> wide;
+};
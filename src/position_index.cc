@@ -0,0 +1,315 @@
+#include "position_index.h"
+
+#include <algorithm>
+
+namespace {
+
+using interval = interval_index::interval;
+
+// Names and include paths, the tokens that mean something on their own
+inline bool is_occurrence(syntax_kind kind) {
+    return kind == syntax_kind::identifier || kind == syntax_kind::include_path;
+}
+
+// Append the intervals of a subtree in sorted order, zero width nodes cover no position
+void collect(std::string_view text, const syntax_element &element, uint32_t offset, std::vector<interval> &out) {
+    const syntax_kind kind = element.kind();
+    if (!element.is_node()) {
+        if (is_occurrence(kind)) {
+            out.push_back({text_start(text, element, offset), offset + element.width, static_cast<uint32_t>(kind), 0});
+        }
+        return;
+    }
+    const syntax_node &node = *element.node();
+    // list_chunk only balances long lists, it means nothing at a position
+    if (kind != syntax_kind::list_chunk) {
+        const uint32_t start = text_start(text, node, offset);
+        if (start < offset + node.width) {
+            out.push_back({start, offset + node.width, static_cast<uint32_t>(kind), 0});
+        }
+    }
+    for (const syntax_element &child : node) {
+        if (child.width) {
+            collect(text, child, offset, out);
+        }
+        offset += child.width;
+    }
+}
+
+// Children that cover the same intervals in both trees: reused subtrees, or tokens of the same shape
+inline bool same_shape(const syntax_element &a, const syntax_element &b) {
+    if (a.width != b.width || a.kind() != b.kind()) return false;
+    if (a.is_node()) return a.node() == b.node();
+    return a.trivia() == b.trivia() && a.trivia() != syntax_element::TRIVIA_UNKNOWN;
+}
+
+struct positioned {
+    const syntax_element *element;
+    uint32_t offset;
+};
+
+void flatten(const syntax_node &node, uint32_t offset, std::vector<positioned> &out) {
+    out.clear();
+    for_each_item(node, offset, [&out](const syntax_element &element, uint32_t offset) {
+        out.push_back({&element, offset});
+    });
+}
+
+struct changed_node {
+    uint32_t offset;        // including trivia
+    uint32_t end;
+    syntax_kind kind;
+    interval now;           // after the edit, if covers_text
+    bool covers_text;
+};
+
+} // namespace
+
+///////////////////////////////////////////////////////////
+// interval_index
+///////////////////////////////////////////////////////////
+
+void interval_index::assign(std::vector<interval> sorted) {
+    items = std::move(sorted);
+    const size_t n = items.size();
+    if (n == 0) {
+        root_level = -1;
+        return;
+    }
+
+    // Leaves are the even indices, every level up halves the nodes. last tracks the max end of
+    // the rightmost subtree, which may be incomplete.
+    size_t last_i = 0;
+    uint32_t last = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        last_i = i;
+        last = items[i].max_end = items[i].end;
+    }
+    int k = 1;
+    for (; (size_t(1) << k) <= n; ++k) {
+        const size_t x = size_t(1) << (k - 1);
+        const size_t first = (x << 1) - 1;
+        const size_t step = x << 2;
+        for (size_t i = first; i < n; i += step) {
+            const uint32_t left = items[i - x].max_end;
+            const uint32_t right = i + x < n ? items[i + x].max_end : last;
+            items[i].max_end = std::max({items[i].end, left, right});
+        }
+        last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+        if (last_i < n && items[last_i].max_end > last) {
+            last = items[last_i].max_end;
+        }
+    }
+    root_level = k - 1;
+}
+
+void interval_index::overlapping(uint32_t start, uint32_t end, std::vector<uint32_t> &out) const {
+    if (root_level < 0) return;
+    if (end <= start) end = start + 1;
+
+    struct frame {
+        size_t x;
+        int k;
+        bool left_done;
+    };
+    frame stack[64];
+    int top = 0;
+    stack[top++] = {(size_t(1) << root_level) - 1, root_level, false};
+    const size_t n = items.size();
+    while (top) {
+        const frame f = stack[--top];
+        if (f.k <= 3) {
+            // Small subtree, a linear scan is cheaper
+            const size_t first = f.x >> f.k << f.k;
+            const size_t last = std::min(n, first + (size_t(1) << (f.k + 1)) - 1);
+            for (size_t i = first; i < last && items[i].start < end; ++i) {
+                if (start < items[i].end) out.push_back(i);
+            }
+        } else if (!f.left_done) {
+            stack[top++] = {f.x, f.k, true};
+            const size_t left = f.x - (size_t(1) << (f.k - 1));
+            if (left >= n || items[left].max_end > start) {
+                stack[top++] = {left, f.k - 1, false};
+            }
+        } else if (f.x < n && items[f.x].start < end) {
+            if (start < items[f.x].end) out.push_back(f.x);
+            const size_t right = f.x + (size_t(1) << (f.k - 1));
+            if (right >= n || items[right].max_end > start) {
+                stack[top++] = {right, f.k - 1, false};
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////
+// position_index
+///////////////////////////////////////////////////////////
+
+void position_index::build(std::string_view text, const syntax_tree &tree) {
+    std::vector<interval> intervals;
+    if (!tree.empty()) {
+        collect(text, syntax_element(tree.root), 0, intervals);
+    }
+    syntax.assign(std::move(intervals));
+    build_errors(text, tree);
+}
+
+void position_index::update(std::string_view text, const syntax_tree &old, const syntax_tree &tree) {
+    if (old.empty() || tree.empty()) {
+        build(text, tree);
+        return;
+    }
+
+    // Walk down both trees as long as exactly one child differs and keeps its kind. The nodes on
+    // the way changed their width, the children in between the common prefix and suffix are
+    // walked again.
+    std::vector<changed_node> ancestors;
+    std::vector<interval> walked;
+    const syntax_node *before = old.root.get();
+    const syntax_node *after = tree.root.get();
+    uint32_t offset = 0;
+    uint32_t old_begin = 0, old_end = 0, new_end = 0;
+    std::vector<positioned> old_items, new_items;
+    while (before != after) {
+        changed_node node{offset, offset + before->width, before->kind, {0, 0, 0, 0}, false};
+        const uint32_t start = text_start(text, *after, offset);
+        if (start < offset + after->width) {
+            node.now = {start, offset + after->width, static_cast<uint32_t>(after->kind), 0};
+            node.covers_text = true;
+        }
+        ancestors.push_back(node);
+
+        // Long lists are rebalanced by the parser, compare their items and not the chunks
+        flatten(*before, offset, old_items);
+        flatten(*after, offset, new_items);
+        size_t prefix = 0;
+        while (prefix < old_items.size() && prefix < new_items.size() &&
+               same_shape(*old_items[prefix].element, *new_items[prefix].element)) {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < old_items.size() - prefix && suffix < new_items.size() - prefix &&
+               same_shape(*old_items[old_items.size() - 1 - suffix].element, *new_items[new_items.size() - 1 - suffix].element)) {
+            suffix++;
+        }
+
+        const size_t old_middle = old_items.size() - prefix - suffix;
+        const size_t new_middle = new_items.size() - prefix - suffix;
+        const syntax_element *old_child = old_middle == 1 ? old_items[prefix].element : nullptr;
+        const syntax_element *new_child = new_middle == 1 ? new_items[prefix].element : nullptr;
+        if (old_child && new_child && old_child->is_node() && new_child->is_node() &&
+                old_child->kind() == new_child->kind()) {
+            offset = old_items[prefix].offset;
+            before = old_child->node();
+            after = new_child->node();
+            continue;
+        }
+
+        old_begin = prefix < old_items.size() ? old_items[prefix].offset : offset + before->width;
+        old_end = suffix ? old_items[old_items.size() - suffix].offset : offset + before->width;
+        new_end = suffix ? new_items[new_items.size() - suffix].offset : offset + after->width;
+        for (size_t i = prefix; i < prefix + new_middle; i++) {
+            if (new_items[i].element->width) {
+                collect(text, *new_items[i].element, new_items[i].offset, walked);
+            }
+        }
+        break;
+    }
+    if (ancestors.empty()) {
+        build_errors(text, tree);
+        return;
+    }
+
+    std::vector<interval> items = syntax.release();
+    auto starting_at = [&items](uint32_t offset) {
+        return std::lower_bound(items.begin(), items.end(), offset,
+                                [](const interval &item, uint32_t offset) { return item.start < offset; }) - items.begin();
+    };
+
+    // An ancestor is the first interval of its kind and old end that starts inside its raw span,
+    // descendants of the same kind and end (chained module instantiations) start later
+    std::vector<size_t> found(ancestors.size(), items.size());
+    for (size_t i = 0; i < ancestors.size(); i++) {
+        const changed_node &node = ancestors[i];
+        for (size_t j = starting_at(node.offset); j < items.size() && items[j].start < node.end; j++) {
+            if (items[j].end == node.end && items[j].value == static_cast<uint32_t>(node.kind)) {
+                found[i] = j;
+                break;
+            }
+        }
+    }
+    // Ancestors starting before the edit keep their place and only move their end, the others
+    // are replaced like the children that changed. They go in front of the children, so nodes
+    // with the same range stay outer first like in a full build.
+    std::vector<size_t> dropped;
+    std::vector<interval> inserted;
+    for (size_t i = 0; i < ancestors.size(); i++) {
+        const changed_node &node = ancestors[i];
+        if (found[i] < items.size() && items[found[i]].start < old_begin && node.covers_text) {
+            items[found[i]].end = node.now.end;
+            items[found[i]].value = node.now.value;
+            continue;
+        }
+        if (found[i] < items.size() && items[found[i]].start >= old_end) dropped.push_back(found[i]);
+        if (node.covers_text) inserted.push_back(node.now);
+    }
+    inserted.insert(inserted.end(), walked.begin(), walked.end());
+    std::stable_sort(inserted.begin(), inserted.end(), interval_index::before);
+
+    // Everything starting in the old region belongs to the children that were walked again
+    const size_t first = starting_at(old_begin);
+    const size_t last = starting_at(old_end);
+    const int64_t delta = static_cast<int64_t>(new_end) - old_end;
+    std::sort(dropped.begin(), dropped.end());
+    for (auto it = dropped.rbegin(); it != dropped.rend(); ++it) {
+        items.erase(items.begin() + *it);
+    }
+    for (size_t i = last; i < items.size(); i++) {
+        items[i].start += delta;
+        items[i].end += delta;
+    }
+    items.erase(items.begin() + first, items.begin() + last);
+    items.insert(items.begin() + first, inserted.begin(), inserted.end());
+
+    // Only an ancestor whose text starts behind the edit can end up out of place
+    const size_t next = first + inserted.size();
+    if ((first > 0 && next > first && interval_index::before(items[first], items[first - 1])) ||
+            (next > first && next < items.size() && interval_index::before(items[next], items[next - 1]))) {
+        std::stable_sort(items.begin(), items.end(), interval_index::before);
+    }
+    syntax.assign(std::move(items));
+    build_errors(text, tree);
+}
+
+void position_index::build_errors(std::string_view text, const syntax_tree &tree) {
+    // Few and found without walking error free subtrees, rebuilt with every version
+    error_list.clear();
+    collect_errors(text, tree, error_list);
+    std::vector<interval> intervals;
+    intervals.reserve(error_list.size());
+    for (uint32_t i = 0; i < error_list.size(); i++) {
+        const syntax_diagnostic &error = error_list[i];
+        // Errors at the end of a line have no length, they still belong to that position
+        intervals.push_back({error.offset, error.offset + std::max<uint32_t>(1, error.length), i, 0});
+    }
+    std::stable_sort(intervals.begin(), intervals.end(), interval_index::before);
+    diagnostics.assign(std::move(intervals));
+}
+
+const interval_index::interval *position_index::node_at(uint32_t offset) const {
+    std::vector<uint32_t> found;
+    syntax.overlapping(offset, offset, found);
+    for (auto it = found.rbegin(); it != found.rend(); ++it) {
+        if (is_node(static_cast<syntax_kind>(syntax[*it].value))) return &syntax[*it];
+    }
+    return nullptr;
+}
+
+const interval_index::interval *position_index::occurrence_at(uint32_t offset) const {
+    std::vector<uint32_t> found;
+    syntax.overlapping(offset, offset, found);
+    for (auto it = found.rbegin(); it != found.rend(); ++it) {
+        if (is_occurrence(static_cast<syntax_kind>(syntax[*it].value))) return &syntax[*it];
+    }
+    return nullptr;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "syntax_tree.h"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/**
+ * Static interval tree over half open byte ranges: a sorted array with an implicit binary tree
+ * on top (the array index of a node at level k ends in k one bits), augmented with the largest
+ * end in every subtree. Queries are O(log n + k) without any pointers or allocations.
+ */
+class interval_index {
+public:
+    struct interval {
+        uint32_t start;
+        uint32_t end;
+        uint32_t value;
+        uint32_t max_end;   // of the subtree, set by assign
+    };
+
+    // Intervals sorted by start, longer intervals first if they start at the same offset
+    static bool before(const interval &a, const interval &b) {
+        return a.start < b.start || (a.start == b.start && a.end > b.end);
+    }
+
+    // Take over intervals sorted with before and build the tree
+    void assign(std::vector<interval> sorted);
+    // Hand the intervals back for an update in place, the index is empty until the next assign
+    std::vector<interval> release() { root_level = -1; return std::move(items); }
+
+    // Indices of the intervals overlapping [start, end) in sorted order, the outer one first for
+    // nested intervals. An empty range asks for the intervals containing start.
+    void overlapping(uint32_t start, uint32_t end, std::vector<uint32_t> &out) const;
+
+    const interval &operator[](size_t i) const { return items[i]; }
+    const std::vector<interval> &all() const { return items; }
+    size_t size() const { return items.size(); }
+
+private:
+    std::vector<interval> items;
+    int root_level = -1;
+};
+
+/**
+ * Everything of a document that sits at a position: syntax nodes, occurrences of names and
+ * include paths, and syntax errors, each in an interval_index over byte offsets. Node and
+ * occurrence intervals exclude leading trivia, so they only cover the text that belongs to them.
+ *
+ * After an edit only the subtrees the incremental parse did not reuse are walked again, the
+ * intervals before them are kept and the ones behind them are moved by the length difference.
+ */
+class position_index {
+public:
+    void build(std::string_view text, const syntax_tree &tree);
+    // old is the tree text was parsed from before the edit
+    void update(std::string_view text, const syntax_tree &old, const syntax_tree &tree);
+
+    // Innermost node covering offset, nullptr if there is none. The value is the syntax_kind.
+    const interval_index::interval *node_at(uint32_t offset) const;
+    // Identifier or include path covering offset, nullptr if there is none
+    const interval_index::interval *occurrence_at(uint32_t offset) const;
+
+    // Indices into syntax() or errors() of the intervals overlapping [start, end)
+    void nodes_in(uint32_t start, uint32_t end, std::vector<uint32_t> &out) const { syntax.overlapping(start, end, out); }
+    void errors_in(uint32_t start, uint32_t end, std::vector<uint32_t> &out) const { diagnostics.overlapping(start, end, out); }
+
+    const interval_index &nodes() const { return syntax; }
+    // Sorted by offset, as reported by collect_errors
+    const std::vector<syntax_diagnostic> &errors() const { return error_list; }
+
+private:
+    void build_errors(std::string_view text, const syntax_tree &tree);
+
+    // Nodes and occurrences, the value is the syntax_kind
+    interval_index syntax;
+    // The value is the index into error_list
+    interval_index diagnostics;
+    std::vector<syntax_diagnostic> error_list;
+};
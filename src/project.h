@@ -1,17 +1,41 @@
 #pragma once
 
+#include "dependency_graph.h"
+#include "document.h"
+#include "hover.h"
+#include "include_resolver.h"
 #include "lsp.h"
-#include <deque>
+#include "render_cache.h"
+#include "symbol_index.h"
+#include "uri_table.h"
+#include "xref_index.h"
 
-struct openFile {
-    DocumentUri uri;
-    std::string modified_content;
-};
+#include <unordered_map>
+#include <vector>
 
 struct project {
-    WorkspaceFolder workspace;
+    std::vector<WorkspaceFolder> workspace_folders;
+    // The client accepts window/workDoneProgress/create
+    bool client_work_done_progress = false;
+    // The client accepts window/showDocument
+    bool client_show_document = false;
+
+    // All per-document state is keyed by the interned DocumentId
+    std::unordered_map<DocumentId, text_document> open_files;
+
+    // Symbols of all files in the workspace folders and all open documents
+    symbol_index symbols;
+    // Uses of global names in the same files
+    xref_index xrefs;
 
-    std::deque<openFile> open_files;
+    // include/use edges between all indexed and open documents
+    dependency_graph dependencies;
+    // Shared with the indexer workers, thread safe
+    include_resolver includes;
+
+    // Hovers of the open documents
+    hover_cache hovers;
+    // Rendered models by render key, configured by the initialize request
+    render_cache renders;
     // store project status information
 };
-
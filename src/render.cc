@@ -0,0 +1,384 @@
+#include "render.h"
+#include "document.h"
+#include "index_cache.h"
+#include "project.h"
+#include "scad_parser.h"
+#include "task_pool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace {
+
+// Part of every render key, changes of the evaluator or the geometry have to increment it
+constexpr uint32_t RENDER_ENGINE_VERSION = 4;
+
+// Kept for the life of the process, a render worker builds on the renders it did before
+geometry_cache &subtree_cache() {
+    static geometry_cache cache;
+    return cache;
+}
+
+bool read_file(const std::string &path, std::string &out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    out = contents.str();
+    return true;
+}
+
+// Appends the raw bytes of trivially copyable values
+template <typename T>
+void put(std::string &out, const T &value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+bool get(std::string_view &in, T &value) {
+    if (in.size() < sizeof(T)) return false;
+    memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return true;
+}
+
+void put_string(std::string &out, std::string_view text) {
+    put(out, static_cast<uint64_t>(text.size()));
+    out.append(text.data(), text.size());
+}
+
+bool get_string(std::string_view &in, std::string &text) {
+    uint64_t length;
+    if (!get(in, length) || in.size() < length) return false;
+    text.assign(in.data(), length);
+    in.remove_prefix(length);
+    return true;
+}
+
+// The ranges of the calls are converted with the texts the render read
+void locate_parts(const render_job &job, const csg_node &root, render_output &out) {
+    std::vector<const csg_node *> primitives;
+    collect_primitives(root, primitives);
+    std::vector<line_index> lines(job.sources.size());
+    std::vector<bool> indexed(job.sources.size(), false);
+    for (const scad_source &source : job.sources) out.files.push_back(source.path);
+    out.parts.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        const source_span &span = primitives[i]->source;
+        // The parameter overrides come after the sources and make no geometry
+        if (span.file >= job.sources.size()) continue;
+        const std::string &text = job.sources[span.file].text;
+        if (!indexed[span.file]) {
+            lines[span.file].build(text);
+            indexed[span.file] = true;
+        }
+        out.parts[i].file = span.file;
+        out.parts[i].range = lines[span.file].range_of(text, span.begin, span.end - span.begin);
+    }
+}
+
+} // namespace
+
+bool prepare_render(const project &proj, DocumentId doc, render_parameters parameters, render_job &job) {
+    const uri_table &uris = uri_table::global();
+    job = render_job();
+    job.parameters = std::move(parameters);
+
+    // Breadth first over the include and use edges, the document is the first source
+    std::unordered_map<DocumentId, size_t> index;
+    std::vector<DocumentId> docs;
+    auto add = [&](DocumentId d) -> int64_t {
+        auto known = index.find(d);
+        if (known != index.end()) return static_cast<int64_t>(known->second);
+        scad_source source;
+        source.path = uris.path(d);
+        auto open = proj.open_files.find(d);
+        if (open != proj.open_files.end()) {
+            source.text = open->second.text();
+            source.tree = open->second.syntax();
+        } else if (read_file(source.path, source.text)) {
+            source.tree = parse_scad(source.text, 0);
+        } else {
+            return -1;
+        }
+        index.emplace(d, job.sources.size());
+        docs.push_back(d);
+        job.sources.push_back(std::move(source));
+        return static_cast<int64_t>(job.sources.size() - 1);
+    };
+    if (add(doc) < 0) return false;
+    for (size_t i = 0; i < docs.size(); i++) {
+        const std::vector<file_import> &imports = proj.dependencies.imports(docs[i]);
+        const std::vector<DocumentId> &targets = proj.dependencies.targets(docs[i]);
+        for (size_t k = 0; k < imports.size(); k++) {
+            if (targets[k] == INVALID_DOCUMENT_ID) continue;
+            const int64_t target = add(targets[k]);
+            if (target >= 0) job.sources[i].imports.emplace(imports[k].path, static_cast<size_t>(target));
+        }
+    }
+
+    // The key covers the contents, the resolution of every import and the parameters
+    std::string manifest = "render " + std::to_string(RENDER_ENGINE_VERSION) + " " +
+                           quality_name(job.parameters.quality) + "\n";
+    for (const auto &variable : job.parameters.variables) {
+        manifest += variable.first + "=" + variable.second + "\n";
+    }
+    char hash[32];
+    for (const scad_source &source : job.sources) {
+        snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(content_hash(source.text)));
+        manifest.append(source.path).push_back('\0');
+        manifest.append(hash).push_back('\n');
+        const std::map<std::string, size_t> imports(source.imports.begin(), source.imports.end());
+        for (const auto &import : imports) {
+            manifest.append(import.first).push_back('\0');
+            manifest.append(std::to_string(import.second)).push_back('\n');
+        }
+    }
+    job.key = content_hash(manifest);
+    return true;
+}
+
+const char *quality_name(render_quality quality) {
+    switch (quality) {
+    case render_quality::preview: return "preview";
+    case render_quality::coarse: return "coarse";
+    case render_quality::full: return "full";
+    }
+    return "?";
+}
+
+task_pool &render_threads() {
+    static task_pool threads;
+    return threads;
+}
+
+render_output run_render(const render_job &job) {
+    render_output out;
+    evaluation_options options;
+    switch (job.parameters.quality) {
+    case render_quality::preview:
+        options.coarsest = {8, 2, 30};
+        // About 150 ms until the first picture of any model, the coarse level has all of it
+        options.max_instances = 20000;
+        break;
+    case render_quality::coarse:
+        options.coarsest = {24, 1, 10};
+        break;
+    case render_quality::full:
+        break;
+    }
+    scad_source overrides;
+    if (!job.parameters.variables.empty()) {
+        overrides.path = "<parameters>";
+        for (const auto &variable : job.parameters.variables) {
+            overrides.text += variable.first + " = " + variable.second + ";\n";
+        }
+        overrides.tree = parse_scad(overrides.text, 0);
+        options.overrides = &overrides;
+    }
+
+    evaluation_result result = evaluate_scad(job.sources, options);
+    out.messages = std::move(result.messages);
+    out.failed = result.failed;
+    if (result.root) {
+        std::vector<std::string> warnings;
+        build_options build;
+        build.cache = &subtree_cache();
+        build.tasks = &render_threads();
+        build.preview = job.parameters.quality == render_quality::preview;
+        solid_ptr model = build_geometry(*result.root, warnings, build);
+        for (const std::string &warning : warnings) out.messages.push_back("WARNING: " + warning);
+        out.geometry = triangulate(*model);
+        locate_parts(job, *result.root, out);
+    }
+    return out;
+}
+
+///////////////////////////////////////////////////////////
+// render_job
+///////////////////////////////////////////////////////////
+
+std::string render_job::serialize() const {
+    std::string out;
+    put(out, key);
+    put(out, static_cast<uint8_t>(parameters.quality));
+    put(out, static_cast<uint32_t>(parameters.variables.size()));
+    for (const auto &variable : parameters.variables) {
+        put_string(out, variable.first);
+        put_string(out, variable.second);
+    }
+    put(out, static_cast<uint32_t>(sources.size()));
+    for (const scad_source &source : sources) {
+        put_string(out, source.path);
+        put_string(out, source.text);
+        put(out, static_cast<uint32_t>(source.imports.size()));
+        for (const auto &import : source.imports) {
+            put_string(out, import.first);
+            put(out, static_cast<uint64_t>(import.second));
+        }
+    }
+    return out;
+}
+
+bool render_job::deserialize(std::string_view data, render_job &out) {
+    out = render_job();
+    uint32_t count;
+    uint8_t quality;
+    if (!get(data, out.key) || !get(data, quality) || quality > static_cast<uint8_t>(render_quality::full) ||
+        !get(data, count)) {
+        return false;
+    }
+    out.parameters.quality = static_cast<render_quality>(quality);
+    for (uint32_t i = 0; i < count; i++) {
+        std::pair<std::string, std::string> variable;
+        if (!get_string(data, variable.first) || !get_string(data, variable.second)) return false;
+        out.parameters.variables.push_back(std::move(variable));
+    }
+    if (!get(data, count)) return false;
+    out.sources.resize(count);
+    for (scad_source &source : out.sources) {
+        uint32_t imports;
+        if (!get_string(data, source.path) || !get_string(data, source.text) || !get(data, imports)) return false;
+        for (uint32_t k = 0; k < imports; k++) {
+            std::string path;
+            uint64_t target;
+            if (!get_string(data, path) || !get(data, target) || target >= count) return false;
+            source.imports.emplace(std::move(path), static_cast<size_t>(target));
+        }
+        source.tree = parse_scad(source.text, 0);
+    }
+    return data.empty();
+}
+
+///////////////////////////////////////////////////////////
+// render_output
+///////////////////////////////////////////////////////////
+
+size_t render_output::memory_size() const {
+    size_t bytes = sizeof(*this) + geometry.positions.capacity() * sizeof(float) +
+                   geometry.indices.capacity() * sizeof(uint32_t);
+    for (const std::string &message : messages) bytes += sizeof(std::string) + message.capacity();
+    for (const std::string &file : files) bytes += sizeof(std::string) + file.capacity();
+    bytes += geometry.parts.capacity() * sizeof(uint32_t) + parts.capacity() * sizeof(part_source);
+    return bytes;
+}
+
+std::string render_output::serialize(bool with_mesh) const {
+    std::string out;
+    out.reserve(32 + (with_mesh ? geometry.position_bytes().size() + geometry.index_bytes().size() : 0) +
+                geometry.parts.size() * sizeof(uint32_t));
+    put(out, static_cast<uint32_t>(failed));
+    put(out, static_cast<uint32_t>(messages.size()));
+    put(out, static_cast<uint64_t>(geometry.positions.size()));
+    put(out, static_cast<uint64_t>(geometry.indices.size()));
+    for (const std::string &message : messages) {
+        put(out, static_cast<uint32_t>(message.size()));
+        out += message;
+    }
+    put(out, static_cast<uint32_t>(files.size()));
+    for (const std::string &file : files) put_string(out, file);
+    put(out, static_cast<uint32_t>(parts.size()));
+    for (const part_source &part : parts) {
+        put(out, part.file);
+        put(out, part.range.start.line);
+        put(out, part.range.start.character);
+        put(out, part.range.end.line);
+        put(out, part.range.end.character);
+    }
+    if (with_mesh) {
+        out += geometry.position_bytes();
+        out += geometry.index_bytes();
+    }
+    // One per triangle, or none for a render that failed before the geometry
+    put(out, static_cast<uint8_t>(!geometry.parts.empty()));
+    out.append(reinterpret_cast<const char *>(geometry.parts.data()), geometry.parts.size() * sizeof(uint32_t));
+    return out;
+}
+
+namespace {
+
+// The mesh is read from data unless it is given apart
+bool deserialize_output(std::string_view data, const std::string_view *apart, render_output &out) {
+    uint32_t failed, message_count;
+    uint64_t position_count, index_count;
+    if (!get(data, failed) || !get(data, message_count) || !get(data, position_count) || !get(data, index_count)) {
+        return false;
+    }
+    out.failed = failed != 0;
+    out.messages.clear();
+    for (uint32_t i = 0; i < message_count; i++) {
+        uint32_t length;
+        if (!get(data, length) || data.size() < length) return false;
+        out.messages.emplace_back(data.substr(0, length));
+        data.remove_prefix(length);
+    }
+    uint32_t file_count, part_count;
+    if (!get(data, file_count)) return false;
+    out.files.clear();
+    for (uint32_t i = 0; i < file_count; i++) {
+        std::string file;
+        if (!get_string(data, file)) return false;
+        out.files.push_back(std::move(file));
+    }
+    if (!get(data, part_count) || part_count > data.size()) return false;
+    out.parts.resize(part_count);
+    for (part_source &part : out.parts) {
+        if (!get(data, part.file) || part.file >= std::max<uint32_t>(file_count, 1) ||
+            !get(data, part.range.start.line) || !get(data, part.range.start.character) ||
+            !get(data, part.range.end.line) || !get(data, part.range.end.character)) {
+            return false;
+        }
+    }
+    std::string_view mesh;
+    if (!apart) {
+        if (position_count > data.size() / sizeof(float) || index_count > data.size() / sizeof(uint32_t) ||
+            data.size() < position_count * sizeof(float) + index_count * sizeof(uint32_t) + 1) {
+            return false;
+        }
+        mesh = data.substr(0, position_count * sizeof(float) + index_count * sizeof(uint32_t));
+        data.remove_prefix(mesh.size());
+    } else if (position_count > apart->size() / sizeof(float) || index_count > apart->size() / sizeof(uint32_t) ||
+               apart->size() != position_count * sizeof(float) + index_count * sizeof(uint32_t) || data.empty()) {
+        return false;
+    } else {
+        mesh = *apart;
+    }
+    out.geometry.positions.resize(position_count);
+    memcpy(out.geometry.positions.data(), mesh.data(), position_count * sizeof(float));
+    out.geometry.indices.resize(index_count);
+    memcpy(out.geometry.indices.data(), mesh.data() + position_count * sizeof(float), index_count * sizeof(uint32_t));
+    uint8_t has_parts = 0;
+    get(data, has_parts);
+    const size_t triangles = index_count / 3;
+    out.geometry.parts.clear();
+    if (has_parts) {
+        if (data.size() != triangles * sizeof(uint32_t)) return false;
+        out.geometry.parts.resize(triangles);
+        memcpy(out.geometry.parts.data(), data.data(), triangles * sizeof(uint32_t));
+        for (uint32_t part : out.geometry.parts) {
+            if (part >= part_count) return false;
+        }
+    } else if (!data.empty()) {
+        return false;
+    }
+    // Indices have to stay inside the vertices, whatever is on the disk
+    const size_t vertices = position_count / 3;
+    for (uint32_t index : out.geometry.indices) {
+        if (index >= vertices) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+bool render_output::deserialize(std::string_view data, render_output &out) {
+    return deserialize_output(data, nullptr, out);
+}
+
+bool render_output::deserialize(std::string_view data, std::string_view mesh, render_output &out) {
+    return deserialize_output(data, &mesh, out);
+}
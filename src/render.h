@@ -0,0 +1,88 @@
+#pragma once
+
+#include "evaluator.h"
+#include "geometry.h"
+#include "lsp.h"
+#include "uri_table.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class task_pool;
+struct project;
+
+// Lower qualities come back quicker, for a first picture of a model that takes long
+enum class render_quality : uint8_t {
+    // Coarse circles and spheres put together without boolean operations, of a big model only the
+    // first module instances
+    preview,
+    // Coarse circles and spheres
+    coarse,
+    full,
+};
+
+const char *quality_name(render_quality quality);
+
+// What a render depends on besides the files
+struct render_parameters {
+    // Top level variables set from outside like OpenSCAD's -D name=value, the value is an expression
+    std::vector<std::pair<std::string, std::string>> variables;
+    render_quality quality = render_quality::full;
+};
+
+/**
+ * Everything a render reads: the document, the files it includes and uses, transitively, and
+ * the parameters. The key is a hash over all of it, equal keys render the same model.
+ */
+struct render_job {
+    std::vector<scad_source> sources;
+    render_parameters parameters;
+    uint64_t key = 0;
+
+    // Flat binary form for the render workers, without the syntax trees
+    std::string serialize() const;
+    // Parses the sources again
+    static bool deserialize(std::string_view data, render_job &out);
+};
+
+/**
+ * Collect the files of a render, open documents with their unsaved text and everything else
+ * from the disk. The include/use edges are the ones of the dependency graph.
+ * False if the document itself can not be read.
+ */
+bool prepare_render(const project &proj, DocumentId doc, render_parameters parameters, render_job &job);
+
+// The module call that made a part of the model
+struct part_source {
+    // Index into render_output::files
+    uint32_t file = 0;
+    lsRange range;
+};
+
+struct render_output {
+    mesh geometry;
+    std::vector<std::string> messages;
+    bool failed = false;
+    // The paths of the sources and where every part came from, geometry.parts index into parts
+    std::vector<std::string> files;
+    std::vector<part_source> parts;
+
+    // Bytes held in memory, for the cache limits
+    size_t memory_size() const;
+    // Flat binary form for the disk cache, in native byte order. Without the mesh the positions
+    // and indices are left out, the render workers pass them in front of the rest.
+    std::string serialize(bool with_mesh = true) const;
+    static bool deserialize(std::string_view data, render_output &out);
+    // The rest and the positions and indices of the mesh as given by mesh::position_bytes and
+    // mesh::index_bytes, one after the other
+    static bool deserialize(std::string_view data, std::string_view mesh, render_output &out);
+};
+
+render_output run_render(const render_job &job);
+
+// Threads building the geometry, started on first use
+task_pool &render_threads();
@@ -0,0 +1,229 @@
+#include "render_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char MAGIC[8] = {'S', 'C', 'A', 'D', 'R', 'N', 'D', '\n'};
+constexpr uint32_t BYTE_ORDER_TAG = 0x01020304;
+constexpr char EXTENSION[] = ".render";
+
+struct entry_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key;
+    uint64_t payload_size;
+};
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// <16 hex digits>.render
+bool parse_entry_name(const std::string &name, uint64_t &key) {
+    if (name.size() != 16 + sizeof(EXTENSION) - 1 || name.compare(16, std::string::npos, EXTENSION) != 0) return false;
+    char *end = nullptr;
+    key = std::strtoull(name.substr(0, 16).c_str(), &end, 16);
+    return end && *end == '\0';
+}
+
+} // namespace
+
+void render_cache::configure(const std::string &directory, size_t memory_limit, size_t disk_limit) {
+    this->memory_limit = memory_limit;
+    this->disk_limit = disk_limit;
+    disk_directory = directory;
+    disk.clear();
+    counters.disk_entries = 0;
+    counters.disk_bytes = 0;
+    trim_memory();
+    if (disk_directory.empty()) return;
+
+    std::error_code err;
+    fs::create_directories(disk_directory, err);
+    for (fs::directory_iterator it(disk_directory, err), end; !err && it != end; it.increment(err)) {
+        uint64_t key;
+        if (!parse_entry_name(it->path().filename().string(), key)) continue;
+        struct stat st;
+        if (::stat(it->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        const int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        disk[key] = {static_cast<uint64_t>(st.st_size), mtime};
+        counters.disk_bytes += st.st_size;
+    }
+    counters.disk_entries = disk.size();
+    trim_disk();
+}
+
+std::shared_ptr<const render_output> render_cache::find(uint64_t key) {
+    auto it = memory.find(key);
+    if (it != memory.end()) {
+        recent.splice(recent.begin(), recent, it->second);
+        counters.memory_hits++;
+        return it->second->output;
+    }
+
+    auto output = std::make_shared<render_output>();
+    // Other servers sharing the directory may have added the entry since it was scanned
+    if (!disk_directory.empty() && read_entry(key, *output)) {
+        counters.disk_hits++;
+        remember(key, output);
+        return output;
+    }
+    counters.misses++;
+    return nullptr;
+}
+
+void render_cache::store(uint64_t key, std::shared_ptr<const render_output> output) {
+    // A failed render is tried again, an error of the renderer must not outlive its fix
+    if (output->failed) return;
+    counters.stores++;
+    if (!disk_directory.empty()) write_entry(key, *output);
+    remember(key, std::move(output));
+}
+
+void render_cache::remember(uint64_t key, std::shared_ptr<const render_output> output) {
+    const size_t bytes = output->memory_size();
+    auto it = memory.find(key);
+    if (it != memory.end()) {
+        counters.memory_bytes -= it->second->bytes;
+        recent.erase(it->second);
+        memory.erase(it);
+    }
+    // Results larger than the whole memory layer are only kept on disk
+    if (bytes > memory_limit) return;
+    recent.push_front({key, std::move(output), bytes});
+    memory[key] = recent.begin();
+    counters.memory_bytes += bytes;
+    trim_memory();
+    counters.memory_entries = memory.size();
+}
+
+void render_cache::trim_memory() {
+    while (counters.memory_bytes > memory_limit && !recent.empty()) {
+        counters.memory_bytes -= recent.back().bytes;
+        memory.erase(recent.back().key);
+        recent.pop_back();
+        counters.memory_evictions++;
+    }
+    counters.memory_entries = memory.size();
+}
+
+std::string render_cache::entry_path(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx%s", static_cast<unsigned long long>(key), EXTENSION);
+    return (fs::path(disk_directory) / name).string();
+}
+
+bool render_cache::read_entry(uint64_t key, render_output &out) {
+    const std::string path = entry_path(key);
+    std::ifstream in(path, std::ios::binary);
+    if (!in && !disk.count(key)) return false;
+    std::ostringstream contents;
+    if (in) contents << in.rdbuf();
+    const std::string data = contents.str();
+
+    entry_header header;
+    bool valid = data.size() >= sizeof(header);
+    if (valid) {
+        memcpy(&header, data.data(), sizeof(header));
+        valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION &&
+                header.byte_order == BYTE_ORDER_TAG && header.key == key &&
+                header.payload_size == data.size() - sizeof(header) &&
+                render_output::deserialize(std::string_view(data).substr(sizeof(header)), out) && !out.failed;
+    }
+
+    auto it = disk.find(key);
+    if (!valid) {
+        // Written by another version, cut short, deleted behind our back or a failed render
+        std::error_code err;
+        fs::remove(path, err);
+        if (it != disk.end()) {
+            counters.disk_bytes -= it->second.bytes;
+            disk.erase(it);
+            counters.disk_entries = disk.size();
+        }
+        return false;
+    }
+    // The modification time orders the entries for eviction, also for the next server
+    ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    if (it == disk.end()) {
+        disk[key] = {data.size(), now_ns()};
+        counters.disk_bytes += data.size();
+        counters.disk_entries = disk.size();
+    } else {
+        it->second.last_used_ns = now_ns();
+    }
+    return true;
+}
+
+void render_cache::write_entry(uint64_t key, const render_output &output) {
+    const std::string payload = output.serialize();
+    const uint64_t bytes = sizeof(entry_header) + payload.size();
+    if (bytes > disk_limit) return;
+
+    entry_header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_TAG;
+    header.key = key;
+    header.payload_size = payload.size();
+
+    const std::string path = entry_path(key);
+    const std::string temporary = path + ".tmp" + std::to_string(::getpid());
+    std::error_code err;
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(payload.data(), payload.size());
+        if (!out) {
+            fs::remove(temporary, err);
+            return;
+        }
+    }
+    fs::rename(temporary, path, err);
+    if (err) {
+        fs::remove(temporary, err);
+        return;
+    }
+
+    auto it = disk.find(key);
+    if (it != disk.end()) counters.disk_bytes -= it->second.bytes;
+    disk[key] = {bytes, now_ns()};
+    counters.disk_bytes += bytes;
+    counters.disk_entries = disk.size();
+    trim_disk();
+}
+
+void render_cache::trim_disk() {
+    if (counters.disk_bytes <= disk_limit) return;
+    std::vector<std::pair<int64_t, uint64_t>> by_age;
+    by_age.reserve(disk.size());
+    for (const auto &entry : disk) by_age.emplace_back(entry.second.last_used_ns, entry.first);
+    std::sort(by_age.begin(), by_age.end());
+
+    std::error_code err;
+    for (const auto &oldest : by_age) {
+        if (counters.disk_bytes <= disk_limit) break;
+        fs::remove(entry_path(oldest.second), err);
+        counters.disk_bytes -= disk[oldest.second].bytes;
+        disk.erase(oldest.second);
+        counters.disk_evictions++;
+    }
+    counters.disk_entries = disk.size();
+}
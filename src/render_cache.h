@@ -0,0 +1,80 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+struct render_cache_stats {
+    uint64_t memory_hits = 0;
+    uint64_t disk_hits = 0;
+    uint64_t misses = 0;
+    uint64_t stores = 0;
+    uint64_t memory_evictions = 0;
+    uint64_t disk_evictions = 0;
+
+    size_t memory_entries = 0;
+    size_t memory_bytes = 0;
+    size_t disk_entries = 0;
+    size_t disk_bytes = 0;
+};
+
+/**
+ * Render results by render key. Recently used results are kept in memory, every result is
+ * also written to a directory so it survives a restart of the server. Both layers drop their
+ * least recently used results when they grow beyond their limit.
+ *
+ * A disk entry is one file named after the key, with a header repeating the key and the
+ * format version. Entries are written under a temporary name and renamed, so several servers
+ * can share the directory. The modification time of an entry is its last use.
+ */
+class render_cache {
+public:
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = size_t(64) << 20;
+    static constexpr size_t DEFAULT_DISK_LIMIT = size_t(512) << 20;
+    static constexpr uint32_t VERSION = 2;
+
+    // An empty directory disables the disk layer, entries already in the directory are picked up
+    void configure(const std::string &directory, size_t memory_limit, size_t disk_limit);
+
+    // Memory first, then the disk, null if neither has the key
+    std::shared_ptr<const render_output> find(uint64_t key);
+    // Failed renders are not kept
+    void store(uint64_t key, std::shared_ptr<const render_output> output);
+
+    const render_cache_stats &stats() const { return counters; }
+    const std::string &directory() const { return disk_directory; }
+
+private:
+    struct memory_entry {
+        uint64_t key;
+        std::shared_ptr<const render_output> output;
+        size_t bytes;
+    };
+
+    struct disk_entry {
+        uint64_t bytes;
+        int64_t last_used_ns;
+    };
+
+    std::string entry_path(uint64_t key) const;
+    bool read_entry(uint64_t key, render_output &out);
+    void write_entry(uint64_t key, const render_output &output);
+    void remember(uint64_t key, std::shared_ptr<const render_output> output);
+    void trim_memory();
+    void trim_disk();
+
+    // Most recently used first
+    std::list<memory_entry> recent;
+    std::unordered_map<uint64_t, std::list<memory_entry>::iterator> memory;
+    std::unordered_map<uint64_t, disk_entry> disk;
+
+    std::string disk_directory;
+    size_t memory_limit = DEFAULT_MEMORY_LIMIT;
+    size_t disk_limit = DEFAULT_DISK_LIMIT;
+    render_cache_stats counters;
+};
@@ -0,0 +1,591 @@
+#include "render_pool.h"
+#include "shared_segment.h"
+
+#include <QMetaObject>
+#include <QObject>
+#include <QSocketNotifier>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+// The server end of the zygote socket, -1 without a zygote
+int zygote_fd = -1;
+
+struct job_header {
+    uint64_t size;
+    double cpu_seconds;
+    uint64_t memory_bytes;
+};
+
+// The result segment starts with the mesh as clients read it, the rest of the output follows
+struct result_header {
+    uint32_t status;
+    uint64_t size;
+    uint64_t mesh_bytes;
+};
+
+// Maps a segment for the parser. Segments from workers have to be sealed, so a worker can not
+// truncate one under the mapping.
+template <typename F>
+bool read_segment(int fd, uint64_t size, bool sealed, F &&parse) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != size) return false;
+    if (sealed && !(::fcntl(fd, F_GET_SEALS) & F_SEAL_SHRINK)) return false;
+    if (size == 0) return parse(std::string_view());
+    void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+    const bool valid = parse(std::string_view(static_cast<const char *>(data), size));
+    ::munmap(data, size);
+    return valid;
+}
+
+std::shared_ptr<const render_output> failure(const std::string &message) {
+    auto output = std::make_shared<render_output>();
+    output->failed = true;
+    output->messages.push_back("ERROR: " + message);
+    return output;
+}
+
+///////////////////////////////////////////////////////////
+// Worker and zygote processes
+///////////////////////////////////////////////////////////
+
+volatile sig_atomic_t worker_socket = -1;
+
+void cpu_limit_reached(int) {
+    const result_header reply = {static_cast<uint32_t>(render_status::CPU_LIMIT), 0, 0};
+    ::send(worker_socket, &reply, sizeof(reply), MSG_NOSIGNAL);
+    ::_exit(1);
+}
+
+// Only the soft limits are set, an unprivileged process can not raise a hard limit again
+void set_soft_limit(int resource, rlim_t value) {
+    struct rlimit limit;
+    if (::getrlimit(resource, &limit) != 0) return;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? value : std::min(value, limit.rlim_max);
+    ::setrlimit(resource, &limit);
+}
+
+// The limits count from what the worker used so far
+void limit_job(const job_header &header) {
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    const double used = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    set_soft_limit(RLIMIT_CPU, static_cast<rlim_t>(std::ceil(used + std::max(1.0, header.cpu_seconds))));
+
+    // RLIMIT_DATA counts the writable private memory, unlike the address space it does not grow
+    // much with the reserved but unused arenas of the threads
+    unsigned long data_pages = 0;
+    if (FILE *statm = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(statm, "%*u %*u %*u %*u %*u %lu", &data_pages) != 1) data_pages = 0;
+        std::fclose(statm);
+    }
+    set_soft_limit(RLIMIT_DATA, static_cast<rlim_t>(data_pages) * ::sysconf(_SC_PAGESIZE) + header.memory_bytes);
+}
+
+[[noreturn]] void run_worker(int socket) {
+    ::signal(SIGCHLD, SIG_DFL);
+    ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+    worker_socket = socket;
+    struct sigaction action = {};
+    action.sa_handler = cpu_limit_reached;
+    ::sigaction(SIGXCPU, &action, nullptr);
+    // Before the first limit, the stacks of the threads are not part of any render
+    render_threads();
+
+    while (true) {
+        job_header header;
+        int fd;
+        const ssize_t received = receive_message(socket, &header, sizeof(header), fd);
+        if (received != sizeof(header) || fd < 0) ::_exit(received == 0 ? 0 : 1);
+
+        result_header reply = {static_cast<uint32_t>(render_status::DONE), 0, 0};
+        int result = -1;
+        try {
+            limit_job(header);
+            render_job job;
+            render_output output;
+            if (read_segment(fd, header.size, false,
+                             [&](std::string_view data) { return render_job::deserialize(data, job); })) {
+                output = run_render(job);
+            } else {
+                output = *failure("The render worker got an invalid job");
+            }
+            // The mesh goes from the geometry straight into the segment, which a local client maps
+            const std::string rest = output.serialize(false);
+            const std::string_view positions = output.geometry.position_bytes();
+            const std::string_view indices = output.geometry.index_bytes();
+            result = make_segment("render-result", {positions, indices, rest});
+            reply.mesh_bytes = positions.size() + indices.size();
+            reply.size = reply.mesh_bytes + rest.size();
+            if (result < 0) reply.status = static_cast<uint32_t>(render_status::CRASHED);
+        } catch (const std::bad_alloc &) {
+            reply.status = static_cast<uint32_t>(render_status::MEMORY_LIMIT);
+        }
+        ::close(fd);
+        send_message(socket, &reply, sizeof(reply), result);
+        if (result >= 0) ::close(result);
+        // Whatever is left after running out of memory is not worth keeping
+        if (reply.status != static_cast<uint32_t>(render_status::DONE)) ::_exit(1);
+    }
+}
+
+// Forks a worker for every byte the server sends and hands back its socket with the pid
+[[noreturn]] void run_zygote(int socket) {
+    // The workers are reaped by the kernel
+    ::signal(SIGCHLD, SIG_IGN);
+    while (true) {
+        char request;
+        const ssize_t received = ::recv(socket, &request, 1, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) ::_exit(0);
+
+        int pair[2];
+        pid_t pid = -1;
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == 0) {
+            pid = ::fork();
+            if (pid == 0) {
+                ::close(socket);
+                ::close(pair[0]);
+                run_worker(pair[1]);
+            }
+            ::close(pair[1]);
+        } else {
+            pair[0] = -1;
+        }
+        send_message(socket, &pid, sizeof(pid), pid > 0 ? pair[0] : -1);
+        if (pair[0] >= 0) ::close(pair[0]);
+    }
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////
+// Renders in the server
+///////////////////////////////////////////////////////////
+
+// Runs the jobs one after the other on a thread of its own. The pool is only reached through
+// the callbacks, which are not posted anymore once it closed the runner.
+struct render_pool::local_runner {
+    using deliver_callback = std::function<void(render_status, std::shared_ptr<const render_output>)>;
+
+    QObject *context;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::pair<render_job, deliver_callback>> jobs;
+    // Set by the pool when it goes, nothing is delivered anymore
+    bool closed = false;
+    bool rendering = false;
+    std::thread thread;
+
+    explicit local_runner(QObject *context) :
+            context(context)
+    {
+    }
+
+    void run() {
+        while (true) {
+            std::pair<render_job, deliver_callback> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return closed || !jobs.empty(); });
+                if (closed) return;
+                next = std::move(jobs.front());
+                jobs.pop_front();
+                rendering = true;
+            }
+
+            render_status status = render_status::DONE;
+            std::shared_ptr<const render_output> output;
+            try {
+                output = std::make_shared<render_output>(run_render(next.first));
+            } catch (const std::bad_alloc &) {
+                status = render_status::MEMORY_LIMIT;
+                output = failure("The render ran out of memory");
+            } catch (const std::exception &e) {
+                status = render_status::CRASHED;
+                output = failure(std::string("The render failed: ") + e.what());
+            }
+
+            // Under the lock, the pool and its context can not go while the result is posted
+            std::lock_guard<std::mutex> lock(mutex);
+            rendering = false;
+            if (closed) return;
+            deliver_callback deliver = std::move(next.second);
+            QMetaObject::invokeMethod(context, [deliver, status, output] { deliver(status, output); },
+                                      Qt::QueuedConnection);
+        }
+    }
+};
+
+void render_pool::start_zygote() {
+    int pair[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) return;
+    const pid_t server = ::getpid();
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::close(pair[0]);
+        ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (::getppid() != server) ::_exit(0);
+        run_zygote(pair[1]);
+    }
+    ::close(pair[1]);
+    if (pid < 0) {
+        std::cerr << "Can't start the render workers, models are rendered in the server: " << strerror(errno)
+                  << "\n";
+        ::close(pair[0]);
+        return;
+    }
+    zygote_fd = pair[0];
+}
+
+render_pool::render_pool(QObject *context) :
+        context(context),
+        wanted(DEFAULT_WORKERS)
+{
+}
+
+render_pool::~render_pool() {
+    for (const mesh_segment &segment : mesh_segments) ::close(segment.fd);
+    for (const auto &w : workers) {
+        // An idle worker exits when its socket closes, a busy one would finish its render first
+        if (w->busy) ::kill(w->pid, SIGKILL);
+        ::close(w->fd);
+    }
+    if (local) {
+        bool rendering;
+        {
+            std::lock_guard<std::mutex> lock(local->mutex);
+            local->closed = true;
+            rendering = local->rendering;
+        }
+        local->wake.notify_all();
+        // A render in the server can not be interrupted, it finishes on its own and is dropped
+        if (rendering) {
+            local->thread.detach();
+        } else {
+            local->thread.join();
+        }
+    }
+}
+
+void render_pool::configure(unsigned workers, render_limits limits) {
+    this->limits = limits;
+    wanted = workers;
+
+    size_t active = 0;
+    for (size_t i = 0; i < this->workers.size();) {
+        worker *w = this->workers[i].get();
+        if (w->retiring || active < wanted) {
+            active += !w->retiring;
+            i++;
+        } else if (w->busy) {
+            w->retiring = true;
+            i++;
+        } else {
+            remove(w);
+        }
+    }
+    top_up();
+    dispatch();
+}
+
+render_pool::ticket render_pool::submit(render_job job, done_callback done) {
+    const ticket t = next_ticket++;
+    std::vector<std::pair<ticket, done_callback>> &waiting_for_key = callbacks[job.key];
+    waiting_for_key.emplace_back(t, std::move(done));
+    ticket_keys[t] = job.key;
+    if (waiting_for_key.size() > 1) return t;
+
+    if (workers.empty()) top_up();
+    if (job.parameters.quality == render_quality::preview) {
+        // A preview is meant to come back quickly, it only waits for the other previews
+        auto it = std::find_if(waiting.begin(), waiting.end(), [](const render_job &queued) {
+            return queued.parameters.quality != render_quality::preview;
+        });
+        waiting.insert(it, std::move(job));
+    } else {
+        waiting.push_back(std::move(job));
+    }
+    dispatch();
+    return t;
+}
+
+void render_pool::cancel(ticket t) {
+    auto found = ticket_keys.find(t);
+    if (found == ticket_keys.end()) return;
+    const uint64_t key = found->second;
+    ticket_keys.erase(found);
+
+    auto it = callbacks.find(key);
+    if (it == callbacks.end()) return;
+    auto &waiting_for_key = it->second;
+    waiting_for_key.erase(std::remove_if(waiting_for_key.begin(), waiting_for_key.end(),
+                                         [t](const auto &entry) { return entry.first == t; }),
+                          waiting_for_key.end());
+    if (!waiting_for_key.empty()) return;
+    callbacks.erase(it);
+
+    for (auto queued = waiting.begin(); queued != waiting.end(); ++queued) {
+        if (queued->key == key) {
+            waiting.erase(queued);
+            return;
+        }
+    }
+    for (const auto &w : workers) {
+        if (w->busy && w->key == key && !w->cancelled) {
+            // Its hang up removes it and starts a replacement
+            ::kill(w->pid, SIGKILL);
+            w->cancelled = true;
+            w->retiring = true;
+            return;
+        }
+    }
+}
+
+size_t render_pool::running() const {
+    size_t busy = local_key != 0;
+    for (const auto &w : workers) busy += w->busy;
+    return busy;
+}
+
+bool render_pool::spawn() {
+    const char request = 'w';
+    if (zygote_fd < 0 || ::send(zygote_fd, &request, 1, MSG_NOSIGNAL) != 1) return false;
+    pid_t pid = -1;
+    int fd;
+    const ssize_t size = receive_message(zygote_fd, &pid, sizeof(pid), fd);
+    if (size <= 0) {
+        std::cerr << "The render zygote is gone, no more render workers are started\n";
+        ::close(zygote_fd);
+        zygote_fd = -1;
+    }
+    if (size != sizeof(pid) || fd < 0) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+
+    auto w = std::make_unique<worker>();
+    w->fd = fd;
+    w->pid = pid;
+    w->notifier = std::make_unique<QSocketNotifier>(fd, QSocketNotifier::Read);
+    worker *started = w.get();
+    QObject::connect(w->notifier.get(), &QSocketNotifier::activated, context, [this, started] { received(started); });
+    workers.push_back(std::move(w));
+    return true;
+}
+
+void render_pool::top_up() {
+    size_t active = 0;
+    for (const auto &w : workers) active += !w->retiring;
+    while (active < wanted && spawn()) active++;
+}
+
+render_pool::worker *render_pool::pick(const render_job &job) {
+    worker *idle = nullptr;
+    for (const auto &w : workers) {
+        if (w->busy || w->retiring) continue;
+        // The worker that rendered the document last still has its subtrees cached
+        if (!job.sources.empty() && w->document == job.sources[0].path) return w.get();
+        if (!idle) idle = w.get();
+    }
+    return idle;
+}
+
+void render_pool::dispatch() {
+    // Nobody left to render the queued jobs but the server itself
+    if (workers.empty()) {
+        dispatch_local();
+        return;
+    }
+    while (!waiting.empty()) {
+        worker *w = pick(waiting.front());
+        if (!w) break;
+
+        render_job job = std::move(waiting.front());
+        waiting.pop_front();
+        const std::string payload = job.serialize();
+        const int fd = make_segment("render-job", {payload});
+        if (fd < 0) {
+            finish(job.key, render_status::CRASHED, failure("Can't pass the job to a render worker"));
+            continue;
+        }
+        const job_header header = {payload.size(), limits.cpu_seconds, limits.memory_bytes};
+        const bool sent = send_message(w->fd, &header, sizeof(header), fd);
+        ::close(fd);
+        if (!sent) {
+            // Dead, it is replaced when its hang up is seen
+            w->retiring = true;
+            waiting.push_front(std::move(job));
+            continue;
+        }
+        w->busy = true;
+        w->key = job.key;
+        w->document = job.sources.empty() ? std::string() : job.sources[0].path;
+    }
+}
+
+void render_pool::dispatch_local() {
+    if (local_key != 0 || waiting.empty()) return;
+    if (!local) {
+        local = std::make_shared<local_runner>(context);
+        // The thread shares the runner, a render that can not be stopped may outlive the pool
+        local->thread = std::thread([runner = local] { runner->run(); });
+    }
+
+    render_job job = std::move(waiting.front());
+    waiting.pop_front();
+    local_key = job.key;
+    const uint64_t key = job.key;
+    // Runs on the thread of the context, only while the pool exists
+    auto deliver = [this, key](render_status status, std::shared_ptr<const render_output> output) {
+        local_key = 0;
+        finish(key, status, std::move(output));
+        dispatch();
+    };
+    {
+        std::lock_guard<std::mutex> lock(local->mutex);
+        local->jobs.emplace_back(std::move(job), std::move(deliver));
+    }
+    local->wake.notify_one();
+}
+
+void render_pool::received(worker *w) {
+    result_header header;
+    int fd;
+    const ssize_t size = receive_message(w->fd, &header, sizeof(header), fd, MSG_DONTWAIT);
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (size != sizeof(header)) {
+        // Hung up: crashed, killed, or exited after a limit
+        if (fd >= 0) ::close(fd);
+        const bool busy = w->busy && !w->cancelled;
+        const uint64_t key = w->key;
+        remove(w);
+        if (busy) finish(key, render_status::CRASHED, failure("The render worker crashed"));
+        top_up();
+        dispatch();
+        return;
+    }
+
+    if (w->cancelled) {
+        // Finished before the kill arrived, nobody wants the result
+        if (fd >= 0) ::close(fd);
+        remove(w);
+        top_up();
+        dispatch();
+        return;
+    }
+
+    const uint64_t key = w->key;
+    w->busy = false;
+    w->key = 0;
+    render_status status = header.status <= static_cast<uint32_t>(render_status::CRASHED)
+                               ? static_cast<render_status>(header.status)
+                               : render_status::CRASHED;
+    std::shared_ptr<const render_output> output;
+    if (status == render_status::DONE) {
+        auto result = std::make_shared<render_output>();
+        auto parse = [&](std::string_view data) {
+            return render_output::deserialize(data.substr(header.mesh_bytes), data.substr(0, header.mesh_bytes),
+                                              *result);
+        };
+        if (fd >= 0 && header.mesh_bytes <= header.size && read_segment(fd, header.size, true, parse)) {
+            output = std::move(result);
+            if (header.mesh_bytes > 0) {
+                keep_mesh_segment(key, fd, header.mesh_bytes);
+                fd = -1;
+            }
+        } else {
+            status = render_status::CRASHED;
+        }
+    }
+    if (fd >= 0) ::close(fd);
+
+    char message[128];
+    switch (status) {
+    case render_status::DONE:
+        break;
+    case render_status::CPU_LIMIT:
+        snprintf(message, sizeof(message), "The render took more than %g s of CPU time", limits.cpu_seconds);
+        output = failure(message);
+        break;
+    case render_status::MEMORY_LIMIT:
+        snprintf(message, sizeof(message), "The render needed more than %zu MiB of memory", limits.memory_bytes >> 20);
+        output = failure(message);
+        break;
+    case render_status::CRASHED:
+        output = failure("The render worker sent an invalid result");
+        break;
+    }
+
+    // A worker exits after a limit, the replacement is started right away
+    if (w->retiring || status != render_status::DONE) {
+        remove(w);
+        top_up();
+    }
+    finish(key, status, std::move(output));
+    dispatch();
+}
+
+void render_pool::keep_mesh_segment(uint64_t key, int fd, uint64_t size) {
+    mesh_segments.push_front({key, fd, size});
+    while (mesh_segments.size() > KEPT_MESH_SEGMENTS) {
+        ::close(mesh_segments.back().fd);
+        mesh_segments.pop_back();
+    }
+}
+
+int render_pool::take_mesh_segment(uint64_t key, uint64_t size) {
+    for (auto it = mesh_segments.begin(); it != mesh_segments.end(); ++it) {
+        if (it->key != key) continue;
+        const int fd = it->size == size ? it->fd : -1;
+        if (fd < 0) ::close(it->fd);
+        mesh_segments.erase(it);
+        return fd;
+    }
+    return -1;
+}
+
+void render_pool::finish(uint64_t key, render_status status, std::shared_ptr<const render_output> output) {
+    auto it = callbacks.find(key);
+    if (it == callbacks.end()) return;
+    const std::vector<std::pair<ticket, done_callback>> waiting_for_key = std::move(it->second);
+    callbacks.erase(it);
+    for (const auto &entry : waiting_for_key) ticket_keys.erase(entry.first);
+    for (const auto &entry : waiting_for_key) entry.second(status, output);
+}
+
+void render_pool::remove(worker *w) {
+    // Called from the notifier's own signal, it can only be deleted later
+    w->notifier->setEnabled(false);
+    w->notifier.release()->deleteLater();
+    ::close(w->fd);
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        if (it->get() == w) {
+            workers.erase(it);
+            break;
+        }
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "render.h"
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class QObject;
+class QSocketNotifier;
+
+// Per render, a worker over either limit is stopped and replaced
+struct render_limits {
+    double cpu_seconds = 120;
+    size_t memory_bytes = size_t(4) << 30;
+};
+
+enum class render_status {
+    DONE,
+    CPU_LIMIT,
+    MEMORY_LIMIT,
+    // The worker died, or there is none and the render failed to start
+    CRASHED,
+};
+
+/**
+ * Renders in worker processes, so a model that loops forever, takes all the memory or crashes
+ * the evaluator only costs its worker and the server keeps answering.
+ *
+ * The workers are forked from a zygote, a process forked by main() before Qt or any thread is
+ * started. It stays single threaded with the render code already loaded, so a new worker
+ * starts right away and a fork never happens in the threaded server. The pool keeps its
+ * workers for the whole connection and replaces the ones that die.
+ *
+ * A job and its result are passed as memfd segments, the socket of a worker only carries a
+ * small header and the descriptor. The result segment starts with the positions and indices of
+ * the mesh, so the segments of the last few results can go to local clients as they are. A
+ * worker sets its CPU time and data size limits before every job. The CPU time is that of all
+ * threads of the worker. Jobs with the same key wait for the same render. A document goes to
+ * the worker that rendered it last if that one is idle, its geometry_cache has the unchanged
+ * subtrees.
+ */
+class render_pool {
+public:
+    static constexpr unsigned DEFAULT_WORKERS = 2;
+
+    // The output is a failed one with an error message unless the status is DONE
+    using done_callback = std::function<void(render_status, std::shared_ptr<const render_output>)>;
+    // Identifies one submit, to cancel it
+    using ticket = uint64_t;
+
+    // In main(), before anything else. Without a zygote the renders run on a thread of the server,
+    // one after the other.
+    static void start_zygote();
+
+    // The callbacks run on the thread of the context object
+    explicit render_pool(QObject *context);
+    ~render_pool();
+
+    render_pool(const render_pool &) = delete;
+    render_pool &operator=(const render_pool &) = delete;
+
+    // Starts or stops workers to get to the given number, running jobs are not interrupted
+    void configure(unsigned workers, render_limits limits);
+    // Preview jobs are queued ahead of the others
+    ticket submit(render_job job, done_callback done);
+    // The callback is not called anymore. A render nobody else waits for is dropped from the
+    // queue, or its worker is killed if it already started.
+    void cancel(ticket t);
+
+    size_t running() const;
+    size_t queued() const { return waiting.size(); }
+
+    /**
+     * The sealed memfd a worker wrote the result of a recent render into, with the size bytes
+     * of positions and indices at its start and the rest of the output behind them. The caller
+     * owns the descriptor. -1 if there is none, or its mesh has another size.
+     */
+    int take_mesh_segment(uint64_t key, uint64_t size);
+
+private:
+    // The thread of the server that renders while there is no worker
+    struct local_runner;
+
+    struct worker {
+        int fd = -1;
+        pid_t pid = 0;
+        std::unique_ptr<QSocketNotifier> notifier;
+        // The job being rendered, 0 if idle
+        uint64_t key = 0;
+        bool busy = false;
+        // Still running the job of a configuration that removed it
+        bool retiring = false;
+        // Killed for a cancelled job, whatever it still sends is ignored
+        bool cancelled = false;
+        // Path of the last document rendered
+        std::string document;
+    };
+
+    bool spawn();
+    // Starts workers until there are as many as configured
+    void top_up();
+    // An idle worker for the job, preferably one that rendered the document before
+    worker *pick(const render_job &job);
+    void dispatch();
+    // Hands the next waiting job to the local runner if it is idle
+    void dispatch_local();
+    void received(worker *w);
+    void finish(uint64_t key, render_status status, std::shared_ptr<const render_output> output);
+    void keep_mesh_segment(uint64_t key, int fd, uint64_t size);
+    void remove(worker *w);
+
+    QObject *context;
+    render_limits limits;
+    unsigned wanted = 0;
+
+    std::vector<std::unique_ptr<worker>> workers;
+    // Jobs not handed to a worker yet, in order
+    std::deque<render_job> waiting;
+    // Everybody waiting for a key, queued or running
+    std::unordered_map<uint64_t, std::vector<std::pair<ticket, done_callback>>> callbacks;
+    // The key of every ticket in callbacks
+    std::unordered_map<ticket, uint64_t> ticket_keys;
+    ticket next_ticket = 1;
+
+    struct mesh_segment {
+        uint64_t key;
+        int fd;
+        uint64_t size;
+    };
+    // The result segments of the last renders with a mesh, newest first
+    static constexpr size_t KEPT_MESH_SEGMENTS = 4;
+    std::deque<mesh_segment> mesh_segments;
+
+    // Started on first use. A cancelled job keeps running, only its result is dropped.
+    std::shared_ptr<local_runner> local;
+    // The key of the job on the local runner, 0 if idle
+    uint64_t local_key = 0;
+};
@@ -0,0 +1,193 @@
+#include "render_progress.h"
+#include "connection.h"
+#include "messages.h"
+#include "project.h"
+
+#include <QTimer>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+
+std::string key_string(uint64_t key) {
+    char text[32];
+    snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(key));
+    return text;
+}
+
+} // namespace
+
+render_progress::render_progress(Connection *conn, project *proj) :
+        conn(conn),
+        proj(proj)
+{
+}
+
+render_progress::~render_progress() {
+    for (const auto &entry : sessions) {
+        for (render_pool::ticket t : entry.second.tickets) conn->renderer.cancel(t);
+    }
+}
+
+void render_progress::start(DocumentId doc, const render_parameters &parameters, int budget_ms, std::string token,
+                            mesh_delivery delivery, const RequestId &id) {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        if (it->second.doc == doc) {
+            stop(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    // From the full render down to the best level that is cached, those are rendered
+    std::vector<render_job> jobs;
+    std::shared_ptr<const render_output> cached;
+    render_quality cached_quality = render_quality::preview;
+    uint64_t cached_key = 0;
+    for (render_quality quality : {render_quality::full, render_quality::coarse, render_quality::preview}) {
+        render_parameters level = parameters;
+        level.quality = quality;
+        render_job job;
+        if (!prepare_render(*proj, doc, std::move(level), job)) {
+            conn->send(ResponseError(ErrorCode::InvalidParams, "Can't read " + uri_table::global().path(doc)), id);
+            return;
+        }
+        cached = proj->renders.find(job.key);
+        if (cached) {
+            cached_quality = quality;
+            cached_key = job.key;
+            break;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    const uint64_t session_id = next_session++;
+    session &s = sessions[session_id];
+    s.doc = doc;
+    s.version = proj->dependencies.version(doc);
+    s.request = id;
+    s.delivery = delivery;
+    s.token = token.empty() ? "openscad/render/" + std::to_string(session_id) : std::move(token);
+    if (cached) {
+        s.quality = cached_quality;
+        s.key = cached_key;
+        s.cached = true;
+        s.output = std::move(cached);
+        if (cached_quality == render_quality::full) {
+            answer(s, true);
+            sessions.erase(session_id);
+            return;
+        }
+    }
+
+    QTimer::singleShot(std::max(0, budget_ms), conn, [this, session_id] { budget_expired(session_id); });
+
+    // Preview first, the pool puts it ahead of other renders as well
+    for (auto job = jobs.rbegin(); job != jobs.rend(); ++job) {
+        const uint64_t key = job->key;
+        const render_quality quality = job->parameters.quality;
+        const render_pool::ticket t = conn->renderer.submit(
+            std::move(*job), [this, session_id, key, quality](render_status status,
+                                                             std::shared_ptr<const render_output> output) {
+                rendered(session_id, key, quality, status, std::move(output));
+            });
+        // A job the pool could not hand out fails right away, the session may be over already
+        auto it = sessions.find(session_id);
+        if (it == sessions.end()) return;
+        it->second.tickets.push_back(t);
+    }
+}
+
+void render_progress::document_changed() {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        if (proj->dependencies.version(it->second.doc) != it->second.version) {
+            stop(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void render_progress::rendered(uint64_t id, uint64_t key, render_quality quality, render_status status,
+                               std::shared_ptr<const render_output> output) {
+    // Failures from the limits or a crash depend on more than the key and are not kept
+    if (status == render_status::DONE) proj->renders.store(key, output);
+
+    auto it = sessions.find(id);
+    if (it == sessions.end()) return;
+    session &s = it->second;
+    std::cout << "Rendered " << uri_table::global().path(s.doc) << " [" << key_string(key) << ", "
+              << quality_name(quality) << "] " << output->geometry.triangle_count() << " triangles\n";
+    // A lower level that took longer than a higher one
+    if (s.output && quality <= s.quality) return;
+
+    s.quality = quality;
+    s.key = key;
+    s.cached = false;
+    s.output = std::move(output);
+    const bool final = quality == render_quality::full;
+    if (!s.answered) {
+        if (final || s.budget_over) answer(s, final);
+    } else {
+        report(s, false);
+    }
+
+    if (final) {
+        for (render_pool::ticket t : s.tickets) conn->renderer.cancel(t);
+        sessions.erase(it);
+        return;
+    }
+    // Changed on disk meanwhile, which is not seen until now
+    if (proj->dependencies.version(s.doc) != s.version) stop(it);
+}
+
+void render_progress::budget_expired(uint64_t id) {
+    auto it = sessions.find(id);
+    if (it == sessions.end()) return;
+    session &s = it->second;
+    s.budget_over = true;
+    // Otherwise the first level that is done answers
+    if (s.output && !s.answered) answer(s, false);
+}
+
+void render_progress::answer(session &s, bool final) {
+    OpenSCADRenderResult result;
+    result.cached = s.cached;
+    result.key = key_string(s.key);
+    result.quality = s.quality;
+    if (!final) result.progressToken = s.token;
+    result.output = s.output;
+    result.mesh = conn->meshes.offer(s.key, s.output, s.delivery);
+    conn->send(result, s.request);
+    s.answered = true;
+}
+
+void render_progress::report(const session &s, bool superseded) {
+    RenderProgressParams progress;
+    progress.token = s.token;
+    progress.value.quality = s.quality;
+    progress.value.superseded = superseded;
+    // The superseded report only ends the progress, the model did not change since the last one
+    if (!superseded) {
+        progress.value.key = key_string(s.key);
+        progress.value.output = s.output;
+        progress.value.mesh = conn->meshes.offer(s.key, s.output, s.delivery);
+    }
+    conn->send_notification(progress, "$/progress");
+}
+
+void render_progress::stop(session_map::iterator it) {
+    session &s = it->second;
+    for (render_pool::ticket t : s.tickets) conn->renderer.cancel(t);
+    if (s.answered) {
+        report(s, true);
+    } else if (s.output) {
+        answer(s, true);
+    } else {
+        conn->send(ResponseError(ErrorCode::RequestCancelled, "The document changed before it was rendered"),
+                   s.request);
+    }
+    sessions.erase(it);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "lsp.h"
+#include "mesh_channel.h"
+#include "render.h"
+#include "render_pool.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Connection;
+struct project;
+
+/**
+ * Renders with a time budget: a preview, a coarse and a full render of the document are queued
+ * at once and the request is answered with the best of them that is done when the budget runs
+ * out, or with the full one if that comes first. Every better level after the answer is sent as
+ * $/progress with the partial result token of the request.
+ *
+ * The levels are cached like any other render, so a level that is cached already is not
+ * rendered again and a cached full render answers right away.
+ *
+ * A session ends with its full render, or when the document or one of its dependencies changes.
+ * The renders still running for it are cancelled then. A session that did not answer yet
+ * answers with what it has, one that did gets a last $/progress marked as superseded.
+ */
+class render_progress {
+public:
+    render_progress(Connection *conn, project *proj);
+    // Cancels the renders still running for the sessions
+    ~render_progress();
+
+    render_progress(const render_progress &) = delete;
+    render_progress &operator=(const render_progress &) = delete;
+
+    // An older session of the same document is superseded. Without a token one is made up.
+    void start(DocumentId doc, const render_parameters &parameters, int budget_ms, std::string token,
+               mesh_delivery delivery, const RequestId &id);
+    // Ends the sessions of documents whose version changed
+    void document_changed();
+
+    size_t active() const { return sessions.size(); }
+
+private:
+    struct session {
+        DocumentId doc;
+        // Of the dependency graph when the request came in
+        uint32_t version = 0;
+        RequestId request;
+        std::string token;
+        mesh_delivery delivery = mesh_delivery::json;
+        bool answered = false;
+        bool budget_over = false;
+        // The best level so far
+        render_quality quality = render_quality::preview;
+        uint64_t key = 0;
+        bool cached = false;
+        std::shared_ptr<const render_output> output;
+        std::vector<render_pool::ticket> tickets;
+    };
+    using session_map = std::unordered_map<uint64_t, session>;
+
+    void rendered(uint64_t id, uint64_t key, render_quality quality, render_status status,
+                  std::shared_ptr<const render_output> output);
+    void budget_expired(uint64_t id);
+    // The response to the request, with the token if better levels follow
+    void answer(session &s, bool final);
+    void report(const session &s, bool superseded);
+    // Cancels the renders of the session, answers or reports as superseded and drops it
+    void stop(session_map::iterator it);
+
+    Connection *conn;
+    project *proj;
+    session_map sessions;
+    uint64_t next_session = 1;
+};
@@ -0,0 +1,111 @@
+#include "request_task.h"
+#include "connection.h"
+#include "connection_handler.h"
+#include "messages.h"
+
+#include <QJsonObject>
+#include <QMetaObject>
+
+///////////////////////////////////////////////////////////
+// request_task
+///////////////////////////////////////////////////////////
+
+std::function<void()> request_task::waker() {
+    task_runner *r = &runner;
+    Connection *conn = runner.conn;
+    const uint64_t task = id;
+    const uint64_t awaited = ++wait;
+    // Queued even on the connection's own thread, the task is not suspended yet when a callback
+    // comes right away
+    return [r, conn, task, awaited] {
+        QMetaObject::invokeMethod(conn, [r, task, awaited] { r->resume(task, awaited); }, Qt::QueuedConnection);
+    };
+}
+
+void request_task::suspend() {
+    (*yield)();
+}
+
+client_response request_task::request(RequestMessage &message, const std::string &method) {
+    client_response response;
+    const std::function<void()> wake = waker();
+    runner.conn->send(message, method, {}, [&response, wake](const ResponseMessage &msg, Connection *, project *) {
+        response.result = msg.raw_result.value("result");
+        const QJsonValue error = msg.raw_result.value("error");
+        if (msg.error) {
+            // Also the RequestCancelled of clean_pending_messages, which has no raw result
+            response.failed = true;
+            response.error_code = static_cast<int>(msg.error->code);
+            response.error_message = msg.error->message;
+        } else if (error.isObject()) {
+            response.failed = true;
+            response.error_code = error.toObject().value("code").toInt();
+            response.error_message = error.toObject().value("message").toString().toStdString();
+        }
+        wake();
+    });
+    suspend();
+    return response;
+}
+
+///////////////////////////////////////////////////////////
+// task_runner
+///////////////////////////////////////////////////////////
+
+task_runner::task_runner(Connection *conn) :
+        conn(conn),
+        stacks(STACK_SIZE)
+{
+}
+
+task_runner::~task_runner() {
+    tasks.clear();
+}
+
+void task_runner::start(const RequestId &request, std::function<void(request_task &)> body) {
+    const uint64_t id = next_task++;
+    auto owned = std::unique_ptr<request_task>(new request_task(*this, id, request));
+    request_task *task = owned.get();
+    tasks.emplace(id, std::move(owned));
+    try {
+        // Runs the body up to its first wait
+        task->body = std::make_unique<request_task::coroutine::pull_type>(
+            stacks, [task, body = std::move(body)](request_task::coroutine::push_type &yield) {
+                task->yield = &yield;
+                body(*task);
+            });
+    } catch (const boost::context::detail::forced_unwind &) {
+        throw;
+    } catch (...) {
+        failed(id);
+        return;
+    }
+    finished(id);
+}
+
+void task_runner::resume(uint64_t id, uint64_t wait) {
+    auto it = tasks.find(id);
+    if (it == tasks.end() || it->second->wait != wait) return;
+    request_task::coroutine::pull_type &body = *it->second->body;
+    try {
+        body();
+    } catch (const boost::context::detail::forced_unwind &) {
+        throw;
+    } catch (...) {
+        failed(id);
+        return;
+    }
+    finished(id);
+}
+
+void task_runner::failed(uint64_t id) {
+    // The stack of the task is gone, its request is answered from a copy of the id
+    const RequestId request = tasks.at(id)->answered;
+    tasks.erase(id);
+    answer_failure(conn, request);
+}
+
+void task_runner::finished(uint64_t id) {
+    auto it = tasks.find(id);
+    if (it != tasks.end() && it->second->body && !*it->second->body) tasks.erase(it);
+}
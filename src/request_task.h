@@ -0,0 +1,121 @@
+#pragma once
+
+#include "lsp.h"
+
+#include <QJsonValue>
+
+#include <boost/context/detail/exception.hpp>
+#include <boost/context/pooled_fixedsize_stack.hpp>
+#include <boost/coroutine2/coroutine.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+class Connection;
+class RequestMessage;
+class task_runner;
+
+// What the client answered to a request of the server
+struct client_response {
+    QJsonValue result;
+    bool failed = false;
+    int error_code = 0;
+    std::string error_message;
+};
+
+/**
+ * A request handler running as a coroutine on the thread of its connection. It suspends while
+ * it waits for the client or for a callback interface and is resumed from the event loop once
+ * that is done, so no thread waits with it. A suspended task holds nothing but its stack.
+ *
+ * The waits may only be called from inside the task. A task still suspended when the
+ * connection goes away is unwound: the destructors on its stack run, the code after the wait
+ * does not. So a task must not swallow exceptions with catch (...) without throwing them again.
+ */
+class request_task {
+public:
+    request_task(const request_task &) = delete;
+    request_task &operator=(const request_task &) = delete;
+
+    // Sends the request and suspends until the client answered it. A request the client does
+    // not answer in time fails with RequestCancelled, see Connection::PENDING_TIMEOUT.
+    client_response request(RequestMessage &message, const std::string &method);
+
+    // Suspends until a callback interface delivers its value. start gets the function to call
+    // with it, which may be called right away or later from any thread.
+    template <typename T>
+    T await(const std::function<void(std::function<void(T)>)> &start);
+
+private:
+    friend class task_runner;
+    using coroutine = boost::coroutines2::coroutine<void>;
+
+    request_task(task_runner &runner, uint64_t id, const RequestId &answered) :
+            runner(runner), id(id), answered(answered) {}
+
+    // Resumes the task from the event loop, once, and only for the wait it was made for
+    std::function<void()> waker();
+    void suspend();
+
+    task_runner &runner;
+    const uint64_t id;
+    // The request the task answers, with the error if the body throws
+    const RequestId answered;
+    // Counts the waits, a wake up of an older one is ignored
+    uint64_t wait = 0;
+    coroutine::push_type *yield = nullptr;
+    std::unique_ptr<coroutine::pull_type> body;
+};
+
+/**
+ * The coroutines of a connection. A task starts right away and runs until its first wait, the
+ * stacks come from a pool so starting one costs about as much as a heap allocation.
+ */
+class task_runner {
+public:
+    // Enough for the handlers, the work that needs deep stacks runs on workers
+    static constexpr size_t STACK_SIZE = size_t(256) << 10;
+
+    explicit task_runner(Connection *conn);
+    // Unwinds the suspended tasks
+    ~task_runner();
+
+    task_runner(const task_runner &) = delete;
+    task_runner &operator=(const task_runner &) = delete;
+
+    // What the body throws is answered to the request like the errors of other handlers
+    void start(const RequestId &request, std::function<void(request_task &)> body);
+
+    size_t suspended() const { return tasks.size(); }
+
+private:
+    friend class request_task;
+
+    void resume(uint64_t id, uint64_t wait);
+    // Drops the task if its body returned
+    void finished(uint64_t id);
+    // Drops the task whose body threw and answers its request with the exception being handled
+    void failed(uint64_t id);
+
+    Connection *conn;
+    boost::context::pooled_fixedsize_stack stacks;
+    std::unordered_map<uint64_t, std::unique_ptr<request_task>> tasks;
+    uint64_t next_task = 1;
+};
+
+template <typename T>
+T request_task::await(const std::function<void(std::function<void(T)>)> &start) {
+    std::optional<T> value;
+    const std::function<void()> wake = waker();
+    start([&value, wake](T delivered) {
+        value.emplace(std::move(delivered));
+        wake();
+    });
+    // Also when the value came right away, the wake up is queued already
+    suspend();
+    return std::move(*value);
+}
@@ -0,0 +1,448 @@
+#include "scad_lexer.h"
+
+#include <cstring>
+
+const char *kind_name(syntax_kind kind) {
+    switch (kind) {
+    case syntax_kind::end_of_file: return "end of file";
+    case syntax_kind::identifier: return "identifier";
+    case syntax_kind::number: return "number";
+    case syntax_kind::string: return "string";
+    case syntax_kind::include_path: return "include path";
+    case syntax_kind::kw_module: return "module";
+    case syntax_kind::kw_function: return "function";
+    case syntax_kind::kw_include: return "include";
+    case syntax_kind::kw_use: return "use";
+    case syntax_kind::kw_if: return "if";
+    case syntax_kind::kw_else: return "else";
+    case syntax_kind::kw_for: return "for";
+    case syntax_kind::kw_let: return "let";
+    case syntax_kind::kw_each: return "each";
+    case syntax_kind::kw_assert: return "assert";
+    case syntax_kind::kw_echo: return "echo";
+    case syntax_kind::kw_true: return "true";
+    case syntax_kind::kw_false: return "false";
+    case syntax_kind::kw_undef: return "undef";
+    case syntax_kind::lparen: return "(";
+    case syntax_kind::rparen: return ")";
+    case syntax_kind::lbracket: return "[";
+    case syntax_kind::rbracket: return "]";
+    case syntax_kind::lbrace: return "{";
+    case syntax_kind::rbrace: return "}";
+    case syntax_kind::semicolon: return ";";
+    case syntax_kind::comma: return ",";
+    case syntax_kind::assign: return "=";
+    case syntax_kind::colon: return ":";
+    case syntax_kind::question: return "?";
+    case syntax_kind::dot: return ".";
+    case syntax_kind::plus: return "+";
+    case syntax_kind::minus: return "-";
+    case syntax_kind::star: return "*";
+    case syntax_kind::slash: return "/";
+    case syntax_kind::percent: return "%";
+    case syntax_kind::caret: return "^";
+    case syntax_kind::bang: return "!";
+    case syntax_kind::hash: return "#";
+    case syntax_kind::less: return "<";
+    case syntax_kind::greater: return ">";
+    case syntax_kind::less_equal: return "<=";
+    case syntax_kind::greater_equal: return ">=";
+    case syntax_kind::equal: return "==";
+    case syntax_kind::not_equal: return "!=";
+    case syntax_kind::logical_and: return "&&";
+    case syntax_kind::logical_or: return "||";
+    case syntax_kind::unterminated_string: return "unterminated string";
+    case syntax_kind::unterminated_comment: return "unterminated comment";
+    case syntax_kind::unknown_character: return "unknown character";
+    case syntax_kind::file: return "file";
+    case syntax_kind::list_chunk: return "list chunk";
+    case syntax_kind::include_statement: return "include statement";
+    case syntax_kind::use_statement: return "use statement";
+    case syntax_kind::block: return "block";
+    case syntax_kind::assignment: return "assignment";
+    case syntax_kind::module_definition: return "module definition";
+    case syntax_kind::function_definition: return "function definition";
+    case syntax_kind::module_instantiation: return "module instantiation";
+    case syntax_kind::if_statement: return "if statement";
+    case syntax_kind::parameter_list: return "parameter list";
+    case syntax_kind::parameter: return "parameter";
+    case syntax_kind::argument_list: return "argument list";
+    case syntax_kind::named_argument: return "named argument";
+    case syntax_kind::ternary_expression: return "ternary expression";
+    case syntax_kind::binary_expression: return "binary expression";
+    case syntax_kind::unary_expression: return "unary expression";
+    case syntax_kind::call_expression: return "call";
+    case syntax_kind::index_expression: return "index expression";
+    case syntax_kind::member_expression: return "member access";
+    case syntax_kind::paren_expression: return "parenthesized expression";
+    case syntax_kind::vector_expression: return "vector";
+    case syntax_kind::range_expression: return "range";
+    case syntax_kind::let_expression: return "let expression";
+    case syntax_kind::assert_expression: return "assert expression";
+    case syntax_kind::echo_expression: return "echo expression";
+    case syntax_kind::function_literal: return "function literal";
+    case syntax_kind::comprehension_for: return "for comprehension";
+    case syntax_kind::comprehension_if: return "if comprehension";
+    case syntax_kind::comprehension_each: return "each comprehension";
+    case syntax_kind::error: return "error";
+    }
+    return "<invalid>";
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_identifier_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$';
+}
+
+static inline bool is_identifier_char(char c) {
+    return is_identifier_start(c) || is_digit(c);
+}
+
+static inline uint32_t skip_spaces(const char *data, uint32_t pos, uint32_t size) {
+    while (pos < size && is_space(data[pos])) pos++;
+    return pos;
+}
+
+static inline uint32_t scan_digits(const char *data, uint32_t pos, uint32_t size) {
+    while (pos < size && is_digit(data[pos])) pos++;
+    return pos;
+}
+
+static inline uint32_t scan_identifier(const char *data, uint32_t pos, uint32_t size) {
+    while (pos < size && is_identifier_char(data[pos])) pos++;
+    return pos;
+}
+
+/**
+ * Skips trivia starting at pos. If a block comment is not terminated,
+ * unterminated is set to the offset of the comment start and the end of the text is returned.
+ */
+static uint32_t skip_trivia_checked(std::string_view text, uint32_t pos, uint32_t *unterminated) {
+    const char *data = text.data();
+    const uint32_t size = text.size();
+    while (pos < size) {
+        char c = data[pos];
+        if (is_space(c)) {
+            pos = skip_spaces(data, pos + 1, size);
+        } else if (c == '/' && pos + 1 < size && data[pos + 1] == '/') {
+            const void *eol = memchr(data + pos, '\n', size - pos);
+            pos = eol ? static_cast<const char *>(eol) - data + 1 : size;
+        } else if (c == '/' && pos + 1 < size && data[pos + 1] == '*') {
+            size_t close = text.find("*/", pos + 2);
+            if (close == std::string_view::npos) {
+                if (unterminated) *unterminated = pos;
+                return size;
+            }
+            pos = close + 2;
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+uint32_t skip_trivia(std::string_view text, uint32_t pos) {
+    return skip_trivia_checked(text, pos, nullptr);
+}
+
+static syntax_kind keyword_kind(std::string_view word) {
+    switch (word.size()) {
+    case 2:
+        if (word == "if") return syntax_kind::kw_if;
+        break;
+    case 3:
+        if (word == "use") return syntax_kind::kw_use;
+        if (word == "for") return syntax_kind::kw_for;
+        if (word == "let") return syntax_kind::kw_let;
+        break;
+    case 4:
+        if (word == "else") return syntax_kind::kw_else;
+        if (word == "each") return syntax_kind::kw_each;
+        if (word == "echo") return syntax_kind::kw_echo;
+        if (word == "true") return syntax_kind::kw_true;
+        break;
+    case 5:
+        if (word == "false") return syntax_kind::kw_false;
+        if (word == "undef") return syntax_kind::kw_undef;
+        break;
+    case 6:
+        if (word == "module") return syntax_kind::kw_module;
+        if (word == "assert") return syntax_kind::kw_assert;
+        break;
+    case 7:
+        if (word == "include") return syntax_kind::kw_include;
+        break;
+    case 8:
+        if (word == "function") return syntax_kind::kw_function;
+        break;
+    }
+    return syntax_kind::identifier;
+}
+
+static uint32_t lex_number(const char *data, uint32_t pos, uint32_t size) {
+    pos = scan_digits(data, pos, size);
+    if (pos < size && data[pos] == '.') {
+        pos = scan_digits(data, pos + 1, size);
+    }
+    if (pos < size && (data[pos] == 'e' || data[pos] == 'E')) {
+        uint32_t exp = pos + 1;
+        if (exp < size && (data[exp] == '+' || data[exp] == '-')) exp++;
+        if (exp < size && is_digit(data[exp])) {
+            pos = scan_digits(data, exp, size);
+        }
+    }
+    return pos;
+}
+
+/**
+ * Lex the token whose text starts at start (there is no trivia at start and start < size).
+ * Returns the end of the token.
+ */
+static uint32_t lex_significant(std::string_view text, uint32_t start, syntax_kind previous, syntax_kind &kind) {
+    const char *data = text.data();
+    const uint32_t size = text.size();
+    uint32_t end = start + 1;
+    char c = data[start];
+    char next = start + 1 < size ? data[start + 1] : '\0';
+
+    if (is_identifier_start(c)) {
+        end = scan_identifier(data, end, size);
+        kind = keyword_kind(text.substr(start, end - start));
+    } else if (is_digit(c) || (c == '.' && is_digit(next))) {
+        end = lex_number(data, start, size);
+        kind = syntax_kind::number;
+    } else if (c == '"') {
+        kind = syntax_kind::unterminated_string;
+        while (end < size) {
+            if (data[end] == '\\' && end + 1 < size) {
+                end += 2;
+            } else if (data[end] == '"') {
+                end++;
+                kind = syntax_kind::string;
+                break;
+            } else {
+                end++;
+            }
+        }
+    } else if (c == '<' && (previous == syntax_kind::kw_include || previous == syntax_kind::kw_use)) {
+        // The path ends at the closing '>', an unclosed path ends at the line break
+        while (end < size && data[end] != '>' && data[end] != '\n') end++;
+        if (end < size && data[end] == '>') {
+            end++;
+            kind = syntax_kind::include_path;
+        } else {
+            kind = syntax_kind::unterminated_string;
+        }
+    } else {
+        switch (c) {
+        case '(': kind = syntax_kind::lparen; break;
+        case ')': kind = syntax_kind::rparen; break;
+        case '[': kind = syntax_kind::lbracket; break;
+        case ']': kind = syntax_kind::rbracket; break;
+        case '{': kind = syntax_kind::lbrace; break;
+        case '}': kind = syntax_kind::rbrace; break;
+        case ';': kind = syntax_kind::semicolon; break;
+        case ',': kind = syntax_kind::comma; break;
+        case ':': kind = syntax_kind::colon; break;
+        case '?': kind = syntax_kind::question; break;
+        case '.': kind = syntax_kind::dot; break;
+        case '+': kind = syntax_kind::plus; break;
+        case '-': kind = syntax_kind::minus; break;
+        case '*': kind = syntax_kind::star; break;
+        case '/': kind = syntax_kind::slash; break;
+        case '%': kind = syntax_kind::percent; break;
+        case '^': kind = syntax_kind::caret; break;
+        case '#': kind = syntax_kind::hash; break;
+        case '=':
+            if (next == '=') { kind = syntax_kind::equal; end++; }
+            else kind = syntax_kind::assign;
+            break;
+        case '!':
+            if (next == '=') { kind = syntax_kind::not_equal; end++; }
+            else kind = syntax_kind::bang;
+            break;
+        case '<':
+            if (next == '=') { kind = syntax_kind::less_equal; end++; }
+            else kind = syntax_kind::less;
+            break;
+        case '>':
+            if (next == '=') { kind = syntax_kind::greater_equal; end++; }
+            else kind = syntax_kind::greater;
+            break;
+        case '&':
+            if (next == '&') { kind = syntax_kind::logical_and; end++; }
+            else kind = syntax_kind::unknown_character;
+            break;
+        case '|':
+            if (next == '|') { kind = syntax_kind::logical_or; end++; }
+            else kind = syntax_kind::unknown_character;
+            break;
+        default:
+            // Consume a whole UTF-8 sequence so the error covers one character
+            while (end < size && (static_cast<unsigned char>(data[end]) & 0xC0) == 0x80) end++;
+            kind = syntax_kind::unknown_character;
+            break;
+        }
+    }
+    return end;
+}
+
+scad_token lex_token(std::string_view text, uint32_t pos, syntax_kind previous) {
+    const uint32_t size = text.size();
+    scad_token tok;
+    tok.offset = pos;
+
+    uint32_t unterminated = size;
+    uint32_t start = skip_trivia_checked(text, pos, &unterminated);
+    if (unterminated != size) {
+        tok.kind = syntax_kind::unterminated_comment;
+        tok.trivia = unterminated - pos;
+        tok.length = size - unterminated;
+        return tok;
+    }
+    tok.trivia = start - pos;
+    if (start >= size) {
+        tok.kind = syntax_kind::end_of_file;
+        return tok;
+    }
+
+    tok.length = lex_significant(text, start, previous, tok.kind) - start;
+    return tok;
+}
+
+namespace {
+
+enum char_class : uint8_t {
+    CLASS_OTHER,        // Handled by lex_significant (comments, strings, dots, two character operators, ...)
+    CLASS_SPACE,
+    CLASS_IDENTIFIER,
+    CLASS_DIGIT,
+    CLASS_PUNCTUATION,  // Always a single character token
+};
+
+// Indexed by the first byte of a token, lets tokenize_scad dispatch the common cases with one load
+struct char_table {
+    char_class classes[256] = {};
+    syntax_kind punctuation[256] = {};
+
+    constexpr char_table() {
+        for (int c = 0; c < 256; c++) {
+            if (c == ' ' || (c >= '\t' && c <= '\r')) classes[c] = CLASS_SPACE;
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$') classes[c] = CLASS_IDENTIFIER;
+            if (c >= '0' && c <= '9') classes[c] = CLASS_DIGIT;
+        }
+        const char single[] = "()[]{};,:?+-*%^#";
+        const syntax_kind kinds[] = {
+            syntax_kind::lparen, syntax_kind::rparen, syntax_kind::lbracket, syntax_kind::rbracket,
+            syntax_kind::lbrace, syntax_kind::rbrace, syntax_kind::semicolon, syntax_kind::comma,
+            syntax_kind::colon, syntax_kind::question, syntax_kind::plus, syntax_kind::minus,
+            syntax_kind::star, syntax_kind::percent, syntax_kind::caret, syntax_kind::hash,
+        };
+        for (int i = 0; single[i]; i++) {
+            unsigned char c = single[i];
+            classes[c] = CLASS_PUNCTUATION;
+            punctuation[c] = kinds[i];
+        }
+    }
+};
+constexpr char_table chars;
+
+} // namespace
+
+/**
+ * Fast path for lists of numbers like "1.5, -2, 3e2]": after a number, further numbers that
+ * are separated by a comma and whitespace only are emitted directly without going through
+ * the trivia and token dispatch. Returns the position behind the last emitted token.
+ */
+static uint32_t lex_number_run(const char *data, uint32_t pos, uint32_t size, token_stream &out) {
+    while (pos < size && data[pos] == ',') {
+        uint32_t next = skip_spaces(data, pos + 1, size);
+        bool negative = next < size && data[next] == '-';
+        uint32_t digits = next + negative;
+        if (digits >= size || !is_digit(data[digits])) break;
+
+        out.push(syntax_kind::comma, pos, 1);
+        if (negative) {
+            out.push(syntax_kind::minus, next, 1);
+        }
+        uint32_t end = lex_number(data, digits, size);
+        out.push(syntax_kind::number, digits, end - digits);
+        pos = end;
+        if (pos < size && data[pos] == ' ') pos++;
+    }
+    return pos;
+}
+
+token_stream tokenize_scad(std::string_view text) {
+    token_stream out;
+    tokenize_scad(text, out);
+    return out;
+}
+
+void tokenize_scad(std::string_view text, token_stream &out) {
+    const char *data = text.data();
+    const uint32_t size = text.size();
+
+    out.clear();
+    // Generated files average about five bytes per token
+    out.kinds.reserve(size / 4 + 1);
+    out.offsets.reserve(size / 4 + 1);
+    out.lengths.reserve(size / 4 + 1);
+
+    uint32_t pos = 0;
+    syntax_kind previous = syntax_kind::end_of_file;
+    while (pos < size) {
+        const unsigned char c = data[pos];
+        syntax_kind kind;
+        uint32_t end;
+        switch (chars.classes[c]) {
+        case CLASS_SPACE:
+            pos = skip_spaces(data, pos + 1, size);
+            continue;
+        case CLASS_PUNCTUATION:
+            kind = chars.punctuation[c];
+            end = pos + 1;
+            break;
+        case CLASS_IDENTIFIER:
+            end = scan_identifier(data, pos + 1, size);
+            kind = keyword_kind(text.substr(pos, end - pos));
+            break;
+        case CLASS_DIGIT:
+            end = lex_number(data, pos, size);
+            out.push(syntax_kind::number, pos, end - pos);
+            previous = syntax_kind::number;
+            pos = lex_number_run(data, end, size, out);
+            if (pos != end) {
+                previous = out.kinds.back();
+            }
+            continue;
+        default: {
+            uint32_t unterminated = size;
+            uint32_t start = skip_trivia_checked(text, pos, &unterminated);
+            if (unterminated != size) {
+                out.push(syntax_kind::unterminated_comment, unterminated, size - unterminated);
+                pos = size;
+                continue;
+            }
+            if (start != pos) {
+                // A comment
+                pos = start;
+                continue;
+            }
+            end = lex_significant(text, pos, previous, kind);
+            break;
+        }
+        }
+        out.push(kind, pos, end - pos);
+        previous = kind;
+        pos = end;
+    }
+    out.push(syntax_kind::end_of_file, size, 0);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/**
+ * All kinds of elements in an OpenSCAD syntax tree. Tokens and nodes share one enum so a
+ * syntax_element can store either one with a single byte.
+ */
+enum class syntax_kind : uint8_t {
+    // Tokens
+    end_of_file,
+    identifier,
+    number,
+    string,
+    include_path,       // <path/to/file.scad> after include or use
+
+    kw_module,
+    kw_function,
+    kw_include,
+    kw_use,
+    kw_if,
+    kw_else,
+    kw_for,
+    kw_let,
+    kw_each,
+    kw_assert,
+    kw_echo,
+    kw_true,
+    kw_false,
+    kw_undef,
+
+    lparen,
+    rparen,
+    lbracket,
+    rbracket,
+    lbrace,
+    rbrace,
+    semicolon,
+    comma,
+    assign,
+    colon,
+    question,
+    dot,
+    plus,
+    minus,
+    star,
+    slash,
+    percent,
+    caret,
+    bang,
+    hash,
+    less,
+    greater,
+    less_equal,
+    greater_equal,
+    equal,
+    not_equal,
+    logical_and,
+    logical_or,
+
+    unterminated_string,
+    unterminated_comment,
+    unknown_character,
+
+    // Nodes
+    FIRST_NODE,
+    file = FIRST_NODE,
+    list_chunk,         // Groups long lists into a balanced tree, see scad_parser.cc
+
+    // Statements
+    include_statement,
+    use_statement,
+    block,
+    assignment,
+    module_definition,
+    function_definition,
+    module_instantiation,
+    if_statement,
+
+    parameter_list,
+    parameter,
+    argument_list,
+    named_argument,
+
+    // Expressions
+    ternary_expression,
+    binary_expression,  // Flat chain of operands and operators of equal precedence
+    unary_expression,
+    call_expression,
+    index_expression,
+    member_expression,
+    paren_expression,
+    vector_expression,
+    range_expression,
+    let_expression,
+    assert_expression,
+    echo_expression,
+    function_literal,
+    comprehension_for,
+    comprehension_if,
+    comprehension_each,
+
+    error,
+};
+
+inline bool is_token(syntax_kind kind) { return kind < syntax_kind::FIRST_NODE; }
+inline bool is_node(syntax_kind kind) { return kind >= syntax_kind::FIRST_NODE; }
+
+const char *kind_name(syntax_kind kind);
+
+/**
+ * A single lexed token. offset points at the start of its leading trivia (whitespace and
+ * comments), the token text itself starts at offset + trivia.
+ */
+struct scad_token {
+    syntax_kind kind = syntax_kind::end_of_file;
+    uint32_t offset = 0;
+    uint32_t trivia = 0;
+    uint32_t length = 0;
+
+    uint32_t text_offset() const { return offset + trivia; }
+    uint32_t end() const { return offset + trivia + length; }
+    uint32_t width() const { return trivia + length; }
+};
+
+// Skips whitespace and comments, returns the offset of the first significant character
+uint32_t skip_trivia(std::string_view text, uint32_t pos);
+
+/**
+ * Lex the token starting at pos (including its leading trivia).
+ * The previous significant token is needed to recognize the <path> after include and use.
+ */
+scad_token lex_token(std::string_view text, uint32_t pos, syntax_kind previous);
+
+/**
+ * All tokens of a text as parallel arrays. offsets and lengths describe the token text, the
+ * trivia of a token is the gap to the end of the previous token. The last token is always
+ * end_of_file, its trivia is the trailing whitespace of the text.
+ */
+struct token_stream {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<syntax_kind> kinds;
+
+    size_t size() const { return kinds.size(); }
+
+    void clear() {
+        offsets.clear();
+        lengths.clear();
+        kinds.clear();
+    }
+
+    void push(syntax_kind kind, uint32_t offset, uint32_t length) {
+        kinds.push_back(kind);
+        offsets.push_back(offset);
+        lengths.push_back(length);
+    }
+
+    scad_token token(size_t i) const {
+        scad_token tok;
+        tok.kind = kinds[i];
+        tok.offset = i ? offsets[i - 1] + lengths[i - 1] : 0;
+        tok.trivia = offsets[i] - tok.offset;
+        tok.length = lengths[i];
+        return tok;
+    }
+};
+
+/**
+ * Lex a whole text at once, producing the same tokens as repeated lex_token calls.
+ * The first byte of a token picks its class from a table, lists of numbers (as in polyhedron
+ * points) take a fast path.
+ */
+token_stream tokenize_scad(std::string_view text);
+
+// Same as above, but reuses the memory of out (which is cleared first)
+void tokenize_scad(std::string_view text, token_stream &out);
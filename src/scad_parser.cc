@@ -0,0 +1,799 @@
+#include "scad_parser.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <vector>
+
+text_edit_span text_edit_span::then(const text_edit_span &next) const {
+    // Damaged range in the text between both edits
+    uint32_t start = std::min(offset, next.offset);
+    uint32_t end = std::max(offset + new_length, next.offset + next.old_length);
+
+    text_edit_span combined;
+    combined.offset = start;
+    combined.old_length = end - new_length + old_length - start;
+    combined.new_length = end + next.new_length - next.old_length - start;
+    return combined;
+}
+
+namespace {
+
+/**
+ * Lists (statements, vector elements, arguments, parameters) longer than CHUNK_SIZE items are
+ * split into a balanced tree of list_chunk nodes. Machine generated files contain vectors with
+ * millions of elements; chunking keeps the nodes small so an edit inside such a vector only
+ * rebuilds the chunks on the path to the edit and reuses all others.
+ */
+constexpr size_t CHUNK_SIZE = 32;
+
+constexpr uint32_t NO_OFFSET = ~uint32_t(0);
+
+// Start of the last token of the element (ignoring zero width elements)
+uint32_t last_token_start(const syntax_element &element, uint32_t offset) {
+    const syntax_element *e = &element;
+    while (e->is_node()) {
+        const syntax_node *node = e->node();
+        uint32_t child_offset = offset + node->width;
+        const syntax_element *last = nullptr;
+        for (size_t i = node->size; i-- > 0;) {
+            child_offset -= (*node)[i].width;
+            if ((*node)[i].width) {
+                last = &(*node)[i];
+                break;
+            }
+        }
+        if (!last) return NO_OFFSET;
+        e = last;
+        offset = child_offset;
+    }
+    return offset;
+}
+
+// Start of the last token that ends strictly before pos
+uint32_t last_token_before(const syntax_element &element, uint32_t offset, uint32_t pos) {
+    if (element.width == 0 || offset >= pos) return NO_OFFSET;
+    if (offset + element.width < pos) return last_token_start(element, offset);
+    if (!element.is_node()) return NO_OFFSET;
+
+    const syntax_node *node = element.node();
+    uint32_t child_offset = offset + node->width;
+    for (size_t i = node->size; i-- > 0;) {
+        child_offset -= (*node)[i].width;
+        uint32_t found = last_token_before((*node)[i], child_offset, pos);
+        if (found != NO_OFFSET) return found;
+    }
+    return NO_OFFSET;
+}
+
+syntax_kind last_token_kind(const syntax_element &element) {
+    const syntax_element *e = &element;
+    while (e->is_node()) {
+        const syntax_node *node = e->node();
+        const syntax_element *last = nullptr;
+        for (size_t i = node->size; i-- > 0;) {
+            if ((*node)[i].width) {
+                last = &(*node)[i];
+                break;
+            }
+        }
+        if (!last) return syntax_kind::error;
+        e = last;
+    }
+    return e->kind();
+}
+
+syntax_error token_error(syntax_kind kind) {
+    switch (kind) {
+    case syntax_kind::unterminated_string: return syntax_error::unterminated_string;
+    case syntax_kind::unterminated_comment: return syntax_error::unterminated_comment;
+    case syntax_kind::unknown_character: return syntax_error::unknown_character;
+    default: return syntax_error::unexpected_token;
+    }
+}
+
+bool starts_instantiation(syntax_kind kind) {
+    switch (kind) {
+    case syntax_kind::identifier:
+    case syntax_kind::kw_for:
+    case syntax_kind::kw_let:
+    case syntax_kind::kw_assert:
+    case syntax_kind::kw_echo:
+    case syntax_kind::bang:
+    case syntax_kind::hash:
+    case syntax_kind::percent:
+    case syntax_kind::star:
+        return true;
+    default:
+        return false;
+    }
+}
+
+class scad_parser {
+public:
+    scad_parser(std::string_view text, const token_stream *tokens, const syntax_tree *old, const text_edit_span *edit) :
+        text(text), tokens(tokens)
+    {
+        if (old && old->root && edit) {
+            this->old_root = old->root;
+            this->edit = *edit;
+            // A node in front of the edit can only be reused if the token following it is
+            // unchanged as well - that token decided where the node ended.
+            uint32_t before = last_token_before(syntax_element(old->root), 0, edit->offset);
+            this->reuse_before = before == NO_OFFSET ? 0 : before;
+        }
+        current = tokens ? tokens->token(next_token++) : lex_token(text, 0, syntax_kind::end_of_file);
+    }
+
+    syntax_tree parse(int version) {
+        parse_statement_list(syntax_kind::file, syntax_kind::end_of_file);
+        chunk(0, false);
+        // The end of file token carries the trailing trivia
+        while (!at(syntax_kind::end_of_file)) {
+            stack.push_back(error_token(token_error(current.kind)));
+        }
+        stack.push_back(bump());
+
+        syntax_tree tree;
+        tree.version = version;
+        tree.root = finish(syntax_kind::file, 0).node_ptr();
+        tree.reused_bytes = reused_bytes;
+        assert(tree.root->width == text.size());
+        return tree;
+    }
+
+private:
+    std::string_view text;
+
+    // A full parse reads the pre-lexed tokens, an incremental parse lexes lazily
+    // since it skips over most of the text
+    const token_stream *tokens = nullptr;
+    size_t next_token = 0;
+
+    scad_token current;
+    scad_token lookahead;
+    bool has_lookahead = false;
+
+    syntax_node_ptr old_root;
+    text_edit_span edit;
+    uint32_t reuse_before = 0;
+    uint32_t reused_bytes = 0;
+
+    // Children of all nodes under construction, each parse function pushes its children and
+    // turns them into a node with finish(). This avoids one vector per node.
+    std::vector<syntax_element> stack;
+
+    ///////////////////////////////////////////////////////
+    // Token handling
+    ///////////////////////////////////////////////////////
+    bool at(syntax_kind kind) const { return current.kind == kind; }
+
+    scad_token lex_next() {
+        return tokens ? tokens->token(next_token++) : lex_token(text, current.end(), current.kind);
+    }
+
+    const scad_token &peek_next() {
+        if (!has_lookahead) {
+            lookahead = lex_next();
+            has_lookahead = true;
+        }
+        return lookahead;
+    }
+
+    syntax_element bump() {
+        syntax_element element(current);
+        if (current.kind != syntax_kind::end_of_file) {
+            if (has_lookahead) {
+                current = lookahead;
+                has_lookahead = false;
+            } else {
+                current = lex_next();
+            }
+        }
+        return element;
+    }
+
+    void jump_to(uint32_t pos) {
+        assert(!tokens);
+        has_lookahead = false;
+        current = lex_token(text, pos, syntax_kind::end_of_file);
+    }
+
+    static syntax_element missing(syntax_error error) {
+        return syntax_element(syntax_node::make(syntax_kind::error, nullptr, 0, error));
+    }
+
+    syntax_element error_token(syntax_error error) {
+        syntax_element token = bump();
+        return syntax_element(syntax_node::make(syntax_kind::error, &token, 1, error));
+    }
+
+    void expect(syntax_kind kind, syntax_error error) {
+        if (at(kind)) {
+            stack.push_back(bump());
+        } else {
+            stack.push_back(missing(error));
+        }
+    }
+
+    // Turn the elements pushed since start into a node
+    syntax_element finish(syntax_kind kind, size_t start) {
+        syntax_node_ptr node = syntax_node::make_from(kind, stack.data() + start, stack.size() - start);
+        stack.resize(start);
+        return syntax_element(std::move(node));
+    }
+
+    ///////////////////////////////////////////////////////
+    // Incremental reuse
+    ///////////////////////////////////////////////////////
+
+    /**
+     * Find a node of the previous tree that starts at the current position, was a direct element
+     * of a list with the same owner and is not affected by the edit.
+     * The owner is the list node kind (file, block, vector_expression, ...), the argument list
+     * of a for comprehension is owned by comprehension_for since it also accepts ';' separators.
+     */
+    syntax_node_ptr find_reusable(syntax_kind list_owner) {
+        if (!old_root) return nullptr;
+
+        // Map the position back into the old text, nodes in front of the edit have to end before
+        // reuse_before, nodes behind the edit are shifted by the size difference
+        uint32_t pos = current.offset;
+        uint32_t old_pos;
+        bool in_front = pos < edit.offset;
+        if (in_front) {
+            old_pos = pos;
+        } else if (pos >= edit.offset + edit.new_length) {
+            old_pos = pos - edit.new_length + edit.old_length;
+        } else {
+            return nullptr;
+        }
+
+        const syntax_node *node = old_root.get();
+        uint32_t node_offset = 0;
+        syntax_kind owner = syntax_kind::file;
+        while (true) {
+            const syntax_element *found = nullptr;
+            uint32_t child_offset = node_offset;
+            for (const syntax_element &child : *node) {
+                if (child_offset > old_pos) break;
+                if (child.is_node() && old_pos < child_offset + child.width) {
+                    found = &child;
+                    break;
+                }
+                child_offset += child.width;
+            }
+            if (!found) return nullptr;
+
+            // Error nodes are not reused, they are paired with recovery markers of zero width
+            if (found->kind() == syntax_kind::error) return nullptr;
+
+            if (child_offset == old_pos && owner == list_owner) {
+                if (!in_front || child_offset + found->width <= reuse_before) {
+                    return found->node_ptr();
+                }
+            }
+
+            switch (found->kind()) {
+            case syntax_kind::list_chunk:
+                break;
+            case syntax_kind::argument_list:
+                owner = node->kind == syntax_kind::comprehension_for ? syntax_kind::comprehension_for
+                                                                      : syntax_kind::argument_list;
+                break;
+            case syntax_kind::file:
+            case syntax_kind::block:
+            case syntax_kind::parameter_list:
+            case syntax_kind::vector_expression:
+                owner = found->kind();
+                break;
+            default:
+                // The children of other nodes are no list elements, the body of a for
+                // comprehension must not pass for an element of its argument list
+                owner = syntax_kind::error;
+                break;
+            }
+            node = found->node();
+            node_offset = child_offset;
+        }
+    }
+
+    bool try_reuse(syntax_kind list_owner, syntax_kind *last_kind = nullptr) {
+        syntax_node_ptr node = find_reusable(list_owner);
+        if (!node) return false;
+
+        uint32_t end = current.offset + node->width;
+        reused_bytes += node->width;
+        stack.emplace_back(std::move(node));
+        if (last_kind) {
+            *last_kind = last_token_kind(stack.back());
+        }
+        jump_to(end);
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////
+    // Lists
+    ///////////////////////////////////////////////////////
+    // Group the list elements on the stack behind start into list_chunk nodes
+    void chunk(size_t start, bool separated) {
+        std::vector<syntax_element> level;
+        while (stack.size() - start > CHUNK_SIZE) {
+            const size_t count = stack.size() - start;
+            level.clear();
+            size_t group = start;
+            for (size_t i = start; i < stack.size(); i++) {
+                // Separated lists are only split behind a separator, so every chunk but the
+                // last one of a list ends with a ','. A zero width recovery marker stays in the
+                // chunk of the error that follows it.
+                syntax_kind kind = stack[i].kind();
+                bool boundary = stack[i].width > 0 &&
+                    (!separated || kind == syntax_kind::comma || kind == syntax_kind::list_chunk);
+                if (i + 1 - group >= CHUNK_SIZE && boundary && i + 1 < stack.size()) {
+                    level.emplace_back(syntax_node::make_from(syntax_kind::list_chunk, &stack[group], i + 1 - group));
+                    group = i + 1;
+                }
+            }
+            if (stack.size() - group == 1 && stack[group].kind() == syntax_kind::list_chunk) {
+                level.push_back(std::move(stack[group]));
+            } else if (group < stack.size()) {
+                level.emplace_back(syntax_node::make_from(syntax_kind::list_chunk, &stack[group], stack.size() - group));
+            }
+            stack.resize(start);
+            std::move(level.begin(), level.end(), std::back_inserter(stack));
+            if (level.size() >= count) break;
+        }
+    }
+
+    /**
+     * Parse the elements of a separated list up to close. Elements already pushed behind
+     * items_start (the first element of a vector, or a reused chunk of them) become part of the
+     * list.
+     */
+    template <typename ElementParser>
+    void parse_separated_list(size_t items_start, syntax_kind list_owner, syntax_kind close,
+                              bool allow_semicolon, ElementParser parse_element) {
+        bool expect_element = stack.size() == items_start || last_token_kind(stack.back()) == syntax_kind::comma;
+        while (!at(close) && !at(syntax_kind::end_of_file)) {
+            bool separator = at(syntax_kind::comma) || (allow_semicolon && at(syntax_kind::semicolon));
+            if (expect_element) {
+                syntax_kind last = syntax_kind::error;
+                if (try_reuse(list_owner, &last)) {
+                    expect_element = last == syntax_kind::comma;
+                    continue;
+                }
+                if (separator) {
+                    stack.push_back(missing(syntax_error::expected_expression));
+                } else {
+                    stack.push_back(parse_element());
+                }
+                expect_element = false;
+            } else if (separator) {
+                stack.push_back(bump());
+                expect_element = true;
+            } else {
+                stack.push_back(error_token(token_error(current.kind)));
+            }
+        }
+        chunk(items_start, true);
+    }
+
+    ///////////////////////////////////////////////////////
+    // Statements
+    ///////////////////////////////////////////////////////
+    void parse_statement_list(syntax_kind list_owner, syntax_kind close) {
+        while (!at(close) && !at(syntax_kind::end_of_file)) {
+            if (try_reuse(list_owner)) continue;
+
+            uint32_t before = current.offset;
+            stack.push_back(parse_statement());
+            if (current.offset == before) {
+                // Nothing could be parsed, skip the offending token
+                stack.push_back(error_token(token_error(current.kind)));
+            }
+        }
+    }
+
+    syntax_element parse_statement() {
+        switch (current.kind) {
+        case syntax_kind::semicolon:
+            return bump();
+        case syntax_kind::lbrace:
+            return parse_block();
+        case syntax_kind::kw_include:
+        case syntax_kind::kw_use:
+            return parse_include();
+        case syntax_kind::kw_module:
+            return parse_module_definition();
+        case syntax_kind::kw_function:
+            return parse_function_definition();
+        case syntax_kind::kw_if:
+            return parse_if_statement();
+        case syntax_kind::identifier:
+            if (peek_next().kind == syntax_kind::assign) {
+                return parse_assignment();
+            }
+            return parse_module_instantiation();
+        default:
+            if (starts_instantiation(current.kind)) {
+                return parse_module_instantiation();
+            }
+            return missing(syntax_error::expected_statement);
+        }
+    }
+
+    // The statement following a module instantiation, if or module definition
+    syntax_element parse_child_statement() {
+        switch (current.kind) {
+        case syntax_kind::semicolon:
+            return bump();
+        case syntax_kind::lbrace:
+            return parse_block();
+        case syntax_kind::kw_if:
+            return parse_if_statement();
+        default:
+            if (starts_instantiation(current.kind)) {
+                return parse_module_instantiation();
+            }
+            return missing(syntax_error::expected_statement);
+        }
+    }
+
+    syntax_element parse_block() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // {
+
+        size_t items = stack.size();
+        parse_statement_list(syntax_kind::block, syntax_kind::rbrace);
+        chunk(items, false);
+
+        expect(syntax_kind::rbrace, syntax_error::expected_rbrace);
+        return finish(syntax_kind::block, start);
+    }
+
+    syntax_element parse_include() {
+        syntax_kind kind = at(syntax_kind::kw_include) ? syntax_kind::include_statement : syntax_kind::use_statement;
+        size_t start = stack.size();
+        stack.push_back(bump());
+        if (at(syntax_kind::include_path)) {
+            stack.push_back(bump());
+        } else if (at(syntax_kind::unterminated_string)) {
+            stack.push_back(error_token(syntax_error::expected_include_path));
+        } else {
+            stack.push_back(missing(syntax_error::expected_include_path));
+        }
+        return finish(kind, start);
+    }
+
+    syntax_element parse_module_definition() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // module
+        expect(syntax_kind::identifier, syntax_error::expected_identifier);
+        stack.push_back(parse_parameter_list());
+        stack.push_back(parse_child_statement());
+        return finish(syntax_kind::module_definition, start);
+    }
+
+    syntax_element parse_function_definition() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // function
+        expect(syntax_kind::identifier, syntax_error::expected_identifier);
+        stack.push_back(parse_parameter_list());
+        expect(syntax_kind::assign, syntax_error::expected_assign);
+        stack.push_back(parse_expression());
+        expect(syntax_kind::semicolon, syntax_error::expected_semicolon);
+        return finish(syntax_kind::function_definition, start);
+    }
+
+    syntax_element parse_if_statement() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // if
+        expect(syntax_kind::lparen, syntax_error::expected_lparen);
+        stack.push_back(parse_expression());
+        expect(syntax_kind::rparen, syntax_error::expected_rparen);
+        stack.push_back(parse_child_statement());
+        if (at(syntax_kind::kw_else)) {
+            stack.push_back(bump());
+            stack.push_back(parse_child_statement());
+        }
+        return finish(syntax_kind::if_statement, start);
+    }
+
+    syntax_element parse_assignment() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // identifier
+        stack.push_back(bump()); // =
+        stack.push_back(parse_expression());
+        expect(syntax_kind::semicolon, syntax_error::expected_semicolon);
+        return finish(syntax_kind::assignment, start);
+    }
+
+    syntax_element parse_module_instantiation() {
+        size_t start = stack.size();
+        // Modifiers ! # % *
+        while (at(syntax_kind::bang) || at(syntax_kind::hash) || at(syntax_kind::percent) || at(syntax_kind::star)) {
+            stack.push_back(bump());
+        }
+        if (at(syntax_kind::identifier) || at(syntax_kind::kw_for) || at(syntax_kind::kw_let) ||
+                at(syntax_kind::kw_assert) || at(syntax_kind::kw_echo)) {
+            stack.push_back(bump());
+        } else {
+            stack.push_back(missing(syntax_error::expected_identifier));
+        }
+        stack.push_back(parse_argument_list(false));
+        stack.push_back(parse_child_statement());
+        return finish(syntax_kind::module_instantiation, start);
+    }
+
+    syntax_element parse_parameter_list() {
+        size_t start = stack.size();
+        if (!at(syntax_kind::lparen)) {
+            stack.push_back(missing(syntax_error::expected_lparen));
+            return finish(syntax_kind::parameter_list, start);
+        }
+        stack.push_back(bump());
+        parse_separated_list(stack.size(), syntax_kind::parameter_list, syntax_kind::rparen, false, [this]() {
+            size_t start = stack.size();
+            if (!at(syntax_kind::identifier)) {
+                return missing(syntax_error::expected_identifier);
+            }
+            stack.push_back(bump());
+            if (at(syntax_kind::assign)) {
+                stack.push_back(bump());
+                stack.push_back(parse_expression());
+            }
+            return syntax_element(finish(syntax_kind::parameter, start));
+        });
+        expect(syntax_kind::rparen, syntax_error::expected_rparen);
+        return finish(syntax_kind::parameter_list, start);
+    }
+
+    syntax_element parse_argument_list(bool allow_semicolon) {
+        size_t start = stack.size();
+        if (!at(syntax_kind::lparen)) {
+            stack.push_back(missing(syntax_error::expected_lparen));
+            return finish(syntax_kind::argument_list, start);
+        }
+        stack.push_back(bump());
+        syntax_kind list_owner = allow_semicolon ? syntax_kind::comprehension_for : syntax_kind::argument_list;
+        parse_separated_list(stack.size(), list_owner, syntax_kind::rparen, allow_semicolon, [this]() {
+            if (at(syntax_kind::identifier) && peek_next().kind == syntax_kind::assign) {
+                size_t start = stack.size();
+                stack.push_back(bump());
+                stack.push_back(bump());
+                stack.push_back(parse_expression());
+                return syntax_element(finish(syntax_kind::named_argument, start));
+            }
+            return parse_expression();
+        });
+        expect(syntax_kind::rparen, syntax_error::expected_rparen);
+        return finish(syntax_kind::argument_list, start);
+    }
+
+    ///////////////////////////////////////////////////////
+    // Expressions
+    ///////////////////////////////////////////////////////
+    syntax_element parse_expression() {
+        syntax_element condition = parse_binary(0);
+        if (!at(syntax_kind::question)) {
+            return condition;
+        }
+        size_t start = stack.size();
+        stack.push_back(std::move(condition));
+        stack.push_back(bump()); // ?
+        stack.push_back(parse_expression());
+        expect(syntax_kind::colon, syntax_error::expected_colon);
+        stack.push_back(parse_expression());
+        return finish(syntax_kind::ternary_expression, start);
+    }
+
+    // Precedence of a binary operator from 0 (||) to 5 (* / %), -1 for other tokens
+    static int binary_precedence(syntax_kind kind) {
+        switch (kind) {
+        case syntax_kind::logical_or: return 0;
+        case syntax_kind::logical_and: return 1;
+        case syntax_kind::equal:
+        case syntax_kind::not_equal: return 2;
+        case syntax_kind::less:
+        case syntax_kind::less_equal:
+        case syntax_kind::greater:
+        case syntax_kind::greater_equal: return 3;
+        case syntax_kind::plus:
+        case syntax_kind::minus: return 4;
+        case syntax_kind::star:
+        case syntax_kind::slash:
+        case syntax_kind::percent: return 5;
+        default: return -1;
+        }
+    }
+
+    /**
+     * Operators of one precedence level are left associative and stored as one flat node.
+     * Precedence climbing: only operators of at least min_level are consumed.
+     */
+    syntax_element parse_binary(int min_level) {
+        syntax_element left = parse_unary();
+        while (true) {
+            const int level = binary_precedence(current.kind);
+            if (level < min_level) {
+                return left;
+            }
+            size_t start = stack.size();
+            stack.push_back(std::move(left));
+            while (binary_precedence(current.kind) == level) {
+                stack.push_back(bump());
+                stack.push_back(parse_binary(level + 1));
+            }
+            left = finish(syntax_kind::binary_expression, start);
+        }
+    }
+
+    syntax_element parse_unary() {
+        if (at(syntax_kind::bang) || at(syntax_kind::minus) || at(syntax_kind::plus)) {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            stack.push_back(parse_unary());
+            return finish(syntax_kind::unary_expression, start);
+        }
+        syntax_element base = parse_postfix();
+        if (!at(syntax_kind::caret)) {
+            return base;
+        }
+        // Exponentiation is right associative
+        size_t start = stack.size();
+        stack.push_back(std::move(base));
+        stack.push_back(bump());
+        stack.push_back(parse_unary());
+        return finish(syntax_kind::binary_expression, start);
+    }
+
+    syntax_element parse_postfix() {
+        syntax_element expr = parse_primary();
+        while (at(syntax_kind::lparen) || at(syntax_kind::lbracket) || at(syntax_kind::dot)) {
+            size_t start = stack.size();
+            stack.push_back(std::move(expr));
+            if (at(syntax_kind::lparen)) {
+                stack.push_back(parse_argument_list(false));
+                expr = finish(syntax_kind::call_expression, start);
+            } else if (at(syntax_kind::lbracket)) {
+                stack.push_back(bump());
+                stack.push_back(parse_expression());
+                expect(syntax_kind::rbracket, syntax_error::expected_rbracket);
+                expr = finish(syntax_kind::index_expression, start);
+            } else if (at(syntax_kind::dot)) {
+                stack.push_back(bump());
+                expect(syntax_kind::identifier, syntax_error::expected_identifier);
+                expr = finish(syntax_kind::member_expression, start);
+            }
+        }
+        return expr;
+    }
+
+    syntax_element parse_primary() {
+        switch (current.kind) {
+        case syntax_kind::number:
+        case syntax_kind::string:
+        case syntax_kind::identifier:
+        case syntax_kind::kw_true:
+        case syntax_kind::kw_false:
+        case syntax_kind::kw_undef:
+            return bump();
+        case syntax_kind::lparen: {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            stack.push_back(parse_expression());
+            expect(syntax_kind::rparen, syntax_error::expected_rparen);
+            return finish(syntax_kind::paren_expression, start);
+        }
+        case syntax_kind::lbracket:
+            return parse_vector();
+        case syntax_kind::kw_let:
+            return parse_prefixed(syntax_kind::let_expression, false);
+        case syntax_kind::kw_assert:
+            return parse_prefixed(syntax_kind::assert_expression, false);
+        case syntax_kind::kw_echo:
+            return parse_prefixed(syntax_kind::echo_expression, false);
+        case syntax_kind::kw_function: {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            stack.push_back(parse_parameter_list());
+            stack.push_back(parse_expression());
+            return finish(syntax_kind::function_literal, start);
+        }
+        case syntax_kind::unterminated_string:
+        case syntax_kind::unterminated_comment:
+        case syntax_kind::unknown_character:
+            return error_token(token_error(current.kind));
+        default:
+            return missing(syntax_error::expected_expression);
+        }
+    }
+
+    // let(...) expr, assert(...) expr, echo(...) expr - inside vectors the body may be a comprehension
+    syntax_element parse_prefixed(syntax_kind kind, bool in_vector) {
+        size_t start = stack.size();
+        stack.push_back(bump());
+        stack.push_back(parse_argument_list(false));
+        stack.push_back(in_vector ? parse_vector_element() : parse_expression());
+        return finish(kind, start);
+    }
+
+    syntax_element parse_vector() {
+        size_t start = stack.size();
+        stack.push_back(bump()); // [
+
+        size_t items = stack.size();
+        if (!at(syntax_kind::rbracket)) {
+            // A first element reused from the old tree can start a range as well. A reused chunk
+            // holds more elements, a ':' behind it is an error of the vector like in a full parse.
+            if (!try_reuse(syntax_kind::vector_expression)) {
+                stack.push_back(parse_vector_element());
+            }
+            // [start : end] and [start : step : end] are ranges
+            if (at(syntax_kind::colon) && stack.back().kind() != syntax_kind::list_chunk) {
+                stack.push_back(bump());
+                stack.push_back(parse_expression());
+                if (at(syntax_kind::colon)) {
+                    stack.push_back(bump());
+                    stack.push_back(parse_expression());
+                }
+                expect(syntax_kind::rbracket, syntax_error::expected_rbracket);
+                return finish(syntax_kind::range_expression, start);
+            }
+        }
+        parse_separated_list(items, syntax_kind::vector_expression, syntax_kind::rbracket, false, [this]() {
+            return parse_vector_element();
+        });
+        expect(syntax_kind::rbracket, syntax_error::expected_rbracket);
+        return finish(syntax_kind::vector_expression, start);
+    }
+
+    syntax_element parse_vector_element() {
+        switch (current.kind) {
+        case syntax_kind::kw_for: {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            // C-style for (init; condition; update) is allowed in comprehensions
+            stack.push_back(parse_argument_list(true));
+            stack.push_back(parse_vector_element());
+            return finish(syntax_kind::comprehension_for, start);
+        }
+        case syntax_kind::kw_if: {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            expect(syntax_kind::lparen, syntax_error::expected_lparen);
+            stack.push_back(parse_expression());
+            expect(syntax_kind::rparen, syntax_error::expected_rparen);
+            stack.push_back(parse_vector_element());
+            if (at(syntax_kind::kw_else)) {
+                stack.push_back(bump());
+                stack.push_back(parse_vector_element());
+            }
+            return finish(syntax_kind::comprehension_if, start);
+        }
+        case syntax_kind::kw_each: {
+            size_t start = stack.size();
+            stack.push_back(bump());
+            stack.push_back(parse_vector_element());
+            return finish(syntax_kind::comprehension_each, start);
+        }
+        case syntax_kind::kw_let:
+            return parse_prefixed(syntax_kind::let_expression, true);
+        default:
+            return parse_expression();
+        }
+    }
+};
+
+} // namespace
+
+syntax_tree parse_scad(std::string_view text, int version) {
+    token_stream tokens = tokenize_scad(text);
+    scad_parser parser(text, &tokens, nullptr, nullptr);
+    return parser.parse(version);
+}
+
+syntax_tree reparse_scad(const syntax_tree &old, std::string_view text, const text_edit_span &edit, int version) {
+    scad_parser parser(text, nullptr, &old, &edit);
+    return parser.parse(version);
+}
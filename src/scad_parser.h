@@ -0,0 +1,27 @@
+#pragma once
+
+#include "syntax_tree.h"
+
+#include <string_view>
+
+/**
+ * A replaced byte range: [offset, offset + old_length) of the old text was replaced by
+ * [offset, offset + new_length) of the new text.
+ */
+struct text_edit_span {
+    uint32_t offset = 0;
+    uint32_t old_length = 0;
+    uint32_t new_length = 0;
+
+    // The single span covering this edit followed by next (next is in the coordinates after this edit)
+    text_edit_span then(const text_edit_span &next) const;
+};
+
+syntax_tree parse_scad(std::string_view text, int version);
+
+/**
+ * Parse the new text of a document, reusing all subtrees of old that are not affected by edit.
+ * The cost is proportional to the size of the edit and the depth of the tree, not the size
+ * of the document.
+ */
+syntax_tree reparse_scad(const syntax_tree &old, std::string_view text, const text_edit_span &edit, int version);
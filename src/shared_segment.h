@@ -0,0 +1,18 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <initializer_list>
+#include <string_view>
+
+// Passing descriptors and memfd segments between processes over Unix sockets
+
+// One message with an optional descriptor, never raises SIGPIPE
+bool send_message(int socket, const void *data, size_t size, int fd);
+
+// The size of the message, 0 on hang up. fd is -1 if none came with it.
+ssize_t receive_message(int socket, void *data, size_t size, int &fd, int flags = 0);
+
+// A sealed memfd holding the pieces one after the other, -1 if memfd is not available
+int make_segment(const char *name, std::initializer_list<std::string_view> pieces);
@@ -0,0 +1,534 @@
+#include "symbol_index.h"
+#include "index_cache.h"
+
+#include <algorithm>
+
+namespace {
+
+lsRange record_range(const index_snapshot::symbol_record &sym) {
+    lsRange range;
+    range.start.line = sym.start_line;
+    range.start.character = sym.start_character;
+    range.end.line = sym.end_line;
+    range.end.character = sym.end_character;
+    return range;
+}
+
+std::string_view snapshot_container(const index_snapshot &base, const index_snapshot::symbol_record &sym) {
+    return sym.container == index_snapshot::NO_NAME ? std::string_view() : base.name(sym.container);
+}
+
+// FNV-1a
+inline uint32_t hash_name(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * How well a lower case name matches the lower case query, 0 if it does not contain the
+ * query at all. Exact matches rank before prefixes, substrings and subsequences.
+ */
+int match_score(std::string_view name, std::string_view query) {
+    if (name == query) return 1000;
+    size_t pos = name.find(query);
+    if (pos == 0) return 800;
+    if (pos != std::string_view::npos) return 600 - static_cast<int>(std::min<size_t>(pos, 100));
+
+    size_t matched = 0;
+    for (size_t i = 0; i < name.size() && matched < query.size(); i++) {
+        if (name[i] == query[matched]) matched++;
+    }
+    return matched == query.size() ? 300 : 0;
+}
+
+struct ranked_name {
+    uint32_t name;
+    int score;
+    bool in_base;
+};
+
+// The names of a snapshot as seen by rank_names, hidden files are skipped when the symbols are reported
+struct snapshot_layer {
+    const index_snapshot &snapshot;
+
+    size_t name_count() const { return snapshot.name_count(); }
+    std::string_view lower_name(uint32_t id) const { return snapshot.lower_name(id); }
+    bool live(uint32_t) const { return true; }
+    std::pair<const uint32_t *, const uint32_t *> postings(uint32_t key) const { return snapshot.postings(key); }
+};
+
+/**
+ * Append the names of one layer that match the lower case needle to ranked. hits is the trigram
+ * count per name, all zero, and left that way.
+ */
+template <typename Layer>
+void rank_names(const Layer &layer, const std::string &needle, size_t limit, bool in_base,
+                std::vector<ranked_name> &ranked, std::vector<uint16_t> &hits) {
+    const size_t count = layer.name_count();
+
+    if (needle.empty()) {
+        // Nothing to rank, report names in index order
+        size_t added = 0;
+        for (uint32_t id = 0; id < count && added < limit; id++) {
+            if (!layer.live(id)) continue;
+            ranked.push_back({id, 0, in_base});
+            added++;
+        }
+    } else if (needle.size() < 3) {
+        // Too short for trigrams, only names starting with the query are reported
+        auto list = layer.postings(symbol_index::prefix_key(needle));
+        for (const uint32_t *it = list.first; it != list.second; ++it) {
+            if (!layer.live(*it)) continue;
+            ranked.push_back({*it, match_score(layer.lower_name(*it), needle), in_base});
+        }
+    } else {
+        std::vector<uint32_t> keys;
+        for (size_t i = 0; i + 3 <= needle.size(); i++) {
+            keys.push_back(symbol_index::trigram_key(needle.data() + i));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        const size_t trigrams = keys.size();
+
+        std::vector<std::pair<const uint32_t *, const uint32_t *>> lists;
+        for (uint32_t key : keys) {
+            auto list = layer.postings(key);
+            if (list.first != list.second) lists.push_back(list);
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b) {
+            return a.second - a.first < b.second - b.first;
+        });
+
+        // A third of the query trigrams may be missing from a name (typos). A name with enough
+        // hits has to be in one of the shortest trigrams - required + 1 lists, the longer lists
+        // only count hits of names that are already candidates.
+        const size_t required = std::max<size_t>(1, trigrams - trigrams / 3);
+        const size_t admitting = trigrams - required + 1;
+
+        // hits is zero for every name between queries, only the candidates are reset
+        if (hits.size() < count) hits.resize(count, 0);
+        std::vector<uint32_t> candidates;
+        for (size_t i = 0; i < lists.size(); i++) {
+            for (const uint32_t *it = lists[i].first; it != lists[i].second; ++it) {
+                if (i < admitting) {
+                    if (hits[*it]++ == 0) candidates.push_back(*it);
+                } else if (hits[*it]) {
+                    hits[*it]++;
+                }
+            }
+        }
+        for (uint32_t id : candidates) {
+            const uint16_t found = hits[id];
+            hits[id] = 0;
+            if (found < required || !layer.live(id)) continue;
+            int score = match_score(layer.lower_name(id), needle);
+            if (score == 0) {
+                score = 100 * found / trigrams;
+            }
+            ranked.push_back({id, score, in_base});
+        }
+    }
+}
+
+// Offset of the child at index inside a node starting at offset
+uint32_t child_offset(const syntax_node &node, uint32_t offset, size_t index) {
+    for (size_t i = 0; i < index; i++) {
+        offset += node[i].width;
+    }
+    return offset;
+}
+
+} // namespace
+
+symbol_index::symbol_index() {
+    name_offsets.push_back(0);
+    name_slots.assign(1024, NO_NAME);
+}
+
+symbol_index::~symbol_index() = default;
+
+void symbol_index::attach_snapshot(std::unique_ptr<const index_snapshot> snapshot) {
+    base = std::move(snapshot);
+    base_documents.clear();
+    base_files.clear();
+    base_live_symbols = 0;
+    if (base) {
+        for (uint32_t file = 0; file < base->file_count(); file++) {
+            const DocumentId doc = uri_table::global().intern_path(std::string(base->file_path(file)));
+            base_documents.push_back(doc);
+            base_files[doc] = file;
+            base_live_symbols += base->symbol_count(file);
+        }
+    }
+    base_hidden.assign(base_documents.size(), false);
+
+    // Documents that are already indexed are newer than their snapshot version
+    for (const auto &doc : documents) {
+        hide_base(doc.first);
+    }
+}
+
+void symbol_index::hide_base(DocumentId doc) {
+    auto it = base_files.find(doc);
+    if (it == base_files.end() || base_hidden[it->second]) return;
+    base_hidden[it->second] = true;
+    base_live_symbols -= base->symbol_count(it->second);
+}
+
+symbol_index::name_id symbol_index::find_name(std::string_view name) const {
+    const size_t mask = name_slots.size() - 1;
+    for (size_t slot = hash_name(name) & mask; name_slots[slot] != NO_NAME; slot = (slot + 1) & mask) {
+        if (this->name(name_slots[slot]) == name) {
+            return name_slots[slot];
+        }
+    }
+    return NO_NAME;
+}
+
+symbol_index::name_id symbol_index::intern(std::string_view name) {
+    const size_t mask = name_slots.size() - 1;
+    size_t slot = hash_name(name) & mask;
+    while (name_slots[slot] != NO_NAME) {
+        if (this->name(name_slots[slot]) == name) {
+            return name_slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    const name_id id = name_count();
+    names.append(name);
+    for (char c : name) {
+        lower_names.push_back(to_lower(c));
+    }
+    name_offsets.push_back(names.size());
+    name_first_symbol.push_back(NO_SYMBOL);
+    name_live_symbols.push_back(0);
+    name_slots[slot] = id;
+
+    // Ids are handed out in increasing order, so the postings stay sorted
+    std::string_view lower = lower_name(id);
+    for (size_t i = 0; i + 3 <= lower.size(); i++) {
+        std::vector<name_id> &list = postings[trigram_key(lower.data() + i)];
+        if (list.empty() || list.back() != id) {
+            list.push_back(id);
+        }
+    }
+    for (size_t length = 1; length <= 2 && length <= lower.size(); length++) {
+        postings[prefix_key(lower.substr(0, length))].push_back(id);
+    }
+
+    // Keep the hash table at most half full
+    if (name_count() * 2 > name_slots.size()) {
+        std::vector<name_id> slots(name_slots.size() * 2, NO_NAME);
+        const size_t new_mask = slots.size() - 1;
+        for (name_id existing = 0; existing < name_count(); existing++) {
+            size_t s = hash_name(this->name(existing)) & new_mask;
+            while (slots[s] != NO_NAME) s = (s + 1) & new_mask;
+            slots[s] = existing;
+        }
+        name_slots = std::move(slots);
+    }
+    return id;
+}
+
+void symbol_index::add_symbol(DocumentId doc, name_id name, name_id container, SymbolKind kind, const lsRange &range) {
+    const uint32_t symbol = symbol_name.size();
+    symbol_name.push_back(name);
+    symbol_container.push_back(container);
+    symbol_kind.push_back(kind);
+    symbol_document.push_back(doc);
+    symbol_range.push_back(range);
+    symbol_next.push_back(name_first_symbol[name]);
+    name_first_symbol[name] = symbol;
+    name_live_symbols[name]++;
+    live_symbols++;
+}
+
+void document_symbols::extract(std::string_view text, const line_index &lines, const syntax_tree &tree) {
+    names.clear();
+    symbols.clear();
+    if (!tree.empty()) {
+        collect(text, lines, *tree.root, 0, NO_CONTAINER);
+    }
+}
+
+void document_symbols::collect(std::string_view text, const line_index &lines, const syntax_node &list, uint32_t offset, uint32_t container) {
+    for_each_item(list, offset, [&](const syntax_element &item, uint32_t item_offset) {
+        const syntax_node *node = item.node();
+        SymbolKind kind;
+        size_t name_index;
+        switch (item.kind()) {
+        case syntax_kind::module_definition:
+            kind = SymbolKind::Module;
+            name_index = 1;
+            break;
+        case syntax_kind::function_definition:
+            kind = SymbolKind::Function;
+            name_index = 1;
+            break;
+        case syntax_kind::assignment:
+            kind = SymbolKind::Variable;
+            name_index = 0;
+            break;
+        case syntax_kind::block:
+            collect(text, lines, *node, item_offset, container);
+            return;
+        default:
+            return;
+        }
+        if (node->size <= name_index || (*node)[name_index].kind() != syntax_kind::identifier) {
+            return;
+        }
+
+        const std::string_view name = token_text(text, (*node)[name_index], child_offset(*node, item_offset, name_index));
+        const uint32_t start = text_start(text, item, item_offset);
+        const uint32_t index = symbols.size();
+        symbols.push_back({static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size()), container, kind,
+                           lines.range_of(text, start, item_offset + item.width - start)});
+        names.append(name);
+
+        // Definitions inside a module body are local to the module
+        if (item.kind() == syntax_kind::module_definition && node->size > 3 &&
+                (*node)[3].kind() == syntax_kind::block) {
+            collect(text, lines, *(*node)[3].node(), child_offset(*node, item_offset, 3), index);
+        }
+    });
+}
+
+void symbol_index::update(DocumentId doc, const text_document &text) {
+    document_symbols symbols;
+    symbols.extract(text.text(), text.lines(), text.syntax());
+    update(doc, symbols);
+}
+
+void symbol_index::update(DocumentId doc, const document_symbols &symbols) {
+    remove(doc);
+    if (symbols.symbols.empty()) return;
+
+    symbol_span span;
+    span.first = symbol_name.size();
+    span.count = symbols.symbols.size();
+    for (const document_symbols::symbol &sym : symbols.symbols) {
+        // Containers always come before the symbols they contain
+        const name_id container = sym.container == document_symbols::NO_CONTAINER ?
+            NO_NAME : symbol_name[span.first + sym.container];
+        add_symbol(doc, intern(symbols.name(sym)), container, sym.kind, sym.range);
+    }
+    documents[doc] = span;
+}
+
+void symbol_index::remove(DocumentId doc) {
+    hide_base(doc);
+    auto it = documents.find(doc);
+    if (it == documents.end()) return;
+
+    for (uint32_t i = it->second.first; i < it->second.first + it->second.count; i++) {
+        symbol_document[i] = INVALID_DOCUMENT_ID;
+        name_live_symbols[symbol_name[i]]--;
+    }
+    live_symbols -= it->second.count;
+    documents.erase(it);
+
+    const size_t dead = symbol_name.size() - live_symbols;
+    if (dead > 4096 && dead > live_symbols) {
+        compact();
+    }
+}
+
+std::vector<DocumentId> symbol_index::documents_in(std::string_view directory) const {
+    auto below = [directory](DocumentId doc) {
+        const std::string &path = uri_table::global().path(doc);
+        return path.size() > directory.size() && path[directory.size()] == '/' &&
+               std::string_view(path).substr(0, directory.size()) == directory;
+    };
+
+    std::vector<DocumentId> found;
+    for (const auto &doc : documents) {
+        if (below(doc.first)) found.push_back(doc.first);
+    }
+    for (uint32_t file = 0; file < base_documents.size(); file++) {
+        if (!base_hidden[file] && below(base_documents[file])) found.push_back(base_documents[file]);
+    }
+    return found;
+}
+
+void symbol_index::compact() {
+    // Ranges are copied into a new column, which also drops the unpacked ranges of removed symbols
+    range_column ranges;
+    ranges.reserve(live_symbols);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < symbol_name.size(); i++) {
+        if (symbol_document[i] == INVALID_DOCUMENT_ID) continue;
+        symbol_name[kept] = symbol_name[i];
+        symbol_container[kept] = symbol_container[i];
+        symbol_kind[kept] = symbol_kind[i];
+        symbol_document[kept] = symbol_document[i];
+        ranges.push_back(symbol_range[i]);
+        kept++;
+    }
+    symbol_name.resize(kept);
+    symbol_container.resize(kept);
+    symbol_kind.resize(kept);
+    symbol_document.resize(kept);
+    symbol_range = std::move(ranges);
+    symbol_next.resize(kept);
+
+    // The live symbols of a document stay contiguous, so the spans only move
+    std::fill(name_first_symbol.begin(), name_first_symbol.end(), NO_SYMBOL);
+    for (auto &doc : documents) {
+        doc.second.count = 0;
+    }
+    for (uint32_t i = 0; i < kept; i++) {
+        symbol_next[i] = name_first_symbol[symbol_name[i]];
+        name_first_symbol[symbol_name[i]] = i;
+
+        symbol_span &span = documents[symbol_document[i]];
+        if (span.count == 0) span.first = i;
+        span.count++;
+    }
+}
+
+struct symbol_index::live_layer {
+    const symbol_index &index;
+
+    size_t name_count() const { return index.name_count(); }
+    std::string_view lower_name(name_id id) const { return index.lower_name(id); }
+    bool live(name_id id) const { return index.name_live_symbols[id] != 0; }
+    std::pair<const uint32_t *, const uint32_t *> postings(uint32_t key) const {
+        auto it = index.postings.find(key);
+        if (it == index.postings.end()) return {nullptr, nullptr};
+        return {it->second.data(), it->second.data() + it->second.size()};
+    }
+};
+
+void symbol_index::query(std::string_view query, size_t limit, symbol_results &out) const {
+    std::string needle;
+    needle.reserve(query.size());
+    for (char c : query) {
+        needle.push_back(to_lower(c));
+    }
+
+    std::vector<ranked_name> ranked;
+    rank_names(live_layer{*this}, needle, limit, false, ranked, query_hits);
+    if (base && base_live_symbols) {
+        rank_names(snapshot_layer{*base}, needle, limit, true, ranked, query_hits);
+    }
+
+    auto name_of = [this](const ranked_name &r) { return r.in_base ? base->name(r.name) : name(r.name); };
+    auto better = [&name_of](const ranked_name &a, const ranked_name &b) {
+        if (a.score != b.score) return a.score > b.score;
+        const std::string_view a_name = name_of(a);
+        const std::string_view b_name = name_of(b);
+        if (a_name.size() != b_name.size()) return a_name.size() < b_name.size();
+        if (a_name != b_name) return a_name < b_name;
+        return a.in_base != b.in_base ? b.in_base : a.name < b.name;
+    };
+
+    // Names of the base layer may have only hidden symbols, so more names than limit can be
+    // needed. They are sorted in chunks as the output fills up.
+    const size_t end = out.size() + limit;
+    size_t sorted = 0;
+    for (size_t i = 0; i < ranked.size() && out.size() < end; i++) {
+        if (i == sorted) {
+            sorted = std::min(ranked.size(), sorted + std::max<size_t>(limit, 16));
+            std::partial_sort(ranked.begin() + i, ranked.begin() + sorted, ranked.end(), better);
+        }
+
+        if (!ranked[i].in_base) {
+            for (uint32_t symbol = name_first_symbol[ranked[i].name]; symbol != NO_SYMBOL && out.size() < end;
+                    symbol = symbol_next[symbol]) {
+                if (symbol_document[symbol] == INVALID_DOCUMENT_ID) continue;
+
+                out.add(name(symbol_name[symbol]), container_name(symbol_container[symbol]), symbol_kind[symbol],
+                        symbol_document[symbol], symbol_range[symbol]);
+            }
+            continue;
+        }
+
+        auto symbols = base->symbols_of(ranked[i].name);
+        for (const index_snapshot::symbol_record *sym = symbols.first; sym != symbols.second && out.size() < end; ++sym) {
+            if (base_hidden[sym->file]) continue;
+
+            out.add(base->name(ranked[i].name), snapshot_container(*base, *sym), static_cast<SymbolKind>(sym->kind),
+                    base_documents[sym->file], record_range(*sym));
+        }
+    }
+}
+
+void symbol_index::definitions(std::string_view name, const std::vector<DocumentId> &docs,
+                               symbol_results &out) const {
+    auto visible = [&docs](DocumentId doc) { return std::binary_search(docs.begin(), docs.end(), doc); };
+
+    const name_id id = find_name(name);
+    if (id != NO_NAME) {
+        for (uint32_t symbol = name_first_symbol[id]; symbol != NO_SYMBOL; symbol = symbol_next[symbol]) {
+            if (symbol_document[symbol] == INVALID_DOCUMENT_ID || !visible(symbol_document[symbol])) continue;
+
+            out.add(name, container_name(symbol_container[symbol]), symbol_kind[symbol], symbol_document[symbol],
+                    symbol_range[symbol]);
+        }
+    }
+    if (!base || !base_live_symbols || name.empty()) return;
+
+    // The snapshot has no hash table, its postings narrow the names down to the ones sharing the
+    // first trigram (or the prefix of short names)
+    std::string lower;
+    for (char c : name) lower.push_back(to_lower(c));
+    auto candidates = base->postings(lower.size() >= 3 ? trigram_key(lower.data()) :
+                                     prefix_key(std::string_view(lower).substr(0, 2)));
+    for (const uint32_t *it = candidates.first; it != candidates.second; ++it) {
+        if (base->name(*it) != name) continue;
+
+        auto symbols = base->symbols_of(*it);
+        for (const index_snapshot::symbol_record *sym = symbols.first; sym != symbols.second; ++sym) {
+            if (base_hidden[sym->file] || !visible(base_documents[sym->file])) continue;
+
+            out.add(name, snapshot_container(*base, *sym), static_cast<SymbolKind>(sym->kind), base_documents[sym->file],
+                    record_range(*sym));
+        }
+        break;
+    }
+}
+
+std::string_view symbol_index::container_name(name_id container) const {
+    return container == NO_NAME ? std::string_view() : name(container);
+}
+
+///////////////////////////////////////////////////////////
+// symbol_results
+///////////////////////////////////////////////////////////
+
+uint32_t symbol_results::intern(std::string_view text, pooled_text &last) {
+    if (pooled(last.offset, last.length) != text) {
+        last.offset = pool.size();
+        last.length = text.size();
+        pool.append(text);
+    }
+    return last.offset;
+}
+
+void symbol_results::add(std::string_view name, std::string_view container, SymbolKind kind, DocumentId doc,
+                         const lsRange &range) {
+    name_offsets.push_back(intern(name, last_name));
+    name_lengths.push_back(name.size());
+    container_offsets.push_back(container.empty() ? 0 : intern(container, last_container));
+    container_lengths.push_back(container.size());
+    kinds.push_back(kind);
+    documents.push_back(doc);
+    ranges.push_back(range);
+}
+
+SymbolInformation symbol_results::materialize(size_t i) const {
+    SymbolInformation info;
+    info.name = std::string(name(i));
+    info.kind = kinds[i];
+    info.location.uri = uri_table::global().uri(documents[i]);
+    info.location.range = ranges[i];
+    if (container_lengths[i]) {
+        info.containerName = std::string(container(i));
+    }
+    return info;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "document.h"
+#include "lsp.h"
+#include "packed_range.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The definitions of one document, extracted from its syntax tree. Extraction does not touch
+ * an index, so it can run on any thread and be merged into the symbol_index later.
+ */
+struct document_symbols {
+    static constexpr uint32_t NO_CONTAINER = ~uint32_t(0);
+
+    struct symbol {
+        uint32_t name_offset;   // into names
+        uint32_t name_length;
+        uint32_t container;     // index of the enclosing symbol or NO_CONTAINER
+        SymbolKind kind;
+        lsRange range;
+    };
+
+    std::string names;
+    std::vector<symbol> symbols;
+
+    void extract(std::string_view text, const line_index &lines, const syntax_tree &tree);
+
+    std::string_view name(const symbol &sym) const {
+        return std::string_view(names.data() + sym.name_offset, sym.name_length);
+    }
+
+private:
+    void collect(std::string_view text, const line_index &lines, const syntax_node &list, uint32_t offset, uint32_t container);
+};
+
+class index_snapshot;
+
+/**
+ * Symbols found by a query, kept in columns until the response is written. Results come grouped
+ * by name, so a name or container is only added to the pool when it differs from the previous one.
+ */
+class symbol_results {
+public:
+    // An empty container means the symbol is not nested in another one
+    void add(std::string_view name, std::string_view container, SymbolKind kind, DocumentId doc, const lsRange &range);
+
+    size_t size() const { return kinds.size(); }
+    bool empty() const { return kinds.empty(); }
+
+    std::string_view name(size_t i) const { return pooled(name_offsets[i], name_lengths[i]); }
+    std::string_view container(size_t i) const { return pooled(container_offsets[i], container_lengths[i]); }
+    SymbolKind kind(size_t i) const { return kinds[i]; }
+    DocumentId document(size_t i) const { return documents[i]; }
+    lsRange range(size_t i) const { return ranges[i]; }
+
+    // The LSP form of result i, only built to serialize it
+    SymbolInformation materialize(size_t i) const;
+
+private:
+    std::string_view pooled(uint32_t offset, uint32_t length) const {
+        return std::string_view(pool.data() + offset, length);
+    }
+    struct pooled_text {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+    uint32_t intern(std::string_view text, pooled_text &last);
+
+    std::string pool;
+    pooled_text last_name;
+    pooled_text last_container;
+
+    std::vector<uint32_t> name_offsets;
+    std::vector<uint32_t> name_lengths;
+    std::vector<uint32_t> container_offsets;
+    std::vector<uint32_t> container_lengths;
+    std::vector<SymbolKind> kinds;
+    std::vector<DocumentId> documents;
+    range_column ranges;
+};
+
+/**
+ * Index of the modules, functions and variables of all documents in the workspace, used to
+ * answer workspace/symbol.
+ *
+ * Storage is flat: every name is interned once into a string pool, symbols are parallel
+ * columns indexed by symbol number and refer to names by id. Ranges are packed to 8 bytes.
+ * Fuzzy matching works on trigram postings of the interned (lower case) names, so a query
+ * only inspects names that share trigrams with it.
+ *
+ * An index_snapshot from an earlier run can be attached as a read only base layer. It is
+ * queried in place, documents that are updated or removed hide their symbols in the base.
+ */
+class symbol_index {
+public:
+    using name_id = uint32_t;
+    static constexpr name_id NO_NAME = ~name_id(0);
+
+    symbol_index();
+    ~symbol_index();
+
+    // Posting keys, shared with the snapshot format
+    static char to_lower(char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; }
+    static uint32_t trigram_key(const char *s) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(s[0])) << 16) |
+               (static_cast<uint32_t>(static_cast<unsigned char>(s[1])) << 8) |
+                static_cast<uint32_t>(static_cast<unsigned char>(s[2]));
+    }
+    // Key for the first one or two characters of a name, tagged so it cannot collide with trigrams
+    static uint32_t prefix_key(std::string_view prefix) {
+        uint32_t key = static_cast<uint32_t>(prefix.size()) << 24;
+        for (char c : prefix) {
+            key = (key & 0xFF000000u) | ((key << 8) & 0x00FFFF00u) | static_cast<unsigned char>(c);
+        }
+        return key;
+    }
+
+    // Replace the base layer, all its documents are visible until they are updated or removed
+    void attach_snapshot(std::unique_ptr<const index_snapshot> snapshot);
+    const index_snapshot *snapshot() const { return base.get(); }
+
+    // Replace all symbols of a document with the definitions in its current syntax tree
+    void update(DocumentId doc, const text_document &text);
+    void update(DocumentId doc, const document_symbols &symbols);
+    void remove(DocumentId doc);
+
+    // Documents with symbols in the index whose path is below directory
+    std::vector<DocumentId> documents_in(std::string_view directory) const;
+
+    // Append up to limit symbols matching query to out, best matches first. Queries share scratch
+    // memory of the index, they must not run at the same time.
+    void query(std::string_view query, size_t limit, symbol_results &out) const;
+    // Append the symbols called exactly name that are defined in one of docs (sorted) to out
+    void definitions(std::string_view name, const std::vector<DocumentId> &docs, symbol_results &out) const;
+
+    size_t symbol_count() const { return live_symbols + base_live_symbols; }
+    size_t name_count() const { return name_offsets.size() - 1; }
+
+    std::string_view name(name_id id) const {
+        return std::string_view(names.data() + name_offsets[id], name_offsets[id + 1] - name_offsets[id]);
+    }
+
+private:
+    static constexpr uint32_t NO_SYMBOL = ~uint32_t(0);
+
+    // The in-memory names as seen by the query ranking
+    struct live_layer;
+
+    name_id intern(std::string_view name);
+    // NO_NAME if the name was never interned
+    name_id find_name(std::string_view name) const;
+    void add_symbol(DocumentId doc, name_id name, name_id container, SymbolKind kind, const lsRange &range);
+    // Empty for NO_NAME
+    std::string_view container_name(name_id container) const;
+    void compact();
+    void hide_base(DocumentId doc);
+
+    std::string_view lower_name(name_id id) const {
+        return std::string_view(lower_names.data() + name_offsets[id], name_offsets[id + 1] - name_offsets[id]);
+    }
+
+    // Interned names: names and lower_names share name_offsets, name_slots is an open
+    // addressing hash table of name ids
+    std::string names;
+    std::string lower_names;
+    std::vector<uint32_t> name_offsets;
+    std::vector<name_id> name_slots;
+    // Head of the list of symbols with that name, continued by symbol_next
+    std::vector<uint32_t> name_first_symbol;
+    // Symbols with that name that were not removed, names without any are not reported
+    std::vector<uint32_t> name_live_symbols;
+
+    // Sorted name ids per trigram of the lower case name, and per first one and two characters
+    std::unordered_map<uint32_t, std::vector<name_id>> postings;
+
+    // Symbol columns, removed symbols keep their slot with document INVALID_DOCUMENT_ID until
+    // the next compaction
+    std::vector<name_id> symbol_name;
+    std::vector<name_id> symbol_container;
+    std::vector<SymbolKind> symbol_kind;
+    std::vector<DocumentId> symbol_document;
+    range_column symbol_range;
+    std::vector<uint32_t> symbol_next;
+    size_t live_symbols = 0;
+
+    // The symbols of one document are always appended together, so a document owns one range
+    struct symbol_span {
+        uint32_t first;
+        uint32_t count;
+    };
+    std::unordered_map<DocumentId, symbol_span> documents;
+
+    // Base layer, files of the snapshot are identified by their index in it
+    std::unique_ptr<const index_snapshot> base;
+    std::vector<DocumentId> base_documents;
+    std::unordered_map<DocumentId, uint32_t> base_files;
+    std::vector<bool> base_hidden;
+    size_t base_live_symbols = 0;
+
+    // Trigram hits per name of either layer, zero between queries
+    mutable std::vector<uint16_t> query_hits;
+};
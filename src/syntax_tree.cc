@@ -0,0 +1,126 @@
+#include "syntax_tree.h"
+
+#include <cassert>
+#include <new>
+
+const char *error_message(syntax_error error) {
+    switch (error) {
+    case syntax_error::none: return "no error";
+    case syntax_error::unexpected_token: return "unexpected token";
+    case syntax_error::expected_statement: return "expected a statement";
+    case syntax_error::expected_expression: return "expected an expression";
+    case syntax_error::expected_identifier: return "expected an identifier";
+    case syntax_error::expected_semicolon: return "expected ';'";
+    case syntax_error::expected_lparen: return "expected '('";
+    case syntax_error::expected_rparen: return "expected ')'";
+    case syntax_error::expected_rbracket: return "expected ']'";
+    case syntax_error::expected_rbrace: return "expected '}'";
+    case syntax_error::expected_assign: return "expected '='";
+    case syntax_error::expected_colon: return "expected ':'";
+    case syntax_error::expected_include_path: return "expected <path>";
+    case syntax_error::unterminated_string: return "unterminated string";
+    case syntax_error::unterminated_comment: return "unterminated comment";
+    case syntax_error::unknown_character: return "unknown character";
+    }
+    return "<invalid error>";
+}
+
+syntax_element::syntax_element(syntax_node_ptr node) :
+    width(node->width),
+    packed(static_cast<uint32_t>(node->kind)),
+    child(std::move(node))
+{}
+
+template <typename Element>
+syntax_node_ptr syntax_node::make_node(syntax_kind kind, Element *children, size_t count, syntax_error error) {
+    assert(::is_node(kind));
+    void *memory = ::operator new(sizeof(syntax_node) + count * sizeof(syntax_element));
+    syntax_node *node = new (memory) syntax_node(kind, error, count);
+
+    syntax_element *dst = const_cast<syntax_element *>(node->begin());
+    uint32_t width = 0;
+    bool has_error = (kind == syntax_kind::error);
+    for (size_t i = 0; i < count; i++) {
+        width += children[i].width;
+        if (children[i].is_node() && children[i].node()->has_error()) {
+            has_error = true;
+        }
+        new (dst + i) syntax_element(std::move(children[i]));
+    }
+    node->width = width;
+    node->flags = has_error ? FLAG_HAS_ERROR : 0;
+    return syntax_node_ptr(node);
+}
+
+syntax_node_ptr syntax_node::make(syntax_kind kind, const syntax_element *children, size_t count, syntax_error error) {
+    return make_node(kind, children, count, error);
+}
+
+syntax_node_ptr syntax_node::make_from(syntax_kind kind, syntax_element *children, size_t count) {
+    return make_node(kind, children, count, syntax_error::none);
+}
+
+syntax_node::~syntax_node() {
+    syntax_element *children = const_cast<syntax_element *>(begin());
+    for (uint32_t i = 0; i < size; i++) {
+        children[i].~syntax_element();
+    }
+}
+
+void intrusive_ptr_add_ref(const syntax_node *node) {
+    node->refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(const syntax_node *node) {
+    if (node->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        node->~syntax_node();
+        ::operator delete(const_cast<syntax_node *>(node));
+    }
+}
+
+uint32_t text_start(std::string_view text, const syntax_node &node, uint32_t offset) {
+    // The first child with a width holds the first token, error markers have none
+    for (const syntax_element &child : node) {
+        if (child.width) {
+            return text_start(text, child, offset);
+        }
+    }
+    return offset;
+}
+
+uint32_t text_start(std::string_view text, const syntax_element &element, uint32_t offset) {
+    if (element.is_node()) {
+        return text_start(text, *element.node(), offset);
+    }
+    if (element.trivia() == syntax_element::TRIVIA_UNKNOWN) {
+        return skip_trivia(text, offset);
+    }
+    return offset + element.trivia();
+}
+
+std::string_view token_text(std::string_view text, const syntax_element &element, uint32_t offset) {
+    uint32_t start = text_start(text, element, offset);
+    return text.substr(start, offset + element.width - start);
+}
+
+static void collect_errors(std::string_view text, const syntax_node &node, uint32_t offset, std::vector<syntax_diagnostic> &out) {
+    if (node.kind == syntax_kind::error) {
+        syntax_diagnostic diag;
+        diag.offset = std::min<uint32_t>(text_start(text, node, offset), offset + node.width);
+        diag.length = offset + node.width - diag.offset;
+        diag.error = node.error;
+        out.push_back(diag);
+    }
+    for (const syntax_element &child : node) {
+        if (child.is_node() && child.node()->has_error()) {
+            collect_errors(text, *child.node(), offset, out);
+        }
+        offset += child.width;
+    }
+}
+
+void collect_errors(std::string_view text, const syntax_tree &tree, std::vector<syntax_diagnostic> &out) {
+    if (tree.root && tree.root->has_error()) {
+        collect_errors(text, *tree.root, 0, out);
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "scad_lexer.h"
+
+#include <boost/intrusive_ptr.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+enum class syntax_error : uint8_t {
+    none,
+    unexpected_token,
+    expected_statement,
+    expected_expression,
+    expected_identifier,
+    expected_semicolon,
+    expected_lparen,
+    expected_rparen,
+    expected_rbracket,
+    expected_rbrace,
+    expected_assign,
+    expected_colon,
+    expected_include_path,
+    unterminated_string,
+    unterminated_comment,
+    unknown_character,
+};
+
+const char *error_message(syntax_error error);
+
+struct syntax_node;
+using syntax_node_ptr = boost::intrusive_ptr<const syntax_node>;
+
+void intrusive_ptr_add_ref(const syntax_node *node);
+void intrusive_ptr_release(const syntax_node *node);
+
+/**
+ * One child of a syntax node, either a token or a nested node.
+ *
+ * The tree does not store absolute positions or text, only widths. A subtree can therefore be
+ * shared unchanged between two versions of a document even if the text before it was edited;
+ * absolute offsets are computed while walking down from the root.
+ */
+class syntax_element {
+public:
+    static constexpr uint32_t TRIVIA_UNKNOWN = 0xFFFFFF;
+
+    syntax_element() = default;
+    syntax_element(const scad_token &token) :
+        width(token.width()),
+        packed(static_cast<uint32_t>(token.kind) |
+               (std::min<uint32_t>(token.trivia, TRIVIA_UNKNOWN) << 8))
+    {}
+    syntax_element(syntax_node_ptr node);
+
+    // Number of bytes covered, including the leading trivia of the first token
+    uint32_t width = 0;
+
+    syntax_kind kind() const { return static_cast<syntax_kind>(packed & 0xFF); }
+    bool is_node() const { return ::is_node(kind()); }
+
+    // Leading trivia of a token, TRIVIA_UNKNOWN if it was too long to store
+    uint32_t trivia() const { return packed >> 8; }
+
+    const syntax_node *node() const { return child.get(); }
+    const syntax_node_ptr &node_ptr() const { return child; }
+
+private:
+    uint32_t packed = 0;
+    syntax_node_ptr child;
+};
+
+/**
+ * Immutable, reference counted syntax node. The children are allocated inline behind the node.
+ */
+struct syntax_node {
+    static constexpr uint8_t FLAG_HAS_ERROR = 1;
+
+    mutable std::atomic<uint32_t> refcount{0};
+    const syntax_kind kind;
+    uint8_t flags = 0;
+    // Only set for syntax_kind::error nodes
+    const syntax_error error;
+    uint32_t width = 0;
+    const uint32_t size;
+
+    bool has_error() const { return flags & FLAG_HAS_ERROR; }
+
+    const syntax_element *begin() const { return reinterpret_cast<const syntax_element *>(this + 1); }
+    const syntax_element *end() const { return begin() + size; }
+    const syntax_element &operator[](size_t i) const { return begin()[i]; }
+
+    static syntax_node_ptr make(syntax_kind kind, const syntax_element *children, size_t count,
+                                syntax_error error = syntax_error::none);
+    static syntax_node_ptr make(syntax_kind kind, const std::vector<syntax_element> &children,
+                                syntax_error error = syntax_error::none) {
+        return make(kind, children.data(), children.size(), error);
+    }
+    // Like make, but the children are moved into the node
+    static syntax_node_ptr make_from(syntax_kind kind, syntax_element *children, size_t count);
+
+private:
+    syntax_node(syntax_kind kind, syntax_error error, uint32_t size) :
+        kind(kind), error(error), size(size) {}
+    ~syntax_node();
+
+    template <typename Element>
+    static syntax_node_ptr make_node(syntax_kind kind, Element *children, size_t count, syntax_error error);
+
+    friend void intrusive_ptr_release(const syntax_node *node);
+};
+
+static_assert(sizeof(syntax_node) % alignof(syntax_element) == 0, "children are placed directly behind the node");
+
+/**
+ * The parsed form of one version of a document.
+ */
+struct syntax_tree {
+    int version = 0;
+    syntax_node_ptr root;
+
+    // Bytes taken over from the previous version by an incremental parse
+    uint32_t reused_bytes = 0;
+
+    bool empty() const { return !root; }
+};
+
+/**
+ * Visit the children of a node with their absolute offsets. list_chunk nodes are flattened,
+ * so callers see the elements of a long list as if they were direct children.
+ */
+template <typename F>
+void for_each_item(const syntax_node &node, uint32_t offset, F &&f) {
+    for (const syntax_element &child : node) {
+        if (child.kind() == syntax_kind::list_chunk) {
+            for_each_item(*child.node(), offset, f);
+        } else {
+            f(child, offset);
+        }
+        offset += child.width;
+    }
+}
+
+// Offset of the first significant character of the element starting at offset
+uint32_t text_start(std::string_view text, const syntax_element &element, uint32_t offset);
+uint32_t text_start(std::string_view text, const syntax_node &node, uint32_t offset);
+
+// The text of a token element without its trivia
+std::string_view token_text(std::string_view text, const syntax_element &element, uint32_t offset);
+
+struct syntax_diagnostic {
+    uint32_t offset;
+    uint32_t length;
+    syntax_error error;
+};
+
+// Collect all error nodes, subtrees without errors are skipped
+void collect_errors(std::string_view text, const syntax_tree &tree, std::vector<syntax_diagnostic> &out);
@@ -0,0 +1,119 @@
+#include "task_pool.h"
+
+#include <chrono>
+#include <exception>
+
+namespace {
+
+// The pool the current thread belongs to and its deque
+thread_local const task_pool *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+} // namespace
+
+task_pool::task_pool(unsigned threads) {
+    queues.reserve(threads + 1);
+    for (unsigned i = 0; i <= threads; i++) queues.push_back(std::make_unique<task_queue>());
+    this->threads.reserve(threads);
+    for (unsigned i = 1; i <= threads; i++) this->threads.emplace_back(&task_pool::work, this, i);
+}
+
+task_pool::~task_pool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) thread.join();
+}
+
+size_t task_pool::own_queue() const {
+    return current_pool == this ? current_queue : 0;
+}
+
+void task_pool::push(size_t queue, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(std::move(task));
+    }
+    pending++;
+    // Taking the lock orders the increment before the check of a thread going to sleep
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    wake.notify_one();
+}
+
+bool task_pool::run_one(size_t queue) {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        if (!queues[queue]->tasks.empty()) {
+            task = std::move(queues[queue]->tasks.back());
+            queues[queue]->tasks.pop_back();
+        }
+    }
+    for (size_t i = 1; !task && i < queues.size(); i++) {
+        task_queue &victim = *queues[(queue + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+    if (!task) return false;
+    pending--;
+    task();
+    return true;
+}
+
+void task_pool::work(size_t queue) {
+    current_pool = this;
+    current_queue = queue;
+    while (true) {
+        if (run_one(queue)) continue;
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || pending > 0; });
+        if (stopping) return;
+    }
+}
+
+void task_pool::help_until(const std::function<bool()> &done) {
+    const size_t queue = own_queue();
+    unsigned idle = 0;
+    while (!done()) {
+        if (run_one(queue)) {
+            idle = 0;
+        } else if (++idle < 64) {
+            std::this_thread::yield();
+        } else {
+            // The rest is running on other threads
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+}
+
+void task_pool::parallel_for(size_t count, const std::function<void(size_t)> &body) {
+    if (threads.empty() || count < 2) {
+        for (size_t i = 0; i < count; i++) body(i);
+        return;
+    }
+
+    std::atomic<size_t> left{count};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto run = [&](size_t i) {
+        try {
+            body(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+        }
+        left--;
+    };
+
+    // The newest task is taken first by this thread, so it goes on with body(1) after body(0)
+    const size_t queue = own_queue();
+    for (size_t i = count - 1; i > 0; i--) push(queue, [&run, i] { run(i); });
+    run(0);
+    help_until([&left] { return left == 0; });
+    if (error) std::rethrow_exception(error);
+}
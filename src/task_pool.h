@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fork-join parallelism on a fixed set of threads.
+ *
+ * Every thread of the pool has a deque of tasks. It runs the newest of its own tasks first and
+ * steals the oldest task of another thread when it has none, so big subtrees are split up
+ * early and a thread mostly stays on its own part. Threads outside the pool share one more
+ * deque.
+ *
+ * A thread waiting for its tasks runs other tasks meanwhile, so parallel_for can be nested
+ * without running out of threads.
+ */
+class task_pool {
+public:
+    // Threads besides the one calling parallel_for
+    explicit task_pool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()) - 1);
+    ~task_pool();
+
+    task_pool(const task_pool &) = delete;
+    task_pool &operator=(const task_pool &) = delete;
+
+    size_t thread_count() const { return threads.size(); }
+
+    // Runs body(0) to body(count - 1) and returns when all are done. The first exception one of
+    // them throws is thrown again here, after the others finished.
+    void parallel_for(size_t count, const std::function<void(size_t)> &body);
+
+    // Runs tasks until done() holds
+    void help_until(const std::function<bool()> &done);
+
+private:
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Index of the deque of the calling thread
+    size_t own_queue() const;
+    void push(size_t queue, std::function<void()> task);
+    bool run_one(size_t queue);
+    void work(size_t queue);
+
+    // [0] is for threads outside the pool
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> threads;
+
+    // Tasks pushed and not taken yet, the idle threads sleep while there are none
+    std::atomic<size_t> pending{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
@@ -0,0 +1,83 @@
+#include "uri_table.h"
+
+#include <cassert>
+#include <mutex>
+
+uri_table &uri_table::global() {
+    static uri_table table;
+    return table;
+}
+
+DocumentId uri_table::intern(const DocumentUri &uri) {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = by_uri.find(uri.raw_uri);
+        if (it != by_uri.end()) {
+            return it->second;
+        }
+    }
+
+    // Decode outside of the lock, the insert re-checks for a concurrent intern of the same URI
+    DocumentUri copy = uri;
+    std::string path = uri.getPath();
+    return insert(std::move(copy), std::move(path));
+}
+
+DocumentId uri_table::intern_path(const std::string &path) {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = by_path.find(path);
+        if (it != by_path.end()) {
+            return it->second;
+        }
+    }
+
+    return insert(DocumentUri::fromPath(path), std::string(path));
+}
+
+DocumentId uri_table::insert(DocumentUri &&uri, std::string &&path) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = by_uri.find(uri.raw_uri);
+    if (it != by_uri.end()) {
+        return it->second;
+    }
+
+    DocumentId id = entries.size();
+    assert(id != INVALID_DOCUMENT_ID);
+    entries.push_back({std::move(uri), std::move(path)});
+
+    const entry &e = entries.back();
+    by_uri.emplace(e.uri.raw_uri, id);
+    // Several spellings of an URI may decode to the same path, the first one wins
+    by_path.emplace(e.path, id);
+    return id;
+}
+
+DocumentId uri_table::find(const DocumentUri &uri) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = by_uri.find(uri.raw_uri);
+    return it == by_uri.end() ? INVALID_DOCUMENT_ID : it->second;
+}
+
+DocumentId uri_table::find_path(const std::string &path) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = by_path.find(path);
+    return it == by_path.end() ? INVALID_DOCUMENT_ID : it->second;
+}
+
+const DocumentUri &uri_table::uri(DocumentId id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    assert(id < entries.size());
+    return entries[id].uri;
+}
+
+const std::string &uri_table::path(DocumentId id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    assert(id < entries.size());
+    return entries[id].path;
+}
+
+size_t uri_table::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return entries.size();
+}
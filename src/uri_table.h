@@ -0,0 +1,56 @@
+#pragma once
+
+#include "lsp.h"
+
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * Stable handle for a document. Every distinct DocumentUri is interned exactly once in the
+ * uri_table, so everything past message decoding compares, hashes and stores documents as
+ * 32-bit ids instead of URI strings.
+ */
+using DocumentId = uint32_t;
+constexpr DocumentId INVALID_DOCUMENT_ID = ~DocumentId(0);
+
+/**
+ * Process wide URI interner.
+ *
+ * Ids are never reused and entries are never removed, so a DocumentId and the references
+ * returned by uri() and path() stay valid for the lifetime of the server.
+ * The decoded filesystem path is computed once when the URI is first seen.
+ */
+class uri_table {
+public:
+    static uri_table &global();
+
+    DocumentId intern(const DocumentUri &uri);
+    DocumentId intern_path(const std::string &path);
+
+    // Returns INVALID_DOCUMENT_ID if the URI has never been interned
+    DocumentId find(const DocumentUri &uri) const;
+    DocumentId find_path(const std::string &path) const;
+
+    const DocumentUri &uri(DocumentId id) const;
+    const std::string &path(DocumentId id) const;
+
+    size_t size() const;
+
+private:
+    struct entry {
+        DocumentUri uri;
+        std::string path;
+    };
+
+    DocumentId insert(DocumentUri &&uri, std::string &&path);
+
+    // The maps are keyed by views into entries - std::deque never moves its elements on push_back
+    mutable std::shared_mutex mutex;
+    std::deque<entry> entries;
+    std::unordered_map<std::string_view, DocumentId> by_uri;
+    std::unordered_map<std::string_view, DocumentId> by_path;
+};
@@ -0,0 +1,627 @@
+#include "workspace.h"
+#include "connection.h"
+#include "diagnostics.h"
+#include "messages.h"
+
+#include <QMetaObject>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Read only mapping of a whole file, the pages are only read when the parser gets to them
+class mapped_file {
+public:
+    explicit mapped_file(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size = st.st_size;
+            if (size == 0) {
+                ok = true;
+            } else {
+                void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    ::madvise(mapping, size, MADV_SEQUENTIAL);
+                    data = static_cast<const char *>(mapping);
+                    ok = true;
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    ~mapped_file() {
+        if (data) ::munmap(const_cast<char *>(data), size);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool valid() const { return ok; }
+    std::string_view text() const { return std::string_view(data, data ? size : 0); }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+};
+
+void extract_file(std::string_view text, line_index &lines, document_symbols &symbols, std::vector<file_import> &imports,
+                  document_references &references) {
+    const syntax_tree tree = parse_scad(text, 0);
+    lines.build(text);
+    symbols.extract(text, lines, tree);
+    extract_imports(text, lines, tree, imports);
+    references.extract(text, lines, tree);
+}
+
+// The file is gone, documents importing it keep their edge until their imports are resolved again
+void forget_file(project &proj, DocumentId doc) {
+    proj.symbols.remove(doc);
+    proj.xrefs.remove(doc);
+    proj.dependencies.remove(doc);
+    proj.dependencies.invalidate(doc);
+}
+
+inline std::string_view file_name(std::string_view path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string_view::npos ? path : path.substr(slash + 1);
+}
+
+bool stat_file(const std::string &path, file_stamp &stamp) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return false;
+    stamp.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    stamp.size = st.st_size;
+    return true;
+}
+
+// A worker hands its results to the main thread after this many files or this much time
+constexpr size_t BATCH_FILES = 256;
+constexpr auto BATCH_INTERVAL = std::chrono::milliseconds(100);
+
+} // namespace
+
+bool index_file(project &proj, DocumentId doc) {
+    const std::string &path = uri_table::global().path(doc);
+    mapped_file file(path);
+    if (!file.valid()) {
+        forget_file(proj, doc);
+        return false;
+    }
+    line_index lines;
+    document_symbols symbols;
+    std::vector<file_import> imports;
+    document_references references;
+    extract_file(file.text(), lines, symbols, imports, references);
+    proj.symbols.update(doc, symbols);
+    proj.xrefs.update(doc, references);
+
+    std::vector<DocumentId> targets;
+    proj.includes.resolve(path, imports, targets);
+    set_imports(proj, doc, std::move(imports), std::move(targets), true);
+    return true;
+}
+
+bool set_imports(project &proj, DocumentId doc, std::vector<file_import> imports, std::vector<DocumentId> targets,
+                 bool changed) {
+    const bool retargeted = proj.dependencies.targets(doc) != targets;
+    proj.dependencies.set_imports(doc, std::move(imports), std::move(targets));
+    if (changed || retargeted) {
+        proj.dependencies.invalidate(doc);
+    }
+    return retargeted;
+}
+
+void update_imports(project &proj, const text_document &doc) {
+    std::vector<file_import> imports;
+    extract_imports(doc.text(), doc.lines(), doc.syntax(), imports);
+
+    // Most edits do not touch the imports, only their ranges move
+    const std::vector<file_import> &known = proj.dependencies.imports(doc.id);
+    const bool same_files = std::equal(imports.begin(), imports.end(), known.begin(), known.end(),
+        [](const file_import &a, const file_import &b) { return a.path == b.path; });
+    std::vector<DocumentId> targets;
+    if (same_files) {
+        targets = proj.dependencies.targets(doc.id);
+    } else {
+        proj.includes.resolve(uri_table::global().path(doc.id), imports, targets);
+    }
+    set_imports(proj, doc.id, std::move(imports), std::move(targets), true);
+}
+
+// Refreshes with at least this many files report progress
+constexpr size_t REFRESH_PROGRESS_FILES = 256;
+
+workspace_indexer::workspace_indexer(Connection *conn, project *proj, unsigned threads) :
+        conn(conn),
+        proj(proj),
+        threads(std::max(1u, threads)),
+        watcher(conn, [this](file_changes changes) { refresh(std::move(changes)); })
+{}
+
+workspace_indexer::~workspace_indexer() {
+    current_run++;
+    if (coordinator.joinable()) {
+        coordinator.join();
+    }
+}
+
+void workspace_indexer::start() {
+    cancel();
+
+    const unsigned run_id = ++current_run;
+    active = true;
+    refreshing = false;
+    total = 0;
+    processed = 0;
+    started = std::chrono::steady_clock::now();
+    queued_changes = file_changes();
+    if (proj->client_work_done_progress) {
+        begin_progress("Indexing workspace");
+    }
+    watcher.clear();
+    proj->includes.clear();
+
+    std::vector<std::string> roots;
+    for (const WorkspaceFolder &folder : proj->workspace_folders) {
+        roots.push_back(folder.uri.getPath());
+    }
+
+    // The snapshot of the last run answers queries until the files are checked
+    cache_path = roots.empty() ? std::string() : index_cache_path(roots);
+    if (!cache_path.empty()) {
+        proj->symbols.attach_snapshot(index_snapshot::open(cache_path));
+        if (const index_snapshot *snapshot = proj->symbols.snapshot()) {
+            std::cout << "Loaded index snapshot " << cache_path << " with " << snapshot->file_count() << " files, "
+                      << proj->symbols.symbol_count() << " symbols\n";
+        }
+    }
+
+    coordinator = std::thread(&workspace_indexer::run, this, std::move(roots), proj->symbols.snapshot(), run_id);
+}
+
+void workspace_indexer::cancel() {
+    current_run++;
+    if (coordinator.joinable()) {
+        coordinator.join();
+    }
+    if (active) {
+        active = false;
+        end_progress("Cancelled");
+    }
+}
+
+void workspace_indexer::refresh(file_changes changes) {
+    // Right away, a running indexing resolves with the same cache
+    proj->includes.invalidate(changes);
+    if (changes.overflow) {
+        std::cerr << "Lost track of changes on disk, indexing the workspace again\n";
+        start();
+        return;
+    }
+    if (active) {
+        auto append = [](std::vector<std::string> &to, std::vector<std::string> &from) {
+            to.insert(to.end(), std::make_move_iterator(from.begin()), std::make_move_iterator(from.end()));
+        };
+        append(queued_changes.files, changes.files);
+        append(queued_changes.new_directories, changes.new_directories);
+        append(queued_changes.removed_directories, changes.removed_directories);
+        return;
+    }
+
+    // Nothing below a removed directory can be read any more, open documents stay as they are
+    std::vector<DocumentId> removed;
+    for (const std::string &directory : changes.removed_directories) {
+        for (DocumentId doc : proj->symbols.documents_in(directory)) {
+            if (proj->open_files.count(doc)) continue;
+            forget_file(*proj, doc);
+            removed.push_back(doc);
+        }
+    }
+    if (!removed.empty()) {
+        resolve_again({}, removed);
+    }
+    if (changes.files.empty() && changes.new_directories.empty()) return;
+
+    const unsigned run_id = ++current_run;
+    active = true;
+    refreshing = true;
+    total = 0;
+    processed = 0;
+    started = std::chrono::steady_clock::now();
+    if (proj->client_work_done_progress &&
+            (changes.files.size() >= REFRESH_PROGRESS_FILES || !changes.new_directories.empty())) {
+        begin_progress("Updating index");
+    }
+    if (coordinator.joinable()) {
+        coordinator.join();
+    }
+    coordinator = std::thread(&workspace_indexer::run_refresh, this, std::move(changes.files),
+                              std::move(changes.new_directories), run_id);
+}
+
+bool workspace_indexer::collect_files(const std::string &root, unsigned run_id, std::vector<std::string> &found) {
+    watcher.watch_directory(root);
+    std::error_code err;
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, err);
+    for (; !err && it != fs::recursive_directory_iterator(); it.increment(err)) {
+        if (current_run != run_id) return false;
+        if (it->is_directory(err)) {
+            watcher.watch_directory(it->path().string());
+        } else if (it->path().extension() == ".scad" && it->is_regular_file(err)) {
+            found.push_back(it->path().string());
+        }
+    }
+    if (err) {
+        std::cerr << "Could not index " << root << ": " << err.message() << "\n";
+    }
+    return true;
+}
+
+void workspace_indexer::run_refresh(std::vector<std::string> files, std::vector<std::string> directories, unsigned run_id) {
+    for (const std::string &directory : directories) {
+        if (!collect_files(directory, run_id, files)) return;
+    }
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+
+    const size_t count = files.size();
+    QMetaObject::invokeMethod(conn, [this, count, run_id] { scanned(count, run_id); }, Qt::QueuedConnection);
+
+    // Only full runs write the snapshot, the next start checks the refreshed files again
+    paths = std::move(files);
+    path_snapshot_file.assign(paths.size(), index_snapshot::NO_FILE);
+    next_path = 0;
+    process(nullptr, run_id);
+
+    if (current_run == run_id) {
+        QMetaObject::invokeMethod(conn, [this, run_id] { finished(run_id); }, Qt::QueuedConnection);
+    }
+}
+
+void workspace_indexer::run(std::vector<std::string> roots, const index_snapshot *snapshot, unsigned run_id) {
+    std::vector<std::string> found;
+    for (const std::string &root : roots) {
+        if (!collect_files(root, run_id, found)) return;
+    }
+
+    const size_t files = found.size();
+    QMetaObject::invokeMethod(conn, [this, files, run_id] { scanned(files, run_id); }, Qt::QueuedConnection);
+
+    // Large files first, so no worker starts on a big one when the others are almost done. The
+    // snapshot knows the size of most files already.
+    std::vector<std::pair<uintmax_t, size_t>> sizes;
+    std::vector<uint32_t> snapshot_files;
+    std::vector<bool> seen(snapshot ? snapshot->file_count() : 0, false);
+    sizes.reserve(found.size());
+    for (size_t i = 0; i < found.size(); i++) {
+        const uint32_t file = snapshot ? snapshot->find_file(found[i]) : index_snapshot::NO_FILE;
+        snapshot_files.push_back(file);
+        std::error_code err;
+        uintmax_t size = 0;
+        if (file != index_snapshot::NO_FILE) {
+            seen[file] = true;
+            size = snapshot->stamp(file).size;
+        } else {
+            size = fs::file_size(found[i], err);
+        }
+        sizes.emplace_back(err ? 0 : size, i);
+    }
+    std::sort(sizes.begin(), sizes.end(), std::greater<>());
+    paths.clear();
+    path_snapshot_file.clear();
+    paths.reserve(found.size());
+    for (const auto &entry : sizes) {
+        paths.push_back(std::move(found[entry.second]));
+        path_snapshot_file.push_back(snapshot_files[entry.second]);
+    }
+    next_path = 0;
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        results.clear();
+    }
+
+    batch removed;
+    for (uint32_t file = 0; file < seen.size(); file++) {
+        if (!seen[file]) {
+            removed.removed.push_back(uri_table::global().intern_path(std::string(snapshot->file_path(file))));
+        }
+    }
+    if (!removed.removed.empty()) {
+        deliver(std::move(removed), run_id);
+    }
+
+    process(snapshot, run_id);
+
+    // Changes on disk are queued until the snapshot is written, so they never wait for it
+    if (current_run == run_id) {
+        write_snapshot(snapshot);
+        QMetaObject::invokeMethod(conn, [this, run_id] { finished(run_id); }, Qt::QueuedConnection);
+    }
+}
+
+void workspace_indexer::process(const index_snapshot *snapshot, unsigned run_id) {
+    // The coordinator is one of the workers
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads && i < paths.size(); i++) {
+        workers.emplace_back(&workspace_indexer::work, this, snapshot, run_id);
+    }
+    work(snapshot, run_id);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void workspace_indexer::work(const index_snapshot *snapshot, unsigned run_id) {
+    line_index lines;
+    batch current;
+    auto last_delivery = std::chrono::steady_clock::now();
+
+    while (current_run == run_id) {
+        const size_t i = next_path++;
+        if (i >= paths.size()) break;
+        current.processed++;
+
+        const uint32_t snapshot_file = path_snapshot_file[i];
+        file_stamp stamp;
+        if (!stat_file(paths[i], stamp)) {
+            current.removed.push_back(uri_table::global().intern_path(paths[i]));
+            continue;
+        }
+
+        // Unchanged files keep their symbols in the snapshot, a new modification time with the
+        // same content (checkouts, touch) only updates the stamp
+        file_stamp known;
+        if (snapshot_file != index_snapshot::NO_FILE) {
+            known = snapshot->stamp(snapshot_file);
+            if (known.mtime_ns == stamp.mtime_ns && known.size == stamp.size) {
+                add_unchanged(snapshot, snapshot_file, known, i, current);
+                continue;
+            }
+        }
+
+        mapped_file mapped(paths[i]);
+        if (mapped.valid()) {
+            stamp.hash = content_hash(mapped.text());
+            if (snapshot_file != index_snapshot::NO_FILE && known.size == stamp.size && known.hash == stamp.hash) {
+                add_unchanged(snapshot, snapshot_file, stamp, i, current);
+            } else {
+                indexed_file file;
+                file.doc = uri_table::global().intern_path(paths[i]);
+                file.path = i;
+                file.stamp = stamp;
+                extract_file(mapped.text(), lines, file.symbols, file.imports, file.references);
+                proj->includes.resolve(paths[i], file.imports, file.targets);
+                current.files.emplace_back(std::move(file));
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (current.processed >= BATCH_FILES || now - last_delivery >= BATCH_INTERVAL) {
+            deliver(std::move(current), run_id);
+            current = batch();
+            last_delivery = now;
+        }
+    }
+    if (current.processed) {
+        deliver(std::move(current), run_id);
+    }
+}
+
+void workspace_indexer::add_unchanged(const index_snapshot *snapshot, uint32_t snapshot_file, file_stamp stamp,
+                                      size_t path, batch &current) {
+    current.unchanged.emplace_back(snapshot_file, stamp);
+    const DocumentId doc = uri_table::global().intern_path(paths[path]);
+
+    snapshot_references file;
+    snapshot->references(snapshot_file, file.references);
+    if (!file.references.references.empty()) {
+        file.doc = doc;
+        current.unchanged_references.emplace_back(std::move(file));
+    }
+
+    // The files they refer to may have appeared or gone away since the snapshot was written
+    resolved_imports resolved;
+    snapshot->imports(snapshot_file, resolved.imports);
+    if (resolved.imports.empty()) return;
+    resolved.doc = doc;
+    proj->includes.resolve(paths[path], resolved.imports, resolved.targets);
+    current.unchanged_imports.emplace_back(std::move(resolved));
+}
+
+void workspace_indexer::deliver(batch &&done, unsigned run_id) {
+    auto shared = std::make_shared<const batch>(std::move(done));
+    if (!cache_path.empty()) {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        results.push_back(shared);
+    }
+    QMetaObject::invokeMethod(conn, [this, shared, run_id] { merge(*shared, run_id); }, Qt::QueuedConnection);
+}
+
+void workspace_indexer::write_snapshot(const index_snapshot *snapshot) {
+    if (cache_path.empty()) return;
+
+    const auto start = std::chrono::steady_clock::now();
+    index_snapshot_writer writer;
+    std::vector<std::pair<uint32_t, file_stamp>> unchanged;
+    bool changed = !snapshot;
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        for (const auto &done : results) {
+            for (const indexed_file &file : done->files) {
+                writer.add_file(paths[file.path], file.stamp, file.symbols, file.imports, file.references);
+            }
+            for (const auto &entry : done->unchanged) {
+                changed |= entry.second.mtime_ns != snapshot->stamp(entry.first).mtime_ns;
+            }
+            unchanged.insert(unchanged.end(), done->unchanged.begin(), done->unchanged.end());
+            changed |= !done->files.empty() || !done->removed.empty();
+        }
+        results.clear();
+    }
+    if (!changed) return;
+    if (snapshot) {
+        writer.add_files(*snapshot, unchanged);
+    }
+
+    if (!writer.write(cache_path)) {
+        std::cerr << "Could not write index snapshot " << cache_path << "\n";
+        return;
+    }
+    std::cout << "Wrote index snapshot " << cache_path << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count() << " ms\n";
+}
+
+void workspace_indexer::scanned(size_t files, unsigned run_id) {
+    if (run_id != current_run) return;
+    total = files;
+    report_progress("0/" + std::to_string(total) + " files", 0);
+}
+
+void workspace_indexer::merge(const batch &done, unsigned run_id) {
+    if (run_id != current_run) return;
+
+    // Open documents are indexed from the editor's text
+    std::vector<DocumentId> appeared;
+    for (const indexed_file &file : done.files) {
+        if (proj->open_files.count(file.doc)) continue;
+        proj->symbols.update(file.doc, file.symbols);
+        proj->xrefs.update(file.doc, file.references);
+        set_imports(*proj, file.doc, file.imports, file.targets, true);
+        appeared.push_back(file.doc);
+    }
+    for (const snapshot_references &file : done.unchanged_references) {
+        if (proj->open_files.count(file.doc)) continue;
+        proj->xrefs.update(file.doc, file.references);
+    }
+    for (const resolved_imports &file : done.unchanged_imports) {
+        if (proj->open_files.count(file.doc)) continue;
+        set_imports(*proj, file.doc, file.imports, file.targets, false);
+    }
+    std::vector<DocumentId> removed;
+    for (DocumentId doc : done.removed) {
+        if (proj->open_files.count(doc)) continue;
+        forget_file(*proj, doc);
+        removed.push_back(doc);
+    }
+    // A full run resolves every file against the disk as it is, only refreshes can leave imports
+    // pointing at files that changed in the meantime
+    if (refreshing) {
+        resolve_again(appeared, removed);
+    }
+    processed += done.processed;
+
+    const int percentage = total ? static_cast<int>(processed * 100 / total) : 100;
+    if (percentage != reported_percentage) {
+        report_progress(std::to_string(processed) + "/" + std::to_string(total) + " files", percentage);
+    }
+}
+
+void workspace_indexer::finished(unsigned run_id) {
+    if (run_id != current_run) return;
+    active = false;
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+    std::cout << "Indexed " << processed << " files, " << proj->symbols.symbol_count() << " symbols in "
+              << elapsed.count() << " ms\n";
+    end_progress(std::to_string(processed) + " files, " + std::to_string(proj->symbols.symbol_count()) + " symbols");
+
+    if (!queued_changes.empty()) {
+        file_changes changes = std::move(queued_changes);
+        queued_changes = file_changes();
+        refresh(std::move(changes));
+    }
+}
+
+void workspace_indexer::resolve_again(const std::vector<DocumentId> &appeared, const std::vector<DocumentId> &removed) {
+    std::vector<DocumentId> affected;
+    for (DocumentId doc : removed) {
+        const std::vector<DocumentId> &importers = proj->dependencies.importers(doc);
+        affected.insert(affected.end(), importers.begin(), importers.end());
+    }
+    if (!appeared.empty()) {
+        std::unordered_set<std::string_view> names;
+        for (DocumentId doc : appeared) {
+            names.insert(file_name(uri_table::global().path(doc)));
+        }
+        proj->dependencies.unresolved_imports_of(names, affected);
+    }
+    std::sort(affected.begin(), affected.end());
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+
+    for (DocumentId doc : affected) {
+        std::vector<file_import> imports = proj->dependencies.imports(doc);
+        std::vector<DocumentId> targets;
+        proj->includes.resolve(uri_table::global().path(doc), imports, targets);
+        if (!set_imports(*proj, doc, std::move(imports), std::move(targets), false)) continue;
+
+        auto open = proj->open_files.find(doc);
+        if (open != proj->open_files.end()) {
+            publish_diagnostics(conn, *proj, open->second);
+        }
+    }
+}
+
+void workspace_indexer::begin_progress(const std::string &title) {
+    const unsigned run_id = current_run;
+    progress = progress_state::CREATING;
+    progress_token = "openscad/indexing/" + std::to_string(run_id);
+    reported_percentage = -1;
+
+    // The token may only be used once the client has created it
+    WorkDoneProgressCreateParams create;
+    create.token = progress_token;
+    conn->send(create, "window/workDoneProgress/create", {},
+        [this, run_id, title](const ResponseMessage &msg, Connection *, project *) {
+            if (run_id != current_run || progress != progress_state::CREATING) return;
+            if (msg.error || !active) {
+                progress = progress_state::NONE;
+                return;
+            }
+            progress = progress_state::ACTIVE;
+
+            ProgressParams begin;
+            begin.token = progress_token;
+            begin.value.kind = "begin";
+            begin.value.title = title;
+            begin.value.percentage = reported_percentage < 0 ? 0 : reported_percentage;
+            conn->send_notification(begin, "$/progress");
+        });
+}
+
+void workspace_indexer::report_progress(const std::string &message, int percentage) {
+    reported_percentage = percentage;
+    if (progress != progress_state::ACTIVE) return;
+
+    ProgressParams report;
+    report.token = progress_token;
+    report.value.kind = "report";
+    report.value.message = message;
+    report.value.percentage = percentage;
+    conn->send_notification(report, "$/progress");
+}
+
+void workspace_indexer::end_progress(const std::string &message) {
+    if (progress == progress_state::ACTIVE) {
+        ProgressParams end;
+        end.token = progress_token;
+        end.value.kind = "end";
+        end.value.message = message;
+        conn->send_notification(end, "$/progress");
+    }
+    progress = progress_state::NONE;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "file_watcher.h"
+#include "index_cache.h"
+#include "project.h"
+#include "symbol_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Connection;
+
+/**
+ * Indexes all .scad files below the workspace folders of a project on a pool of worker threads.
+ *
+ * The workers map, parse and extract the symbols of a file without touching the project. Their
+ * results are merged into the symbol index in batches on the main thread, so workspace/symbol
+ * answers from the files indexed so far while the rest is still running. Progress is reported
+ * to the client with $/progress if it supports server initiated progress.
+ *
+ * The symbols of all files read from disk are kept in an index_snapshot in the cache directory.
+ * On the next start the snapshot is attached to the symbol index right away and only files
+ * whose modification time, size or content hash changed are parsed again.
+ *
+ * Afterwards a file_watcher keeps the index in sync with the disk: changed files are parsed
+ * again in the background, removed ones are dropped.
+ *
+ * The workers also resolve the include and use statements of every file, the main thread puts
+ * them into the dependency graph of the project. The references to global names go into the
+ * cross reference index the same way, for unchanged files they are read from the snapshot.
+ * When files appear or go away, the imports referring to them are resolved again.
+ */
+class workspace_indexer {
+public:
+    // threads includes the coordinator, which works through the files with the others
+    workspace_indexer(Connection *conn, project *proj,
+                      unsigned threads = std::max(1u, std::thread::hardware_concurrency()));
+    // Cancels a running indexing and waits for the threads
+    ~workspace_indexer();
+
+    // (Re)start indexing the workspace folders of the project, returns immediately
+    void start();
+    void cancel();
+
+    // Index what changed on disk, queued until a running indexing is done
+    void refresh(file_changes changes);
+
+    bool running() const { return active; }
+
+private:
+    struct indexed_file {
+        DocumentId doc;
+        uint32_t path;      // into paths
+        file_stamp stamp;
+        document_symbols symbols;
+        std::vector<file_import> imports;
+        std::vector<DocumentId> targets;
+        document_references references;
+    };
+
+    // References of a snapshot file that did not change
+    struct snapshot_references {
+        DocumentId doc;
+        document_references references;
+    };
+
+    // Imports of a snapshot file that did not change, resolved against the disk as it is now
+    struct resolved_imports {
+        DocumentId doc;
+        std::vector<file_import> imports;
+        std::vector<DocumentId> targets;
+    };
+
+    // Files a worker hands to the main thread at once, read or not
+    struct batch {
+        std::vector<indexed_file> files;
+        // Snapshot files that are still up to date, with their current stamp
+        std::vector<std::pair<uint32_t, file_stamp>> unchanged;
+        std::vector<resolved_imports> unchanged_imports;
+        std::vector<snapshot_references> unchanged_references;
+        // Snapshot files that are gone
+        std::vector<DocumentId> removed;
+        size_t processed = 0;
+    };
+
+    // Background threads
+    void run(std::vector<std::string> roots, const index_snapshot *snapshot, unsigned run_id);
+    void run_refresh(std::vector<std::string> files, std::vector<std::string> directories, unsigned run_id);
+    // Walk a directory, watch all directories below it and collect the .scad files
+    bool collect_files(const std::string &root, unsigned run_id, std::vector<std::string> &found);
+    void process(const index_snapshot *snapshot, unsigned run_id);
+    void work(const index_snapshot *snapshot, unsigned run_id);
+    void add_unchanged(const index_snapshot *snapshot, uint32_t snapshot_file, file_stamp stamp, size_t path,
+                       batch &current);
+    void deliver(batch &&done, unsigned run_id);
+    void write_snapshot(const index_snapshot *snapshot);
+
+    // Main thread
+    void scanned(size_t files, unsigned run_id);
+    void merge(const batch &done, unsigned run_id);
+    void finished(unsigned run_id);
+    // Resolve the imports that may refer to files that appeared or were removed again
+    void resolve_again(const std::vector<DocumentId> &appeared, const std::vector<DocumentId> &removed);
+
+    void begin_progress(const std::string &title);
+    void report_progress(const std::string &message, int percentage);
+    void end_progress(const std::string &message);
+
+    Connection *conn;
+    project *proj;
+    unsigned threads;
+
+    // Incremented by every start and cancel, results of older runs are dropped
+    std::atomic<unsigned> current_run{0};
+    std::thread coordinator;
+
+    // Shared by the workers of one run
+    std::vector<std::string> paths;
+    std::vector<uint32_t> path_snapshot_file;
+    std::atomic<size_t> next_path{0};
+
+    // Everything the workers delivered, written to the snapshot at the end of the run
+    std::string cache_path;
+    std::mutex results_mutex;
+    std::vector<std::shared_ptr<const batch>> results;
+
+    // Main thread state of the current run
+    bool active = false;
+    // Refreshes change single files, full runs see the whole workspace as it is
+    bool refreshing = false;
+    size_t total = 0;
+    size_t processed = 0;
+    std::chrono::steady_clock::time_point started;
+
+    enum class progress_state { NONE, CREATING, ACTIVE };
+    progress_state progress = progress_state::NONE;
+    std::string progress_token;
+    int reported_percentage = -1;
+
+    // Changes that came in while indexing was running
+    file_changes queued_changes;
+
+    // Last, so it stops before anything its events refer to goes away
+    file_watcher watcher;
+};
+
+// (Re)index a single file from disk, returns false if it could not be read
+bool index_file(project &proj, DocumentId doc);
+
+/**
+ * Replace the imports of a document in the dependency graph. Everything depending on it is
+ * invalidated if its content changed or the imports now resolve to other files, the result
+ * tells whether they do.
+ */
+bool set_imports(project &proj, DocumentId doc, std::vector<file_import> imports, std::vector<DocumentId> targets,
+                 bool changed);
+// Imports of an open document from its current syntax tree
+void update_imports(project &proj, const text_document &doc);
@@ -0,0 +1,357 @@
+#include "xref_index.h"
+
+#include <algorithm>
+
+namespace {
+
+// How many entries ahead references() fetches the document, and then the range of a reference
+constexpr size_t DOCUMENT_LOOKAHEAD = 64;
+constexpr size_t RANGE_LOOKAHEAD = 32;
+
+inline bool is_modifier(syntax_kind kind) {
+    return kind == syntax_kind::bang || kind == syntax_kind::hash || kind == syntax_kind::percent ||
+           kind == syntax_kind::star;
+}
+
+/**
+ * Walks a syntax tree and records the names that refer to something outside the expression.
+ * Names bound by parameters, let and for are tracked on a stack, reads of them are not
+ * references to a global variable or function.
+ */
+class reference_collector {
+public:
+    reference_collector(std::string_view text, const line_index &lines, document_references &out) :
+            text(text), lines(lines), out(out)
+    {}
+
+    void visit(const syntax_element &element, uint32_t offset) {
+        if (!element.is_node()) {
+            if (element.kind() == syntax_kind::identifier) {
+                use(element, offset, reference_kind::variable);
+            }
+            return;
+        }
+
+        const syntax_node &node = *element.node();
+        const size_t mark = locals.size();
+        switch (node.kind) {
+        case syntax_kind::module_definition:
+        case syntax_kind::function_definition:
+            // module name(parameters) body, function name(parameters) = body;
+            each_child(node, offset, [this](size_t i, const syntax_element &child, uint32_t child_offset) {
+                if (i == 2 && child.kind() == syntax_kind::parameter_list) {
+                    bind_parameters(*child.node(), child_offset);
+                } else if (i > 2) {
+                    visit(child, child_offset);
+                }
+            });
+            break;
+        case syntax_kind::function_literal:
+            each_child(node, offset, [this](size_t i, const syntax_element &child, uint32_t child_offset) {
+                if (i == 1 && child.kind() == syntax_kind::parameter_list) {
+                    bind_parameters(*child.node(), child_offset);
+                } else if (i > 1) {
+                    visit(child, child_offset);
+                }
+            });
+            break;
+        case syntax_kind::assignment:
+        case syntax_kind::named_argument:
+        case syntax_kind::parameter:
+            // The name is defined here, only the value uses names
+            visit_children(node, offset, 1);
+            break;
+        case syntax_kind::member_expression:
+            // The member name after the dot belongs to the object
+            each_child(node, offset, [this](size_t i, const syntax_element &child, uint32_t child_offset) {
+                if (i == 0) visit(child, child_offset);
+            });
+            break;
+        case syntax_kind::call_expression:
+            each_child(node, offset, [this](size_t i, const syntax_element &child, uint32_t child_offset) {
+                if (i == 0 && child.kind() == syntax_kind::identifier) {
+                    use(child, child_offset, reference_kind::function);
+                } else {
+                    visit(child, child_offset);
+                }
+            });
+            break;
+        case syntax_kind::module_instantiation: {
+            // for and let bind their arguments for the child statement
+            bool named = false;
+            syntax_kind name = syntax_kind::error;
+            each_child(node, offset, [this, &named, &name](size_t, const syntax_element &child, uint32_t child_offset) {
+                if (!named && !is_modifier(child.kind())) {
+                    named = true;
+                    name = child.kind();
+                    if (name == syntax_kind::identifier) {
+                        use(child, child_offset, reference_kind::module);
+                    }
+                } else if (child.kind() == syntax_kind::argument_list &&
+                           (name == syntax_kind::kw_for || name == syntax_kind::kw_let)) {
+                    bind_arguments(*child.node(), child_offset);
+                } else {
+                    visit(child, child_offset);
+                }
+            });
+            break;
+        }
+        case syntax_kind::let_expression:
+        case syntax_kind::comprehension_for:
+            each_child(node, offset, [this](size_t i, const syntax_element &child, uint32_t child_offset) {
+                if (i == 1 && child.kind() == syntax_kind::argument_list) {
+                    bind_arguments(*child.node(), child_offset);
+                } else {
+                    visit(child, child_offset);
+                }
+            });
+            break;
+        default:
+            visit_children(node, offset, 0);
+            break;
+        }
+        locals.resize(mark);
+    }
+
+private:
+    // Children with their index and offset, long lists are flattened
+    template <typename F>
+    static void each_child(const syntax_node &node, uint32_t offset, F &&f) {
+        size_t i = 0;
+        for_each_item(node, offset, [&](const syntax_element &child, uint32_t child_offset) {
+            f(i++, child, child_offset);
+        });
+    }
+
+    void visit_children(const syntax_node &node, uint32_t offset, size_t first) {
+        each_child(node, offset, [this, first](size_t i, const syntax_element &child, uint32_t child_offset) {
+            if (i >= first) visit(child, child_offset);
+        });
+    }
+
+    // Default values may use the parameters before them
+    void bind_parameters(const syntax_node &list, uint32_t offset) {
+        for_each_item(list, offset, [this](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() == syntax_kind::parameter) {
+                visit_children(*item.node(), item_offset, 1);
+                bind(*item.node(), item_offset);
+            }
+        });
+    }
+
+    // let and for bind one name after the other
+    void bind_arguments(const syntax_node &list, uint32_t offset) {
+        for_each_item(list, offset, [this](const syntax_element &item, uint32_t item_offset) {
+            if (item.kind() == syntax_kind::named_argument) {
+                visit_children(*item.node(), item_offset, 1);
+                bind(*item.node(), item_offset);
+            } else {
+                visit(item, item_offset);
+            }
+        });
+    }
+
+    // The first child of a parameter or named argument is the name
+    void bind(const syntax_node &node, uint32_t offset) {
+        if (node.size && node[0].kind() == syntax_kind::identifier) {
+            locals.push_back(token_text(text, node[0], offset));
+        }
+    }
+
+    void use(const syntax_element &token, uint32_t offset, reference_kind kind) {
+        const std::string_view name = token_text(text, token, offset);
+        // Local variables can hold function literals, modules are always global
+        if (kind != reference_kind::module && std::find(locals.rbegin(), locals.rend(), name) != locals.rend()) {
+            return;
+        }
+        const uint32_t start = offset + token.width - name.size();
+        out.add(name, kind, lines.range_of(text, start, name.size()));
+    }
+
+    std::string_view text;
+    const line_index &lines;
+    document_references &out;
+    std::vector<std::string_view> locals;
+};
+
+} // namespace
+
+///////////////////////////////////////////////////////////
+// document_references
+///////////////////////////////////////////////////////////
+
+void document_references::extract(std::string_view text, const line_index &lines, const syntax_tree &tree) {
+    names.clear();
+    references.clear();
+    if (!tree.empty()) {
+        reference_collector(text, lines, *this).visit(syntax_element(tree.root), 0);
+    }
+}
+
+void document_references::add(std::string_view name, reference_kind kind, const lsRange &range) {
+    references.push_back({static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size()), kind, range});
+    names.append(name);
+}
+
+Location location_results::materialize(size_t i) const {
+    Location location;
+    location.uri = uri_table::global().uri(documents[i]);
+    location.range = ranges[i];
+    return location;
+}
+
+///////////////////////////////////////////////////////////
+// xref_index
+///////////////////////////////////////////////////////////
+
+xref_index::target_id xref_index::intern(reference_kind kind, std::string_view name) {
+    std::string key;
+    key.reserve(name.size() + 1);
+    key.push_back(static_cast<char>(kind));
+    key.append(name);
+    auto inserted = target_ids.try_emplace(std::move(key), static_cast<target_id>(targets.size()));
+    if (inserted.second) {
+        target t;
+        t.name = std::string_view(inserted.first->first).substr(1);
+        t.kind = kind;
+        targets.emplace_back(std::move(t));
+    }
+    return inserted.first->second;
+}
+
+xref_index::target_id xref_index::find(reference_kind kind, std::string_view name) const {
+    std::string key;
+    key.reserve(name.size() + 1);
+    key.push_back(static_cast<char>(kind));
+    key.append(name);
+    auto it = target_ids.find(key);
+    return it == target_ids.end() ? NO_TARGET : it->second;
+}
+
+void xref_index::update(DocumentId doc, const text_document &text) {
+    document_references references;
+    references.extract(text.text(), text.lines(), text.syntax());
+    update(doc, references);
+}
+
+void xref_index::update(DocumentId doc, const document_references &references) {
+    retire(doc);
+
+    document &d = documents[doc];
+    d.targets.reserve(references.references.size());
+    d.ranges.reserve(references.references.size());
+    for (uint32_t i = 0; i < references.references.size(); i++) {
+        const document_references::reference &ref = references.references[i];
+        const target_id id = intern(ref.kind, references.name(ref));
+        d.targets.push_back(id);
+        d.ranges.push_back(ref.range);
+
+        // Documents indexed in increasing id order keep the entries sorted without any work
+        target &t = targets[id];
+        const bool in_order = t.sorted == t.entries.size() && (t.entries.empty() || t.entries.back().doc <= doc);
+        t.entries.push_back({doc, d.generation, i});
+        if (in_order) t.sorted++;
+    }
+    live_references += references.references.size();
+}
+
+void xref_index::remove(DocumentId doc) {
+    retire(doc);
+    document &d = documents[doc];
+    d.targets.shrink_to_fit();
+    d.ranges.shrink_to_fit();
+}
+
+void xref_index::retire(DocumentId doc) {
+    if (documents.size() <= doc) {
+        documents.resize(doc + 1);
+    }
+    document &d = documents[doc];
+    d.generation++;
+    for (target_id id : d.targets) {
+        target &t = targets[id];
+        // Bounds the memory of targets that are never queried while a document is edited
+        if (++t.outdated > 64 && t.outdated * 2 > t.entries.size()) {
+            settle(t);
+        }
+    }
+    live_references -= d.targets.size();
+    d.targets.clear();
+    d.ranges.clear();
+}
+
+void xref_index::settle(target &t) {
+    if (t.outdated == 0 && t.sorted == t.entries.size()) return;
+
+    size_t kept = 0;
+    size_t sorted_kept = 0;
+    for (size_t i = 0; i < t.entries.size(); i++) {
+        if (!current(t.entries[i])) continue;
+        t.entries[kept++] = t.entries[i];
+        if (i < t.sorted) sorted_kept = kept;
+    }
+    t.entries.resize(kept);
+
+    // The entries of one document are appended together and in order, stable sorts keep them so
+    auto by_document = [](const entry &a, const entry &b) { return a.doc < b.doc; };
+    std::stable_sort(t.entries.begin() + sorted_kept, t.entries.end(), by_document);
+    std::inplace_merge(t.entries.begin(), t.entries.begin() + sorted_kept, t.entries.end(), by_document);
+    t.sorted = kept;
+    t.outdated = 0;
+}
+
+xref_index::target_id xref_index::target_at(DocumentId doc, const Position &pos, lsRange *range) const {
+    if (doc >= documents.size()) return NO_TARGET;
+    const document &d = documents[doc];
+
+    // The last reference starting at or before pos, a position right behind a name still counts
+    size_t low = 0, high = d.ranges.size();
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (d.ranges[mid].start <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) return NO_TARGET;
+    const lsRange found = d.ranges[low - 1];
+    if (!(pos <= found.end)) return NO_TARGET;
+    if (range) *range = found;
+    return d.targets[low - 1];
+}
+
+void xref_index::references(target_id id, const std::vector<DocumentId> *docs, location_results &out) {
+    target &t = targets[id];
+    settle(t);
+    if (!docs) out.reserve(out.size() + t.entries.size());
+
+    auto next_doc = docs ? docs->begin() : std::vector<DocumentId>::const_iterator();
+    for (size_t i = 0; i < t.entries.size();) {
+        const DocumentId doc = t.entries[i].doc;
+        size_t end = i + 1;
+        while (end < t.entries.size() && t.entries[end].doc == doc) end++;
+
+        bool wanted = true;
+        if (docs) {
+            next_doc = std::lower_bound(next_doc, docs->end(), doc);
+            if (next_doc == docs->end()) break;
+            wanted = *next_doc == doc;
+        }
+        if (wanted) {
+            const document &d = documents[doc];
+            // The ranges of the documents are spread over the heap, fetch them before they are read
+            if (i + DOCUMENT_LOOKAHEAD < t.entries.size()) {
+                __builtin_prefetch(&documents[t.entries[i + DOCUMENT_LOOKAHEAD].doc]);
+            }
+            if (i + RANGE_LOOKAHEAD < t.entries.size()) {
+                const entry &ahead = t.entries[i + RANGE_LOOKAHEAD];
+                documents[ahead.doc].ranges.prefetch(ahead.index);
+            }
+            for (; i < end; i++) {
+                out.add(doc, d.ranges, t.entries[i].index);
+            }
+        }
+        i = end;
+    }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "document.h"
+#include "lsp.h"
+#include "packed_range.h"
+#include "uri_table.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// OpenSCAD keeps modules, functions and variables in separate namespaces
+enum class reference_kind : uint8_t {
+    module,
+    function,
+    variable,
+};
+
+/**
+ * The global names a document uses: instantiated modules, called functions and read variables.
+ * Parameters and names bound by let and for are local and left out. Like document_symbols it is
+ * extracted without touching an index, so it can run on any thread.
+ */
+struct document_references {
+    struct reference {
+        uint32_t name_offset;   // into names
+        uint32_t name_length;
+        reference_kind kind;
+        lsRange range;
+    };
+
+    std::string names;
+    // In document order
+    std::vector<reference> references;
+
+    void extract(std::string_view text, const line_index &lines, const syntax_tree &tree);
+
+    std::string_view name(const reference &ref) const {
+        return std::string_view(names.data() + ref.name_offset, ref.name_length);
+    }
+    void add(std::string_view name, reference_kind kind, const lsRange &range);
+};
+
+/**
+ * Locations kept in columns until the response is written, like symbol_results.
+ */
+class location_results {
+public:
+    void add(DocumentId doc, const lsRange &range) {
+        documents.push_back(doc);
+        ranges.push_back(range);
+    }
+    void add(DocumentId doc, const range_column &from, size_t i) {
+        documents.push_back(doc);
+        ranges.append(from, i);
+    }
+
+    void reserve(size_t n) {
+        documents.reserve(n);
+        ranges.reserve(n);
+    }
+    size_t size() const { return documents.size(); }
+    bool empty() const { return documents.empty(); }
+    DocumentId document(size_t i) const { return documents[i]; }
+    lsRange range(size_t i) const { return ranges[i]; }
+
+    Location materialize(size_t i) const;
+
+private:
+    std::vector<DocumentId> documents;
+    range_column ranges;
+};
+
+/**
+ * Cross references of the workspace: every use of a global name, grouped by what it refers to.
+ *
+ * A target is a name in one of the namespaces, each target holds the (document, reference)
+ * pairs using it sorted by document. Finding the references of a target is a lookup of its
+ * entries, restricting them to some documents a merge with the sorted document list.
+ *
+ * Updating a document only bumps its generation and appends the new entries, the entries of
+ * older generations are dropped and the appended ones sorted in when a target is queried, or
+ * when more than half of its entries are outdated.
+ */
+class xref_index {
+public:
+    using target_id = uint32_t;
+    static constexpr target_id NO_TARGET = ~target_id(0);
+
+    // Replace all references of a document with the ones in its current syntax tree
+    void update(DocumentId doc, const text_document &text);
+    void update(DocumentId doc, const document_references &references);
+    void remove(DocumentId doc);
+
+    // The reference covering pos in doc and its range, NO_TARGET if there is none
+    target_id target_at(DocumentId doc, const Position &pos, lsRange *range = nullptr) const;
+    target_id find(reference_kind kind, std::string_view name) const;
+
+    std::string_view name(target_id target) const { return targets[target].name; }
+    reference_kind kind(target_id target) const { return targets[target].kind; }
+
+    // Append the references to target from the documents in docs (sorted), all if docs is null
+    void references(target_id target, const std::vector<DocumentId> *docs, location_results &out);
+
+    size_t target_count() const { return targets.size(); }
+    size_t reference_count() const { return live_references; }
+
+private:
+    struct entry {
+        DocumentId doc;
+        uint32_t generation;
+        uint32_t index;     // into the references of the document
+    };
+
+    struct target {
+        std::string_view name;  // the key in target_ids without its kind
+        reference_kind kind;
+        std::vector<entry> entries;
+        // entries before this are sorted by document
+        uint32_t sorted = 0;
+        uint32_t outdated = 0;
+    };
+
+    struct document {
+        // Bumped by every update, entries of older generations are outdated
+        uint32_t generation = 0;
+        // Target and range of every reference, in document order
+        std::vector<target_id> targets;
+        range_column ranges;
+    };
+
+    target_id intern(reference_kind kind, std::string_view name);
+    bool current(const entry &e) const { return e.generation == documents[e.doc].generation; }
+    // Drop outdated entries of a target and sort in the appended ones
+    void settle(target &t);
+    // The references of doc are outdated in their targets
+    void retire(DocumentId doc);
+
+    // Keys are the kind followed by the name
+    std::unordered_map<std::string, target_id> target_ids;
+    std::vector<target> targets;
+
+    // Indexed by DocumentId, ids are dense
+    std::vector<document> documents;
+    size_t live_references = 0;
+};